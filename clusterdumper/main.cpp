@@ -8,8 +8,14 @@ fat_MBR mbr;
 
 uint32_t offset = 0;
 
+fat_Container container;
+bool packed = false;
+
 uint8_t fetch(unsigned address, unsigned count, char* out)
 {
+    if (packed)
+        return fat_containerRead(&container, address, count, out);
+
     file.seekg(address);
     file.read(out, count);
 
@@ -19,7 +25,7 @@ uint8_t fetch(unsigned address, unsigned count, char* out)
 uint8_t findFile(const string& file, fat_DirectoryEntry* entry)
 {
     char buf[255];
-    while (fat_nextDirectoryEntry(&boot, offset, 2, fetch, entry, buf, 255))
+    while (fat_nextDirectoryEntry(&boot, offset, FAT_DIRECTORY_ROOT, fetch, entry, buf, 255))
     {
         if (file.compare(buf) == 0)
             return 1;
@@ -61,20 +67,76 @@ void printChain(unsigned cluster)
     cout << endl << endl;
 }
 
+// Follows the chain through a paged FAT, a contiguous piece of the chain is printed as one extent
+int printPagedChain(unsigned cluster, uint64_t budget)
+{
+    fat_PageCache cache;
+    fat_PagedFat paged;
+    if (!fat_pageCacheInit(&cache, budget) || !fat_pagedOpen(&boot, offset, fetch, &cache, &paged))
+    {
+        cout << "Error reading data from fetch." << endl;
+        fat_pageCacheDestroy(&cache);
+        return -1;
+    }
+
+    fat_PagedStats stats;
+    fat_pagedStats(&paged, &stats);
+
+    cout << hex << setfill('0');
+    cout << "Paged FAT:" << endl;
+    cout << "  Pages: 0x" << setw(8) << stats.pages << endl;
+    cout << "  Irregular Pages: 0x" << setw(8) << stats.irregularPages << endl;
+    cout << "  Runs: 0x" << setw(8) << stats.runs << endl;
+    cout << "  Index Bytes: 0x" << setw(8) << stats.indexBytes << endl;
+    cout << "  Flat Bytes: 0x" << setw(8) << stats.flatBytes << endl;
+    cout << "  Cache Slots: 0x" << setw(8) << cache.slotCount << endl << endl;
+
+    cout << "Dumping extents of the cluster chain (first cluster:length)" << endl;
+
+    FatType type = fat_getType(&boot);
+    uint32_t length, next;
+    int result = 0;
+    for (uint32_t steps = 0; cluster >= 2 && steps < paged.entryCount; ++steps)
+    {
+        if (!fat_pagedExtent(&paged, cluster, &length, &next))
+        {
+            cout << endl << "Cluster out of range or error reading data from fetch." << endl;
+            result = -1;
+            break;
+        }
+
+        cout << setw(8) << cluster << ":" << setw(8) << length << " ";
+        if (fat_isEndOfChain(type, next) || next < 2)
+            break;
+        cluster = next;
+    }
+
+    cout << endl << endl;
+    cout << "Cache: 0x" << setw(8) << cache.hits << " hits, 0x" << setw(8) << cache.misses << " misses" << endl;
+
+    fat_pagedClose(&paged);
+    fat_pageCacheDestroy(&cache);
+    return result;
+}
+
 int main(int argc, char* argv[])
 {
     if (argc < 4)
     {
-        cout << "Usage: " << "fatdumper [image] [mbr] [startcluster]" << endl;
+        cout << "Usage: " << "fatdumper [image] [mbr] [startcluster] [budget]" << endl;
         cout << endl;
         cout << "image: the file to be dumped" << endl;
         cout << "mbr: enter true if there is a mbr present otherwise enter false" << endl;
         cout << "cluster: the starting cluster number" << endl;
+        cout << "budget: (optional) bytes of decoded FAT pages to cache, follows the chain through a paged FAT as extents" << endl;
         return -1;
     }
 
-    file.open(argv[1], ios_base::in | ios_base::binary);
-    if (!file.is_open())
+    packed = fat_containerOpen(argv[1], &container) != 0;          // compressed containers are read as is
+    if (!packed)
+        file.open(argv[1], ios_base::in | ios_base::binary);
+
+    if (!packed && !file.is_open())
     {
         cout << "Couldn't open file? Check the path." << endl;
         return -1;
@@ -96,6 +158,13 @@ int main(int argc, char* argv[])
     unsigned cluster;
     istringstream(argv[3]) >> cluster;
 
+    if (argc > 4)
+    {
+        uint64_t budget;
+        istringstream(argv[4]) >> hex >> budget;
+        return printPagedChain(cluster, budget);
+    }
+
     printChain(cluster);
     return 0;
 }
\ No newline at end of file
@@ -16,6 +16,8 @@
 
 extern "C" {
 #include "fat.h"
+#include "container.h"
+#include "paged.h"
 }
 
 // TODO: reference additional headers your program requires here
@@ -0,0 +1,82 @@
+#include "arena.h"
+
+#ifdef FAT_STATIC_POOL_SIZE
+static uint64_t _pool[(FAT_STATIC_POOL_SIZE + 7) / 8];             // uint64_t keeps it aligned
+static fat_Arena _staticArena = { (uint8_t*)_pool, FAT_STATIC_POOL_SIZE, 0, 0 };
+
+fat_Arena* fat_staticArena(void)
+{
+    return &_staticArena;
+}
+#endif
+
+void fat_arenaInit(fat_Arena* arena, void* memory, uint32_t size)
+{
+    assert(arena != NULL);
+    assert(memory != NULL || size == 0);
+
+    arena->memory = memory;
+    arena->size = size;
+    arena->used = 0;
+    arena->peak = 0;
+}
+
+void* fat_arenaAlloc(fat_Arena* arena, uint32_t size)
+{
+    assert(arena != NULL);
+
+    uint32_t start = (arena->used + FAT_ARENA_ALIGNMENT - 1) & ~(uint32_t)(FAT_ARENA_ALIGNMENT - 1);
+    if (start < arena->used || start > arena->size || size > arena->size - start)
+        return NULL;                                                // doesn't fit (or wraps)
+
+    arena->used = start + size;
+    if (arena->used > arena->peak)
+        arena->peak = arena->used;
+
+    return arena->memory + start;
+}
+
+uint32_t fat_arenaMark(const fat_Arena* arena)
+{
+    assert(arena != NULL);
+
+    return arena->used;
+}
+
+void fat_arenaRelease(fat_Arena* arena, uint32_t mark)
+{
+    assert(arena != NULL);
+    assert(mark <= arena->used);
+
+    arena->used = mark;
+}
+
+uint8_t* fat_readFatArena(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, fat_Arena* arena)
+{
+    assert(boot != NULL);
+    assert(arena != NULL);
+
+    uint32_t mark = fat_arenaMark(arena);
+    uint8_t* table = fat_arenaAlloc(arena, fat_fatSize(boot));
+    if (table == NULL || !fat_readFat(boot, partitionOffset, fetch, table))
+    {
+        fat_arenaRelease(arena, mark);
+        return NULL;
+    }
+
+    return table;
+}
+
+uint8_t fat_openDirectoryArena(const fat_BootSector* boot, unsigned cluster, fat_Arena* arena, fat_DirectoryIterator* it)
+{
+    assert(boot != NULL);
+    assert(arena != NULL);
+
+    uint8_t* buffer = fat_arenaAlloc(arena, fat_clusterSize(boot));
+    if (buffer == NULL)
+        return 0;
+
+    fat_openDirectory(boot, cluster, it);
+    it->buffer = buffer;
+    return 1;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "fat.h"
+
+// Working memory without a heap. An arena hands out pieces of one block of memory the caller owns, in
+// stack order: take a mark, allocate, release to the mark. Nothing is freed one by one, so nothing can
+// fragment. Define FAT_STATIC_POOL_SIZE to get an arena over a static pool of that many bytes.
+
+#define FAT_ARENA_ALIGNMENT 0x08
+
+typedef struct fat_Arena fat_Arena;
+struct fat_Arena
+{
+	uint8_t* memory;
+	uint32_t size;
+	uint32_t used;
+	uint32_t peak;                                                  // most bytes ever in use
+};
+
+// Sets up an arena over size bytes of memory
+void fat_arenaInit(fat_Arena* arena, void* memory, uint32_t size);
+
+// Takes size bytes (aligned to FAT_ARENA_ALIGNMENT), NULL when the arena is full
+void* fat_arenaAlloc(fat_Arena* arena, uint32_t size);
+
+// Gets the current position, to release everything allocated after it
+uint32_t fat_arenaMark(const fat_Arena* arena);
+
+// Releases everything allocated after mark
+void fat_arenaRelease(fat_Arena* arena, uint32_t mark);
+
+// Reads the first FAT into the arena, NULL when it doesn't fit or can't be read
+uint8_t* fat_readFatArena(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, fat_Arena* arena);
+
+// Opens a directory with its cluster buffer taken from the arena, returns 0 when it doesn't fit
+uint8_t fat_openDirectoryArena(const fat_BootSector* boot, unsigned cluster, fat_Arena* arena, fat_DirectoryIterator* it);
+
+#ifdef FAT_STATIC_POOL_SIZE
+// Gets the arena over the static pool
+fat_Arena* fat_staticArena(void);
+#endif
@@ -0,0 +1,444 @@
+#include "batch.h"
+#include "exfat.h"
+
+typedef struct Batch Batch;
+struct Batch
+{
+    const fat_BatchImage* images;
+    uint32_t count;
+    volatile long next;                                             // images taken so far
+    unsigned maxOpen;
+    unsigned open;
+    fat_PageCache cache;
+    batchDone_t done;
+    void* context;
+    fat_BatchTotals totals;
+#ifndef FAT_NO_THREADS
+    fat_Mutex lock;                                                 // open, totals and done
+    fat_Condition closed;
+#endif
+};
+
+// The image a worker is busy with, bound to its thread
+typedef struct Job Job;
+struct Job
+{
+    fat_Device device;
+    uint64_t bytesRead;
+};
+
+typedef struct Directory Directory;
+struct Directory
+{
+    fat_DirectoryIterator it;
+    uint32_t cluster;
+    uint8_t* buffer;                                                // a cluster, kept for the next directory at this depth
+};
+
+typedef struct ExfatDirectory ExfatDirectory;
+struct ExfatDirectory
+{
+    exfat_DirectoryIterator it;
+    uint32_t cluster;
+};
+
+static uint8_t fetchBound64(uint64_t address, unsigned count, char* out)
+{
+    Job* job = fat_threadBinding();
+    job->bytesRead += count;                                        // only the worker of the job reads it
+    return fat_deviceRead(&job->device, address, count, out);
+}
+
+static uint8_t fetchBound(unsigned address, unsigned count, char* out)
+{
+    return fetchBound64(address, count, out);
+}
+
+// Grows stack to hold one more directory, capacity counts the directories
+static void* growStack(void* stack, uint32_t depth, uint32_t* capacity, size_t size)
+{
+    if (depth < *capacity)
+        return stack;
+
+    uint32_t grown = (*capacity == 0) ? 0x10 : *capacity * 2;
+    uint8_t* bigger = realloc(stack, grown * size);
+    if (bigger == NULL)
+        return NULL;
+
+    memset(bigger + *capacity * size, 0, (grown - *capacity) * size);
+    *capacity = grown;
+    return bigger;
+}
+
+// Follows the chain at cluster through the paged FAT, clusters is the length the entry asks for (0 for
+// directories, which end where their chain ends)
+static uint8_t countChain(fat_PagedFat* paged, uint32_t cluster, uint64_t clusters, fat_BatchResult* result)
+{
+    uint64_t seen = 0;
+    while (cluster >= 2 && cluster < paged->entryCount)
+    {
+        uint32_t length, next;
+        if (!fat_pagedExtent(paged, cluster, &length, &next))
+            return 0;
+
+        ++result->fragments;
+        seen += length;
+        if (seen > paged->entryCount)                               // the chain loops
+            break;
+
+        if (fat_isEndOfChain(paged->type, next))
+        {
+            if (seen < clusters)
+                ++result->brokenChains;
+            return 1;
+        }
+
+        cluster = next;
+    }
+
+    ++result->brokenChains;                                         // free, bad or out of range
+    return 1;
+}
+
+// Opens the directory at cluster on the next level of the stack, its entries are read a cluster at once
+static uint8_t pushDirectory(const fat_BootSector* boot, Directory* directory, uint32_t cluster)
+{
+    if (directory->buffer == NULL && (directory->buffer = malloc(fat_clusterSize(boot))) == NULL)
+        return 0;
+
+    fat_openDirectory(boot, cluster, &directory->it);
+    directory->it.buffer = directory->buffer;
+    directory->cluster = (cluster == FAT_DIRECTORY_ROOT) ? fat_rootCluster(boot) : cluster;
+    return 1;
+}
+
+// Lists the tree depth first, a directory pointing to one on its own path is counted but not entered
+static uint8_t countFat(const fat_BootSector* boot, unsigned partitionOffset, fat_PageCache* cache, fat_BatchResult* result)
+{
+    fat_PagedFat paged;
+    if (!fat_pagedOpen(boot, partitionOffset, fetchBound, cache, &paged))
+        return 0;
+
+    result->clusterSize = fat_clusterSize(boot);
+    result->clusters = fat_countOfClusters(boot);
+    uint8_t ok = fat_pagedFreeClusters(&paged, &result->freeClusters);
+
+    uint32_t rootCluster = fat_rootCluster(boot);
+    if (ok && rootCluster != 0)                                     // FAT32 keeps its root in a chain too
+        ok = countChain(&paged, rootCluster, 0, result);
+
+    uint32_t depth = 0, capacity = 0;
+    Directory* stack = growStack(NULL, depth, &capacity, sizeof(Directory));
+    ok &= stack != NULL && pushDirectory(boot, &stack[0], FAT_DIRECTORY_ROOT);
+    depth = ok;
+
+    while (ok && depth > 0)
+    {
+        Directory* top = &stack[depth - 1];
+        fat_DirectoryEntry entry;
+        if (!fat_readDirectory(boot, partitionOffset, fetchBound, &top->it, &entry, NULL, 0))
+        {
+            ok = fat_endOfDirectory(&top->it);
+            --depth;
+            continue;
+        }
+
+        if ((entry.fileAttributes & FAT_FILE_ATTR_VOLUME) || entry.fileName[0] == '.')
+            continue;                                               // volume label, "." and ".."
+
+        uint32_t cluster = entry.clusterHigh << 16 | entry.clusterLow;
+        if (!(entry.fileAttributes & FAT_FILE_ATTR_DIRECTORY))
+        {
+            ++result->files;
+            result->bytes += entry.fileSize;
+            if (entry.fileSize > 0)
+                ok = countChain(&paged, cluster, (entry.fileSize + (uint64_t)result->clusterSize - 1) / result->clusterSize, result);
+            continue;
+        }
+
+        ++result->directories;
+        ok = countChain(&paged, cluster, 0, result);
+
+        uint8_t loop = cluster < 2 || cluster >= paged.entryCount;
+        for (uint32_t i = 0; !loop && i < depth; ++i)
+            loop = stack[i].cluster == cluster;
+        if (!ok || loop)
+            continue;
+
+        Directory* grown = growStack(stack, depth, &capacity, sizeof(Directory));
+        ok = grown != NULL;
+        if (ok)
+        {
+            stack = grown;
+            ok = pushDirectory(boot, &stack[depth], cluster);
+            depth += ok;
+        }
+    }
+
+    for (uint32_t i = 0; i < capacity; ++i)
+        free(stack[i].buffer);
+    free(stack);
+    fat_pagedClose(&paged);
+    return ok;
+}
+
+// Counts the runs of an exFAT chain, a NoFatChain file is a single run
+static void countExfatChain(const exfat_Volume* volume, uint32_t cluster, uint64_t length, uint8_t noFatChain, fat_BatchResult* result)
+{
+    if (length == 0)
+        return;
+
+    if (noFatChain)
+    {
+        ++result->fragments;
+        return;
+    }
+
+    uint64_t clusters = (length + volume->clusterSize - 1) / volume->clusterSize;
+    ++result->fragments;
+    for (uint64_t i = 1; i < clusters; ++i)
+    {
+        uint32_t next = exfat_nextCluster(volume, cluster);
+        if (next == 0 || i > volume->boot.clusterCount)
+        {
+            ++result->brokenChains;
+            return;
+        }
+
+        if (next != cluster + 1)
+            ++result->fragments;
+        cluster = next;
+    }
+}
+
+static uint8_t countExfat(unsigned partitionOffset, fat_BatchResult* result)
+{
+    exfat_Volume* volume = malloc(sizeof(exfat_Volume));            // the up-case table alone is 128 KB
+    if (volume == NULL)
+        return 0;
+
+    if (!exfat_mount(fetchBound64, partitionOffset, volume))
+    {
+        free(volume);
+        result->status = FAT_BATCH_MOUNT;
+        return 1;
+    }
+
+    result->clusterSize = volume->clusterSize;
+    result->clusters = volume->boot.clusterCount;
+    result->freeClusters = volume->freeClusters;
+
+    uint32_t depth = 0, capacity = 0;
+    ExfatDirectory* stack = growStack(NULL, depth, &capacity, sizeof(ExfatDirectory));
+    uint8_t ok = stack != NULL;
+    if (ok)
+    {
+        exfat_openDirectory(volume, NULL, &stack[0].it);
+        stack[0].cluster = volume->boot.firstClusterOfRootDirectory;
+        depth = 1;
+    }
+
+    while (ok && depth > 0)
+    {
+        ExfatDirectory* top = &stack[depth - 1];
+        exfat_File file;
+        if (!exfat_readDirectory(volume, &top->it, &file))
+        {
+            ok = exfat_endOfDirectory(&top->it);
+            --depth;
+            continue;
+        }
+
+        countExfatChain(volume, file.firstCluster, file.dataLength, (file.flags & EXFAT_FLAG_NO_FAT_CHAIN) != 0, result);
+        if (!(file.attributes & FAT_FILE_ATTR_DIRECTORY))
+        {
+            ++result->files;
+            result->bytes += file.dataLength;
+            continue;
+        }
+
+        ++result->directories;
+        uint8_t loop = file.firstCluster < 2;
+        for (uint32_t i = 0; !loop && i < depth; ++i)
+            loop = stack[i].cluster == file.firstCluster;
+        if (loop)
+            continue;
+
+        ExfatDirectory* grown = growStack(stack, depth, &capacity, sizeof(ExfatDirectory));
+        ok = grown != NULL;
+        if (ok)
+        {
+            stack = grown;
+            exfat_openDirectory(volume, &file, &stack[depth].it);
+            stack[depth].cluster = file.firstCluster;
+            ++depth;
+        }
+    }
+
+    free(stack);
+    exfat_unmount(volume);
+    free(volume);
+    return ok;
+}
+
+// Checks the fields the driver divides by, anything else is taken as is
+static uint8_t validBootSector(const fat_BootSector* boot)
+{
+    if (memcmp(boot->OEM, "EXFAT   ", sizeof(boot->OEM)) == 0)     // fat_getType would divide by the empty fields
+        return 1;
+
+    uint16_t bytesPerSector = boot->bytesPerSector;
+    uint8_t sectorsPerCluster = boot->sectorsPerCluster;
+    return bytesPerSector >= 0x200 && bytesPerSector <= 0x1000 && (bytesPerSector & (bytesPerSector - 1)) == 0
+        && sectorsPerCluster != 0 && (sectorsPerCluster & (sectorsPerCluster - 1)) == 0
+        && boot->numberOfFATs != 0 && boot->reservedSectors != 0 && fat_sectorsPerFat(boot) != 0;
+}
+
+static void processImage(Batch* b, Job* job, fat_BatchResult* result)
+{
+    uint64_t start = fat_traceClock();
+    job->bytesRead = 0;
+    if (!fat_deviceOpen(result->image->path, &job->device))
+    {
+        result->status = FAT_BATCH_OPEN;
+        result->elapsed = fat_traceClock() - start;
+        return;
+    }
+
+    fat_BootSector boot;
+    uint32_t offset = 0;
+    uint8_t ok;
+    if (result->image->mbr)
+    {
+        offset = fat_nextPartitionSector(fetchBound, &boot, NULL);
+        ok = offset != (uint32_t)-1 && offset != 0;
+    }
+    else
+        ok = fetchBound(0, sizeof(fat_BootSector), (char*)&boot);
+
+    if (!ok || !validBootSector(&boot))
+        result->status = FAT_BATCH_MOUNT;
+    else
+    {
+        result->type = fat_getType(&boot);
+        ok = (result->type == EXFAT)
+            ? countExfat(offset, result)
+            : countFat(&boot, offset, &b->cache, result);
+        if (!ok)
+            result->status = FAT_BATCH_READ;
+    }
+
+    fat_deviceClose(&job->device);
+    result->bytesRead = job->bytesRead;
+    result->elapsed = fat_traceClock() - start;
+}
+
+static void batchWorker(void* argument)
+{
+    Batch* b = argument;
+    Job job;
+    memset(&job, 0, sizeof(Job));
+    void* binding = fat_threadBinding();
+    fat_threadBind(&job);
+
+    for (;;)
+    {
+        long index = fat_atomicIncrement(&b->next) - 1;
+        if (index >= (long)b->count)
+            break;
+
+#ifndef FAT_NO_THREADS
+        fat_mutexLock(&b->lock);
+        while (b->open == b->maxOpen)
+            fat_conditionWait(&b->closed, &b->lock);
+        ++b->open;
+        fat_mutexUnlock(&b->lock);
+#endif
+
+        fat_BatchResult result;
+        memset(&result, 0, sizeof(fat_BatchResult));
+        result.image = &b->images[index];
+        result.index = (uint32_t)index;
+        processImage(b, &job, &result);
+
+#ifndef FAT_NO_THREADS
+        fat_mutexLock(&b->lock);
+        --b->open;
+        fat_conditionSignal(&b->closed);
+#endif
+        ++b->totals.images;
+        b->totals.failed += result.status != FAT_BATCH_OK;
+        b->totals.files += result.files;
+        b->totals.directories += result.directories;
+        b->totals.bytes += result.bytes;
+        b->totals.bytesRead += result.bytesRead;
+        if (b->done != NULL)
+            b->done(&result, b->context);
+#ifndef FAT_NO_THREADS
+        fat_mutexUnlock(&b->lock);
+#endif
+    }
+
+    fat_threadBind(binding);
+}
+
+uint8_t fat_batchRun(const fat_BatchImage* images, uint32_t count, const fat_BatchOptions* options, batchDone_t done, void* context, fat_BatchTotals* totals)
+{
+    assert(images != NULL || count == 0);
+
+    fat_BatchOptions defaults = { 0, 0, 0 };
+    if (options == NULL)
+        options = &defaults;
+
+    Batch b;
+    memset(&b, 0, sizeof(Batch));
+    b.images = images;
+    b.count = count;
+    b.done = done;
+    b.context = context;
+
+    unsigned threads = options->threads;
+#ifdef FAT_NO_THREADS
+    threads = 1;
+#else
+    if (threads == 0)
+        threads = fat_processorCount();
+#endif
+    if (threads > count)
+        threads = (count > 0) ? count : 1;
+    b.maxOpen = (options->maxOpen == 0 || options->maxOpen > threads) ? threads : options->maxOpen;
+
+    if (!fat_pageCacheInit(&b.cache, (options->cacheBytes != 0) ? options->cacheBytes : FAT_BATCH_DEFAULT_CACHE))
+        return 0;
+
+    uint64_t start = fat_traceClock();
+#ifndef FAT_NO_THREADS
+    fat_mutexInit(&b.lock);
+    fat_conditionInit(&b.closed);
+
+    // the calling thread is one of the workers
+    fat_Thread* handles = malloc(threads * sizeof(fat_Thread));
+    unsigned started = 0;
+    for (; handles != NULL && started + 1 < threads; ++started)
+    {
+        if (!fat_threadStart(&handles[started], batchWorker, &b))
+            break;
+    }
+
+    batchWorker(&b);                                                // with fewer threads the others take more images
+    for (unsigned i = 0; i < started; ++i)
+        fat_threadJoin(handles[i]);
+    free(handles);
+
+    fat_conditionDestroy(&b.closed);
+    fat_mutexDestroy(&b.lock);
+#else
+    batchWorker(&b);
+#endif
+
+    b.totals.elapsed = fat_traceClock() - start;
+    fat_pageCacheDestroy(&b.cache);
+    if (totals != NULL)
+        *totals = b.totals;
+    return 1;
+}
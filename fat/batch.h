@@ -0,0 +1,80 @@
+#pragma once
+
+#include "fat.h"
+#include "device.h"
+#include "paged.h"
+#include "thread.h"
+
+#ifdef FAT_NO_HEAP
+#error "the batch opens devices and grows its directory stacks on the heap, leave batch.c out of FAT_NO_HEAP builds"
+#endif
+
+// Processes a list of images on one pool of worker threads. A worker takes the next image of the list,
+// opens and mounts it and counts its tree: files, directories, bytes, the runs of every chain and the
+// free clusters. One image stays on one worker from opening to closing, the workers handle different
+// images at the same time. The fetch of the driver has no context, so the worker binds its image to the
+// thread (fat_threadBind) and a single fetch function reads the image bound to the calling thread.
+//
+// At most maxOpen images are open at a time (an image is one descriptor), a worker waits for a slot
+// before it opens the next one. The FATs are paged (paged.h) into one page cache of cacheBytes shared
+// by every image, so the memory of a batch follows the fragmentation and the count of workers rather
+// than the size and the count of the images. exFAT volumes are read through exfat.h.
+
+#define FAT_BATCH_OK 0x00
+#define FAT_BATCH_OPEN 0x01                                         // the image couldn't be opened
+#define FAT_BATCH_MOUNT 0x02                                        // no FAT or exFAT volume found
+#define FAT_BATCH_READ 0x03                                         // a fetch failed or out of memory
+#define FAT_BATCH_DEFAULT_CACHE 0x4000000                           // bytes of decoded FAT pages
+
+typedef struct fat_BatchImage fat_BatchImage;
+struct fat_BatchImage
+{
+	const char* path;
+	uint8_t mbr;                                                    // read the boot sector of the first partition
+};
+
+typedef struct fat_BatchOptions fat_BatchOptions;
+struct fat_BatchOptions
+{
+	unsigned threads;                                               // workers, 0 is one per processor
+	unsigned maxOpen;                                               // images open at once, 0 is one per worker
+	uint64_t cacheBytes;                                            // shared by all images, 0 is FAT_BATCH_DEFAULT_CACHE
+};
+
+typedef struct fat_BatchResult fat_BatchResult;
+struct fat_BatchResult
+{
+	const fat_BatchImage* image;
+	uint32_t index;                                                 // in the list of images
+	uint8_t status;                                                 // FAT_BATCH_*
+	FatType type;
+	uint32_t clusterSize;
+	uint32_t clusters;
+	uint32_t freeClusters;
+	uint64_t files;
+	uint64_t directories;
+	uint64_t bytes;                                                 // sum of the file sizes
+	uint64_t fragments;                                             // contiguous runs of all chains
+	uint64_t brokenChains;                                          // chains shorter than the file, looping or leaving the volume
+	uint64_t bytesRead;                                             // fetched from the image
+	uint64_t elapsed;                                               // nanoseconds from opening to closing
+};
+
+typedef struct fat_BatchTotals fat_BatchTotals;
+struct fat_BatchTotals
+{
+	uint32_t images;
+	uint32_t failed;
+	uint64_t files;
+	uint64_t directories;
+	uint64_t bytes;
+	uint64_t bytesRead;
+	uint64_t elapsed;                                               // nanoseconds of the whole batch
+};
+
+// Called for every image in the order they finish, never from two threads at once
+typedef void(*batchDone_t)(const fat_BatchResult* result, void* context);
+
+// Processes count images, returns 0 only when the batch couldn't be started (failed images are reported
+// through done). options may be NULL for the defaults, totals is optional.
+uint8_t fat_batchRun(const fat_BatchImage* images, uint32_t count, const fat_BatchOptions* options, batchDone_t done, void* context, fat_BatchTotals* totals);
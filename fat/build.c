@@ -0,0 +1,454 @@
+#include "build.h"
+
+static uint32_t endOfChain(FatType type)
+{
+    return type == FAT12 ? 0x0FFF : type == FAT16 ? 0xFFFF : 0x0FFFFFFF;
+}
+
+// Copies text into a space padded field of length bytes
+static void setPadded(uint8_t* field, const char* text, unsigned length)
+{
+    memset(field, ' ', length);
+    for (unsigned i = 0; text != NULL && text[i] != 0 && i < length; ++i)
+        field[i] = (uint8_t)toupper((unsigned char)text[i]);
+}
+
+// Fills boot for the given type and cluster size, 0 when the volume doesn't get that type with it
+static uint8_t layout(const fat_BuildOptions* options, FatType type, uint32_t clusterSize, fat_BootSector* boot)
+{
+    uint16_t bytesPerSector = options->bytesPerSector != 0 ? options->bytesPerSector : 0x200;
+    uint64_t totalSectors = options->size / bytesPerSector;
+    uint32_t sectorsPerCluster = clusterSize / bytesPerSector;
+    if (totalSectors > 0xFFFFFFFF || sectorsPerCluster == 0 || sectorsPerCluster > 0x80
+        || (sectorsPerCluster & (sectorsPerCluster - 1)) != 0 || clusterSize % bytesPerSector != 0)
+        return 0;
+
+    memset(boot, 0, sizeof(fat_BootSector));
+    boot->jumpBoot[0] = 0xEB;
+    boot->jumpBoot[1] = type == FAT32 ? 0x58 : 0x3C;                // past the extended boot sector
+    boot->jumpBoot[2] = 0x90;
+    memcpy(boot->OEM, "MSWIN4.1", sizeof(boot->OEM));
+    boot->bytesPerSector = bytesPerSector;
+    boot->sectorsPerCluster = (uint8_t)sectorsPerCluster;
+    boot->reservedSectors = type == FAT32 ? 0x20 : 0x01;
+    boot->numberOfFATs = 0x02;
+    boot->media = 0xF8;
+    boot->sectorsPerTrack = 0x3F;
+    boot->numberOfHeads = 0xFF;
+    boot->hiddenSectors = options->hiddenSectors;
+
+    if (type != FAT32)                                              // whole sectors of root entries
+    {
+        uint32_t perSector = bytesPerSector / sizeof(fat_DirectoryEntry);
+        uint32_t entries = options->rootEntries != 0 ? options->rootEntries : FAT_BUILD_ROOT_ENTRIES;
+        entries = (entries + perSector - 1) / perSector * perSector;
+        if (entries > 0xFFFF)
+            return 0;
+        boot->rootEntries = (uint16_t)entries;
+    }
+
+    if (type != FAT32 && totalSectors < 0x10000)
+        boot->totalSectors16 = (uint16_t)totalSectors;
+    else
+        boot->totalSectors32 = (uint32_t)totalSectors;
+
+    // The FAT size depends on the count of clusters and the other way around. Starting with the clusters
+    // of a volume without FATs gives FATs which are large enough, the second round can only shrink them.
+    uint32_t fixedSectors = boot->reservedSectors + fat_numberOfRootDirSectors(boot);
+    uint32_t fatSectors = 0;
+    for (;;)
+    {
+        uint64_t used = fixedSectors + (uint64_t)boot->numberOfFATs * fatSectors;
+        if (used >= totalSectors)
+            return 0;
+
+        uint64_t entries = (totalSectors - used) / sectorsPerCluster + 2;
+        uint64_t bytes = type == FAT12 ? (entries * 3 + 1) / 2 : entries * (type == FAT16 ? 2 : 4);
+        uint32_t needed = (uint32_t)((bytes + bytesPerSector - 1) / bytesPerSector);
+        if (needed <= fatSectors)
+            break;
+        fatSectors = needed;
+    }
+
+    if (type == FAT32)
+    {
+        fat32_BootSector* extended = (fat32_BootSector*)boot->rest;
+        extended->sectorsPerFAT32 = fatSectors;
+        extended->rootCluster = 2;
+        extended->fileSystemInformationSector = 1;
+        extended->backupBootSector = 6;
+        extended->logicalDriveNumber = 0x80;
+        extended->bootSignature = 0x29;
+        extended->volumeId = options->volumeId;
+        setPadded(extended->volumeLabel, options->label != NULL ? options->label : "NO NAME", sizeof(extended->volumeLabel));
+        memcpy(extended->fatName, "FAT32   ", sizeof(extended->fatName));
+    }
+    else
+    {
+        if (fatSectors > 0xFFFF)
+            return 0;
+
+        fat16_BootSector* extended = (fat16_BootSector*)boot->rest;
+        boot->sectorsPerFAT16 = (uint16_t)fatSectors;
+        extended->driveNumber = 0x80;
+        extended->bootSignature = 0x29;
+        extended->volumeId = options->volumeId;
+        setPadded(extended->volumeLabel, options->label != NULL ? options->label : "NO NAME", sizeof(extended->volumeLabel));
+        memcpy(extended->fileSystemType, type == FAT12 ? "FAT12   " : "FAT16   ", sizeof(extended->fileSystemType));
+    }
+
+    ((uint8_t*)boot)[0x1FE] = 0x55;                                 // the signature ends the first 512 bytes for every type
+    ((uint8_t*)boot)[0x1FF] = 0xAA;
+
+    uint32_t clusters = fat_countOfClusters(boot);
+    return fat_getType(boot) == type && clusters > 0 && clusters < 0x0FFFFFF5;
+}
+
+uint8_t fat_buildBootSector(const fat_BuildOptions* options, fat_BootSector* boot)
+{
+    assert(options != NULL);
+    assert(boot != NULL);
+
+    uint16_t bytesPerSector = options->bytesPerSector != 0 ? options->bytesPerSector : 0x200;
+    uint8_t type = options->type;
+    if (type == FAT_BUILD_TYPE_AUTO)                                // small volumes FAT12, up to 512 MB FAT16
+        type = options->size < 0x1000000 ? FAT12 : options->size < 0x20000000 ? FAT16 : FAT32;
+
+    if (options->clusterSize != 0)
+        return layout(options, (FatType)type, options->clusterSize, boot);
+
+    // FAT12/FAT16 get the smallest clusters which fit. FAT32 starts from the sizes Microsoft uses (4 KB up
+    // to 8 GB, doubling up to 32 GB), smaller when there would be too few clusters, then larger.
+    uint32_t preferred = bytesPerSector;
+    if (type == FAT32)
+        preferred = options->size <= 0x200000000ull ? 0x1000 : options->size <= 0x400000000ull ? 0x2000 : options->size <= 0x800000000ull ? 0x4000 : 0x8000;
+    if (preferred < bytesPerSector)
+        preferred = bytesPerSector;
+
+    for (uint32_t size = preferred; size >= bytesPerSector; size >>= 1)
+    {
+        if (layout(options, (FatType)type, size, boot))
+            return 1;
+    }
+
+    for (uint32_t size = preferred << 1; size <= 0x8000; size <<= 1)
+    {
+        if (layout(options, (FatType)type, size, boot))
+            return 1;
+    }
+
+    return 0;
+}
+
+uint8_t fat_builderInit(fat_Builder* builder, const fat_BootSector* boot, unsigned partitionOffset, storeData_t store)
+{
+    assert(builder != NULL);
+    assert(boot != NULL);
+    assert(store != NULL);
+
+    memset(builder, 0, sizeof(fat_Builder));
+    builder->boot = boot;
+    builder->partitionOffset = partitionOffset;
+    builder->store = store;
+    builder->type = fat_getType(boot);
+    builder->clusterSize = fat_clusterSize(boot);
+    builder->nextCluster = 2;
+    builder->lastCluster = fat_countOfClusters(boot) + 1;
+    builder->table = calloc(boot->numberOfFATs, fat_fatSize(boot));
+    if (builder->table == NULL)
+        return 0;
+
+    uint32_t eoc = endOfChain(builder->type);                       // the media byte extended with ones, then end of chain
+    fat_setFatEntry(builder->type, builder->table, 0, (eoc & ~0xFFu) | boot->media);
+    fat_setFatEntry(builder->type, builder->table, 1, eoc);
+    return 1;
+}
+
+uint32_t fat_builderAllocate(fat_Builder* builder, uint32_t bytes)
+{
+    assert(builder != NULL);
+    assert(builder->table != NULL);
+
+    uint32_t count = bytes == 0 ? 1 : (uint32_t)(((uint64_t)bytes + builder->clusterSize - 1) / builder->clusterSize);
+    uint32_t first = builder->nextCluster;
+    if (count > builder->lastCluster + 1 - first)
+        return 0;
+
+    for (uint32_t cluster = first; cluster + 1 < first + count; ++cluster)
+        fat_setFatEntry(builder->type, builder->table, cluster, cluster + 1);
+    fat_setFatEntry(builder->type, builder->table, first + count - 1, endOfChain(builder->type));
+
+    builder->nextCluster = first + count;
+    return first;
+}
+
+uint64_t fat_builderAddress(const fat_Builder* builder, uint32_t cluster)
+{
+    assert(builder != NULL);
+
+    return (uint64_t)fat_firstSectorOfCluster(builder->boot, cluster) * builder->boot->bytesPerSector + builder->partitionOffset;
+}
+
+// Writes the FSInfo sector and the backups of it and the boot sector
+static uint8_t writeFat32(fat_Builder* builder)
+{
+    const fat32_BootSector* extended = (const fat32_BootSector*)builder->boot->rest;
+
+    fat_FileSystemInformationSector info;
+    memset(&info, 0, sizeof(info));
+    info.firstSignature = 0x41615252;
+    info.fsinfoSignature = 0x61417272;
+    info.freeClusters = (int32_t)(builder->lastCluster + 1 - builder->nextCluster);
+    info.lastAllocatedCluster = builder->nextCluster - 1;
+    info.signature = 0xAA55;
+
+    uint32_t infoAddress = fat_sectorToAddress(builder->boot, builder->partitionOffset, extended->fileSystemInformationSector);
+    uint32_t backup = fat_sectorToAddress(builder->boot, builder->partitionOffset, extended->backupBootSector);
+    return builder->store(infoAddress, sizeof(info), (const char*)&info)
+        && builder->store(backup, sizeof(fat_BootSector), (const char*)builder->boot)
+        && builder->store(backup + builder->boot->bytesPerSector, sizeof(info), (const char*)&info);
+}
+
+uint8_t fat_builderFinish(fat_Builder* builder)
+{
+    assert(builder != NULL);
+    assert(builder->table != NULL);
+
+    const fat_BootSector* boot = builder->boot;
+    uint32_t fatSize = fat_fatSize(boot);
+    for (uint8_t i = 1; i < boot->numberOfFATs; ++i)
+        memcpy(builder->table + i * fatSize, builder->table, fatSize);
+
+    uint8_t ok = builder->store(builder->partitionOffset, sizeof(fat_BootSector), (const char*)boot)
+        && (builder->type != FAT32 || writeFat32(builder))
+        && builder->store(fat_sectorToAddress(boot, builder->partitionOffset, boot->reservedSectors), boot->numberOfFATs * fatSize, (const char*)builder->table);
+
+    fat_builderFree(builder);
+    return ok;
+}
+
+void fat_builderFree(fat_Builder* builder)
+{
+    assert(builder != NULL);
+
+    free(builder->table);
+    builder->table = NULL;
+}
+
+// Characters allowed in a short name besides letters and digits
+static uint8_t isShortNameCharacter(char c)
+{
+    return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (c != 0 && strchr("$%'-_@~`!(){}^#&", c) != NULL);
+}
+
+// Converts length bytes of name into at most max characters of a short name part, returns 0 if lossy
+static uint8_t shortNamePart(const char* name, unsigned length, uint8_t* part, unsigned max, unsigned* used)
+{
+    uint8_t exact = 1;
+    *used = 0;
+    for (unsigned i = 0; i < length; ++i)
+    {
+        unsigned char c = (unsigned char)name[i];
+        if ((c & 0xC0) == 0x80)                                     // rest of a multibyte character
+            continue;
+        if (c == ' ' || c == '.')                                   // dropped
+        {
+            exact = 0;
+            continue;
+        }
+
+        char converted = (char)toupper(c);
+        if (converted != (char)c)
+            exact = 0;
+        if (!isShortNameCharacter(converted))
+        {
+            converted = '_';
+            exact = 0;
+        }
+
+        if (*used == max)
+            return 0;
+        part[(*used)++] = (uint8_t)converted;
+    }
+
+    return exact;
+}
+
+uint8_t fat_shortName(const char* name, uint32_t tail, uint8_t* shortName)
+{
+    assert(name != NULL);
+    assert(shortName != NULL);
+    assert(tail <= 999999);
+
+    const char* start = name;
+    while (*name == '.')                                            // a leading period doesn't start an extension
+        ++name;
+
+    const char* dot = strrchr(name, '.');
+    unsigned baseLength = dot != NULL ? (unsigned)(dot - name) : (unsigned)strlen(name);
+
+    memset(shortName, ' ', 11);
+    unsigned baseUsed, extensionUsed;
+    uint8_t exact = shortNamePart(name, baseLength, shortName, 8, &baseUsed)
+        & (dot == NULL || shortNamePart(dot + 1, (unsigned)strlen(dot + 1), shortName + 8, 3, &extensionUsed));
+    exact = exact && name == start && baseUsed > 0 && (dot == NULL || extensionUsed > 0);
+
+    if (baseUsed == 0)
+    {
+        shortName[0] = '_';
+        baseUsed = 1;
+    }
+    if (shortName[0] == 0xE5)
+        shortName[0] = 0x05;
+
+    if (exact || tail == 0)
+        return exact;
+
+    char digits[8];
+    unsigned length = (unsigned)sprintf(digits, "~%u", (unsigned)tail);
+    unsigned at = baseUsed + length > 8 ? 8 - length : baseUsed;
+    memcpy(shortName + at, digits, length);
+    return 0;
+}
+
+// Decodes one UTF-8 character, malformed bytes are taken as they are
+static uint32_t decodeUtf8(const unsigned char** p)
+{
+    const unsigned char* s = *p;
+    uint32_t c = *s++;
+    unsigned extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+    if (extra > 0)
+        c &= 0x3F >> extra;
+    for (; extra > 0 && (*s & 0xC0) == 0x80; --extra)
+        c = c << 6 | (*s++ & 0x3F);
+
+    *p = s;
+    return c;
+}
+
+// Converts the UTF-8 name to the UTF-16 units of a long name, fails when there are more than FAT_LFN_MAX_LENGTH
+static uint8_t nameToUnits(const char* name, uint16_t* units, unsigned* length)
+{
+    *length = 0;
+    for (const unsigned char* p = (const unsigned char*)name; *p != 0;)
+    {
+        uint32_t c = decodeUtf8(&p);
+        if (*length + (c > 0xFFFF ? 2 : 1) > FAT_LFN_MAX_LENGTH)
+            return 0;
+
+        if (c > 0xFFFF)                                             // UTF-16 surrogate pair
+        {
+            c -= 0x10000;
+            units[(*length)++] = (uint16_t)(0xD800 | c >> 10);
+            units[(*length)++] = (uint16_t)(0xDC00 | (c & 0x3FF));
+        }
+        else
+            units[(*length)++] = (uint16_t)c;
+    }
+
+    return 1;
+}
+
+// Upper case of a UTF-16 unit for the scripts of the default exFAT up-case table: Latin, Greek, Cyrillic
+// and the full width forms. Other units map to themselves.
+static uint16_t upcaseUnit(uint16_t c)
+{
+    if ((c >= 'a' && c <= 'z') || (c >= 0x00E0 && c <= 0x00FE && c != 0x00F7))
+        return c - 0x20;
+    if (c == 0x00FF)
+        return 0x0178;
+    if ((c >= 0x0100 && c <= 0x012F) || (c >= 0x0132 && c <= 0x0137) || (c >= 0x014A && c <= 0x0177))   // Latin Extended-A, upper case first
+        return c & ~1;
+    if ((c >= 0x0139 && c <= 0x0148) || (c >= 0x0179 && c <= 0x017E))
+        return (c & 1) ? c : c - 1;
+    if (c == 0x03AC)
+        return 0x0386;
+    if (c >= 0x03AD && c <= 0x03AF)
+        return c - 0x25;
+    if (c == 0x03C2)                                                // final sigma
+        return 0x03A3;
+    if (c >= 0x03B1 && c <= 0x03CB)
+        return c - 0x20;
+    if (c == 0x03CC)
+        return 0x038C;
+    if (c == 0x03CD || c == 0x03CE)
+        return c - 0x3F;
+    if (c >= 0x0430 && c <= 0x044F)
+        return c - 0x20;
+    if (c >= 0x0450 && c <= 0x045F)
+        return c - 0x50;
+    if ((c >= 0x0460 && c <= 0x0481) || (c >= 0x048A && c <= 0x04BF) || (c >= 0x04D0 && c <= 0x052F))
+        return c & ~1;
+    if (c >= 0x04C1 && c <= 0x04CE)
+        return (c & 1) ? c : c - 1;
+    if (c == 0x04CF)
+        return 0x04C0;
+    if (c >= 0xFF41 && c <= 0xFF5A)
+        return c - 0x20;
+    return c;
+}
+
+unsigned fat_foldName(const char* name, char* folded, unsigned foldedLen)
+{
+    assert(name != NULL);
+    assert(folded != NULL && foldedLen > 0);
+
+    uint16_t units[FAT_LFN_MAX_LENGTH];
+    unsigned length;
+    nameToUnits(name, units, &length);                              // a name too long for a long name is folded up to the limit
+
+    for (unsigned i = 0; i < length; ++i)
+        units[i] = upcaseUnit(units[i]);
+
+    return fat_utf16ToUtf8(units, length, folded, foldedLen);
+}
+
+uint8_t fat_longNameEntries(const char* name, const uint8_t* shortName, fat_LongFileName* slots)
+{
+    assert(name != NULL);
+    assert(shortName != NULL);
+    assert(slots != NULL);
+
+    uint16_t units[FAT_LFN_MAX_LENGTH];
+    unsigned length;
+    if (!nameToUnits(name, units, &length) || length == 0)
+        return 0;
+
+    uint8_t count = (uint8_t)((length + 12) / 13);
+    uint8_t checksum = fat_checksum(shortName);
+    for (uint8_t i = 0; i < count; ++i)                             // the last part of the name is stored first
+    {
+        fat_LongFileName* slot = &slots[count - 1 - i];
+        memset(slot, 0, sizeof(fat_LongFileName));
+        slot->ordinal = (uint8_t)(i + 1) | (i + 1 == count ? 0x40 : 0x00);
+        slot->attribute = FAT_FILE_ATTR_LONG_NAME;
+        slot->checksum = checksum;
+
+        for (unsigned j = 0; j < 13; ++j)                           // terminated by 0x0000, padded with 0xFFFF
+        {
+            unsigned index = i * 13 + j;
+            uint16_t unit = index < length ? units[index] : index == length ? 0x0000 : 0xFFFF;
+            if (j < 5)
+                slot->ucs2_1[j] = unit;
+            else if (j < 11)
+                slot->ucs2_2[j - 5] = unit;
+            else
+                slot->ucs2_3[j - 11] = unit;
+        }
+    }
+
+    return count;
+}
+
+uint16_t fat_makeDate(uint8_t day, uint8_t month, uint16_t year)
+{
+    if (year < 1980)
+        return (1 << 5) | 1;                                        // 1 January 1980
+
+    return (uint16_t)(((year - 1980) & 0x7F) << 9 | (month & 0x0F) << 5 | (day & 0x1F));
+}
+
+uint16_t fat_makeTime(uint8_t seconds, uint8_t minute, uint8_t hour)
+{
+    return (uint16_t)((hour & 0x1F) << 11 | (minute & 0x3F) << 5 | (seconds / 2 & 0x1F));
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "fat.h"
+
+#ifdef FAT_NO_HEAP
+#error "the builder keeps the FATs on the heap until they are written, leave build.c out of FAT_NO_HEAP builds"
+#endif
+
+// Formatting and populating a new volume in one pass. fat_buildBootSector lays out the volume,
+// fat_builderAllocate hands out contiguous chains from the start of the data region and fat_builderFinish
+// writes the reserved region, the FSInfo sector and all FATs (one sequential write) at the end. The data
+// itself is written by the caller at fat_builderAddress, so the clusters come out in address order.
+//
+// Nothing but the reserved region and the FATs is written by the builder: it expects a zeroed (i.e. new,
+// sparse) image, the unused part of directory clusters and the fixed root directory have to be zero.
+
+#define FAT_BUILD_TYPE_AUTO 0xFF                                    // fat_BuildOptions.type picked from the size
+#define FAT_BUILD_ROOT_ENTRIES 0x200                                // FAT12/FAT16 fixed root directory
+#define FAT_BUILD_MAX_ENTRIES 0x10000                               // entries a directory may hold
+
+typedef struct fat_BuildOptions fat_BuildOptions;
+struct fat_BuildOptions
+{
+	uint64_t size;                                                  // bytes of the volume
+	uint8_t type;                                                   // FatType or FAT_BUILD_TYPE_AUTO
+	uint16_t bytesPerSector;                                        // 0 is 512
+	uint32_t clusterSize;                                           // bytes, 0 picks one for the type
+	uint16_t rootEntries;                                           // FAT12/FAT16, 0 is FAT_BUILD_ROOT_ENTRIES
+	uint32_t hiddenSectors;                                         // sectors in front of the partition
+	uint32_t volumeId;
+	const char* label;                                              // optional, up to 11 characters
+};
+
+typedef struct fat_Builder fat_Builder;
+struct fat_Builder
+{
+	const fat_BootSector* boot;
+	unsigned partitionOffset;
+	storeData_t store;
+	FatType type;
+	uint32_t clusterSize;
+	uint32_t nextCluster;                                           // first free cluster, everything after it is free too
+	uint32_t lastCluster;
+	uint8_t* table;                                                 // every copy of the FAT, back to back
+};
+
+// Lays out a volume of options->size bytes in boot, 0 when no valid layout exists (i.e. FAT32 in 16 MB)
+uint8_t fat_buildBootSector(const fat_BuildOptions* options, fat_BootSector* boot);
+
+// Starts populating the volume boot describes, the builder keeps pointing at boot
+uint8_t fat_builderInit(fat_Builder* builder, const fat_BootSector* boot, unsigned partitionOffset, storeData_t store);
+
+// Allocates a contiguous chain of at least one cluster for bytes, returns its first cluster or 0 when full
+uint32_t fat_builderAllocate(fat_Builder* builder, uint32_t bytes);
+
+// Byte address of cluster, 64 bit so volumes up to the FAT32 limit can be written
+uint64_t fat_builderAddress(const fat_Builder* builder, uint32_t cluster);
+
+// Writes the boot sector, the FSInfo sector and backups (FAT32) and all FATs, then frees the builder
+uint8_t fat_builderFinish(fat_Builder* builder);
+
+// Frees the builder without writing anything
+void fat_builderFree(fat_Builder* builder);
+
+// Makes the short name (11 bytes, space padded) of name, with the numeric tail ~tail unless tail is 0.
+// Returns 1 when name is a valid short name as it is and needs no long name, the tail is ignored then.
+uint8_t fat_shortName(const char* name, uint32_t tail, uint8_t* shortName);
+
+// Makes the long name entries of the UTF-8 name in the order they are stored, the short entry follows
+// them. Returns the slots used (up to FAT_LFN_MAX_SLOTS), 0 when the name is too long.
+uint8_t fat_longNameEntries(const char* name, const uint8_t* shortName, fat_LongFileName* slots);
+
+// Upper cases the UTF-8 name unit by unit for comparing long names, which ignore case beyond ASCII as well.
+// Returns the bytes written to folded without the termination.
+unsigned fat_foldName(const char* name, char* folded, unsigned foldedLen);
+
+// Encodes the fat date format, years before 1980 become 1980
+uint16_t fat_makeDate(uint8_t day, uint8_t month, uint16_t year);
+
+// Encodes the fat time format, in steps of two seconds
+uint16_t fat_makeTime(uint8_t seconds, uint8_t minute, uint8_t hour);
@@ -0,0 +1,261 @@
+#include "bulk.h"
+
+// Part of an extent, never longer than one fetch
+typedef struct Piece Piece;
+struct Piece
+{
+    uint64_t address;
+    uint64_t offset;                                                // in the file
+    uint32_t length;
+    uint32_t file;                                                  // in the sweep
+};
+
+// A file of the sweep which isn't complete yet
+typedef struct Pending Pending;
+struct Pending
+{
+    uint8_t* buffer;
+    uint32_t remaining;                                             // pieces still to be read
+    uint8_t failed;
+};
+
+typedef struct Bulk Bulk;
+struct Bulk
+{
+    fat_Device* device;
+    const fat_BulkFile* files;
+    uint64_t gap;
+    uint32_t maxRead;
+    uint8_t* scratch;                                               // maxRead bytes, one fetch
+    bulkFile_t done;
+    void* context;
+    fat_BulkStats* stats;
+};
+
+// Orders pieces by address, ties by file and offset so a sweep is the same every time
+static int comparePieces(const void* a, const void* b)
+{
+    const Piece* x = a;
+    const Piece* y = b;
+    if (x->address != y->address)
+        return (x->address > y->address) - (x->address < y->address);
+    if (x->file != y->file)
+        return (x->file > y->file) - (x->file < y->file);
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// Bytes of extent within the file, an extent beyond the size is ignored
+static uint64_t clippedLength(const fat_FileExtent* extent, uint64_t size)
+{
+    if (extent->offset >= size)
+        return 0;
+
+    return (extent->length < size - extent->offset) ? extent->length : size - extent->offset;
+}
+
+static uint8_t deliver(Bulk* bulk, uint32_t index, Pending* file)
+{
+    static const uint8_t empty[1] = { 0 };                          // data of an empty file isn't NULL
+
+    const uint8_t* data = file->failed ? NULL : ((file->buffer != NULL) ? file->buffer : empty);
+    ++bulk->stats->files;
+    bulk->stats->failed += file->failed;
+
+    uint8_t ok = bulk->done(index, 0, data, bulk->files[index].size, bulk->context);
+    free(file->buffer);
+    file->buffer = NULL;
+    return ok;
+}
+
+// Reads the files first up to first + count - 1 in one pass over the device
+static uint8_t sweep(Bulk* bulk, uint32_t first, uint32_t count)
+{
+    const fat_BulkFile* files = bulk->files + first;
+
+    uint64_t pieceCount = 0;
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        for (uint32_t e = 0; e < files[i].extentCount; ++e)
+            pieceCount += (clippedLength(&files[i].extents[e], files[i].size) + bulk->maxRead - 1) / bulk->maxRead;
+    }
+
+    Pending* pending = calloc(count, sizeof(Pending));
+    Piece* pieces = (pieceCount < SIZE_MAX / sizeof(Piece)) ? malloc((size_t)(pieceCount + 1) * sizeof(Piece)) : NULL;
+    uint8_t ok = pending != NULL && pieces != NULL;
+    for (uint32_t i = 0; ok && i < count; ++i)
+    {
+        if (files[i].size > 0)
+            ok = files[i].size <= SIZE_MAX && (pending[i].buffer = calloc((size_t)files[i].size, 1)) != NULL;   // holes stay zero
+    }
+
+    uint64_t n = 0;
+    for (uint32_t i = 0; ok && i < count; ++i)
+    {
+        for (uint32_t e = 0; e < files[i].extentCount; ++e)
+        {
+            uint64_t address = files[i].extents[e].address;
+            uint64_t offset = files[i].extents[e].offset;
+            for (uint64_t length = clippedLength(&files[i].extents[e], files[i].size); length > 0;)
+            {
+                Piece* piece = &pieces[n++];
+                piece->address = address;
+                piece->offset = offset;
+                piece->length = (length < bulk->maxRead) ? (uint32_t)length : bulk->maxRead;
+                piece->file = i;
+                ++pending[i].remaining;
+
+                address += piece->length;
+                offset += piece->length;
+                length -= piece->length;
+            }
+        }
+    }
+
+    if (ok)
+    {
+        qsort(pieces, (size_t)n, sizeof(Piece), comparePieces);
+        ++bulk->stats->sweeps;
+        bulk->stats->pieces += n;
+    }
+
+    for (uint32_t i = 0; ok && i < count; ++i)                      // nothing to read, complete already
+    {
+        if (pending[i].remaining == 0)
+            ok = deliver(bulk, first + i, &pending[i]);
+    }
+
+    for (uint64_t p = 0; ok && p < n;)
+    {
+        // the fetch grows while the next piece is within the gap and the whole still fits the scratch buffer
+        uint64_t start = pieces[p].address;
+        uint64_t end = start + pieces[p].length;
+        uint64_t q = p + 1;
+        while (q < n && pieces[q].address <= end + bulk->gap && pieces[q].address + pieces[q].length - start <= bulk->maxRead)
+        {
+            if (pieces[q].address + pieces[q].length > end)
+                end = pieces[q].address + pieces[q].length;
+            ++q;
+        }
+
+        uint8_t read = fat_deviceRead(bulk->device, start, (unsigned)(end - start), (char*)bulk->scratch);
+        ++bulk->stats->reads;
+        bulk->stats->bytesRead += end - start;
+
+        for (; ok && p < q; ++p)
+        {
+            const Piece* piece = &pieces[p];
+            Pending* file = &pending[piece->file];
+            if (read)
+                memcpy(file->buffer + piece->offset, bulk->scratch + (piece->address - start), piece->length);
+            else
+                file->failed = 1;
+
+            bulk->stats->bytes += piece->length;
+            if (--file->remaining == 0)
+                ok = deliver(bulk, first + piece->file, file);
+        }
+    }
+
+    if (pending != NULL)                                            // left over when stopped or out of memory
+    {
+        for (uint32_t i = 0; i < count; ++i)
+            free(pending[i].buffer);
+    }
+    free(pending);
+    free(pieces);
+    return ok;
+}
+
+// Reads a file larger than the memory budget on its own, in parts of one fetch handed over in offset order
+static uint8_t stream(Bulk* bulk, uint32_t index)
+{
+    const fat_BulkFile* file = &bulk->files[index];
+    uint32_t e = 0;
+    for (uint64_t offset = 0; offset < file->size;)
+    {
+        uint32_t length = (file->size - offset < bulk->maxRead) ? (uint32_t)(file->size - offset) : bulk->maxRead;
+        memset(bulk->scratch, 0, length);                           // holes stay zero
+
+        while (e < file->extentCount && file->extents[e].offset + file->extents[e].length <= offset)
+            ++e;                                                    // behind the part, and so behind every following part
+
+        uint8_t read = 1;
+        for (uint32_t x = e; read && x < file->extentCount && file->extents[x].offset < offset + length; ++x)
+        {
+            const fat_FileExtent* extent = &file->extents[x];
+            uint64_t from = (extent->offset > offset) ? extent->offset : offset;
+            uint64_t to = extent->offset + clippedLength(extent, file->size);
+            if (to > offset + length)
+                to = offset + length;
+            if (from >= to)
+                continue;
+
+            read = fat_deviceRead(bulk->device, extent->address + (from - extent->offset), (unsigned)(to - from), (char*)bulk->scratch + (from - offset));
+            ++bulk->stats->pieces;
+            ++bulk->stats->reads;
+            bulk->stats->bytes += to - from;
+            bulk->stats->bytesRead += to - from;
+        }
+
+        if (!read || offset + length == file->size)
+        {
+            ++bulk->stats->files;
+            bulk->stats->failed += !read;
+        }
+
+        if (!bulk->done(index, offset, read ? bulk->scratch : NULL, length, bulk->context))
+            return 0;
+        if (!read)
+            return 1;
+
+        offset += length;
+    }
+
+    return 1;
+}
+
+uint8_t fat_bulkRead(fat_Device* device, const fat_BulkFile* files, uint32_t count, const fat_BulkOptions* options, bulkFile_t done, void* context, fat_BulkStats* stats)
+{
+    assert(device != NULL);
+    assert(files != NULL || count == 0);
+    assert(done != NULL);
+
+    fat_BulkStats unused;
+    Bulk bulk;
+    bulk.device = device;
+    bulk.files = files;
+    bulk.gap = (options != NULL) ? options->gap : FAT_BULK_GAP;
+    bulk.maxRead = (options != NULL && options->maxRead != 0) ? options->maxRead : FAT_BULK_MAX_READ;
+    bulk.done = done;
+    bulk.context = context;
+    bulk.stats = (stats != NULL) ? stats : &unused;
+    memset(bulk.stats, 0, sizeof(fat_BulkStats));
+
+    uint64_t memory = (options != NULL && options->memory != 0) ? options->memory : FAT_BULK_MEMORY;
+    bulk.scratch = malloc(bulk.maxRead);
+    if (bulk.scratch == NULL)
+        return 0;
+
+    uint8_t op = fat_traceSetOp(FAT_TRACE_OP_DATA);
+    uint8_t ok = 1;
+    for (uint32_t first = 0; ok && first < count;)
+    {
+        if (files[first].size > memory)                             // not buffered, read in parts
+        {
+            ok = stream(&bulk, first++);
+            continue;
+        }
+
+        uint32_t last = first + 1;
+        uint64_t bytes = files[first].size;
+        while (last < count && bytes + files[last].size <= memory)
+            bytes += files[last++].size;
+
+        ok = sweep(&bulk, first, last - first);
+        first = last;
+    }
+    fat_traceSetOp(op);
+
+    free(bulk.scratch);
+    return ok;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "fat.h"
+#include "device.h"
+#include "extract.h"
+
+#ifdef FAT_NO_HEAP
+#error "the pieces and the file buffers of a bulk read are on the heap, leave bulk.c out of FAT_NO_HEAP builds"
+#endif
+
+// Reads many files in the order of their data on the device instead of the order they are asked for.
+// The extents of the files (extract.h) are cut into pieces of at most maxRead bytes and sorted by
+// address, then swept in one direction like an elevator. Pieces which touch, or lie within gap bytes
+// of each other, are read with one fetch and the bytes in between are dropped. Every piece is copied
+// into the buffer of its file, a file is handed to the callback as soon as its last piece is in.
+//
+// Files are buffered whole. A sweep takes the files in the order given until their sizes add up to the
+// memory budget, a directory of thousands of small files thus turns into a few near sequential sweeps
+// over the device. A file larger than the budget isn't buffered: it is read on its own and handed to the
+// callback in parts of maxRead bytes, in offset order.
+
+#define FAT_BULK_GAP 0x10000                                        // bytes read through rather than seeked over
+#define FAT_BULK_MAX_READ 0x100000                                  // most bytes of one fetch
+#define FAT_BULK_MEMORY 0x4000000                                   // bytes of file buffers of one sweep
+
+typedef struct fat_BulkFile fat_BulkFile;
+struct fat_BulkFile
+{
+	const fat_FileExtent* extents;                                  // in offset order, the bytes no extent covers read as zeros
+	uint32_t extentCount;
+	uint64_t size;
+};
+
+typedef struct fat_BulkOptions fat_BulkOptions;
+struct fat_BulkOptions
+{
+	uint64_t gap;                                                   // 0 merges touching pieces only
+	uint32_t maxRead;                                               // 0 is FAT_BULK_MAX_READ
+	uint64_t memory;                                                // 0 is FAT_BULK_MEMORY
+};
+
+typedef struct fat_BulkStats fat_BulkStats;
+struct fat_BulkStats
+{
+	uint32_t files;                                                 // handed to the callback
+	uint32_t failed;                                                // of those, a read failed
+	uint32_t sweeps;
+	uint64_t pieces;
+	uint64_t reads;                                                 // fetches
+	uint64_t bytes;                                                 // of the pieces
+	uint64_t bytesRead;                                             // gaps read through included
+};
+
+// Called for every file once all of it is read, index is its position in the list: offset is 0 and length
+// the size of the file. A file larger than the memory budget comes in several calls of consecutive parts
+// instead, the one ending at the size of the file is the last. data is NULL when a read of the file
+// failed, no more parts of it follow. Return 0 to stop.
+typedef uint8_t(*bulkFile_t)(uint32_t index, uint64_t offset, const uint8_t* data, uint64_t length, void* context);
+
+// Reads count files of device, options may be NULL for the defaults (FAT_BULK_GAP included) and stats is
+// optional. Returns 0 when out of memory or stopped by done, failed reads are reported through done.
+uint8_t fat_bulkRead(fat_Device* device, const fat_BulkFile* files, uint32_t count, const fat_BulkOptions* options, bulkFile_t done, void* context, fat_BulkStats* stats);
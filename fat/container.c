@@ -0,0 +1,440 @@
+#include "container.h"
+
+#ifdef _MSC_VER
+#define fseek64 _fseeki64
+#else
+#define fseek64 fseeko
+#endif
+
+// The compressor writes the LZ4 block format (greedy matching, 4 byte hashes) so containers can be
+// inspected with the regular LZ4 tools. It only has to be fast enough for archiving, reading is what counts.
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_LIMIT 12
+#define LZ4_HASH_BITS 12
+
+static uint32_t read32(const uint8_t* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t hash32(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+static uint8_t* writeLength(uint8_t* op, const uint8_t* end, uint32_t length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        if (op >= end)
+            return NULL;
+        *op++ = 255;
+    }
+
+    if (op >= end)
+        return NULL;
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+static uint8_t* writeSequence(uint8_t* op, const uint8_t* end, const uint8_t* literals, uint32_t literalLength, uint32_t offset, uint32_t matchLength)
+{
+    if (op >= end)
+        return NULL;
+
+    uint8_t* token = op++;
+    *token = (uint8_t)(((literalLength >= 15) ? 15 : literalLength) << 4);
+    if (literalLength >= 15 && (op = writeLength(op, end, literalLength - 15)) == NULL)
+        return NULL;
+
+    if ((uint32_t)(end - op) < literalLength)
+        return NULL;
+    memcpy(op, literals, literalLength);
+    op += literalLength;
+
+    if (matchLength == 0)                                           // last sequence has no match
+        return op;
+
+    if (end - op < 2)
+        return NULL;
+    *op++ = offset & 0xFF;
+    *op++ = (offset >> 8) & 0xFF;
+
+    matchLength -= LZ4_MIN_MATCH;
+    *token |= (matchLength >= 15) ? 15 : matchLength;
+    if (matchLength >= 15)
+        op = writeLength(op, end, matchLength - 15);
+
+    return op;
+}
+
+// Returns the compressed size or 0 when it doesn't fit in dstCapacity
+static uint32_t lz4Compress(const uint8_t* src, uint32_t srcSize, uint8_t* dst, uint32_t dstCapacity)
+{
+    uint32_t table[1 << LZ4_HASH_BITS];
+    memset(table, 0xFF, sizeof(table));
+
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* matchLimit = (srcSize > LZ4_MATCH_LIMIT) ? src + srcSize - LZ4_MATCH_LIMIT : src;
+    const uint8_t* literalLimit = (srcSize > LZ4_LAST_LITERALS) ? src + srcSize - LZ4_LAST_LITERALS : src;
+    uint8_t* op = dst;
+    const uint8_t* end = dst + dstCapacity;
+
+    while (ip < matchLimit)
+    {
+        uint32_t h = hash32(read32(ip));
+        uint32_t candidate = table[h];
+        table[h] = (uint32_t)(ip - src);
+
+        if (candidate == 0xFFFFFFFF || (ip - src) - candidate > 0xFFFF || read32(src + candidate) != read32(ip))
+        {
+            ++ip;
+            continue;
+        }
+
+        const uint8_t* match = src + candidate;
+        uint32_t length = LZ4_MIN_MATCH;
+        while (ip + length < literalLimit && ip[length] == match[length])
+            ++length;
+
+        op = writeSequence(op, end, anchor, (uint32_t)(ip - anchor), (uint32_t)(ip - match), length);
+        if (op == NULL)
+            return 0;
+
+        ip += length;
+        anchor = ip;
+    }
+
+    op = writeSequence(op, end, anchor, (uint32_t)(src + srcSize - anchor), 0, 0);
+    return (op == NULL) ? 0 : (uint32_t)(op - dst);
+}
+
+// Returns 1 if exactly dstSize bytes have been decoded
+static uint8_t lz4Decompress(const uint8_t* src, uint32_t srcSize, uint8_t* dst, uint32_t dstSize)
+{
+    const uint8_t* ip = src;
+    const uint8_t* ipEnd = src + srcSize;
+    uint8_t* op = dst;
+    uint8_t* opEnd = dst + dstSize;
+
+    while (ip < ipEnd)
+    {
+        uint8_t token = *ip++;
+
+        uint32_t length = token >> 4;                               // literals
+        if (length == 15)
+        {
+            uint8_t b;
+            do
+            {
+                if (ip >= ipEnd)
+                    return 0;
+                b = *ip++;
+                length += b;
+            } while (b == 255);
+        }
+
+        if ((uint32_t)(ipEnd - ip) < length || (uint32_t)(opEnd - op) < length)
+            return 0;
+        memcpy(op, ip, length);
+        ip += length;
+        op += length;
+
+        if (ip >= ipEnd)                                            // last sequence
+            break;
+
+        if (ipEnd - ip < 2)
+            return 0;
+        uint32_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (uint32_t)(op - dst))
+            return 0;
+
+        length = token & 0x0F;                                      // match
+        if (length == 15)
+        {
+            uint8_t b;
+            do
+            {
+                if (ip >= ipEnd)
+                    return 0;
+                b = *ip++;
+                length += b;
+            } while (b == 255);
+        }
+        length += LZ4_MIN_MATCH;
+
+        if ((uint32_t)(opEnd - op) < length)
+            return 0;
+
+        const uint8_t* match = op - offset;
+        for (uint32_t i = 0; i < length; ++i)                       // may overlap, copy byte by byte
+            op[i] = match[i];
+        op += length;
+    }
+
+    return op == opEnd;
+}
+
+static uint8_t isZero(const uint8_t* data, uint32_t size)
+{
+    return size == 0 || (data[0] == 0 && memcmp(data, data + 1, size - 1) == 0);
+}
+
+static uint32_t chunkLength(const fat_Container* container, uint32_t chunk)
+{
+    uint64_t start = (uint64_t)chunk * container->header.chunkSize;
+    uint64_t left = container->header.imageSize - start;
+    return (left < container->header.chunkSize) ? (uint32_t)left : container->header.chunkSize;
+}
+
+uint8_t fat_containerOpen(const char* path, fat_Container* container)
+{
+    assert(path != NULL);
+    assert(container != NULL);
+
+    memset(container, 0, sizeof(fat_Container));
+    container->file = fopen(path, "rb");
+    if (container->file == NULL)
+        return 0;
+
+    fat_ContainerHeader* header = &container->header;
+    if (fread(header, sizeof(fat_ContainerHeader), 1, container->file) != 1 ||
+        header->magic != FAT_CONTAINER_MAGIC ||
+        header->version != FAT_CONTAINER_VERSION ||
+        header->chunkSize == 0 ||
+        (header->imageSize + header->chunkSize - 1) / header->chunkSize != header->chunkCount)
+    {
+        fat_containerClose(container);
+        return 0;
+    }
+
+    container->chunks = malloc((size_t)header->chunkCount * sizeof(fat_ChunkEntry) + 1);
+    container->compressed = malloc(header->chunkSize);
+    if (container->chunks == NULL || container->compressed == NULL ||
+        fseek64(container->file, header->indexOffset, SEEK_SET) != 0 ||
+        fread(container->chunks, sizeof(fat_ChunkEntry), header->chunkCount, container->file) != header->chunkCount)
+    {
+        fat_containerClose(container);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < header->chunkCount; ++i)
+    {
+        if (container->chunks[i].type > FAT_CHUNK_LZ4)              // unknown, loadChunk couldn't decode it
+        {
+            fat_containerClose(container);
+            return 0;
+        }
+    }
+
+    for (uint32_t i = 0; i < FAT_CONTAINER_CACHE_SLOTS; ++i)
+        container->cache[i].chunk = 0xFFFFFFFF;
+
+    return 1;
+}
+
+void fat_containerClose(fat_Container* container)
+{
+    assert(container != NULL);
+
+    if (container->file != NULL)
+        fclose(container->file);
+
+    for (uint32_t i = 0; i < FAT_CONTAINER_CACHE_SLOTS; ++i)
+        free(container->cache[i].data);
+
+    free(container->chunks);
+    free(container->compressed);
+    memset(container, 0, sizeof(fat_Container));
+}
+
+// Finds the chunk in the cache or decompresses it into the least recently used slot
+static const uint8_t* loadChunk(fat_Container* container, uint32_t chunk)
+{
+    fat_ChunkCacheSlot* victim = &container->cache[0];
+    for (uint32_t i = 0; i < FAT_CONTAINER_CACHE_SLOTS; ++i)
+    {
+        fat_ChunkCacheSlot* slot = &container->cache[i];
+        if (slot->chunk == chunk)
+        {
+            slot->lastUse = ++container->clock;
+            ++container->hits;
+            return slot->data;
+        }
+
+        if (slot->lastUse < victim->lastUse)
+            victim = slot;
+    }
+
+    ++container->misses;
+    if (victim->data == NULL && (victim->data = malloc(container->header.chunkSize)) == NULL)
+        return NULL;
+
+    const fat_ChunkEntry* entry = &container->chunks[chunk];
+    uint32_t length = chunkLength(container, chunk);
+    uint8_t* target = (entry->type == FAT_CHUNK_STORED) ? victim->data : container->compressed;
+
+    victim->chunk = 0xFFFFFFFF;                                     // invalid until fully decoded
+    if (entry->size > container->header.chunkSize ||
+        fseek64(container->file, entry->offset, SEEK_SET) != 0 ||
+        fread(target, 1, entry->size, container->file) != entry->size)
+        return NULL;
+
+    if (entry->type == FAT_CHUNK_STORED && entry->size != length)
+        return NULL;
+
+    if (entry->type == FAT_CHUNK_LZ4 && !lz4Decompress(container->compressed, entry->size, victim->data, length))
+        return NULL;
+
+    victim->chunk = chunk;
+    victim->lastUse = ++container->clock;
+    return victim->data;
+}
+
+uint8_t fat_containerRead(fat_Container* container, unsigned address, unsigned count, char* out)
+{
+    assert(container != NULL);
+    assert(out != NULL);
+
+    if ((uint64_t)address + count > container->header.imageSize)
+        return 0;
+
+    uint32_t chunkSize = container->header.chunkSize;
+    while (count > 0)
+    {
+        uint32_t chunk = address / chunkSize;
+        uint32_t offset = address % chunkSize;
+        uint32_t length = chunkSize - offset;
+        if (length > count)
+            length = count;
+
+        if (container->chunks[chunk].type == FAT_CHUNK_HOLE)        // served without touching the file
+            memset(out, 0, length);
+        else
+        {
+            const uint8_t* data = loadChunk(container, chunk);
+            if (data == NULL)
+                return 0;
+
+            memcpy(out, data + offset, length);
+        }
+
+        address += length;
+        out += length;
+        count -= length;
+    }
+
+    return 1;
+}
+
+uint8_t fat_containerConvert(const char* rawPath, const char* containerPath, uint32_t chunkSize, fat_ContainerStats* stats)
+{
+    assert(rawPath != NULL);
+    assert(containerPath != NULL);
+
+    if (chunkSize == 0)
+        chunkSize = FAT_CONTAINER_CHUNK_SIZE;
+
+    FILE* raw = fopen(rawPath, "rb");
+    if (raw == NULL)
+        return 0;
+
+    FILE* out = fopen(containerPath, "wb");
+    if (out == NULL)
+    {
+        fclose(raw);
+        return 0;
+    }
+
+    fat_ContainerHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = FAT_CONTAINER_MAGIC;
+    header.version = FAT_CONTAINER_VERSION;
+    header.chunkSize = chunkSize;
+
+    fat_ContainerStats local;
+    if (stats == NULL)
+        stats = &local;
+    memset(stats, 0, sizeof(fat_ContainerStats));
+
+    uint8_t* data = malloc(chunkSize);
+    uint8_t* compressed = malloc(chunkSize);
+    fat_ChunkEntry* chunks = NULL;
+    uint32_t capacity = 0;
+    uint64_t offset = sizeof(header);
+    uint8_t ok = data != NULL && compressed != NULL &&
+        fwrite(&header, sizeof(header), 1, out) == 1;               // placeholder, rewritten at the end
+
+    while (ok)
+    {
+        uint32_t length = (uint32_t)fread(data, 1, chunkSize, raw);
+        if (length == 0)
+            break;
+
+        if (header.chunkCount == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 1024;
+            fat_ChunkEntry* p = realloc(chunks, capacity * sizeof(fat_ChunkEntry));
+            if (p == NULL)
+            {
+                ok = 0;
+                break;
+            }
+            chunks = p;
+        }
+
+        fat_ChunkEntry* entry = &chunks[header.chunkCount++];
+        entry->offset = offset;
+        entry->size = 0;
+        entry->type = FAT_CHUNK_HOLE;
+        header.imageSize += length;
+
+        if (isZero(data, length))
+        {
+            ++stats->holes;
+            continue;
+        }
+
+        uint32_t size = lz4Compress(data, length, compressed, length - 1);
+        if (size > 0)
+        {
+            entry->type = FAT_CHUNK_LZ4;
+            entry->size = size;
+            ok = fwrite(compressed, 1, size, out) == size;
+            ++stats->compressed;
+        }
+        else                                                        // doesn't compress, store as is
+        {
+            entry->type = FAT_CHUNK_STORED;
+            entry->size = length;
+            ok = fwrite(data, 1, length, out) == length;
+            ++stats->stored;
+        }
+
+        offset += entry->size;
+    }
+
+    ok = ok && !ferror(raw);
+    header.indexOffset = offset;
+    if (ok)
+    {
+        ok = fwrite(chunks, sizeof(fat_ChunkEntry), header.chunkCount, out) == header.chunkCount &&
+            fseek64(out, 0, SEEK_SET) == 0 &&
+            fwrite(&header, sizeof(header), 1, out) == 1;
+    }
+
+    stats->imageSize = header.imageSize;
+    stats->containerSize = offset + (uint64_t)header.chunkCount * sizeof(fat_ChunkEntry);
+
+    free(data);
+    free(compressed);
+    free(chunks);
+    fclose(raw);
+    return (fclose(out) == 0) && ok;
+}
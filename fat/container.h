@@ -0,0 +1,87 @@
+#pragma once
+
+#include "fat.h"
+
+#ifdef FAT_NO_HEAP
+#error "containers cache chunks on the heap, leave container.c out of FAT_NO_HEAP builds"
+#endif
+
+// Chunked image container: the raw image is cut in fixed size chunks which are compressed one by one
+// (LZ4 block format), all-zero chunks are holes that take no space. A chunk index at the end of the
+// file maps every chunk to its data so any address can be read without decompressing the rest.
+
+#define FAT_CONTAINER_MAGIC 0x4D494346                              // "FCIM"
+#define FAT_CONTAINER_VERSION 0x01
+#define FAT_CONTAINER_CHUNK_SIZE 0x10000
+#define FAT_CONTAINER_CACHE_SLOTS 0x10
+
+#define FAT_CHUNK_HOLE 0x00
+#define FAT_CHUNK_STORED 0x01
+#define FAT_CHUNK_LZ4 0x02
+
+typedef struct fat_ContainerHeader fat_ContainerHeader;
+PACK(
+struct fat_ContainerHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t chunkSize;
+	uint32_t chunkCount;
+	uint64_t imageSize;
+	uint64_t indexOffset;
+});
+
+typedef struct fat_ChunkEntry fat_ChunkEntry;
+PACK(
+struct fat_ChunkEntry
+{
+	uint64_t offset;
+	uint32_t size;
+	uint32_t type;
+});
+
+// Decompressed chunk kept in memory
+typedef struct fat_ChunkCacheSlot fat_ChunkCacheSlot;
+struct fat_ChunkCacheSlot
+{
+	uint32_t chunk;
+	uint32_t lastUse;
+	uint8_t* data;
+};
+
+typedef struct fat_Container fat_Container;
+struct fat_Container
+{
+	FILE* file;
+	fat_ContainerHeader header;
+	fat_ChunkEntry* chunks;
+	uint8_t* compressed;
+
+	fat_ChunkCacheSlot cache[FAT_CONTAINER_CACHE_SLOTS];
+	uint32_t clock;
+	uint32_t hits;
+	uint32_t misses;
+};
+
+// Statistics of a conversion
+typedef struct fat_ContainerStats fat_ContainerStats;
+struct fat_ContainerStats
+{
+	uint64_t imageSize;
+	uint64_t containerSize;
+	uint32_t holes;
+	uint32_t stored;
+	uint32_t compressed;
+};
+
+// Opens a container, fails when path isn't one
+uint8_t fat_containerOpen(const char* path, fat_Container* container);
+
+// Closes the container and frees the cache
+void fat_containerClose(fat_Container* container);
+
+// Reads count bytes of the image at address, same contract as fetchData_t
+uint8_t fat_containerRead(fat_Container* container, unsigned address, unsigned count, char* out);
+
+// Converts a raw image to a container, chunkSize of 0 selects FAT_CONTAINER_CHUNK_SIZE
+uint8_t fat_containerConvert(const char* rawPath, const char* containerPath, uint32_t chunkSize, fat_ContainerStats* stats);
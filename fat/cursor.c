@@ -0,0 +1,275 @@
+#include "cursor.h"
+
+// FNV-1a over the fields in front of check, catches tokens which were cut or mistyped
+static uint32_t tokenCheck(const fat_DirectoryToken* token)
+{
+    const uint8_t* data = (const uint8_t*)token;
+    uint32_t hash = 0x811C9DC5;
+    for (size_t i = 0; i < sizeof(fat_DirectoryToken) - sizeof(uint32_t); ++i)
+    {
+        hash ^= data[i];
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+// Collects the clusters of the directory, a chain which leaves the volume or loops ends where it does so in fat_readDirectory
+static uint8_t loadChain(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, uint32_t cluster, uint32_t** clusters, uint32_t* count)
+{
+    uint32_t countOfClusters = fat_countOfClusters(boot);
+    uint32_t capacity = 0;
+
+    *clusters = NULL;
+    *count = 0;
+    while (cluster >= 2 && cluster <= countOfClusters + 1 && *count < countOfClusters)
+    {
+        if (*count == capacity)
+        {
+            capacity = (capacity == 0) ? 0x10 : capacity * 2;
+            uint32_t* grown = realloc(*clusters, capacity * sizeof(uint32_t));
+            if (grown == NULL)
+                return 0;
+            *clusters = grown;
+        }
+        (*clusters)[(*count)++] = cluster;
+
+        uint8_t eoc = 0;
+        uint32_t next = fat_nextClusterEntry(boot, partitionOffset, cluster, fetch, &eoc);
+        if (next == 0xFFFFFFFF && !eoc)                             // the fetch failed
+            return 0;
+        if (eoc)
+            break;
+        cluster = next;
+    }
+
+    return 1;
+}
+
+uint8_t fat_directoryIndexBuild(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, unsigned cluster, fat_DirectoryIndex* index)
+{
+    assert(boot != NULL);
+    assert(fetch != NULL);
+    assert(index != NULL);
+
+    memset(index, 0, sizeof(fat_DirectoryIndex));
+    if (cluster == FAT_DIRECTORY_ROOT)
+        cluster = fat_rootCluster(boot);
+    index->startCluster = cluster;
+
+    uint32_t entriesPerCluster = fat_entriesPerCluster(boot);
+    uint8_t ok = 1;
+    if (cluster == FAT_DIRECTORY_ROOT)                              // the root region of FAT12/16
+        index->blockCount = (boot->rootEntries + entriesPerCluster - 1) / entriesPerCluster;
+    else
+        ok = loadChain(boot, partitionOffset, fetch, cluster, &index->clusters, &index->blockCount);
+
+    index->firstOrdinal = malloc((index->blockCount + 1) * sizeof(uint32_t));
+    index->firstSlot = malloc((index->blockCount + 1) * sizeof(uint32_t));
+    uint8_t* buffer = malloc(fat_clusterSize(boot));
+    ok = ok && index->firstOrdinal != NULL && index->firstSlot != NULL && buffer != NULL;
+
+    fat_DirectoryIterator it;
+    fat_openDirectory(boot, cluster, &it);
+    it.chain = index->clusters;
+    it.chainLength = (index->clusters != NULL) ? index->blockCount : 0;
+    it.buffer = buffer;
+
+    fat_DirectoryEntry entry;
+    uint32_t filled = 0;
+    uint32_t readFrom = 0;                                          // slot after the previous entry
+    while (ok && fat_readDirectory(boot, partitionOffset, fetch, &it, &entry, NULL, 0))
+    {
+        // the long name slots are right in front of the short entry, a damaged count never reaches past the previous entry
+        uint32_t shortSlot = it.entryIndex - 1;
+        uint32_t startSlot = (shortSlot - readFrom > it.longNameCount) ? shortSlot - it.longNameCount : readFrom;
+        for (; filled <= shortSlot / entriesPerCluster && filled < index->blockCount; ++filled)
+        {
+            index->firstOrdinal[filled] = index->entryCount;
+            index->firstSlot[filled] = startSlot;
+        }
+
+        ++index->entryCount;
+        readFrom = it.entryIndex;
+    }
+
+    ok = ok && fat_endOfDirectory(&it);                             // not stopped by a failed fetch
+    for (; ok && filled < index->blockCount; ++filled)              // nothing starts in the blocks after the last entry
+    {
+        index->firstOrdinal[filled] = index->entryCount;
+        index->firstSlot[filled] = readFrom;
+    }
+
+    free(buffer);
+    if (!ok)
+        fat_directoryIndexFree(index);
+    return ok;
+}
+
+void fat_directoryIndexFree(fat_DirectoryIndex* index)
+{
+    assert(index != NULL);
+
+    free(index->clusters);
+    free(index->firstOrdinal);
+    free(index->firstSlot);
+    memset(index, 0, sizeof(fat_DirectoryIndex));
+}
+
+void fat_cursorOpen(const fat_BootSector* boot, unsigned cluster, const fat_DirectoryIndex* index, uint8_t* buffer, fat_DirectoryCursor* cursor)
+{
+    assert(boot != NULL);
+    assert(cursor != NULL);
+
+    fat_openDirectory(boot, cluster, &cursor->it);
+    cursor->it.buffer = buffer;
+    cursor->ordinal = 0;
+    cursor->index = index;
+
+    if (index != NULL)
+    {
+        assert(index->startCluster == cursor->it.startCluster);
+        cursor->it.chain = index->clusters;
+        cursor->it.chainLength = (index->clusters != NULL) ? index->blockCount : 0;
+    }
+}
+
+uint8_t fat_cursorNext(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, fat_DirectoryCursor* cursor, fat_DirectoryEntry* entry, char* fileName, unsigned nameLen)
+{
+    assert(cursor != NULL);
+
+    if (!fat_readDirectory(boot, partitionOffset, fetch, &cursor->it, entry, fileName, nameLen))
+        return 0;
+
+    ++cursor->ordinal;
+    return 1;
+}
+
+// Sets the iterator to continue at slot. cluster is the one fat_readDirectory would hold there: the
+// cluster of the slot before, so the first slot of a cluster is reached by following the chain.
+static void moveTo(fat_DirectoryCursor* cursor, uint32_t cluster, uint32_t slot, uint32_t ordinal)
+{
+    cursor->it.currentCluster = cluster;
+    cursor->it.entryIndex = slot;
+    cursor->it.flags = 0;
+    cursor->it.longNameCount = 0;
+    cursor->ordinal = ordinal;
+}
+
+uint8_t fat_cursorSeek(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, fat_DirectoryCursor* cursor, uint32_t ordinal)
+{
+    assert(boot != NULL);
+    assert(cursor != NULL);
+    assert(cursor->index != NULL);
+
+    const fat_DirectoryIndex* index = cursor->index;
+    if (ordinal > index->entryCount)
+        return 0;
+
+    if (index->blockCount == 0)
+        moveTo(cursor, cursor->it.startCluster, 0, 0);
+    else
+    {
+        uint32_t low = 0, high = index->blockCount;                 // the last block whose first entry isn't past ordinal
+        while (high - low > 1)
+        {
+            uint32_t middle = low + (high - low) / 2;
+            if (index->firstOrdinal[middle] <= ordinal)
+                low = middle;
+            else
+                high = middle;
+        }
+
+        uint32_t slot = index->firstSlot[low];
+        uint32_t entriesPerCluster = fat_entriesPerCluster(boot);
+        uint32_t cluster = cursor->it.startCluster;
+        if (index->clusters != NULL && slot > 0)
+            cluster = index->clusters[(slot - 1) / entriesPerCluster];
+        moveTo(cursor, cluster, slot, index->firstOrdinal[low]);
+    }
+
+    fat_DirectoryEntry entry;
+    while (cursor->ordinal < ordinal)                               // within a cluster of ordinal
+    {
+        if (!fat_cursorNext(boot, partitionOffset, fetch, cursor, &entry, NULL, 0))
+            return 0;
+    }
+
+    return 1;
+}
+
+void fat_cursorToken(const fat_DirectoryCursor* cursor, fat_DirectoryToken* token)
+{
+    assert(cursor != NULL);
+    assert(token != NULL);
+
+    memset(token, 0, sizeof(fat_DirectoryToken));
+    token->magic = FAT_TOKEN_MAGIC;
+    token->startCluster = cursor->it.startCluster;
+    token->cluster = cursor->it.currentCluster;
+    token->slot = cursor->it.entryIndex;
+    token->ordinal = cursor->ordinal;
+    token->check = tokenCheck(token);
+}
+
+uint8_t fat_cursorResume(const fat_BootSector* boot, fat_DirectoryCursor* cursor, const fat_DirectoryToken* token)
+{
+    assert(boot != NULL);
+    assert(cursor != NULL);
+    assert(token != NULL);
+
+    if (token->magic != FAT_TOKEN_MAGIC || token->check != tokenCheck(token) || token->startCluster != cursor->it.startCluster)
+        return 0;
+
+    if (token->startCluster == FAT_DIRECTORY_ROOT)
+    {
+        if (token->slot > boot->rootEntries)
+            return 0;
+    }
+    else if (token->cluster < 2 || token->cluster > fat_countOfClusters(boot) + 1)
+        return 0;
+
+    moveTo(cursor, token->cluster, token->slot, token->ordinal);
+    return 1;
+}
+
+void fat_tokenToText(const fat_DirectoryToken* token, char* text)
+{
+    assert(token != NULL);
+    assert(text != NULL);
+
+    const uint8_t* data = (const uint8_t*)token;
+    for (size_t i = 0; i < sizeof(fat_DirectoryToken); ++i)
+        sprintf(text + i * 2, "%02x", data[i]);
+}
+
+static int hexDigit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+uint8_t fat_tokenFromText(const char* text, fat_DirectoryToken* token)
+{
+    assert(text != NULL);
+    assert(token != NULL);
+
+    if (strlen(text) != sizeof(fat_DirectoryToken) * 2)
+        return 0;
+
+    uint8_t* data = (uint8_t*)token;
+    for (size_t i = 0; i < sizeof(fat_DirectoryToken); ++i)
+    {
+        int high = hexDigit(text[i * 2]), low = hexDigit(text[i * 2 + 1]);
+        if (high < 0 || low < 0)
+            return 0;
+        data[i] = (uint8_t)(high << 4 | low);
+    }
+
+    return token->magic == FAT_TOKEN_MAGIC && token->check == tokenCheck(token);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "fat.h"
+
+#ifdef FAT_NO_HEAP
+#error "the index of a directory is built on the heap, leave cursor.c out of FAT_NO_HEAP builds"
+#endif
+
+// Listing a directory a page at a time. A cursor is a directory iterator that counts the entries it
+// returned. Its position can be saved as a token (a few bytes, or text) and later resumed without
+// reading any of the entries before it. A token is always taken between two entries, where no long
+// name is half read, so the slot after the last entry returned is all the long name state it needs.
+//
+// For jumping to an arbitrary entry a directory index is built once: the clusters of the directory in
+// order, and for every cluster the number of the first entry whose short entry is in it together with
+// the slot its long name starts at. A seek looks the cluster up in the index, reads it (and the one
+// before when the long name starts there) and skips the few entries in between. The chain is handed to
+// the iterator, so reading on never reads the FAT either. The root of FAT12/16 has no chain, its fixed
+// region is cut in cluster sized blocks instead.
+
+#define FAT_TOKEN_MAGIC 0x4B544446                                  // "FDTK"
+#define FAT_TOKEN_TEXT 0x31                                         // bytes of a token as text with its terminator
+
+// Position in a directory, valid as long as the directory isn't changed
+typedef struct fat_DirectoryToken fat_DirectoryToken;
+PACK(
+struct fat_DirectoryToken
+{
+	uint32_t magic;
+	uint32_t startCluster;                                          // of the directory
+	uint32_t cluster;                                               // of the last slot read, startCluster before the first
+	uint32_t slot;                                                  // next slot to read
+	uint32_t ordinal;                                               // entries returned before
+	uint32_t check;                                                 // over the fields above
+});
+
+typedef struct fat_DirectoryIndex fat_DirectoryIndex;
+struct fat_DirectoryIndex
+{
+	uint32_t startCluster;
+	uint32_t* clusters;                                             // the chain, NULL for the root of FAT12/16
+	uint32_t blockCount;                                            // clusters, or blocks of the root region
+	uint32_t* firstOrdinal;                                         // per block, first entry with its short entry there or later
+	uint32_t* firstSlot;                                            // per block, slot to start reading that entry at
+	uint32_t entryCount;
+};
+
+typedef struct fat_DirectoryCursor fat_DirectoryCursor;
+struct fat_DirectoryCursor
+{
+	fat_DirectoryIterator it;
+	uint32_t ordinal;                                               // entries returned so far
+	const fat_DirectoryIndex* index;                                // optional
+};
+
+// Lists the directory at cluster once (FAT_DIRECTORY_ROOT for the root) and builds its index, free it with fat_directoryIndexFree
+uint8_t fat_directoryIndexBuild(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, unsigned cluster, fat_DirectoryIndex* index);
+
+void fat_directoryIndexFree(fat_DirectoryIndex* index);
+
+// Opens a cursor at the first entry, index is optional and must belong to the same directory. buffer
+// (fat_clusterSize bytes) is optional as well, with it whole clusters are read at once.
+void fat_cursorOpen(const fat_BootSector* boot, unsigned cluster, const fat_DirectoryIndex* index, uint8_t* buffer, fat_DirectoryCursor* cursor);
+
+// Reads the next entry, returns 0 at the end of the directory
+uint8_t fat_cursorNext(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, fat_DirectoryCursor* cursor, fat_DirectoryEntry* entry, char* fileName, unsigned nameLen);
+
+// Moves the cursor in front of entry ordinal, needs the index. Fails when the directory has fewer entries.
+uint8_t fat_cursorSeek(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, fat_DirectoryCursor* cursor, uint32_t ordinal);
+
+// Gets the position of the cursor
+void fat_cursorToken(const fat_DirectoryCursor* cursor, fat_DirectoryToken* token);
+
+// Moves the cursor to a saved position, fails when the token is damaged or of another directory
+uint8_t fat_cursorResume(const fat_BootSector* boot, fat_DirectoryCursor* cursor, const fat_DirectoryToken* token);
+
+// Writes the token as hexadecimal text (FAT_TOKEN_TEXT bytes) and reads it back, for URLs and the like
+void fat_tokenToText(const fat_DirectoryToken* token, char* text);
+uint8_t fat_tokenFromText(const char* text, fat_DirectoryToken* token);
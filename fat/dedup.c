@@ -0,0 +1,569 @@
+#include "dedup.h"
+#include "hash.h"
+#include "extract.h"
+#include "bulk.h"
+
+typedef struct ClusterPass ClusterPass;
+struct ClusterPass
+{
+    fat_Device* device;
+    const fat_BootSector* boot;
+    unsigned partitionOffset;
+    FatType type;
+    const uint8_t* table;
+    uint32_t clusterSize;
+    uint32_t clustersPerChunk;
+    uint32_t lastCluster;
+    uint32_t image;
+    uint32_t chunkCount;
+    uint64_t* chunkStart;                                           // first record of every chunk
+    fat_DedupRecord* records;
+    volatile long nextChunk;
+    volatile long failed;
+};
+
+typedef struct FilePass FilePass;
+struct FilePass
+{
+    fat_DedupBuilder* builder;
+    const fat_BootSector* boot;
+    unsigned partitionOffset;
+    const uint8_t* table;
+    uint32_t image;
+    fat_BulkFile* files;
+    fat_DedupRecord* records;                                       // all but the hash, one per file
+    uint32_t count;
+    uint64_t fileCapacity, recordCapacity;
+    uint32_t skipped;
+    fat_Xxh64 xxh;                                                  // of the file coming in parts
+    uint8_t failed;
+};
+
+// The walk and fat_loadFat need a fetch, it reads the device bound by fat_dedupAddImage
+static uint8_t fetchBound(unsigned address, unsigned count, char* out)
+{
+    return fat_deviceRead(fat_threadBinding(), address, count, out);
+}
+
+static uint8_t grow(void** buffer, uint64_t* capacity, uint64_t needed, size_t elementSize)
+{
+    if (needed <= *capacity)
+        return 1;
+
+    uint64_t newCapacity = *capacity ? *capacity : 64;
+    while (newCapacity < needed)
+        newCapacity *= 2;
+
+    if (newCapacity > SIZE_MAX / elementSize)
+        return 0;
+
+    void* p = realloc(*buffer, (size_t)newCapacity * elementSize);
+    if (p == NULL)
+        return 0;
+
+    *buffer = p;
+    *capacity = newCapacity;
+    return 1;
+}
+
+// Reserves length bytes (the terminator included) in the names
+static char* reserveName(fat_DedupBuilder* builder, size_t length, uint32_t* offset)
+{
+    if (builder->nameSize + length > 0xFFFFFFFF ||
+        !grow((void**)&builder->names, &builder->nameCapacity, builder->nameSize + length, 1))
+        return NULL;
+
+    *offset = (uint32_t)builder->nameSize;
+    builder->nameSize += length;
+    return builder->names + *offset;
+}
+
+// Allocated and not marked bad
+static uint8_t isHashed(FatType type, uint32_t entry)
+{
+    uint32_t bad = (type == FAT12) ? 0x0FF7 : (type == FAT16) ? 0xFFF7 : 0x0FFFFFF7;
+    return entry != 0 && entry != bad;
+}
+
+static void hashChunks(void* argument)
+{
+    ClusterPass* c = argument;
+    uint8_t* buffer = malloc((size_t)c->clustersPerChunk * c->clusterSize);
+    if (buffer == NULL)
+        fat_atomicIncrement(&c->failed);
+
+    while (buffer != NULL)
+    {
+        long chunk = fat_atomicIncrement(&c->nextChunk) - 1;
+        if (chunk >= (long)c->chunkCount)
+            break;
+
+        uint32_t first = 2 + (uint32_t)chunk * c->clustersPerChunk;
+        uint32_t end = (c->lastCluster + 1 - first > c->clustersPerChunk) ? first + c->clustersPerChunk : c->lastCluster + 1;
+        fat_DedupRecord* out = c->records + c->chunkStart[chunk];
+
+        for (uint32_t cluster = first; cluster < end;)
+        {
+            if (!isHashed(c->type, fat_fatEntry(c->type, c->table, cluster)))
+            {
+                ++cluster;
+                continue;
+            }
+
+            uint32_t start = cluster;                               // a run of allocated clusters is one read
+            while (cluster < end && isHashed(c->type, fat_fatEntry(c->type, c->table, cluster)))
+                ++cluster;
+
+            if (!fat_deviceRead(c->device, fat_clusterToAddress(c->boot, c->partitionOffset, start), (cluster - start) * c->clusterSize, (char*)buffer))
+            {
+                fat_atomicIncrement(&c->failed);
+                break;
+            }
+
+            for (uint32_t i = start; i < cluster; ++i, ++out)
+            {
+                out->hash = fat_xxh64(buffer + (size_t)(i - start) * c->clusterSize, c->clusterSize, 0);
+                out->size = c->clusterSize;
+                out->image = c->image;
+                out->cluster = i;
+                out->path = FAT_DEDUP_NONE;
+            }
+        }
+    }
+
+    free(buffer);
+}
+
+static uint8_t hashClusters(fat_DedupBuilder* builder, fat_DedupImage* image, ClusterPass* c, unsigned threads)
+{
+    uint32_t countOfClusters = c->lastCluster - 1;
+    c->clustersPerChunk = (FAT_DEDUP_CHUNK > c->clusterSize) ? FAT_DEDUP_CHUNK / c->clusterSize : 1;
+    c->chunkCount = (countOfClusters + c->clustersPerChunk - 1) / c->clustersPerChunk;
+    c->chunkStart = malloc(((size_t)c->chunkCount + 1) * sizeof(uint64_t));
+    if (c->chunkStart == NULL)
+        return 0;
+
+    // every chunk writes its records from a known position, so the records come out in cluster order
+    uint64_t records = 0;
+    for (uint32_t chunk = 0; chunk < c->chunkCount; ++chunk)
+    {
+        c->chunkStart[chunk] = records;
+        uint32_t first = 2 + chunk * c->clustersPerChunk;
+        uint32_t end = (c->lastCluster + 1 - first > c->clustersPerChunk) ? first + c->clustersPerChunk : c->lastCluster + 1;
+        for (uint32_t cluster = first; cluster < end; ++cluster)
+            records += isHashed(c->type, fat_fatEntry(c->type, c->table, cluster));
+    }
+
+    if (records == 0 || !grow((void**)&builder->clusters, &builder->clusterCapacity, builder->clusterCount + records, sizeof(fat_DedupRecord)))
+    {
+        free(c->chunkStart);
+        return records == 0;                                        // nothing allocated, nothing to read
+    }
+    c->records = builder->clusters + builder->clusterCount;
+
+#ifdef FAT_NO_THREADS
+    threads = 1;
+#else
+    if (threads == 0)
+        threads = fat_processorCount();
+#endif
+    if (threads > c->chunkCount)
+        threads = (c->chunkCount > 0) ? c->chunkCount : 1;
+
+#ifndef FAT_NO_THREADS
+    fat_Thread* handles = malloc(threads * sizeof(fat_Thread));     // the calling thread is one of the workers
+    unsigned started = 0;
+    for (; handles != NULL && started + 1 < threads; ++started)
+    {
+        if (!fat_threadStart(&handles[started], hashChunks, c))
+            break;
+    }
+
+    hashChunks(c);
+    for (unsigned i = 0; i < started; ++i)
+        fat_threadJoin(handles[i]);
+    free(handles);
+#else
+    hashChunks(c);
+#endif
+
+    free(c->chunkStart);
+    if (c->failed)
+        return 0;
+
+    builder->clusterCount += records;
+    builder->bytesRead += records * c->clusterSize;
+    image->clusters = (uint32_t)records;
+    return 1;
+}
+
+static uint8_t collectFile(const fat_WalkEntry* entry, void* context)
+{
+    FilePass* f = context;
+    if ((entry->entry.fileAttributes & FAT_FILE_ATTR_DIRECTORY) || entry->entry.fileSize == 0)
+        return FAT_WALK_CONTINUE;
+
+    fat_FileExtent* extents;
+    uint32_t extentCount;
+    if (!fat_tableFileExtents(f->boot, f->partitionOffset, f->table, &entry->entry, &extents, &extentCount))
+    {
+        ++f->skipped;
+        return FAT_WALK_CONTINUE;
+    }
+
+    // the path from the root, separated by slashes
+    size_t length = strlen(entry->fileName) + 1;
+    for (const fat_WalkEntry* parent = entry->parent; parent != NULL; parent = parent->parent)
+        length += strlen(parent->fileName) + 1;
+
+    uint32_t path;
+    char* name = reserveName(f->builder, length, &path);
+    if (name == NULL || f->count == FAT_DEDUP_NONE ||
+        !grow((void**)&f->files, &f->fileCapacity, f->count + 1, sizeof(fat_BulkFile)) ||
+        !grow((void**)&f->records, &f->recordCapacity, f->count + 1, sizeof(fat_DedupRecord)))
+    {
+        free(extents);
+        f->failed = 1;
+        return FAT_WALK_STOP;
+    }
+
+    size_t position = length - 1 - strlen(entry->fileName);
+    strcpy(name + position, entry->fileName);
+    for (const fat_WalkEntry* parent = entry->parent; parent != NULL; parent = parent->parent)
+    {
+        name[--position] = '/';
+        position -= strlen(parent->fileName);
+        memcpy(name + position, parent->fileName, strlen(parent->fileName));
+    }
+
+    fat_BulkFile* file = &f->files[f->count];
+    file->extents = extents;
+    file->extentCount = extentCount;
+    file->size = entry->entry.fileSize;
+
+    fat_DedupRecord* record = &f->records[f->count++];
+    record->hash = 0;
+    record->size = entry->entry.fileSize;
+    record->image = f->image;
+    record->cluster = entry->entry.clusterHigh << 16 | entry->entry.clusterLow;
+    record->path = path;
+    return FAT_WALK_CONTINUE;
+}
+
+static uint8_t hashFile(uint32_t index, uint64_t offset, const uint8_t* data, uint64_t length, void* context)
+{
+    FilePass* f = context;
+    if (data == NULL)                                               // a read failed
+    {
+        f->failed = 1;
+        return 0;
+    }
+
+    if (offset == 0)
+        fat_xxh64Init(&f->xxh, 0);
+    fat_xxh64Update(&f->xxh, data, (size_t)length);
+    if (offset + length == f->files[index].size)
+        f->records[index].hash = fat_xxh64Final(&f->xxh);
+    return 1;
+}
+
+static uint8_t hashFiles(fat_DedupBuilder* builder, fat_DedupImage* image, fat_Device* device, FilePass* f)
+{
+    uint8_t ok = fat_walk(f->boot, f->partitionOffset, fetchBound, 1, FAT_WALK_PRE, collectFile, f) && !f->failed;
+
+    fat_BulkStats stats;
+    ok = ok && fat_bulkRead(device, f->files, f->count, NULL, hashFile, f, &stats) && !f->failed;
+    ok = ok && grow((void**)&builder->files, &builder->fileCapacity, builder->fileCount + f->count, sizeof(fat_DedupRecord));
+    if (ok)
+    {
+        if (f->count > 0)                                           // an empty volume has no records at all
+            memcpy(builder->files + builder->fileCount, f->records, (size_t)f->count * sizeof(fat_DedupRecord));
+        builder->fileCount += f->count;
+        builder->bytesRead += stats.bytesRead;
+        image->files = f->count;
+        image->skipped = f->skipped;
+    }
+
+    for (uint32_t i = 0; i < f->count; ++i)
+        free((void*)f->files[i].extents);
+    free(f->files);
+    free(f->records);
+    return ok;
+}
+
+void fat_dedupInit(fat_DedupBuilder* builder)
+{
+    assert(builder != NULL);
+
+    memset(builder, 0, sizeof(fat_DedupBuilder));
+}
+
+void fat_dedupFree(fat_DedupBuilder* builder)
+{
+    assert(builder != NULL);
+
+    free(builder->images);
+    free(builder->clusters);
+    free(builder->files);
+    free(builder->names);
+    memset(builder, 0, sizeof(fat_DedupBuilder));
+}
+
+uint8_t fat_dedupAddImage(fat_DedupBuilder* builder, const char* name, fat_Device* device, const fat_BootSector* boot, unsigned partitionOffset, uint8_t what, unsigned threads)
+{
+    assert(builder != NULL);
+    assert(name != NULL);
+    assert(device != NULL);
+    assert(boot != NULL);
+
+    uint64_t clusterCount = builder->clusterCount, fileCount = builder->fileCount;
+    uint64_t nameSize = builder->nameSize, bytesRead = builder->bytesRead;
+
+    void* binding = fat_threadBinding();
+    fat_threadBind(device);
+
+    fat_DedupImage image;
+    memset(&image, 0, sizeof(image));
+    image.clusterSize = fat_clusterSize(boot);
+
+    uint32_t nameOffset = 0;                                        // the image is packed, no pointers into it
+    char* imageName = reserveName(builder, strlen(name) + 1, &nameOffset);
+    image.name = nameOffset;
+    uint8_t* table = fat_loadFat(boot, partitionOffset, fetchBound);
+    uint8_t ok = imageName != NULL && table != NULL && builder->imageCount < FAT_DEDUP_NONE &&
+        grow((void**)&builder->images, &builder->imageCapacity, builder->imageCount + 1, sizeof(fat_DedupImage));
+    if (ok)
+        strcpy(imageName, name);
+
+    if (ok && (what & FAT_DEDUP_CLUSTERS))
+    {
+        ClusterPass c;
+        memset(&c, 0, sizeof(ClusterPass));
+        c.device = device;
+        c.boot = boot;
+        c.partitionOffset = partitionOffset;
+        c.type = fat_getType(boot);
+        c.table = table;
+        c.clusterSize = image.clusterSize;
+        c.lastCluster = fat_countOfClusters(boot) + 1;
+        c.image = (uint32_t)builder->imageCount;
+        ok = hashClusters(builder, &image, &c, threads);
+    }
+
+    if (ok && (what & FAT_DEDUP_FILES))
+    {
+        FilePass f;
+        memset(&f, 0, sizeof(FilePass));
+        f.builder = builder;
+        f.boot = boot;
+        f.partitionOffset = partitionOffset;
+        f.table = table;
+        f.image = (uint32_t)builder->imageCount;
+        ok = hashFiles(builder, &image, device, &f);
+    }
+
+    fat_threadBind(binding);
+    free(table);
+
+    if (!ok)                                                        // nothing of a failed image stays
+    {
+        builder->clusterCount = clusterCount;
+        builder->fileCount = fileCount;
+        builder->nameSize = nameSize;
+        builder->bytesRead = bytesRead;
+        return 0;
+    }
+
+    builder->images[builder->imageCount++] = image;
+    return 1;
+}
+
+// Orders by hash and size, the records of one content then by image and cluster
+static int compareRecords(const void* a, const void* b)
+{
+    const fat_DedupRecord* x = a;
+    const fat_DedupRecord* y = b;
+    if (x->hash != y->hash)
+        return (x->hash > y->hash) - (x->hash < y->hash);
+    if (x->size != y->size)
+        return (x->size > y->size) - (x->size < y->size);
+    if (x->image != y->image)
+        return (x->image > y->image) - (x->image < y->image);
+    return (x->cluster > y->cluster) - (x->cluster < y->cluster);
+}
+
+static uint64_t align8(uint64_t value)
+{
+    return (value + 7) & ~(uint64_t)7;
+}
+
+static uint8_t writeSection(FILE* file, uint64_t* position, uint64_t offset, const void* data, uint64_t size)
+{
+    static const char padding[8] = { 0 };
+
+    uint8_t ok = fwrite(padding, 1, (size_t)(offset - *position), file) == offset - *position &&
+        (size == 0 || fwrite(data, 1, (size_t)size, file) == size);
+    *position = offset + size;
+    return ok;
+}
+
+uint8_t fat_dedupWrite(fat_DedupBuilder* builder, const char* path)
+{
+    assert(builder != NULL);
+    assert(path != NULL);
+
+    qsort(builder->clusters, (size_t)builder->clusterCount, sizeof(fat_DedupRecord), compareRecords);
+    qsort(builder->files, (size_t)builder->fileCount, sizeof(fat_DedupRecord), compareRecords);
+
+    fat_DedupHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = FAT_DEDUP_MAGIC;
+    header.version = FAT_DEDUP_VERSION;
+    header.imageCount = (uint32_t)builder->imageCount;
+    header.nameSize = (uint32_t)builder->nameSize;
+    header.imageOffset = align8(sizeof(fat_DedupHeader));
+    header.clusterCount = builder->clusterCount;
+    header.clusterOffset = align8(header.imageOffset + builder->imageCount * sizeof(fat_DedupImage));
+    header.fileCount = builder->fileCount;
+    header.fileOffset = header.clusterOffset + builder->clusterCount * sizeof(fat_DedupRecord);   // records are 24 bytes
+    header.nameOffset = header.fileOffset + builder->fileCount * sizeof(fat_DedupRecord);
+    header.fileSize = header.nameOffset + builder->nameSize;
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL)
+        return 0;
+
+    uint64_t position = 0;
+    uint8_t ok =
+        writeSection(file, &position, 0, &header, sizeof(header)) &&
+        writeSection(file, &position, header.imageOffset, builder->images, builder->imageCount * sizeof(fat_DedupImage)) &&
+        writeSection(file, &position, header.clusterOffset, builder->clusters, builder->clusterCount * sizeof(fat_DedupRecord)) &&
+        writeSection(file, &position, header.fileOffset, builder->files, builder->fileCount * sizeof(fat_DedupRecord)) &&
+        writeSection(file, &position, header.nameOffset, builder->names, builder->nameSize);
+
+    return (fclose(file) == 0) && ok;
+}
+
+static uint8_t validSection(const fat_DedupHeader* header, uint64_t offset, uint64_t count, size_t elementSize)
+{
+    return offset >= sizeof(fat_DedupHeader) && offset <= header->fileSize && count <= (header->fileSize - offset) / elementSize;
+}
+
+// Every record refers to an image and a name of the index, and the records are in the order fat_dedupFind searches
+static uint8_t validRecords(const fat_DedupHeader* header, const fat_DedupRecord* records, uint64_t count)
+{
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        if (records[i].image >= header->imageCount ||
+            (records[i].path != FAT_DEDUP_NONE && records[i].path >= header->nameSize) ||
+            (i > 0 && compareRecords(&records[i - 1], &records[i]) > 0))
+            return 0;
+    }
+
+    return 1;
+}
+
+uint8_t fat_dedupOpen(const char* path, fat_DedupIndex* index)
+{
+    assert(path != NULL);
+    assert(index != NULL);
+
+    memset(index, 0, sizeof(fat_DedupIndex));
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return 0;
+
+    fat_DedupHeader header;
+    uint8_t ok = fread(&header, sizeof(header), 1, file) == 1 &&
+        header.magic == FAT_DEDUP_MAGIC && header.version == FAT_DEDUP_VERSION && header.fileSize <= SIZE_MAX &&
+        validSection(&header, header.imageOffset, header.imageCount, sizeof(fat_DedupImage)) &&
+        validSection(&header, header.clusterOffset, header.clusterCount, sizeof(fat_DedupRecord)) &&
+        validSection(&header, header.fileOffset, header.fileCount, sizeof(fat_DedupRecord)) &&
+        validSection(&header, header.nameOffset, header.nameSize, 1);
+
+    uint8_t* data = ok ? malloc((size_t)header.fileSize) : NULL;
+    ok = data != NULL && fseek(file, 0, SEEK_SET) == 0 && fread(data, 1, (size_t)header.fileSize, file) == header.fileSize;
+    fclose(file);
+
+    // the names end in a terminator, so every offset inside the section reads a terminated string
+    ok = ok && (header.nameSize > 0 ? data[header.nameOffset + header.nameSize - 1] == '\0' : header.imageCount == 0);
+    for (uint32_t i = 0; ok && i < header.imageCount; ++i)
+        ok = ((const fat_DedupImage*)(data + header.imageOffset))[i].name < header.nameSize;
+    ok = ok && validRecords(&header, (const fat_DedupRecord*)(data + header.clusterOffset), header.clusterCount) &&
+        validRecords(&header, (const fat_DedupRecord*)(data + header.fileOffset), header.fileCount);
+    if (!ok)
+    {
+        free(data);
+        return 0;
+    }
+
+    index->data = data;
+    index->header = (const fat_DedupHeader*)data;
+    index->images = (const fat_DedupImage*)(data + header.imageOffset);
+    index->clusters = (const fat_DedupRecord*)(data + header.clusterOffset);
+    index->files = (const fat_DedupRecord*)(data + header.fileOffset);
+    index->names = (const char*)(data + header.nameOffset);
+    return 1;
+}
+
+void fat_dedupClose(fat_DedupIndex* index)
+{
+    assert(index != NULL);
+
+    free(index->data);
+    memset(index, 0, sizeof(fat_DedupIndex));
+}
+
+const fat_DedupRecord* fat_dedupFind(const fat_DedupRecord* records, uint64_t count, uint64_t hash, uint64_t* matches)
+{
+    assert(records != NULL || count == 0);
+    assert(matches != NULL);
+
+    uint64_t low = 0, high = count;                                 // the first record not below hash
+    while (low < high)
+    {
+        uint64_t middle = low + (high - low) / 2;
+        if (records[middle].hash < hash)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    uint64_t end = low;
+    while (end < count && records[end].hash == hash)
+        ++end;
+
+    *matches = end - low;
+    return records + low;
+}
+
+const char* fat_dedupName(const fat_DedupIndex* index, uint32_t name)
+{
+    assert(index != NULL);
+
+    return (name < index->header->nameSize)
+        ? index->names + name
+        : "";
+}
+
+void fat_dedupRatio(const fat_DedupRecord* records, uint64_t count, fat_DedupRatio* ratio)
+{
+    assert(records != NULL || count == 0);
+    assert(ratio != NULL);
+
+    memset(ratio, 0, sizeof(fat_DedupRatio));
+    for (uint64_t first = 0; first < count;)
+    {
+        uint64_t end = first + 1;
+        while (end < count && records[end].hash == records[first].hash && records[end].size == records[first].size)
+            ++end;
+
+        ++ratio->contents;
+        ratio->records += end - first;
+        ratio->bytes += (uint64_t)records[first].size * (end - first);
+        ratio->uniqueBytes += records[first].size;
+        ratio->shared += records[end - 1].image != records[first].image;   // sorted by image within a content
+        first = end;
+    }
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "fat.h"
+#include "device.h"
+
+#ifdef FAT_NO_HEAP
+#error "the records of the dedup index are collected on the heap, leave dedup.c out of FAT_NO_HEAP builds"
+#endif
+
+// Content addressed index of a corpus of images, for finding the data they have in common. Every
+// allocated cluster is hashed on its own, and every file is hashed over its content (so it matches
+// across cluster sizes), both with XXH64 (hash.h). Equal hashes of equal sizes are taken to be the same
+// data, a collision is as likely as n^2 / 2^65 for n records.
+//
+// The clusters are hashed by a pool of workers. The volume is cut into chunks of FAT_DEDUP_CHUNK bytes,
+// which the workers take in address order. Each worker reads the runs of allocated clusters of its chunk
+// in one request each, so the device is read front to back in large requests. Every chunk writes its
+// records to a slot reserved for it, no lock is taken. The files are read afterwards by a bulk read
+// (bulk.h), in disk order as well. Empty files are left out.
+//
+// The index file holds a table of the images, the cluster records and the file records (each sorted by
+// hash, size, image and cluster) and the paths of the files. It is loaded whole and searched by hash.
+
+#define FAT_DEDUP_MAGIC 0x50444446                                  // "FDDP"
+#define FAT_DEDUP_VERSION 0x01
+#define FAT_DEDUP_NONE 0xFFFFFFFF
+#define FAT_DEDUP_CHUNK 0x400000                                    // bytes of the volume per task of a worker
+
+#define FAT_DEDUP_CLUSTERS 0x01                                     // what fat_dedupAddImage hashes
+#define FAT_DEDUP_FILES 0x02
+
+typedef struct fat_DedupHeader fat_DedupHeader;
+PACK(
+struct fat_DedupHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t imageCount;
+	uint32_t nameSize;
+	uint64_t imageOffset;
+	uint64_t clusterCount;
+	uint64_t clusterOffset;
+	uint64_t fileCount;
+	uint64_t fileOffset;
+	uint64_t nameOffset;
+	uint64_t fileSize;
+});
+
+typedef struct fat_DedupImage fat_DedupImage;
+PACK(
+struct fat_DedupImage
+{
+	uint32_t name;                                                  // of the image, in the names
+	uint32_t clusterSize;
+	uint32_t clusters;                                              // allocated clusters hashed
+	uint32_t files;                                                 // files hashed
+	uint32_t skipped;                                               // files whose chain ends before the file does
+});
+
+typedef struct fat_DedupRecord fat_DedupRecord;
+PACK(
+struct fat_DedupRecord
+{
+	uint64_t hash;
+	uint32_t size;                                                  // bytes hashed
+	uint32_t image;                                                 // in the table of images
+	uint32_t cluster;                                               // the cluster, or the first cluster of the file
+	uint32_t path;                                                  // of the file in the names, FAT_DEDUP_NONE for clusters
+});
+
+// Records of the images added so far
+typedef struct fat_DedupBuilder fat_DedupBuilder;
+struct fat_DedupBuilder
+{
+	fat_DedupImage* images;
+	uint64_t imageCount, imageCapacity;
+	fat_DedupRecord* clusters;
+	uint64_t clusterCount, clusterCapacity;
+	fat_DedupRecord* files;
+	uint64_t fileCount, fileCapacity;
+	char* names;
+	uint64_t nameSize, nameCapacity;                                // below 4 GB, names are referred to by 32 bit offsets
+	uint64_t bytesRead;
+};
+
+typedef struct fat_DedupIndex fat_DedupIndex;
+struct fat_DedupIndex
+{
+	const fat_DedupHeader* header;
+	const fat_DedupImage* images;
+	const fat_DedupRecord* clusters;
+	const fat_DedupRecord* files;
+	const char* names;
+	void* data;
+};
+
+// Duplication of one kind of record, a content is one distinct hash and size
+typedef struct fat_DedupRatio fat_DedupRatio;
+struct fat_DedupRatio
+{
+	uint64_t records;
+	uint64_t contents;
+	uint64_t shared;                                                // contents found in more than one image
+	uint64_t bytes;                                                 // of all records
+	uint64_t uniqueBytes;                                           // of one record per content
+};
+
+void fat_dedupInit(fat_DedupBuilder* builder);
+void fat_dedupFree(fat_DedupBuilder* builder);
+
+// Hashes what (FAT_DEDUP_*) of the volume on device with threads workers (0 is one per processor) and
+// adds it as image name. The device is bound to the calling thread (fat_threadBind) while the FAT is
+// loaded and the tree walked, the previous binding is restored afterwards. Nothing is added when it fails.
+uint8_t fat_dedupAddImage(fat_DedupBuilder* builder, const char* name, fat_Device* device, const fat_BootSector* boot, unsigned partitionOffset, uint8_t what, unsigned threads);
+
+// Sorts the records and writes the index to path
+uint8_t fat_dedupWrite(fat_DedupBuilder* builder, const char* path);
+
+// Loads the index at path, fails when it is missing or damaged
+uint8_t fat_dedupOpen(const char* path, fat_DedupIndex* index);
+void fat_dedupClose(fat_DedupIndex* index);
+
+// Finds the records of hash among count sorted records, returns the first and their count in matches
+const fat_DedupRecord* fat_dedupFind(const fat_DedupRecord* records, uint64_t count, uint64_t hash, uint64_t* matches);
+
+// Gets a name (of an image or a file path) out of the index
+const char* fat_dedupName(const fat_DedupIndex* index, uint32_t name);
+
+// Counts the duplication of count sorted records
+void fat_dedupRatio(const fat_DedupRecord* records, uint64_t count, fat_DedupRatio* ratio);
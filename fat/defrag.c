@@ -0,0 +1,525 @@
+#include "defrag.h"
+#include "walk.h"
+
+// Chain as it is placed in the new layout, in the order of its new clusters
+typedef struct Chain Chain;
+struct Chain
+{
+    uint32_t oldStart;
+    uint32_t newStart;
+    uint32_t count;
+    uint32_t parent;                                                // new first cluster of the directory holding it, 0 for the root
+    uint8_t directory;
+};
+
+// Directory waiting to be placed and listed
+typedef struct PendingDirectory PendingDirectory;
+struct PendingDirectory
+{
+    uint32_t cluster;                                               // old first cluster
+    uint32_t parent;                                                // new first cluster of its parent
+};
+
+typedef struct Defragmenter Defragmenter;
+struct Defragmenter
+{
+    const fat_BootSector* boot;
+    unsigned partitionOffset;
+    fetchData_t fetch;
+    storeData_t store;
+
+    FatType type;
+    uint32_t clusterSize;
+    uint32_t lastCluster;
+    uint8_t* fat;
+    uint8_t* newFat;
+    uint32_t* newStart;                                             // per old first cluster, 0 while not placed
+    uint32_t nextFree;
+    uint32_t placed;                                                // clusters given to chains
+    uint32_t badClusters;
+
+    Chain* chains;
+    uint32_t chainCount, chainCapacity;
+    PendingDirectory* stack;
+    uint32_t stackCount, stackCapacity;
+
+    uint8_t* batch;
+    uint32_t batchAddress;
+    uint32_t batchLength;
+    fat_DefragStats stats;
+};
+
+// Walk state of fat_fragmentation
+typedef struct FragmentationScan FragmentationScan;
+struct FragmentationScan
+{
+    const fat_BootSector* boot;
+    fat_Fragmentation* fragmentation;
+};
+
+static uint32_t endOfChain(FatType type)
+{
+    return (type == FAT12) ? 0x0FFF : (type == FAT16) ? 0xFFFF : 0x0FFFFFFF;
+}
+
+static uint32_t badCluster(FatType type)
+{
+    return (type == FAT12) ? 0x0FF7 : (type == FAT16) ? 0xFFF7 : 0x0FFFFFF7;
+}
+
+// Clusters marked bad keep their mark and place in the new FAT, no chain is put on them
+static uint8_t isBad(const Defragmenter* d, uint32_t cluster)
+{
+    return fat_fatEntry(d->type, d->fat, cluster) == badCluster(d->type);
+}
+
+// First cluster from cluster on which isn't marked bad, lastCluster + 1 when there is none
+static uint32_t nextGood(const Defragmenter* d, uint32_t cluster)
+{
+    while (cluster <= d->lastCluster && isBad(d, cluster))
+        ++cluster;
+    return cluster;
+}
+
+static uint32_t firstCluster(const fat_DirectoryEntry* entry)
+{
+    return entry->clusterHigh << 16 | entry->clusterLow;
+}
+
+static void setFirstCluster(fat_DirectoryEntry* entry, uint32_t cluster)
+{
+    entry->clusterHigh = (uint16_t)(cluster >> 16);
+    entry->clusterLow = (uint16_t)cluster;
+}
+
+// Follows at most count clusters of the chain (0 follows it to the end), counts them and the runs of contiguous ones
+static uint32_t chainLength(const fat_BootSector* boot, const uint8_t* table, uint32_t cluster, uint32_t count, uint32_t* runs)
+{
+    FatType type = fat_getType(boot);
+    uint32_t lastCluster = fat_countOfClusters(boot) + 1;
+    if (count == 0 || count > lastCluster)
+        count = lastCluster;
+
+    uint32_t length = 0, previous = 0;
+    *runs = 0;
+    while (length < count && cluster >= 2 && cluster <= lastCluster)
+    {
+        if (cluster != previous + 1)
+            ++*runs;
+
+        ++length;
+        previous = cluster;
+        cluster = fat_fatEntry(type, table, cluster);
+        if (fat_isEndOfChain(type, cluster))
+            break;
+    }
+
+    return length;
+}
+
+static uint8_t fragmentationVisit(const fat_WalkEntry* entry, void* context)
+{
+    FragmentationScan* scan = context;
+    fat_Fragmentation* fragmentation = scan->fragmentation;
+    uint8_t directory = (entry->entry.fileAttributes & FAT_FILE_ATTR_DIRECTORY) != 0;
+
+    if (directory)
+        ++fragmentation->directories;
+    else
+        ++fragmentation->files;
+
+    if (!directory && entry->entry.fileSize == 0)                   // no chain
+        return FAT_WALK_CONTINUE;
+
+    uint32_t clusterSize = fat_clusterSize(scan->boot), runs;
+    uint32_t count = directory ? 0 : (entry->entry.fileSize + clusterSize - 1) / clusterSize;
+    fragmentation->clusters += chainLength(scan->boot, entry->iterator->table, firstCluster(&entry->entry), count, &runs);
+    fragmentation->runs += runs;
+    if (runs > 1)
+        ++fragmentation->fragmented;
+
+    return FAT_WALK_CONTINUE;
+}
+
+uint8_t fat_fragmentation(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, fat_Fragmentation* fragmentation)
+{
+    assert(boot != NULL);
+    assert(fetch != NULL);
+    assert(fragmentation != NULL);
+
+    memset(fragmentation, 0, sizeof(fat_Fragmentation));
+    FragmentationScan scan = { boot, fragmentation };
+    return fat_walk(boot, partitionOffset, fetch, 1, FAT_WALK_PRE | FAT_WALK_LAZY_NAMES, fragmentationVisit, &scan);
+}
+
+// Gives the chain at oldStart the next free clusters, returns its new first cluster (0 when it has none).
+// A chain steps over the clusters marked bad, it is contiguous otherwise. Entries sharing a chain share
+// its copy as well.
+static uint32_t place(Defragmenter* d, uint32_t oldStart, uint32_t count, uint8_t directory, uint32_t parent)
+{
+    if (oldStart < 2 || oldStart > d->lastCluster)
+        return 0;
+    if (d->newStart[oldStart] != 0)
+        return d->newStart[oldStart];
+
+    uint32_t runs;
+    uint32_t length = chainLength(d->boot, d->fat, oldStart, count, &runs);
+    uint32_t start = nextGood(d, d->nextFree), last = start;
+    for (uint32_t i = 1; i < length && last <= d->lastCluster; ++i)
+        last = nextGood(d, last + 1);
+    if (length == 0 || last > d->lastCluster)                       // cross-linked chains can add up to more than there is
+        return 0;
+
+    if (d->chainCount == d->chainCapacity)
+    {
+        uint32_t capacity = d->chainCapacity ? d->chainCapacity * 2 : 256;
+        Chain* chains = realloc(d->chains, capacity * sizeof(Chain));
+        if (chains == NULL)
+            return 0;
+
+        d->chains = chains;
+        d->chainCapacity = capacity;
+    }
+
+    Chain* chain = &d->chains[d->chainCount++];
+    chain->oldStart = oldStart;
+    chain->newStart = start;
+    chain->count = length;
+    chain->parent = parent;
+    chain->directory = directory;
+
+    d->newStart[oldStart] = start;
+    d->nextFree = last + 1;
+    d->placed += length;
+    return chain->newStart;
+}
+
+static uint8_t pushDirectory(Defragmenter* d, uint32_t cluster, uint32_t parent)
+{
+    if (d->stackCount == d->stackCapacity)
+    {
+        uint32_t capacity = d->stackCapacity ? d->stackCapacity * 2 : 64;
+        PendingDirectory* stack = realloc(d->stack, capacity * sizeof(PendingDirectory));
+        if (stack == NULL)
+            return 0;
+
+        d->stack = stack;
+        d->stackCapacity = capacity;
+    }
+
+    d->stack[d->stackCount].cluster = cluster;
+    d->stack[d->stackCount++].parent = parent;
+    return 1;
+}
+
+// Places the files of the directory and queues its subdirectories, they are placed once they are listed
+static uint8_t planDirectory(Defragmenter* d, uint32_t oldCluster, uint32_t newCluster, uint8_t* buffer)
+{
+    fat_DirectoryIterator it;
+    fat_openDirectory(d->boot, oldCluster, &it);
+    it.table = d->fat;
+    it.buffer = buffer;
+
+    uint32_t firstPending = d->stackCount;
+    fat_DirectoryEntry entry;
+    while (fat_readDirectory(d->boot, d->partitionOffset, d->fetch, &it, &entry, NULL, 0))
+    {
+        if ((entry.fileAttributes & FAT_FILE_ATTR_VOLUME) || entry.fileName[0] == '.')
+            continue;
+
+        if (entry.fileAttributes & FAT_FILE_ATTR_DIRECTORY)
+        {
+            if (!pushDirectory(d, firstCluster(&entry), newCluster))
+                return 0;
+        }
+        else if (entry.fileSize > 0)
+        {
+            uint32_t cluster = firstCluster(&entry);
+            if (cluster >= 2 && cluster <= d->lastCluster &&        // a file without clusters has nothing to lose
+                place(d, cluster, (entry.fileSize + d->clusterSize - 1) / d->clusterSize, 0, newCluster) == 0)
+                return 0;
+        }
+    }
+
+    for (uint32_t i = firstPending, j = d->stackCount; i + 1 < j; ++i, --j)
+    {                                                               // the first one found comes off the stack first
+        PendingDirectory swap = d->stack[i];
+        d->stack[i] = d->stack[j - 1];
+        d->stack[j - 1] = swap;
+    }
+
+    return fat_endOfDirectory(&it);
+}
+
+// Lays out the tree depth first: a directory, its files, then each of its subdirectories
+static uint8_t plan(Defragmenter* d, uint8_t* buffer)
+{
+    d->nextFree = 2;
+    if (d->type == FAT32 && place(d, fat_rootCluster(d->boot), 0, 1, 0) == 0)
+        return 0;
+
+    if (!planDirectory(d, FAT_DIRECTORY_ROOT, 0, buffer))
+        return 0;
+
+    while (d->stackCount > 0)
+    {
+        PendingDirectory pending = d->stack[--d->stackCount];
+        uint32_t cluster = pending.cluster;
+        if (cluster < 2 || cluster > d->lastCluster || d->newStart[cluster] != 0)
+            continue;                                               // broken, or already placed (a loop in the tree)
+
+        uint32_t newCluster = place(d, cluster, 0, 1, pending.parent);
+        if (newCluster == 0 || !planDirectory(d, cluster, newCluster, buffer))
+            return 0;
+    }
+
+    return 1;
+}
+
+static uint8_t readData(Defragmenter* d, uint32_t address, uint32_t count, void* out)
+{
+    ++d->stats.reads;
+    return d->fetch(address, count, out);
+}
+
+static uint8_t writeData(Defragmenter* d, uint32_t address, uint32_t count, const void* data)
+{
+    ++d->stats.writes;
+    return d->store(address, count, data);
+}
+
+static uint8_t flush(Defragmenter* d)
+{
+    if (d->batchLength == 0)
+        return 1;
+
+    uint8_t ok = writeData(d, d->batchAddress, d->batchLength, d->batch);
+    d->batchAddress += d->batchLength;
+    d->batchLength = 0;
+    return ok;
+}
+
+// Points the entries of a directory at the new chains, returns 0 once the end of the directory has been seen
+static uint8_t patchEntries(const Defragmenter* d, const Chain* chain, fat_DirectoryEntry* entries, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        fat_DirectoryEntry* entry = &entries[i];
+        if (entry->fileName[0] == 0x00)
+            return 0;
+
+        if ((entry->fileAttributes & FAT_FILE_ATTR_LONG_NAME_MASK) == FAT_FILE_ATTR_LONG_NAME || (entry->fileAttributes & FAT_FILE_ATTR_VOLUME))
+            continue;
+
+        uint32_t cluster = firstCluster(entry);
+        if (entry->fileName[0] == 0xE5)                             // its clusters are gone
+            setFirstCluster(entry, 0);
+        else if (memcmp(entry->fileName, ".          ", 11) == 0)
+            setFirstCluster(entry, chain->newStart);
+        else if (memcmp(entry->fileName, "..         ", 11) == 0)
+            setFirstCluster(entry, chain->parent);
+        else
+            setFirstCluster(entry, (cluster >= 2 && cluster <= d->lastCluster) ? d->newStart[cluster] : 0);
+    }
+
+    return 1;
+}
+
+// Copies the chain to its new place, each run of contiguous source clusters is read at once
+static uint8_t copyChain(Defragmenter* d, const Chain* chain)
+{
+    uint32_t entriesPerCluster = d->clusterSize / sizeof(fat_DirectoryEntry);
+    uint32_t cluster = chain->oldStart, target = chain->newStart, done = 0;
+    uint8_t patching = chain->directory;
+
+    while (done < chain->count)
+    {
+        target = nextGood(d, target);
+        uint32_t address = fat_clusterToAddress(d->boot, d->partitionOffset, target);
+        if (d->batchAddress + d->batchLength != address)            // a bad cluster lies between, it isn't written
+        {
+            if (!flush(d))
+                return 0;
+            d->batchAddress = address;
+        }
+
+        uint32_t start = cluster, length = 1;
+        uint32_t space = (FAT_DEFRAG_BATCH - d->batchLength) / d->clusterSize;
+        if (space == 0)
+        {
+            if (!flush(d))
+                return 0;
+            space = FAT_DEFRAG_BATCH / d->clusterSize;
+        }
+
+        uint32_t next = fat_fatEntry(d->type, d->fat, cluster);
+        while (done + length < chain->count && length < space && next == cluster + 1 && !isBad(d, target + length))
+        {
+            cluster = next;
+            next = fat_fatEntry(d->type, d->fat, cluster);
+            ++length;
+        }
+
+        uint8_t* data = d->batch + d->batchLength;
+        if (!readData(d, fat_clusterToAddress(d->boot, d->partitionOffset, start), length * d->clusterSize, data))
+            return 0;
+
+        if (patching)
+            patching = patchEntries(d, chain, (fat_DirectoryEntry*)data, length * entriesPerCluster);
+
+        for (uint32_t i = 0; i < length; ++i)
+        {
+            if (start + i != target + i)
+                ++d->stats.moved;
+        }
+
+        d->batchLength += length * d->clusterSize;
+        done += length;
+        target += length;
+        cluster = next;
+    }
+
+    return 1;
+}
+
+// Copies the region from the boot sector up to the data region, then writes the new FATs over it
+static uint8_t copyMetadata(Defragmenter* d)
+{
+    uint32_t start = d->partitionOffset;
+    uint32_t end = fat_sectorToAddress(d->boot, d->partitionOffset, fat_firstDataSector(d->boot));
+
+    for (uint32_t address = start; address < end; address += FAT_DEFRAG_BATCH)
+    {
+        uint32_t length = (end - address < FAT_DEFRAG_BATCH) ? end - address : FAT_DEFRAG_BATCH;
+        if (!readData(d, address, length, d->batch) || !writeData(d, address, length, d->batch))
+            return 0;
+    }
+
+    if (d->type != FAT32)                                           // the root directory region
+    {
+        uint32_t address = fat_sectorToAddress(d->boot, d->partitionOffset, fat_rootDirectorySector(d->boot));
+        uint32_t length = d->boot->rootEntries * sizeof(fat_DirectoryEntry);
+        Chain root = { 0, 0, 0, 0, 1 };
+
+        if (!readData(d, address, length, d->batch))
+            return 0;
+        patchEntries(d, &root, (fat_DirectoryEntry*)d->batch, d->boot->rootEntries);
+        if (!writeData(d, address, length, d->batch))
+            return 0;
+    }
+
+    uint32_t fatSize = fat_fatSize(d->boot);
+    for (uint8_t i = 0; i < d->boot->numberOfFATs; ++i)
+    {
+        if (!writeData(d, fat_sectorToAddress(d->boot, d->partitionOffset, d->boot->reservedSectors) + i * fatSize, fatSize, d->newFat))
+            return 0;
+    }
+
+    return 1;
+}
+
+// Points the boot sector (and its backup) at the new root and brings the FSInfo sector up to date
+static uint8_t updateFat32(Defragmenter* d)
+{
+    const fat32_BootSector* extended = (const fat32_BootSector*)d->boot->rest;
+    fat_BootSector boot = *d->boot;
+    ((fat32_BootSector*)boot.rest)->rootCluster = d->newStart[extended->rootCluster];
+
+    fat_FileSystemInformationSector info;
+    uint32_t infoAddress = fat_sectorToAddress(d->boot, d->partitionOffset, extended->fileSystemInformationSector);
+    if (!readData(d, infoAddress, sizeof(info), &info))
+        return 0;
+
+    info.freeClusters = (int32_t)(d->lastCluster - 1 - d->placed - d->badClusters);
+    info.lastAllocatedCluster = d->nextFree - 1;
+
+    uint8_t ok = writeData(d, d->partitionOffset, sizeof(boot), &boot) && writeData(d, infoAddress, sizeof(info), &info);
+    if (ok && extended->backupBootSector != 0)                      // the backup FSInfo follows the backup boot sector
+    {
+        uint32_t backup = fat_sectorToAddress(d->boot, d->partitionOffset, extended->backupBootSector);
+        ok = writeData(d, backup, sizeof(boot), &boot) && writeData(d, backup + d->boot->bytesPerSector, sizeof(info), &info);
+    }
+
+    return ok;
+}
+
+uint8_t fat_defrag(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, storeData_t store, fat_DefragStats* stats)
+{
+    assert(boot != NULL);
+    assert(fetch != NULL);
+    assert(store != NULL);
+
+    Defragmenter d;
+    memset(&d, 0, sizeof(Defragmenter));
+    d.boot = boot;
+    d.partitionOffset = partitionOffset;
+    d.fetch = fetch;
+    d.store = store;
+    d.type = fat_getType(boot);
+    d.clusterSize = fat_clusterSize(boot);
+    d.lastCluster = fat_countOfClusters(boot) + 1;
+
+    uint32_t batchSize = FAT_DEFRAG_BATCH;
+    if (d.clusterSize > batchSize)
+        batchSize = d.clusterSize;
+    if (boot->rootEntries * sizeof(fat_DirectoryEntry) > batchSize)
+        batchSize = boot->rootEntries * sizeof(fat_DirectoryEntry);
+
+    d.fat = fat_loadFat(boot, partitionOffset, fetch);
+    d.newFat = calloc(fat_fatSize(boot), 1);
+    d.newStart = calloc(d.lastCluster + 1, sizeof(uint32_t));
+    d.batch = malloc(batchSize);
+    uint8_t ok = d.fat != NULL && d.newFat != NULL && d.newStart != NULL && d.batch != NULL;
+
+    for (uint32_t cluster = 2; ok && cluster <= d.lastCluster; ++cluster)
+    {
+        if (isBad(&d, cluster))
+        {
+            fat_setFatEntry(d.type, d.newFat, cluster, badCluster(d.type));
+            ++d.badClusters;
+        }
+    }
+
+    if (ok)
+        ok = plan(&d, d.batch);                                     // the batch is free until the copy starts
+
+    if (ok)
+    {
+        fat_setFatEntry(d.type, d.newFat, 0, fat_fatEntry(d.type, d.fat, 0));   // media descriptor and flags
+        fat_setFatEntry(d.type, d.newFat, 1, fat_fatEntry(d.type, d.fat, 1));
+        for (uint32_t i = 0; i < d.chainCount; ++i)
+        {
+            const Chain* chain = &d.chains[i];
+            uint32_t cluster = chain->newStart;
+            for (uint32_t j = 0; j + 1 < chain->count; ++j)
+            {
+                uint32_t next = nextGood(&d, cluster + 1);
+                fat_setFatEntry(d.type, d.newFat, cluster, next);
+                cluster = next;
+            }
+            fat_setFatEntry(d.type, d.newFat, cluster, endOfChain(d.type));
+        }
+
+        d.stats.chains = d.chainCount;
+        d.stats.clusters = d.placed;
+        ok = copyMetadata(&d) && (d.type != FAT32 || updateFat32(&d));
+    }
+
+    d.batchAddress = fat_clusterToAddress(boot, partitionOffset, 2);
+    for (uint32_t i = 0; ok && i < d.chainCount; ++i)
+        ok = copyChain(&d, &d.chains[i]);
+
+    if (ok)
+        ok = flush(&d);
+
+    if (stats != NULL)
+        *stats = d.stats;
+
+    free(d.batch);
+    free(d.stack);
+    free(d.chains);
+    free(d.newStart);
+    free(d.newFat);
+    free(d.fat);
+    return ok;
+}
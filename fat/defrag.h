@@ -0,0 +1,46 @@
+#pragma once
+
+#include "fat.h"
+
+#ifdef FAT_NO_HEAP
+#error "the defragmenter plans every chain on the heap, leave defrag.c out of FAT_NO_HEAP builds"
+#endif
+
+// Offline defragmentation into a new image. The tree is laid out depth first from the start of the data
+// region: a directory, then its files, then each of its subdirectories the same way, so every chain is
+// contiguous and a directory sits right before its content. The directory entries (also "." and ".."),
+// the FATs and the FSInfo sector are rewritten to match. Data is copied in batches of up to
+// FAT_DEFRAG_BATCH bytes, reading each contiguous source run at once and writing sequentially.
+//
+// Only the volume itself is written, from its boot sector up to the last used cluster. Free clusters are
+// not written, the caller sizes the image. Deleted entries lose their first cluster, clusters not
+// reachable from the tree (lost chains, deleted files) end up free. Clusters marked bad keep their mark
+// and no data is placed on them, a chain steps over them.
+
+#define FAT_DEFRAG_BATCH 0x400000                                   // bytes per write
+
+typedef struct fat_Fragmentation fat_Fragmentation;
+struct fat_Fragmentation
+{
+	uint32_t files;
+	uint32_t directories;
+	uint32_t fragmented;                                            // files and directories with more than one run
+	uint32_t runs;                                                  // runs of contiguous clusters, one fetch each to read them
+	uint32_t clusters;
+};
+
+typedef struct fat_DefragStats fat_DefragStats;
+struct fat_DefragStats
+{
+	uint32_t chains;
+	uint32_t clusters;                                              // used after defragmenting
+	uint32_t moved;                                                 // clusters which got another number
+	uint32_t reads;
+	uint32_t writes;
+};
+
+// Counts the runs of every file and directory chain
+uint8_t fat_fragmentation(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, fat_Fragmentation* fragmentation);
+
+// Writes the defragmented volume with store, at the same addresses it is read from. stats is optional.
+uint8_t fat_defrag(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, storeData_t store, fat_DefragStats* stats);
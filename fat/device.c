@@ -0,0 +1,344 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE                                                 // O_DIRECT
+#endif
+
+#include "device.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <winioctl.h>
+#include <malloc.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#endif
+
+static void lock(fat_Device* device)
+{
+#ifndef FAT_NO_THREADS
+    fat_mutexLock(&device->lock);
+#else
+    (void)device;
+#endif
+}
+
+static void unlock(fat_Device* device)
+{
+#ifndef FAT_NO_THREADS
+    fat_mutexUnlock(&device->lock);
+#else
+    (void)device;
+#endif
+}
+
+static uint8_t* alignedAlloc(uint32_t alignment, uint32_t size)
+{
+#ifdef _WIN32
+    return _aligned_malloc(size, alignment);
+#else
+    void* memory;
+    return (posix_memalign(&memory, alignment, size) == 0) ? memory : NULL;
+#endif
+}
+
+static void alignedFree(uint8_t* memory)
+{
+#ifdef _WIN32
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
+
+// Opens the file or block device, sets size and the logical sector size (0 when it isn't known)
+static uint8_t openRaw(const char* path, fat_Device* device, uint8_t direct, uint32_t* sectorSize)
+{
+    *sectorSize = 0;
+
+#ifdef _WIN32
+    DWORD flags = direct ? FILE_FLAG_NO_BUFFERING : FILE_ATTRIBUTE_NORMAL;
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, flags, NULL);
+    LARGE_INTEGER size;
+    if (handle == INVALID_HANDLE_VALUE)
+        return 0;
+
+    DISK_GEOMETRY_EX geometry;
+    DWORD returned;
+    if (DeviceIoControl(handle, IOCTL_DISK_GET_DRIVE_GEOMETRY_EX, NULL, 0, &geometry, sizeof(geometry), &returned, NULL))
+    {
+        size = geometry.DiskSize;                                   // \\.\PhysicalDriveN has no file size
+        *sectorSize = geometry.Geometry.BytesPerSector;
+    }
+    else if (!GetFileSizeEx(handle, &size))
+    {
+        CloseHandle(handle);
+        return 0;
+    }
+
+    device->handle = handle;
+    device->size = (uint64_t)size.QuadPart;
+#else
+    int flags = O_RDONLY;
+#ifdef O_DIRECT
+    if (direct)
+        flags |= O_DIRECT;
+#endif
+    int fd = open(path, flags);
+    struct stat st;
+    if (fd < 0)
+        return 0;
+
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+    if (direct)
+        fcntl(fd, F_NOCACHE, 1);                                    // macOS has no O_DIRECT
+#endif
+
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    device->fd = fd;
+    device->size = (uint64_t)st.st_size;
+#ifdef __linux__
+    if (S_ISBLK(st.st_mode))                                        // block devices have no file size
+    {
+        uint64_t size;
+        int logical;
+        if (ioctl(fd, BLKGETSIZE64, &size) == 0)
+            device->size = size;
+        if (ioctl(fd, BLKSSZGET, &logical) == 0 && logical > 0)
+            *sectorSize = (uint32_t)logical;
+    }
+#ifdef STATX_DIOALIGN
+    else if (direct)                                                // files align to what their filesystem needs
+    {
+        struct statx sx;
+        if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &sx) == 0 && (sx.stx_mask & STATX_DIOALIGN) && sx.stx_dio_offset_align > 0)
+            *sectorSize = (sx.stx_dio_offset_align > sx.stx_dio_mem_align) ? sx.stx_dio_offset_align : sx.stx_dio_mem_align;
+    }
+#endif
+#endif
+#endif
+    return 1;
+}
+
+// Reads up to count bytes at address, less only at the end of the device. Returns the bytes read, -1 on errors.
+static int64_t readAt(fat_Device* device, uint64_t address, unsigned count, uint8_t* out)
+{
+    unsigned done = 0;
+    while (done < count)                                            // reads may return less than asked
+    {
+#ifdef _WIN32
+        OVERLAPPED overlapped;
+        DWORD read = 0;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset = (DWORD)(address + done);
+        overlapped.OffsetHigh = (DWORD)((address + done) >> 32);
+        if (!ReadFile((HANDLE)device->handle, out + done, count - done, &read, &overlapped))
+            return (GetLastError() == ERROR_HANDLE_EOF) ? done : -1;
+#else
+        ssize_t read = pread(device->fd, out + done, count - done, (off_t)(address + done));
+        if (read < 0 && errno == EINTR)
+            continue;
+        if (read < 0)
+            return -1;
+#endif
+        if (read == 0)                                              // end of the device
+            break;
+        done += (unsigned)read;
+    }
+
+    return done;
+}
+
+// Opens path if it is a container, they are read under the lock because of the shared chunk cache
+static uint8_t openPacked(const char* path, fat_Device* device)
+{
+    if (!fat_containerOpen(path, &device->container))
+        return 0;
+
+    device->packed = 1;
+    device->size = device->container.header.imageSize;
+#ifndef FAT_NO_THREADS
+    fat_mutexInit(&device->lock);
+#endif
+    return 1;
+}
+
+uint8_t fat_deviceOpen(const char* path, fat_Device* device)
+{
+    assert(path != NULL);
+    assert(device != NULL);
+
+    memset(device, 0, sizeof(fat_Device));
+    if (openPacked(path, device))
+        return 1;
+
+    uint32_t sectorSize;
+    return openRaw(path, device, 0, &sectorSize);
+}
+
+uint8_t fat_deviceOpenDirect(const char* path, fat_Device* device)
+{
+    assert(path != NULL);
+    assert(device != NULL);
+
+    memset(device, 0, sizeof(fat_Device));
+    if (openPacked(path, device))                                   // compressed, there is no cache to bypass
+        return 1;
+
+    uint32_t sectorSize;
+    if (!openRaw(path, device, 1, &sectorSize))
+        return 0;
+
+    device->direct = 1;
+    device->sectorSize = sectorSize;
+    device->alignment = (sectorSize > FAT_DEVICE_DIRECT_ALIGNMENT) ? sectorSize : FAT_DEVICE_DIRECT_ALIGNMENT;
+    if (device->alignment > FAT_DEVICE_DIRECT_BUFFER || (device->buffer = alignedAlloc(FAT_DEVICE_DIRECT_ALIGNMENT, FAT_DEVICE_DIRECT_BUFFER)) == NULL)
+    {
+        fat_deviceClose(device);
+        return 0;
+    }
+
+#ifndef FAT_NO_THREADS
+    fat_mutexInit(&device->lock);
+#endif
+    return 1;
+}
+
+void fat_deviceSetSectorSize(fat_Device* device, uint32_t bytesPerSector)
+{
+    assert(device != NULL);
+
+    if (!device->direct || bytesPerSector < 512 || (bytesPerSector & (bytesPerSector - 1)) || bytesPerSector > FAT_DEVICE_DIRECT_ALIGNMENT)
+        return;                                                     // the buffer is allocated for 4 KB
+
+    uint32_t minimum = (device->sectorSize != 0) ? device->sectorSize : FAT_DEVICE_DIRECT_ALIGNMENT;    // unknown, stay at the safe 4 KB
+    lock(device);
+    device->alignment = (bytesPerSector > minimum) ? bytesPerSector : minimum;  // never below what the device accepts
+    unlock(device);
+}
+
+void fat_deviceClose(fat_Device* device)
+{
+    assert(device != NULL);
+
+    if (device->packed)
+    {
+        fat_containerClose(&device->container);
+#ifndef FAT_NO_THREADS
+        fat_mutexDestroy(&device->lock);
+#endif
+    }
+    else
+    {
+#ifdef _WIN32
+        if (device->handle != NULL)
+            CloseHandle((HANDLE)device->handle);
+#else
+        close(device->fd);
+#endif
+    }
+
+    if (device->buffer != NULL)
+    {
+        alignedFree(device->buffer);
+#ifndef FAT_NO_THREADS
+        fat_mutexDestroy(&device->lock);
+#endif
+    }
+
+    memset(device, 0, sizeof(fat_Device));
+}
+
+// Reads through the aligned buffer, the blocks around the request are kept for the next one
+static uint8_t readDirect(fat_Device* device, uint64_t address, unsigned count, uint8_t* out)
+{
+    uint32_t alignment = device->alignment;
+    if (address % alignment == 0 && count % alignment == 0 && (uintptr_t)out % alignment == 0)
+        return readAt(device, address, count, out) == count;        // already aligned, straight to the caller
+
+    uint8_t ok = 1;
+    lock(device);
+    while (count > 0)
+    {
+        if (address < device->bufferAddress || address >= device->bufferAddress + device->bufferLength)
+        {
+            uint64_t start = address - address % alignment;         // widen to whole blocks, as many as fit
+            uint64_t end = address + count + alignment - 1;
+            end -= end % alignment;
+            if (end - start > FAT_DEVICE_DIRECT_BUFFER)
+                end = start + FAT_DEVICE_DIRECT_BUFFER;
+
+            int64_t read = readAt(device, start, (unsigned)(end - start), device->buffer);
+            device->bufferAddress = start;
+            device->bufferLength = (read > 0) ? (uint32_t)read : 0;
+            if (address >= start + device->bufferLength)            // error, or past the end
+            {
+                ok = 0;
+                break;
+            }
+        }
+
+        uint32_t offset = (uint32_t)(address - device->bufferAddress);
+        uint32_t length = device->bufferLength - offset;
+        if (length > count)
+            length = count;
+
+        memcpy(out, device->buffer + offset, length);
+        address += length;
+        out += length;
+        count -= length;
+    }
+    unlock(device);
+
+    return ok;
+}
+
+static uint8_t readDevice(fat_Device* device, uint64_t address, unsigned count, char* out)
+{
+    if (address + count > device->size)
+        return 0;
+
+    if (device->packed)                                             // the chunk cache is shared
+    {
+        lock(device);
+        uint8_t ok = address <= 0xFFFFFFFF && fat_containerRead(&device->container, (unsigned)address, count, out);
+        unlock(device);
+        return ok;
+    }
+
+    if (device->direct)
+        return readDirect(device, address, count, (uint8_t*)out);
+
+    return readAt(device, address, count, (uint8_t*)out) == count;
+}
+
+void fat_deviceTrace(fat_Device* device, fat_Trace* trace)
+{
+    assert(device != NULL);
+
+    device->trace = trace;
+}
+
+uint8_t fat_deviceRead(fat_Device* device, uint64_t address, unsigned count, char* out)
+{
+    assert(device != NULL);
+    assert(out != NULL);
+
+    if (device->trace == NULL)
+        return readDevice(device, address, count, out);
+
+    uint64_t start = fat_traceClock();
+    uint8_t ok = readDevice(device, address, count, out);
+    fat_traceRecord(device->trace, address, count, start, ok);
+    return ok;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "fat.h"
+#include "container.h"
+#include "thread.h"
+#include "trace.h"
+
+// Image file opened for positional reads. Raw images are read with pread/ReadFile so any number of
+// threads can read at once, containers are recognized by their magic and read under a lock.
+//
+// Opened direct the page cache is bypassed (O_DIRECT, FILE_FLAG_NO_BUFFERING), which only allows reads
+// of whole aligned blocks into aligned memory. Requests which already are go straight to the disk, the
+// others (i.e. the 32 byte directory entries) are widened to the blocks around them and served from a
+// small aligned buffer, so the following entries of the same sector don't hit the disk again.
+
+#define FAT_DEVICE_DIRECT_BUFFER 0x10000                            // bytes of the direct read buffer
+#define FAT_DEVICE_DIRECT_ALIGNMENT 0x1000                          // until the sector size is known
+
+typedef struct fat_Device fat_Device;
+struct fat_Device
+{
+#ifdef _WIN32
+	void* handle;
+#else
+	int fd;
+#endif
+	uint64_t size;
+	uint8_t packed;
+	fat_Container container;
+	uint8_t direct;
+	uint32_t alignment;                                             // of address, size and memory of direct reads
+	uint32_t sectorSize;                                            // logical sector size or direct I/O alignment, 0 when unknown
+	uint8_t* buffer;                                                // direct read buffer
+	uint64_t bufferAddress;
+	uint32_t bufferLength;                                          // valid bytes in buffer
+	fat_Trace* trace;                                               // optional, records every read
+#ifndef FAT_NO_THREADS
+	fat_Mutex lock;
+#endif
+};
+
+// Opens the image (raw or container) at path
+uint8_t fat_deviceOpen(const char* path, fat_Device* device);
+
+// Opens a raw image or block device (i.e. /dev/sdb) past the page cache, containers are opened as usual
+uint8_t fat_deviceOpenDirect(const char* path, fat_Device* device);
+
+// Aligns direct reads to the sector size of the volume (bytesPerSector) instead of 4 KB, but never below the
+// logical sector size of the device (a 512 byte sector volume on a 4 KB sector disk stays at 4 KB). When the
+// device doesn't report it, i.e. a file on a filesystem without STATX_DIOALIGN, the alignment stays at 4 KB
+void fat_deviceSetSectorSize(fat_Device* device, uint32_t bytesPerSector);
+
+// Closes the image
+void fat_deviceClose(fat_Device* device);
+
+// Reads count bytes at address, safe to call from several threads
+uint8_t fat_deviceRead(fat_Device* device, uint64_t address, unsigned count, char* out);
+
+// Records every following read in trace, NULL stops recording
+void fat_deviceTrace(fat_Device* device, fat_Trace* trace);
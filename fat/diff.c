@@ -0,0 +1,670 @@
+#include "diff.h"
+
+// Entry of one side without a counterpart at the same path, yet
+typedef struct DiffItem DiffItem;
+struct DiffItem
+{
+    fat_DirectoryEntry entry;
+    char* path;
+    uint8_t matched;                                                // moved, or dropped with a moved parent
+    uint8_t expanded;                                               // directory of which the content has been listed
+};
+
+typedef struct ItemList ItemList;
+struct ItemList
+{
+    DiffItem* items;
+    uint32_t count, capacity;
+};
+
+// Directory of the first volume compared with one of the second
+typedef struct DirectoryPair DirectoryPair;
+struct DirectoryPair
+{
+    char* paths[2];
+    uint32_t clusters[2];
+};
+
+typedef struct PairStack PairStack;
+struct PairStack
+{
+    DirectoryPair* pairs;
+    uint32_t count, capacity;
+};
+
+typedef struct ListingEntry ListingEntry;
+struct ListingEntry
+{
+    fat_DirectoryEntry entry;
+    char fileName[FAT_LFN_MAX_LENGTH + 1];
+};
+
+typedef struct Listing Listing;
+struct Listing
+{
+    ListingEntry* entries;
+    uint32_t count, capacity;
+};
+
+typedef struct Differ Differ;
+struct Differ
+{
+    const fat_DiffVolume* volumes[2];
+    fat_DiffSummary* summary;
+    diffFound_t found;
+    void* context;
+
+    FatType type;
+    uint32_t clusterSize;
+    uint32_t lastClusters[2];
+    uint8_t* fats[2];
+    uint8_t* buffer;                                                // one cluster, for the directory iterators
+    uint8_t* changed;                                               // bitmap of the FAT entries which differ
+    uint8_t* paired[2];                                             // bitmaps of directory clusters compared, against loops
+    uint8_t* expanded[2];                                           // bitmaps of directory clusters listed one sided
+
+    PairStack pairs;
+    ItemList lists[2];                                              // removed, added
+    Listing listings[2];
+    uint8_t stop;
+    uint8_t failed;
+};
+
+static uint8_t testBit(const uint8_t* bitmap, uint32_t bit)
+{
+    return (bitmap[bit / 8] >> (bit % 8)) & 1;
+}
+
+static void setBit(uint8_t* bitmap, uint32_t bit)
+{
+    bitmap[bit / 8] |= 1 << (bit % 8);
+}
+
+static uint8_t* allocBitmap(uint32_t bits)
+{
+    return calloc(bits / 8 + 1, 1);
+}
+
+static char* joinPath(const char* parent, const char* name)
+{
+    size_t parentLength = strlen(parent);
+    char* path = malloc(parentLength + strlen(name) + 2);
+    if (path == NULL)
+        return NULL;
+
+    if (parentLength > 0)
+    {
+        memcpy(path, parent, parentLength);
+        path[parentLength++] = '/';
+    }
+    strcpy(path + parentLength, name);
+    return path;
+}
+
+static uint8_t isDirectory(const fat_DirectoryEntry* entry)
+{
+    return (entry->fileAttributes & FAT_FILE_ATTR_DIRECTORY) != 0;
+}
+
+static uint32_t firstCluster(const fat_DirectoryEntry* entry)
+{
+    return entry->clusterHigh << 16 | entry->clusterLow;
+}
+
+static void report(Differ* d, uint8_t change, uint8_t fields, const char* path, const char* oldPath, const fat_DirectoryEntry* oldEntry, const fat_DirectoryEntry* newEntry)
+{
+    if (d->stop)
+        return;
+
+    fat_DiffEntry entry;
+    memset(&entry, 0, sizeof(fat_DiffEntry));
+    entry.change = change;
+    entry.fields = fields;
+    entry.path = path;
+    entry.oldPath = oldPath;
+    if (oldEntry != NULL)
+        entry.oldEntry = *oldEntry;
+    if (newEntry != NULL)
+        entry.newEntry = *newEntry;
+
+    if (!d->found(&entry, d->context))
+        d->stop = 1;
+}
+
+// Compares the FATs block by block, only the blocks which differ are compared entry by entry
+static void compareFats(Differ* d, uint32_t size)
+{
+    uint32_t lastCluster = d->lastClusters[0];
+    for (uint32_t start = 0; start < size; start += FAT_DIFF_COMPARE_BLOCK)
+    {
+        uint32_t length = (size - start < FAT_DIFF_COMPARE_BLOCK) ? size - start : FAT_DIFF_COMPARE_BLOCK;
+        if (memcmp(d->fats[0] + start, d->fats[1] + start, length) == 0)
+            continue;
+
+        uint32_t from, to;                                          // clusters with an entry (partly) in the block
+        if (d->type == FAT12)
+        {
+            from = start * 2 / 3;
+            to = ((start + length) * 2 + 2) / 3;
+        }
+        else
+        {
+            uint32_t entrySize = (d->type == FAT16) ? 2 : 4;
+            from = start / entrySize;
+            to = (start + length) / entrySize;
+        }
+
+        if (from < 2)
+            from = 2;
+        for (uint32_t cluster = from; cluster <= to && cluster <= lastCluster; ++cluster)
+        {
+            if (!testBit(d->changed, cluster) && fat_fatEntry(d->type, d->fats[0], cluster) != fat_fatEntry(d->type, d->fats[1], cluster))
+            {
+                setBit(d->changed, cluster);
+                ++d->summary->changedFatEntries;
+            }
+        }
+    }
+}
+
+// Checks if any FAT entry on the chain starting at cluster changed, at most count clusters (0 follows it to the end)
+static uint8_t chainChanged(const Differ* d, uint32_t cluster, uint32_t count)
+{
+    if (d->changed == NULL)                                         // different geometry
+        return 1;
+
+    uint32_t lastCluster = d->lastClusters[0];
+    if (count == 0 || count > lastCluster)
+        count = lastCluster;
+
+    for (uint32_t i = 0; i < count && cluster >= 2 && cluster <= lastCluster; ++i)
+    {
+        if (testBit(d->changed, cluster))
+            return 1;
+
+        uint32_t next = fat_fatEntry(d->type, d->fats[0], cluster);
+        if (fat_isEndOfChain(d->type, next))
+            break;
+        cluster = next;
+    }
+
+    return 0;
+}
+
+static uint8_t compareEntries(const Differ* d, const fat_DirectoryEntry* a, const fat_DirectoryEntry* b)
+{
+    uint8_t fields = 0;
+    uint8_t directory = isDirectory(a);
+
+    if (!directory && a->fileSize != b->fileSize)
+        fields |= FAT_DIFF_FIELD_SIZE;
+    if (firstCluster(a) != firstCluster(b))
+        fields |= FAT_DIFF_FIELD_CHAIN;
+    else if (!directory && a->fileSize > 0 && chainChanged(d, firstCluster(a), (a->fileSize + d->clusterSize - 1) / d->clusterSize))
+        fields |= FAT_DIFF_FIELD_CHAIN;                             // a directory's content is compared instead
+    if (a->fileAttributes != b->fileAttributes)
+        fields |= FAT_DIFF_FIELD_ATTRIBUTES;
+    if (a->time != b->time || a->word != b->word)
+        fields |= FAT_DIFF_FIELD_MODIFIED;
+    if (a->timeCreatedMillis != b->timeCreatedMillis || a->timeCreatedHourMinute != b->timeCreatedHourMinute || a->dateCreated != b->dateCreated)
+        fields |= FAT_DIFF_FIELD_CREATED;
+
+    return fields;
+}
+
+static uint8_t addItem(ItemList* list, const fat_DirectoryEntry* entry, char* path)
+{
+    if (path == NULL)
+        return 0;
+
+    if (list->count == list->capacity)
+    {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 64;
+        DiffItem* items = realloc(list->items, capacity * sizeof(DiffItem));
+        if (items == NULL)
+        {
+            free(path);
+            return 0;
+        }
+
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    DiffItem* item = &list->items[list->count++];
+    item->entry = *entry;
+    item->path = path;
+    item->matched = 0;
+    item->expanded = 0;
+    return 1;
+}
+
+static uint8_t pushPair(Differ* d, char* firstPath, char* secondPath, uint32_t firstCluster, uint32_t secondCluster)
+{
+    if (firstPath == NULL || secondPath == NULL)
+    {
+        free(firstPath);
+        free(secondPath);
+        return 0;
+    }
+
+    PairStack* stack = &d->pairs;
+    if (stack->count == stack->capacity)
+    {
+        uint32_t capacity = stack->capacity ? stack->capacity * 2 : 64;
+        DirectoryPair* pairs = realloc(stack->pairs, capacity * sizeof(DirectoryPair));
+        if (pairs == NULL)
+        {
+            free(firstPath);
+            free(secondPath);
+            return 0;
+        }
+
+        stack->pairs = pairs;
+        stack->capacity = capacity;
+    }
+
+    DirectoryPair* pair = &stack->pairs[stack->count++];
+    pair->paths[0] = firstPath;
+    pair->paths[1] = secondPath;
+    pair->clusters[0] = firstCluster;
+    pair->clusters[1] = secondCluster;
+    return 1;
+}
+
+// Checks if the directory at cluster hasn't been listed yet on that side and marks it, loops in a broken tree end here
+static uint8_t firstVisit(Differ* d, uint8_t** bitmaps, unsigned side, uint32_t cluster)
+{
+    if (cluster < 2 || cluster > d->lastClusters[side] || testBit(bitmaps[side], cluster))
+        return 0;
+
+    setBit(bitmaps[side], cluster);
+    return 1;
+}
+
+static int compareListingEntries(const void* a, const void* b)
+{
+    return strcmp(((const ListingEntry*)a)->fileName, ((const ListingEntry*)b)->fileName);
+}
+
+// Reads the entries of a directory of one side, sorted by name
+static uint8_t readListing(Differ* d, unsigned side, uint32_t cluster, Listing* listing)
+{
+    const fat_DiffVolume* volume = d->volumes[side];
+    listing->count = 0;
+
+    fat_DirectoryIterator it;
+    fat_openDirectory(volume->boot, cluster, &it);
+    it.table = d->fats[side];
+    it.buffer = d->buffer;
+
+    for (;;)
+    {
+        if (listing->count == listing->capacity)
+        {
+            uint32_t capacity = listing->capacity ? listing->capacity * 2 : 64;
+            ListingEntry* entries = realloc(listing->entries, capacity * sizeof(ListingEntry));
+            if (entries == NULL)
+                return 0;
+
+            listing->entries = entries;
+            listing->capacity = capacity;
+        }
+
+        ListingEntry* entry = &listing->entries[listing->count];
+        if (!fat_readDirectory(volume->boot, volume->partitionOffset, volume->fetch, &it, &entry->entry, entry->fileName, sizeof(entry->fileName)))
+            break;
+
+        if ((entry->entry.fileAttributes & FAT_FILE_ATTR_VOLUME) || entry->entry.fileName[0] == '.')
+            continue;                                               // volume label, "." and ".."
+        ++listing->count;
+    }
+
+    if (!fat_endOfDirectory(&it))                                   // fetch failed
+        return 0;
+
+    qsort(listing->entries, listing->count, sizeof(ListingEntry), compareListingEntries);
+    return 1;
+}
+
+static void compareEntryPair(Differ* d, const DirectoryPair* pair, const ListingEntry* a, const ListingEntry* b)
+{
+    if (isDirectory(&a->entry) != isDirectory(&b->entry))          // replaced by something else
+    {
+        if (!addItem(&d->lists[0], &a->entry, joinPath(pair->paths[0], a->fileName)) ||
+            !addItem(&d->lists[1], &b->entry, joinPath(pair->paths[1], b->fileName)))
+            d->failed = d->stop = 1;
+        return;
+    }
+
+    char* path = joinPath(pair->paths[1], b->fileName);
+    if (path == NULL)
+    {
+        d->failed = d->stop = 1;
+        return;
+    }
+
+    uint8_t fields = compareEntries(d, &a->entry, &b->entry);
+    if (fields != 0)
+        report(d, FAT_DIFF_MODIFIED, fields, path, NULL, &a->entry, &b->entry);
+    else if (!isDirectory(&a->entry))
+        ++d->summary->filesUnchanged;
+
+    if (isDirectory(&a->entry) && firstVisit(d, d->paired, 0, firstCluster(&a->entry)) && firstVisit(d, d->paired, 1, firstCluster(&b->entry)))
+    {
+        if (!pushPair(d, joinPath(pair->paths[0], a->fileName), path, firstCluster(&a->entry), firstCluster(&b->entry)))
+            d->failed = d->stop = 1;
+        return;
+    }
+
+    free(path);
+}
+
+// Lists both directories of the pair and merges them by name
+static void comparePair(Differ* d, const DirectoryPair* pair)
+{
+    Listing* first = &d->listings[0];
+    Listing* second = &d->listings[1];
+    if (!readListing(d, 0, pair->clusters[0], first) || !readListing(d, 1, pair->clusters[1], second))
+    {
+        d->failed = d->stop = 1;
+        return;
+    }
+
+    ++d->summary->directoriesCompared;
+    uint32_t i = 0, j = 0;
+    while (!d->stop && (i < first->count || j < second->count))
+    {
+        int order = (i == first->count) ? 1 : (j == second->count) ? -1 : strcmp(first->entries[i].fileName, second->entries[j].fileName);
+        if (order == 0)
+        {
+            compareEntryPair(d, pair, &first->entries[i++], &second->entries[j++]);
+            continue;
+        }
+
+        unsigned side = (order < 0) ? 0 : 1;
+        const ListingEntry* entry = (order < 0) ? &first->entries[i++] : &second->entries[j++];
+        if (!addItem(&d->lists[side], &entry->entry, joinPath(pair->paths[side], entry->fileName)))
+            d->failed = d->stop = 1;
+    }
+}
+
+static void comparePairs(Differ* d)
+{
+    while (d->pairs.count > 0)
+    {
+        DirectoryPair pair = d->pairs.pairs[--d->pairs.count];
+        if (!d->stop)
+            comparePair(d, &pair);
+
+        free(pair.paths[0]);
+        free(pair.paths[1]);
+    }
+}
+
+// Drops the entries listed below a directory which turned out to be moved, its content is compared instead
+static void dropContent(ItemList* list, const char* path)
+{
+    size_t length = strlen(path);
+    for (uint32_t i = 0; i < list->count; ++i)
+    {
+        const char* other = list->items[i].path;
+        if (!list->items[i].matched && strncmp(other, path, length) == 0 && other[length] == '/')
+            list->items[i].matched = 1;
+    }
+}
+
+typedef struct ClusterIndex ClusterIndex;
+struct ClusterIndex
+{
+    uint32_t cluster;
+    uint32_t item;
+};
+
+static int compareClusterIndex(const void* a, const void* b)
+{
+    const ClusterIndex* x = a;
+    const ClusterIndex* y = b;
+    return (x->cluster != y->cluster) ? (x->cluster < y->cluster ? -1 : 1) : (x->item < y->item ? -1 : x->item > y->item);
+}
+
+static ClusterIndex* indexByCluster(const ItemList* list, uint8_t directories, uint32_t* count)
+{
+    ClusterIndex* index = malloc((list->count + 1) * sizeof(ClusterIndex));
+    *count = 0;
+    if (index == NULL)
+        return NULL;
+
+    for (uint32_t i = 0; i < list->count; ++i)
+    {
+        const DiffItem* item = &list->items[i];
+        if (!item->matched && isDirectory(&item->entry) == directories && firstCluster(&item->entry) >= 2)
+        {
+            index[*count].cluster = firstCluster(&item->entry);
+            index[(*count)++].item = i;
+        }
+    }
+
+    qsort(index, *count, sizeof(ClusterIndex), compareClusterIndex);
+    return index;
+}
+
+// Pairs removed and added entries by first cluster and reports them as moved, returns the amount paired
+static uint32_t matchMoves(Differ* d, uint8_t directories)
+{
+    uint32_t counts[2], moves = 0;
+    ClusterIndex* indexes[2];
+    indexes[0] = indexByCluster(&d->lists[0], directories, &counts[0]);
+    indexes[1] = indexByCluster(&d->lists[1], directories, &counts[1]);
+
+    if (indexes[0] == NULL || indexes[1] == NULL)
+        d->failed = d->stop = 1;
+
+    for (uint32_t i = 0, j = 0; !d->stop && i < counts[0] && j < counts[1];)
+    {
+        if (indexes[0][i].cluster != indexes[1][j].cluster)
+        {
+            if (indexes[0][i].cluster < indexes[1][j].cluster)
+                ++i;
+            else
+                ++j;
+            continue;
+        }
+
+        DiffItem* removed = &d->lists[0].items[indexes[0][i++].item];
+        DiffItem* added = &d->lists[1].items[indexes[1][j++].item];
+        if (removed->matched || added->matched)                     // dropped with a directory matched before
+            continue;
+
+        removed->matched = added->matched = 1;
+        ++moves;
+        report(d, FAT_DIFF_MOVED, compareEntries(d, &removed->entry, &added->entry), added->path, removed->path, &removed->entry, &added->entry);
+        if (!directories)
+            continue;
+
+        if (removed->expanded)
+            dropContent(&d->lists[0], removed->path);
+        if (added->expanded)
+            dropContent(&d->lists[1], added->path);
+
+        uint32_t cluster = firstCluster(&removed->entry);
+        if (firstVisit(d, d->paired, 0, cluster) && firstVisit(d, d->paired, 1, cluster))
+        {
+            char* firstPath = malloc(strlen(removed->path) + 1);
+            char* secondPath = malloc(strlen(added->path) + 1);
+            if (firstPath != NULL)
+                strcpy(firstPath, removed->path);
+            if (secondPath != NULL)
+                strcpy(secondPath, added->path);
+
+            if (!pushPair(d, firstPath, secondPath, cluster, cluster))
+                d->failed = d->stop = 1;
+        }
+    }
+
+    free(indexes[0]);
+    free(indexes[1]);
+    return moves;
+}
+
+// Lists the content of the removed and added directories into the lists, returns the amount listed
+static uint32_t expandDirectories(Differ* d)
+{
+    uint32_t expanded = 0;
+    for (unsigned side = 0; side < 2 && !d->stop; ++side)
+    {
+        ItemList* list = &d->lists[side];
+        uint32_t count = list->count;                               // the content is listed next round
+        for (uint32_t i = 0; i < count && !d->stop; ++i)
+        {
+            if (list->items[i].matched || list->items[i].expanded || !isDirectory(&list->items[i].entry))
+                continue;
+
+            list->items[i].expanded = 1;
+            uint32_t cluster = firstCluster(&list->items[i].entry);
+            if (!firstVisit(d, d->expanded, side, cluster))
+                continue;
+
+            Listing* listing = &d->listings[side];
+            if (!readListing(d, side, cluster, listing))
+            {
+                d->failed = d->stop = 1;
+                break;
+            }
+
+            ++expanded;
+            for (uint32_t j = 0; j < listing->count; ++j)
+            {
+                if (!addItem(list, &listing->entries[j].entry, joinPath(list->items[i].path, listing->entries[j].fileName)))
+                {
+                    d->failed = d->stop = 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    return expanded;
+}
+
+static int compareItemPaths(const void* a, const void* b)
+{
+    return strcmp(((const DiffItem*)a)->path, ((const DiffItem*)b)->path);
+}
+
+static void compareVolumes(Differ* d)
+{
+    const fat_BootSector* bootA = d->volumes[0]->boot;
+    const fat_BootSector* bootB = d->volumes[1]->boot;
+    fat_DiffSummary* summary = d->summary;
+
+    summary->bootChanged = memcmp(bootA, bootB, sizeof(fat_BootSector)) != 0;
+    if (fat_getType(bootA) == FAT32 && fat_getType(bootB) == FAT32)
+    {
+        const fat32_BootSector* a = (const fat32_BootSector*)bootA->rest;
+        const fat32_BootSector* b = (const fat32_BootSector*)bootB->rest;
+
+        fat_FileSystemInformationSector infos[2];
+        uint8_t ok =
+            d->volumes[0]->fetch(fat_sectorToAddress(bootA, d->volumes[0]->partitionOffset, a->fileSystemInformationSector), sizeof(fat_FileSystemInformationSector), (char*)&infos[0]) &&
+            d->volumes[1]->fetch(fat_sectorToAddress(bootB, d->volumes[1]->partitionOffset, b->fileSystemInformationSector), sizeof(fat_FileSystemInformationSector), (char*)&infos[1]);
+        summary->fsInfoChanged = !ok || memcmp(&infos[0], &infos[1], sizeof(fat_FileSystemInformationSector)) != 0;
+    }
+
+    summary->geometryChanged = fat_getType(bootA) != fat_getType(bootB) || fat_clusterSize(bootA) != fat_clusterSize(bootB) ||
+        fat_countOfClusters(bootA) != fat_countOfClusters(bootB) || fat_fatSize(bootA) != fat_fatSize(bootB);
+}
+
+uint8_t fat_diff(const fat_DiffVolume* first, const fat_DiffVolume* second, fat_DiffSummary* summary, diffFound_t found, void* context)
+{
+    assert(first != NULL && first->boot != NULL && first->fetch != NULL);
+    assert(second != NULL && second->boot != NULL && second->fetch != NULL);
+    assert(summary != NULL);
+    assert(found != NULL);
+
+    Differ d;
+    memset(&d, 0, sizeof(Differ));
+    memset(summary, 0, sizeof(fat_DiffSummary));
+    d.volumes[0] = first;
+    d.volumes[1] = second;
+    d.summary = summary;
+    d.found = found;
+    d.context = context;
+    d.type = fat_getType(first->boot);
+    d.clusterSize = fat_clusterSize(first->boot);
+
+    compareVolumes(&d);
+
+    uint32_t bufferSize = fat_clusterSize(first->boot);
+    if (fat_clusterSize(second->boot) > bufferSize)
+        bufferSize = fat_clusterSize(second->boot);
+    d.buffer = malloc(bufferSize);
+
+    uint8_t ok = d.buffer != NULL;
+    for (unsigned side = 0; ok && side < 2; ++side)
+    {
+        d.lastClusters[side] = fat_countOfClusters(d.volumes[side]->boot) + 1;
+        d.fats[side] = fat_loadFat(d.volumes[side]->boot, d.volumes[side]->partitionOffset, d.volumes[side]->fetch);
+        d.paired[side] = allocBitmap(d.lastClusters[side] + 1);
+        d.expanded[side] = allocBitmap(d.lastClusters[side] + 1);
+        ok = d.fats[side] != NULL && d.paired[side] != NULL && d.expanded[side] != NULL;
+    }
+
+    if (ok && !summary->geometryChanged)
+    {
+        d.changed = allocBitmap(d.lastClusters[0] + 1);
+        ok = d.changed != NULL;
+        if (ok)
+            compareFats(&d, fat_fatSize(first->boot));
+    }
+
+    if (ok)
+        ok = pushPair(&d, calloc(1, 1), calloc(1, 1), FAT_DIRECTORY_ROOT, FAT_DIRECTORY_ROOT);
+
+    if (ok)
+    {
+        for (;;)                                                    // a moved directory can turn up in a removed or added one
+        {
+            comparePairs(&d);
+            if (d.stop)
+                break;
+            if (matchMoves(&d, 1) > 0)
+                continue;
+            if (expandDirectories(&d) == 0)
+                break;
+        }
+
+        comparePairs(&d);                                           // only frees what is left after a stop
+        matchMoves(&d, 0);
+
+        uint8_t changes[2] = { FAT_DIFF_REMOVED, FAT_DIFF_ADDED };
+        for (unsigned side = 0; side < 2; ++side)
+        {
+            ItemList* list = &d.lists[side];
+            if (list->count > 0)                                    // an empty list has no items at all
+                qsort(list->items, list->count, sizeof(DiffItem), compareItemPaths);
+            for (uint32_t i = 0; i < list->count; ++i)
+            {
+                if (!list->items[i].matched)
+                    report(&d, changes[side], 0, list->items[i].path, NULL, side == 0 ? &list->items[i].entry : NULL, side == 1 ? &list->items[i].entry : NULL);
+            }
+        }
+    }
+
+    for (unsigned side = 0; side < 2; ++side)
+    {
+        for (uint32_t i = 0; i < d.lists[side].count; ++i)
+            free(d.lists[side].items[i].path);
+
+        free(d.lists[side].items);
+        free(d.listings[side].entries);
+        free(d.fats[side]);
+        free(d.paired[side]);
+        free(d.expanded[side]);
+    }
+
+    free(d.pairs.pairs);
+    free(d.changed);
+    free(d.buffer);
+    return ok && !d.failed;
+}
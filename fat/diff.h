@@ -0,0 +1,64 @@
+#pragma once
+
+#include "fat.h"
+
+#ifdef FAT_NO_HEAP
+#error "the diff keeps both FATs and the unmatched entries on the heap, leave diff.c out of FAT_NO_HEAP builds"
+#endif
+
+// Structural diff of two snapshots of a volume. The boot sectors, FSInfo sectors and the FATs are
+// compared first, block by block with memcmp, which gives the FAT entries that changed. The trees are
+// then compared directory by directory: only directory clusters are read, a file whose entry is the
+// same in both and whose chain has no changed FAT entry is unchanged and its data is never read.
+// Removed and added entries pointing at the same first cluster are reported as moved.
+
+#define FAT_DIFF_ADDED 0x01
+#define FAT_DIFF_REMOVED 0x02
+#define FAT_DIFF_MODIFIED 0x03
+#define FAT_DIFF_MOVED 0x04
+
+// Fields of fat_DiffEntry.fields, what differs in a modified or moved entry
+#define FAT_DIFF_FIELD_SIZE 0x01
+#define FAT_DIFF_FIELD_CHAIN 0x02                                   // first cluster or any FAT entry of the chain
+#define FAT_DIFF_FIELD_ATTRIBUTES 0x04
+#define FAT_DIFF_FIELD_MODIFIED 0x08                                // last write date and time
+#define FAT_DIFF_FIELD_CREATED 0x10
+
+#define FAT_DIFF_COMPARE_BLOCK 0x1000                               // bytes of the FATs compared at once
+
+typedef struct fat_DiffVolume fat_DiffVolume;
+struct fat_DiffVolume
+{
+	const fat_BootSector* boot;
+	unsigned partitionOffset;
+	fetchData_t fetch;
+};
+
+typedef struct fat_DiffSummary fat_DiffSummary;
+struct fat_DiffSummary
+{
+	uint8_t bootChanged;
+	uint8_t fsInfoChanged;                                          // FAT32 only, usually the free cluster count
+	uint8_t geometryChanged;                                        // type, cluster size or count differ: every chain counts as changed
+	uint32_t changedFatEntries;
+	uint32_t directoriesCompared;
+	uint32_t filesUnchanged;                                        // never read
+};
+
+typedef struct fat_DiffEntry fat_DiffEntry;
+struct fat_DiffEntry
+{
+	uint8_t change;                                                 // FAT_DIFF_*
+	uint8_t fields;                                                 // FAT_DIFF_FIELD_*, for modified and moved
+	const char* path;                                               // from the root, in the second volume (the first when removed)
+	const char* oldPath;                                            // moved: the path in the first volume
+	fat_DirectoryEntry oldEntry;                                    // not set when added
+	fat_DirectoryEntry newEntry;                                    // not set when removed
+};
+
+// Called for every change, return 0 to stop
+typedef uint8_t(*diffFound_t)(const fat_DiffEntry* change, void* context);
+
+// Compares volume first with second and reports the changes. Directories are reported like files, the
+// content of an added or removed directory is reported entry by entry as well.
+uint8_t fat_diff(const fat_DiffVolume* first, const fat_DiffVolume* second, fat_DiffSummary* summary, diffFound_t found, void* context);
@@ -0,0 +1,493 @@
+#include "exfat.h"
+
+#define ENTRY_SIZE 0x20
+#define MAX_SECONDARY_COUNT 0x12                                    // stream extension and 17 file name entries
+#define END_OF_CHAIN 0xFFFFFFF7                                     // bad cluster and up
+
+#define ITERATOR_END 0x01
+#define ITERATOR_FAILED 0x02
+
+// Rotating checksum of the boot region and the up-case table
+static uint32_t checksum32(uint32_t checksum, const uint8_t* data, unsigned count)
+{
+    for (unsigned i = 0; i < count; ++i)
+        checksum = ((checksum & 1) ? 0x80000000 : 0) + (checksum >> 1) + data[i];
+    return checksum;
+}
+
+static uint16_t checksum16(uint16_t checksum, uint8_t data)
+{
+    return (uint16_t)(((checksum & 1) ? 0x8000 : 0) + (checksum >> 1) + data);
+}
+
+// Checksum of an entry set, the SetChecksum field itself is skipped
+static uint16_t setChecksum(const uint8_t* entries, unsigned count)
+{
+    uint16_t checksum = 0;
+    for (unsigned i = 0; i < count * ENTRY_SIZE; ++i)
+    {
+        if (i != 2 && i != 3)
+            checksum = checksum16(checksum, entries[i]);
+    }
+    return checksum;
+}
+
+static uint16_t nameHash(const exfat_Volume* volume, const uint16_t* name, unsigned length)
+{
+    uint16_t hash = 0;
+    for (unsigned i = 0; i < length; ++i)
+    {
+        uint16_t c = volume->upcase[name[i]];
+        hash = checksum16(hash, (uint8_t)(c & 0xFF));
+        hash = checksum16(hash, (uint8_t)(c >> 8));
+    }
+    return hash;
+}
+
+uint64_t exfat_clusterToAddress(const exfat_Volume* volume, uint32_t cluster)
+{
+    assert(volume != NULL);
+    assert(cluster >= 2);
+
+    return volume->partitionOffset + (uint64_t)volume->boot.clusterHeapOffset * volume->bytesPerSector + (uint64_t)(cluster - 2) * volume->clusterSize;
+}
+
+uint32_t exfat_nextCluster(const exfat_Volume* volume, uint32_t cluster)
+{
+    assert(volume != NULL);
+
+    if (cluster < 2 || cluster > volume->boot.clusterCount + 1)
+        return 0;
+
+    uint32_t fat = volume->boot.fatOffset + ((volume->boot.volumeFlags & 0x01) ? volume->boot.fatLength : 0);  // ActiveFat
+    uint32_t next;
+    if (!volume->fetch(volume->partitionOffset + (uint64_t)fat * volume->bytesPerSector + (uint64_t)cluster * 4, 4, (char*)&next))
+        return 0;
+
+    if (next < 2 || next >= END_OF_CHAIN || next > volume->boot.clusterCount + 1)
+        return 0;
+    return next;
+}
+
+uint8_t exfat_isClusterUsed(const exfat_Volume* volume, uint32_t cluster)
+{
+    assert(volume != NULL);
+
+    if (cluster < 2 || cluster > volume->boot.clusterCount + 1)
+        return 0;
+    return (volume->bitmap[(cluster - 2) / 8] >> ((cluster - 2) % 8)) & 0x01;
+}
+
+// Reads count bytes from offset of the data starting at firstCluster. Without a FAT chain this is one
+// fetch, else the chain is followed and every run of contiguous clusters is one fetch.
+static uint8_t readData(const exfat_Volume* volume, uint32_t firstCluster, uint8_t noFatChain, uint64_t offset, unsigned count, char* out)
+{
+    if (count == 0)
+        return 1;
+    if (firstCluster < 2)
+        return 0;
+
+    if (noFatChain)
+    {
+        uint64_t end = (uint64_t)(firstCluster - 2) * volume->clusterSize + offset + count;
+        if (end > (uint64_t)volume->boot.clusterCount * volume->clusterSize)
+            return 0;
+        return volume->fetch(exfat_clusterToAddress(volume, firstCluster) + offset, count, out);
+    }
+
+    if (offset + count > (uint64_t)volume->boot.clusterCount * volume->clusterSize)
+        return 0;                                                   // longer than the volume, the chain loops
+
+    uint32_t cluster = firstCluster;
+    for (uint64_t skip = offset / volume->clusterSize; skip > 0; --skip)
+    {
+        cluster = exfat_nextCluster(volume, cluster);
+        if (cluster == 0)
+            return 0;
+    }
+
+    unsigned inCluster = (unsigned)(offset % volume->clusterSize);
+    while (count > 0)
+    {
+        // extend the run as long as the chain stays contiguous
+        uint32_t start = cluster, next = 0;
+        uint64_t runLength = volume->clusterSize - inCluster;
+        while (runLength < count && (next = exfat_nextCluster(volume, cluster)) == cluster + 1)
+        {
+            cluster = next;
+            runLength += volume->clusterSize;
+        }
+
+        unsigned length = (runLength < count) ? (unsigned)runLength : count;
+        if (!volume->fetch(exfat_clusterToAddress(volume, start) + inCluster, length, out))
+            return 0;
+
+        out += length;
+        count -= length;
+        inCluster = 0;
+        if (count > 0)                                              // next is where the chain jumps to
+        {
+            if (next == 0)
+                return 0;
+            cluster = next;
+        }
+    }
+
+    return 1;
+}
+
+// Expands the up-case table, runs of characters which map to themselves are stored as 0xFFFF and the length
+static void expandUpcase(const uint16_t* table, unsigned count, uint16_t* upcase)
+{
+    for (unsigned i = 0; i < 0x10000; ++i)
+        upcase[i] = (uint16_t)i;
+
+    unsigned character = 0;
+    for (unsigned i = 0; i < count && character < 0x10000; ++i)
+    {
+        if (table[i] == 0xFFFF && i + 1 < count)
+            character += table[++i];
+        else
+            upcase[character++] = table[i];
+    }
+}
+
+static uint8_t loadBitmap(exfat_Volume* volume, const exfat_SystemEntry* entry)
+{
+    unsigned length = (volume->boot.clusterCount + 7) / 8;
+    if (entry->dataLength < length)
+        return 0;
+
+    volume->bitmap = malloc(length);
+    if (volume->bitmap == NULL || !readData(volume, entry->firstCluster, 0, 0, length, (char*)volume->bitmap))
+        return 0;
+
+    volume->freeClusters = volume->boot.clusterCount;
+    for (uint32_t cluster = 2; cluster < volume->boot.clusterCount + 2; ++cluster)
+        volume->freeClusters -= exfat_isClusterUsed(volume, cluster);
+    return 1;
+}
+
+static uint8_t loadUpcase(exfat_Volume* volume, const exfat_SystemEntry* entry)
+{
+    if (entry->dataLength == 0 || entry->dataLength > 0x20000 || entry->dataLength % 2 != 0)
+        return 0;
+
+    unsigned length = (unsigned)entry->dataLength;
+    uint16_t* table = malloc(length);
+    volume->upcase = malloc(0x10000 * sizeof(uint16_t));
+    uint8_t ok = table != NULL && volume->upcase != NULL
+        && readData(volume, entry->firstCluster, 0, 0, length, (char*)table)
+        && checksum32(0, (const uint8_t*)table, length) == entry->tableChecksum;
+
+    if (ok)
+        expandUpcase(table, length / 2, volume->upcase);
+    free(table);
+    return ok;
+}
+
+void exfat_openDirectory(const exfat_Volume* volume, const exfat_File* directory, exfat_DirectoryIterator* it)
+{
+    assert(volume != NULL);
+    assert(it != NULL);
+
+    memset(it, 0, offsetof(exfat_DirectoryIterator, sector));       // the sector buffer is filled on demand
+    it->sectorAddress = 0;
+    if (directory == NULL)                                          // the root has no stream extension, the FAT ends it
+    {
+        it->firstCluster = volume->boot.firstClusterOfRootDirectory;
+        it->length = UINT64_MAX;
+    }
+    else
+    {
+        it->firstCluster = directory->firstCluster;
+        it->noFatChain = (directory->flags & EXFAT_FLAG_NO_FAT_CHAIN) != 0;
+        it->length = directory->dataLength;
+    }
+    it->cluster = it->firstCluster;
+}
+
+// Copies the entry at the position of it, then moves to the next
+static uint8_t readEntry(const exfat_Volume* volume, exfat_DirectoryIterator* it, uint8_t* entry)
+{
+    if (it->flags & (ITERATOR_END | ITERATOR_FAILED))
+        return 0;
+    if (it->position >= it->length || it->cluster < 2)
+    {
+        it->flags |= ITERATOR_END;
+        return 0;
+    }
+    if (!it->noFatChain && it->position >= (uint64_t)volume->boot.clusterCount * volume->clusterSize)
+    {
+        it->flags |= ITERATOR_FAILED;                               // more clusters than the volume has, the chain loops
+        return 0;
+    }
+
+    uint64_t inCluster = it->position % volume->clusterSize;
+    uint64_t address = it->noFatChain
+        ? exfat_clusterToAddress(volume, it->firstCluster) + it->position
+        : exfat_clusterToAddress(volume, it->cluster) + inCluster;
+    uint64_t sector = address - (address - volume->partitionOffset) % volume->bytesPerSector;
+    if (sector != it->sectorAddress)
+    {
+        if (!volume->fetch(sector, volume->bytesPerSector, (char*)it->sector))
+        {
+            it->flags |= ITERATOR_FAILED;
+            return 0;
+        }
+        it->sectorAddress = sector;
+    }
+
+    memcpy(entry, it->sector + (address - sector), ENTRY_SIZE);
+    it->position += ENTRY_SIZE;
+    if (!it->noFatChain && it->position % volume->clusterSize == 0)
+        it->cluster = exfat_nextCluster(volume, it->cluster);       // 0 ends the directory
+    return 1;
+}
+
+// Reads the boot region and checks its checksum, which skips VolumeFlags and PercentInUse
+static uint8_t readBootRegion(exfat_Volume* volume)
+{
+    if (!volume->fetch(volume->partitionOffset, sizeof(exfat_BootSector), (char*)&volume->boot))
+        return 0;
+
+    const exfat_BootSector* boot = &volume->boot;
+    if (memcmp(boot->fileSystemName, "EXFAT   ", 8) != 0 || boot->signature != 0xAA55)
+        return 0;
+    if (boot->bytesPerSectorShift < 9 || boot->bytesPerSectorShift > 12 || boot->sectorsPerClusterShift > 25 - boot->bytesPerSectorShift)
+        return 0;
+    if (boot->numberOfFats < 1 || boot->numberOfFats > 2 || boot->clusterCount == 0 || boot->firstClusterOfRootDirectory < 2)
+        return 0;
+
+    volume->bytesPerSector = 1u << boot->bytesPerSectorShift;
+    volume->clusterSize = volume->bytesPerSector << boot->sectorsPerClusterShift;
+
+    unsigned length = EXFAT_BOOT_REGION_SECTORS * volume->bytesPerSector;
+    uint8_t* region = malloc(length);
+    if (region == NULL || !volume->fetch(volume->partitionOffset, length, (char*)region))
+    {
+        free(region);
+        return 0;
+    }
+
+    uint32_t checksum = checksum32(0, region, 106);
+    checksum = checksum32(checksum, region + 108, 4);
+    checksum = checksum32(checksum, region + 113, 11 * volume->bytesPerSector - 113);
+
+    uint8_t ok = 1;
+    const uint8_t* stored = region + 11 * volume->bytesPerSector;
+    for (unsigned i = 0; i < volume->bytesPerSector; i += 4)
+        ok &= memcmp(stored + i, &checksum, 4) == 0;
+
+    free(region);
+    return ok;
+}
+
+uint8_t exfat_mount(fetchData64_t fetch, uint64_t partitionOffset, exfat_Volume* volume)
+{
+    assert(fetch != NULL);
+    assert(volume != NULL);
+
+    memset(volume, 0, sizeof(exfat_Volume));
+    volume->fetch = fetch;
+    volume->partitionOffset = partitionOffset;
+    if (!readBootRegion(volume))
+        return 0;
+
+    // the system entries live in the root directory, a second bitmap belongs to the inactive FAT
+    exfat_DirectoryIterator it;
+    exfat_openDirectory(volume, NULL, &it);
+
+    uint8_t activeFat = volume->boot.volumeFlags & 0x01;
+    uint8_t ok = 1;
+    exfat_SystemEntry entry;
+    while (ok && readEntry(volume, &it, (uint8_t*)&entry) && entry.entryType != EXFAT_ENTRY_END)
+    {
+        if (entry.entryType == EXFAT_ENTRY_BITMAP && volume->bitmap == NULL && (entry.flags & 0x01) == activeFat)
+            ok = loadBitmap(volume, &entry);
+        else if (entry.entryType == EXFAT_ENTRY_UPCASE && volume->upcase == NULL)
+            ok = loadUpcase(volume, &entry);
+        else if (entry.entryType == EXFAT_ENTRY_LABEL)
+        {
+            volume->labelLength = (((uint8_t*)&entry)[1] > 0x0B) ? 0x0B : ((uint8_t*)&entry)[1];
+            memcpy(volume->label, (uint8_t*)&entry + 2, volume->labelLength * sizeof(uint16_t));
+        }
+    }
+
+    if (!ok || (it.flags & ITERATOR_FAILED) || volume->bitmap == NULL || volume->upcase == NULL)
+    {
+        exfat_unmount(volume);
+        return 0;
+    }
+
+    return 1;
+}
+
+void exfat_unmount(exfat_Volume* volume)
+{
+    assert(volume != NULL);
+
+    free(volume->bitmap);
+    free(volume->upcase);
+    volume->bitmap = NULL;
+    volume->upcase = NULL;
+}
+
+// Fills file from the entry set, 0 when the set is incomplete or damaged
+static uint8_t parseEntrySet(const exfat_Volume* volume, const uint8_t* set, unsigned count, exfat_File* file)
+{
+    const exfat_FileEntry* primary = (const exfat_FileEntry*)set;
+    const exfat_StreamEntry* stream = (const exfat_StreamEntry*)(set + ENTRY_SIZE);
+    if (setChecksum(set, count) != primary->setChecksum || stream->entryType != EXFAT_ENTRY_STREAM)
+        return 0;
+    if (stream->nameLength == 0 || (unsigned)(stream->nameLength + 14) / 15 > count - 2)
+        return 0;
+
+    file->attributes = primary->fileAttributes;
+    file->created = primary->createTimestamp;
+    file->modified = primary->lastModifiedTimestamp;
+    file->accessed = primary->lastAccessedTimestamp;
+    file->flags = stream->generalSecondaryFlags;
+    file->firstCluster = stream->firstCluster;
+    file->validDataLength = stream->validDataLength;
+    file->dataLength = stream->dataLength;
+    file->nameLength = stream->nameLength;
+    file->nameHash = stream->nameHash;
+
+    for (unsigned i = 0; i < file->nameLength; ++i)
+    {
+        const exfat_NameEntry* name = (const exfat_NameEntry*)(set + (2 + i / 15) * ENTRY_SIZE);
+        if (name->entryType != EXFAT_ENTRY_NAME)
+            return 0;
+        file->name[i] = name->fileName[i % 15];
+    }
+
+    return file->validDataLength <= file->dataLength && nameHash(volume, file->name, file->nameLength) == file->nameHash;
+}
+
+uint8_t exfat_readDirectory(const exfat_Volume* volume, exfat_DirectoryIterator* it, exfat_File* file)
+{
+    assert(volume != NULL);
+    assert(it != NULL);
+
+    uint8_t set[(MAX_SECONDARY_COUNT + 1) * ENTRY_SIZE];
+    while (readEntry(volume, it, set))
+    {
+        if (set[0] == EXFAT_ENTRY_END)
+        {
+            it->flags |= ITERATOR_END;
+            return 0;
+        }
+
+        if (set[0] != EXFAT_ENTRY_FILE)                             // deleted, label, bitmap, up-case, GUID or a stray secondary
+            continue;
+
+        unsigned count = 1u + set[1];
+        if (count < 3 || count > MAX_SECONDARY_COUNT + 1)
+            continue;
+
+        unsigned read = 1;
+        while (read < count && readEntry(volume, it, set + read * ENTRY_SIZE))
+            ++read;
+        if (read < count)
+            return 0;
+
+        if (parseEntrySet(volume, set, count, file))
+            return 1;
+    }
+
+    return 0;
+}
+
+uint8_t exfat_endOfDirectory(const exfat_DirectoryIterator* it)
+{
+    assert(it != NULL);
+
+    return (it->flags & ITERATOR_END) != 0;
+}
+
+// Decodes UTF-8 text into at most max units, returns the count or -1 when it doesn't fit
+static int utf8ToUtf16(const char* text, uint16_t* units, unsigned max)
+{
+    const uint8_t* p = (const uint8_t*)text;
+    unsigned count = 0;
+    while (*p != 0)
+    {
+        uint32_t c = *p++;
+        unsigned continuation = (c >= 0xF0) ? 3 : (c >= 0xE0) ? 2 : (c >= 0xC0) ? 1 : 0;
+        if (continuation > 0)
+            c &= 0x3F >> continuation;
+        for (; continuation > 0 && (*p & 0xC0) == 0x80; --continuation)
+            c = c << 6 | (*p++ & 0x3F);
+
+        if (c >= 0x10000)
+        {
+            if (count + 2 > max)
+                return -1;
+            units[count++] = (uint16_t)(0xD800 + ((c - 0x10000) >> 10));
+            units[count++] = (uint16_t)(0xDC00 + (c & 0x3FF));
+        }
+        else
+        {
+            if (count + 1 > max)
+                return -1;
+            units[count++] = (uint16_t)c;
+        }
+    }
+
+    return (int)count;
+}
+
+uint8_t exfat_findFile(const exfat_Volume* volume, const exfat_File* directory, const char* name, exfat_File* file)
+{
+    assert(volume != NULL);
+    assert(name != NULL);
+    assert(file != NULL);
+
+    uint16_t units[EXFAT_NAME_MAX_LENGTH];
+    int length = utf8ToUtf16(name, units, EXFAT_NAME_MAX_LENGTH);
+    if (length <= 0)
+        return 0;
+    uint16_t hash = nameHash(volume, units, (unsigned)length);
+
+    exfat_DirectoryIterator it;
+    exfat_openDirectory(volume, directory, &it);
+    while (exfat_readDirectory(volume, &it, file))
+    {
+        if (file->nameHash != hash || file->nameLength != length)
+            continue;
+
+        int i = 0;
+        while (i < length && volume->upcase[file->name[i]] == volume->upcase[units[i]])
+            ++i;
+        if (i == length)
+            return 1;
+    }
+
+    return 0;
+}
+
+void exfat_fileName(const exfat_File* file, char* fileName, unsigned nameLen)
+{
+    assert(file != NULL);
+    assert(fileName != NULL);
+
+    fat_utf16ToUtf8(file->name, file->nameLength, fileName, nameLen);
+}
+
+uint8_t exfat_readFile(const exfat_Volume* volume, const exfat_File* file, uint64_t offset, unsigned count, char* out)
+{
+    assert(volume != NULL);
+    assert(file != NULL);
+    assert(out != NULL);
+
+    if (offset > file->dataLength || count > file->dataLength - offset)
+        return 0;
+
+    // between ValidDataLength and DataLength the clusters are allocated but never written
+    unsigned valid = (offset >= file->validDataLength) ? 0
+        : (file->validDataLength - offset < count) ? (unsigned)(file->validDataLength - offset) : count;
+    memset(out + valid, 0, count - valid);
+
+    return readData(volume, file->firstCluster, (file->flags & EXFAT_FLAG_NO_FAT_CHAIN) != 0, offset, valid, out);
+}
@@ -0,0 +1,203 @@
+#pragma once
+
+#include "fat.h"
+
+#ifdef FAT_NO_HEAP
+#error "mounting exFAT loads the up-case table and the allocation bitmap on the heap, leave exfat.c out of FAT_NO_HEAP builds"
+#endif
+
+// exFAT volumes (fat_getType gives EXFAT). Mounting checks the boot region checksum and reads the root
+// directory for the allocation bitmap, the up-case table (expanded, checked against its checksum) and
+// the volume label. Directories are read as entry sets: a file entry, its stream extension (first
+// cluster, lengths and flags) and the file name entries, verified with the set checksum.
+//
+// A file or directory flagged NoFatChain is contiguous, the FAT is never read for it: any range of
+// it is one fetch at the computed address. Other chains are followed in the FAT and read a run of
+// contiguous clusters per fetch. exFAT volumes are usually larger than 4 GB, so reads go through
+// fetchData64_t.
+//
+// Microsoft exFAT File System Specification
+// https://learn.microsoft.com/en-us/windows/win32/fileio/exfat-specification
+
+#define EXFAT_ENTRY_END 0x00
+#define EXFAT_ENTRY_BITMAP 0x81
+#define EXFAT_ENTRY_UPCASE 0x82
+#define EXFAT_ENTRY_LABEL 0x83
+#define EXFAT_ENTRY_FILE 0x85
+#define EXFAT_ENTRY_STREAM 0xC0
+#define EXFAT_ENTRY_NAME 0xC1
+#define EXFAT_ENTRY_IN_USE 0x80                                     // cleared in deleted entries
+
+#define EXFAT_FLAG_ALLOCATION_POSSIBLE 0x01                         // GeneralSecondaryFlags of the stream extension
+#define EXFAT_FLAG_NO_FAT_CHAIN 0x02
+
+#define EXFAT_NAME_MAX_LENGTH 0xFF                                  // UTF-16 units
+#define EXFAT_MAX_SECTOR_SIZE 0x1000
+#define EXFAT_BOOT_REGION_SECTORS 0x0C                              // boot sector, 8 extended, OEM, reserved, checksum
+
+// Fetches data like fetchData_t, with 64 bit addresses
+typedef uint8_t(*fetchData64_t)(uint64_t address, unsigned count, char* out);
+
+typedef struct exfat_BootSector exfat_BootSector;
+PACK(
+struct exfat_BootSector
+{
+	uint8_t jumpBoot[0x03];
+	uint8_t fileSystemName[0x08];                                   // "EXFAT   "
+	uint8_t mustBeZero[0x35];                                       // where the FAT boot sector has its fields
+	uint64_t partitionOffset;                                       // sectors
+	uint64_t volumeLength;                                          // sectors
+	uint32_t fatOffset;                                             // sectors
+	uint32_t fatLength;                                             // sectors
+	uint32_t clusterHeapOffset;                                     // sectors
+	uint32_t clusterCount;
+	uint32_t firstClusterOfRootDirectory;
+	uint32_t volumeSerialNumber;
+	uint16_t fileSystemRevision;
+	uint16_t volumeFlags;
+	uint8_t bytesPerSectorShift;
+	uint8_t sectorsPerClusterShift;
+	uint8_t numberOfFats;
+	uint8_t driveSelect;
+	uint8_t percentInUse;
+	uint8_t reserved[0x07];
+	uint8_t bootCode[0x186];
+	uint16_t signature;
+});
+
+typedef struct exfat_FileEntry exfat_FileEntry;
+PACK(
+struct exfat_FileEntry
+{
+	uint8_t entryType;
+	uint8_t secondaryCount;
+	uint16_t setChecksum;
+	uint16_t fileAttributes;                                        // FAT_FILE_ATTR_*
+	uint16_t reserved1;
+	uint32_t createTimestamp;                                       // fat date in the high, fat time in the low 16 bits
+	uint32_t lastModifiedTimestamp;
+	uint32_t lastAccessedTimestamp;
+	uint8_t create10msIncrement;
+	uint8_t lastModified10msIncrement;
+	uint8_t createUtcOffset;
+	uint8_t lastModifiedUtcOffset;
+	uint8_t lastAccessedUtcOffset;
+	uint8_t reserved2[0x07];
+});
+
+typedef struct exfat_StreamEntry exfat_StreamEntry;
+PACK(
+struct exfat_StreamEntry
+{
+	uint8_t entryType;
+	uint8_t generalSecondaryFlags;                                  // EXFAT_FLAG_*
+	uint8_t reserved1;
+	uint8_t nameLength;
+	uint16_t nameHash;
+	uint16_t reserved2;
+	uint64_t validDataLength;
+	uint32_t reserved3;
+	uint32_t firstCluster;
+	uint64_t dataLength;
+});
+
+typedef struct exfat_NameEntry exfat_NameEntry;
+PACK(
+struct exfat_NameEntry
+{
+	uint8_t entryType;
+	uint8_t generalSecondaryFlags;
+	uint16_t fileName[0x0F];
+});
+
+// Allocation bitmap and up-case table entries share this layout
+typedef struct exfat_SystemEntry exfat_SystemEntry;
+PACK(
+struct exfat_SystemEntry
+{
+	uint8_t entryType;
+	uint8_t flags;                                                  // bitmap: which FAT it belongs to
+	uint8_t reserved1[0x02];
+	uint32_t tableChecksum;                                         // up-case table
+	uint8_t reserved2[0x0C];
+	uint32_t firstCluster;
+	uint64_t dataLength;
+});
+
+typedef struct exfat_Volume exfat_Volume;
+struct exfat_Volume
+{
+	exfat_BootSector boot;
+	uint64_t partitionOffset;                                       // bytes
+	fetchData64_t fetch;
+	uint32_t bytesPerSector;
+	uint32_t clusterSize;
+	uint16_t* upcase;                                               // 0x10000 entries
+	uint8_t* bitmap;                                                // bit per cluster, cluster 2 first
+	uint32_t freeClusters;
+	uint16_t label[0x0B];
+	uint8_t labelLength;
+};
+
+// A file or directory out of its entry set
+typedef struct exfat_File exfat_File;
+struct exfat_File
+{
+	uint16_t attributes;
+	uint32_t created;                                               // timestamps like exfat_FileEntry
+	uint32_t modified;
+	uint32_t accessed;
+	uint8_t flags;                                                  // EXFAT_FLAG_*
+	uint32_t firstCluster;
+	uint64_t validDataLength;                                       // beyond it the content reads as zeros
+	uint64_t dataLength;
+	uint8_t nameLength;
+	uint16_t nameHash;                                              // of the up-cased name, as stored
+	uint16_t name[EXFAT_NAME_MAX_LENGTH];                           // UTF-16, not terminated
+};
+
+// State of a directory listing, reads one sector at a time
+typedef struct exfat_DirectoryIterator exfat_DirectoryIterator;
+struct exfat_DirectoryIterator
+{
+	uint32_t firstCluster;
+	uint8_t noFatChain;
+	uint64_t length;                                                // bytes, the FAT decides for the root
+	uint32_t cluster;                                               // of position
+	uint64_t position;                                              // byte of the next entry
+	uint8_t flags;
+	uint8_t sector[EXFAT_MAX_SECTOR_SIZE];
+	uint64_t sectorAddress;                                         // of the data in sector, 0 when empty
+};
+
+// Mounts the exFAT volume at partitionOffset, unmount it when done
+uint8_t exfat_mount(fetchData64_t fetch, uint64_t partitionOffset, exfat_Volume* volume);
+
+void exfat_unmount(exfat_Volume* volume);
+
+// Byte address of cluster
+uint64_t exfat_clusterToAddress(const exfat_Volume* volume, uint32_t cluster);
+
+// Follows the chain in the FAT, returns 0 at the end of the chain or when the FAT can't be read
+uint32_t exfat_nextCluster(const exfat_Volume* volume, uint32_t cluster);
+
+// Checks the allocation bitmap
+uint8_t exfat_isClusterUsed(const exfat_Volume* volume, uint32_t cluster);
+
+// Opens directory for reading, NULL for the root directory
+void exfat_openDirectory(const exfat_Volume* volume, const exfat_File* directory, exfat_DirectoryIterator* it);
+
+// Reads the next file or directory, skipping deleted and damaged entry sets. Returns 0 at the end.
+uint8_t exfat_readDirectory(const exfat_Volume* volume, exfat_DirectoryIterator* it, exfat_File* file);
+
+// Checks if exfat_readDirectory stopped because the end was reached, 0 means it failed to fetch
+uint8_t exfat_endOfDirectory(const exfat_DirectoryIterator* it);
+
+// Finds the UTF-8 name in directory (NULL for the root), compared through the up-case table
+uint8_t exfat_findFile(const exfat_Volume* volume, const exfat_File* directory, const char* name, exfat_File* file);
+
+// Gets the name of file as UTF-8
+void exfat_fileName(const exfat_File* file, char* fileName, unsigned nameLen);
+
+// Reads count bytes of file from offset, a NoFatChain file in one fetch
+uint8_t exfat_readFile(const exfat_Volume* volume, const exfat_File* file, uint64_t offset, unsigned count, char* out);
@@ -0,0 +1,333 @@
+#include "export.h"
+#include "thread.h"
+
+typedef struct Exporter Exporter;
+struct Exporter
+{
+    uint8_t flags;
+    FatType type;
+    uint32_t lastCluster;
+    exportWrite_t write;
+    void* context;
+    uint8_t failed;
+    uint32_t records;
+    char* buffer;                                                   // FAT_EXPORT_BUFFER bytes
+    unsigned length;
+#ifndef FAT_NO_THREADS
+    fat_Mutex lock;                                                 // the buffer, one record at a time
+#endif
+};
+
+static void flush(Exporter* e)
+{
+    if (e->length > 0 && !e->failed)
+        e->failed = !e->write(e->buffer, e->length, e->context);
+    e->length = 0;
+}
+
+static void putChar(Exporter* e, char c)
+{
+    if (e->length == FAT_EXPORT_BUFFER)
+        flush(e);
+    e->buffer[e->length++] = c;
+}
+
+static void put(Exporter* e, const char* text)
+{
+    while (*text != 0)
+        putChar(e, *text++);
+}
+
+static void putNumber(Exporter* e, uint32_t value)
+{
+    char digits[10];
+    unsigned count = 0;
+    do
+    {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    while (count > 0)
+        putChar(e, digits[--count]);
+}
+
+// Puts value with leading zeros up to width digits
+static void putDigits(Exporter* e, unsigned value, unsigned width)
+{
+    for (unsigned scale = (width == 4) ? 1000 : (width == 3) ? 100 : 10; scale > 0; scale /= 10)
+        putChar(e, (char)('0' + value / scale % 10));
+}
+
+// Length of the UTF-8 sequence at text, 0 when it isn't valid UTF-8
+static unsigned sequenceLength(const uint8_t* text, unsigned remaining)
+{
+    unsigned length = (text[0] < 0x80) ? 1 : (text[0] & 0xE0) == 0xC0 ? 2 : (text[0] & 0xF0) == 0xE0 ? 3 : (text[0] & 0xF8) == 0xF0 ? 4 : 0;
+    if (length == 0 || length > remaining)
+        return 0;
+
+    for (unsigned i = 1; i < length; ++i)
+    {
+        if ((text[i] & 0xC0) != 0x80)
+            return 0;
+    }
+
+    return length;
+}
+
+// Puts the text of a field, escaped for the format. Bytes which aren't UTF-8 (i.e. the OEM code page of a
+// short name) are taken as Latin-1, so the output is always valid UTF-8.
+static void putEscaped(Exporter* e, const char* text, unsigned length)
+{
+    const uint8_t* p = (const uint8_t*)text;
+    const uint8_t* end = p + length;
+    while (p < end)
+    {
+        unsigned sequence = sequenceLength(p, (unsigned)(end - p));
+        if (sequence == 0)                                          // Latin-1 into UTF-8
+        {
+            putChar(e, (char)(0xC0 | *p >> 6));
+            putChar(e, (char)(0x80 | (*p & 0x3F)));
+            ++p;
+            continue;
+        }
+
+        char c = (char)*p;
+        if ((e->flags & FAT_EXPORT_CSV) && c == '"')
+            putChar(e, '"');
+        else if (!(e->flags & FAT_EXPORT_CSV) && (c == '"' || c == '\\'))
+            putChar(e, '\\');
+        else if (!(e->flags & FAT_EXPORT_CSV) && (uint8_t)c < 0x20)
+        {
+            put(e, "\\u00");
+            putChar(e, "0123456789abcdef"[c >> 4]);
+            putChar(e, "0123456789abcdef"[c & 0x0F]);
+            ++p;
+            continue;
+        }
+
+        for (unsigned i = 0; i < sequence; ++i)
+            putChar(e, (char)p[i]);
+        p += sequence;
+    }
+}
+
+// Starts the next field, name is the key in JSON
+static void putField(Exporter* e, const char* name, uint8_t first)
+{
+    if (e->flags & FAT_EXPORT_CSV)
+    {
+        if (!first)
+            putChar(e, ',');
+        return;
+    }
+
+    put(e, first ? "{\"" : ",\"");
+    put(e, name);
+    put(e, "\":");
+}
+
+static void putPath(Exporter* e, const fat_WalkEntry* directory)
+{
+    if (directory == NULL)
+        return;
+
+    putPath(e, directory->parent);
+    putEscaped(e, directory->fileName, (unsigned)strlen(directory->fileName));
+    putChar(e, '/');
+}
+
+// Puts date and time (fat format) as YYYY-MM-DDTHH:MM:SS, milliseconds adds the fraction of creation times
+static void putTimestamp(Exporter* e, uint16_t date, uint16_t time, uint8_t withTime, int milliseconds)
+{
+    if (date == 0)                                                  // never set
+    {
+        if (!(e->flags & FAT_EXPORT_CSV))
+            put(e, "null");
+        return;
+    }
+
+    uint8_t day, month, seconds, minute, hour;
+    uint16_t year;
+    fat_getDate(date, &day, &month, &year);
+    fat_getTime(time, &seconds, &minute, &hour);
+
+    putChar(e, '"');
+    putDigits(e, year, 4);
+    putChar(e, '-');
+    putDigits(e, month, 2);
+    putChar(e, '-');
+    putDigits(e, day, 2);
+    if (withTime)
+    {
+        putChar(e, 'T');
+        putDigits(e, hour, 2);
+        putChar(e, ':');
+        putDigits(e, minute, 2);
+        putChar(e, ':');
+        putDigits(e, seconds + (milliseconds >= 0 ? milliseconds / 1000 : 0), 2);
+        if (milliseconds >= 0)
+        {
+            putChar(e, '.');
+            putDigits(e, milliseconds % 1000, 3);
+        }
+    }
+    putChar(e, '"');
+}
+
+// Puts the runs of contiguous clusters of the chain, JSON [[cluster,count],...] or CSV cluster:count;...
+static void putExtents(Exporter* e, const uint8_t* table, uint32_t cluster)
+{
+    uint8_t csv = (e->flags & FAT_EXPORT_CSV) != 0;
+    putChar(e, csv ? '"' : '[');
+
+    uint32_t steps = 0;                                             // a chain longer than the volume loops
+    uint8_t first = 1;
+    while (cluster >= 2 && cluster <= e->lastCluster && steps <= e->lastCluster)
+    {
+        uint32_t start = cluster, count = 1;
+        uint32_t next = fat_fatEntry(e->type, table, cluster);
+        while (next == cluster + 1 && steps++ <= e->lastCluster)
+        {
+            cluster = next;
+            next = fat_fatEntry(e->type, table, cluster);
+            ++count;
+        }
+
+        if (!first)
+            putChar(e, csv ? ';' : ',');
+        first = 0;
+
+        if (!csv)
+            putChar(e, '[');
+        putNumber(e, start);
+        putChar(e, csv ? ':' : ',');
+        putNumber(e, count);
+        if (!csv)
+            putChar(e, ']');
+
+        ++steps;
+        cluster = fat_isEndOfChain(e->type, next) ? 0 : next;
+    }
+
+    putChar(e, csv ? '"' : ']');
+}
+
+static void putRecord(Exporter* e, const fat_WalkEntry* walkEntry)
+{
+    const fat_DirectoryEntry* entry = &walkEntry->entry;
+    const fat_DirectoryIterator* it = walkEntry->iterator;
+
+    char name[FAT_LFN_MAX_LENGTH * 3 + 1];                          // UTF-8 takes up to three bytes per UCS-2 character
+    fat_walkFileName(walkEntry, name, sizeof(name));
+    uint8_t longName = it->longNameCount != 0 && it->longName[it->longNameCount - 1].checksum == fat_checksum(entry->fileName);
+
+    char shortName[13];                                             // as stored, fat_getFileName lowers the case
+    unsigned length = 0;
+    for (unsigned i = 0; i < 8 && entry->fileName[i] != ' '; ++i)
+        shortName[length++] = (i == 0 && entry->fileName[0] == 0x05) ? (char)0xE5 : (char)entry->fileName[i];
+    for (unsigned i = 0; i < 3 && entry->extension[i] != ' '; ++i)
+    {
+        if (i == 0)
+            shortName[length++] = '.';
+        shortName[length++] = (char)entry->extension[i];
+    }
+
+    putField(e, "path", 1);
+    putChar(e, '"');
+    putPath(e, walkEntry->parent);
+    putEscaped(e, name, (unsigned)strlen(name));
+    putChar(e, '"');
+
+    putField(e, "name", 0);
+    putChar(e, '"');
+    if (longName)
+        putEscaped(e, name, (unsigned)strlen(name));
+    putChar(e, '"');
+
+    putField(e, "shortName", 0);
+    putChar(e, '"');
+    putEscaped(e, shortName, length);
+    putChar(e, '"');
+
+    uint32_t cluster = entry->clusterHigh << 16 | entry->clusterLow;
+    putField(e, "attributes", 0);
+    putNumber(e, entry->fileAttributes);
+    putField(e, "cluster", 0);
+    putNumber(e, cluster);
+    putField(e, "size", 0);
+    putNumber(e, entry->fileSize);
+
+    putField(e, "modified", 0);
+    putTimestamp(e, entry->word, entry->time, 1, -1);
+    putField(e, "created", 0);
+    putTimestamp(e, entry->dateCreated, entry->timeCreatedHourMinute, 1, entry->timeCreatedMillis * 10);
+    putField(e, "accessed", 0);
+    putTimestamp(e, entry->dateAccessed, 0, 0, -1);
+
+    if (e->flags & FAT_EXPORT_EXTENTS)
+    {
+        putField(e, "extents", 0);
+        putExtents(e, it->table, cluster);
+    }
+
+    put(e, (e->flags & FAT_EXPORT_CSV) ? "\n" : "}\n");
+}
+
+static uint8_t exportVisit(const fat_WalkEntry* entry, void* context)
+{
+    Exporter* e = (Exporter*)context;
+
+#ifndef FAT_NO_THREADS
+    fat_mutexLock(&e->lock);
+#endif
+    if (!e->failed)
+    {
+        putRecord(e, entry);
+        ++e->records;
+    }
+    uint8_t failed = e->failed;
+#ifndef FAT_NO_THREADS
+    fat_mutexUnlock(&e->lock);
+#endif
+
+    return failed ? FAT_WALK_STOP : FAT_WALK_CONTINUE;
+}
+
+uint8_t fat_export(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, unsigned threads, uint8_t flags, exportWrite_t write, void* context, uint32_t* records)
+{
+    assert(boot != NULL);
+    assert(fetch != NULL);
+    assert(write != NULL);
+
+    Exporter e;
+    memset(&e, 0, sizeof(Exporter));
+    e.flags = flags;
+    e.type = fat_getType(boot);
+    e.lastCluster = fat_countOfClusters(boot) + 1;
+    e.write = write;
+    e.context = context;
+    e.buffer = malloc(FAT_EXPORT_BUFFER);
+    if (e.buffer == NULL)
+        return 0;
+
+    if (flags & FAT_EXPORT_CSV)
+        put(&e, (flags & FAT_EXPORT_EXTENTS)
+            ? "path,name,shortName,attributes,cluster,size,modified,created,accessed,extents\n"
+            : "path,name,shortName,attributes,cluster,size,modified,created,accessed\n");
+
+#ifndef FAT_NO_THREADS
+    fat_mutexInit(&e.lock);
+#endif
+    uint8_t ok = fat_walk(boot, partitionOffset, fetch, threads, FAT_WALK_PRE | FAT_WALK_LAZY_NAMES, exportVisit, &e);
+#ifndef FAT_NO_THREADS
+    fat_mutexDestroy(&e.lock);
+#endif
+
+    flush(&e);
+    free(e.buffer);
+
+    if (records != NULL)
+        *records = e.records;
+    return ok && !e.failed;
+}
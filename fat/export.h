@@ -0,0 +1,29 @@
+#pragma once
+
+#include "fat.h"
+#include "walk.h"
+
+#ifdef FAT_NO_HEAP
+#error "the export allocates its output buffer, leave export.c out of FAT_NO_HEAP builds"
+#endif
+
+// Machine readable listing of the whole tree, one record per file and directory. The records are
+// formatted straight into one output buffer of FAT_EXPORT_BUFFER bytes which is handed to the caller
+// whenever it fills up, so nothing is allocated per entry and millions of entries stream through
+// the same memory. Records come in the order the walk visits them, not sorted.
+//
+// Fields: path, name (long name, empty without one), shortName (8.3), attributes, cluster, size,
+// modified, created, accessed and with FAT_EXPORT_EXTENTS the runs of the chain as cluster and count.
+// Numbers are decimal, times are ISO 8601 (null in JSON and empty in CSV when the entry has none).
+
+#define FAT_EXPORT_NDJSON 0x00                                      // one JSON object per line
+#define FAT_EXPORT_CSV 0x01                                         // a header line, then one line per entry
+#define FAT_EXPORT_EXTENTS 0x02                                     // add the runs of contiguous clusters
+#define FAT_EXPORT_BUFFER 0x10000
+
+// Receives the next count bytes of the output, never from two threads at once. Return 0 to stop.
+typedef uint8_t(*exportWrite_t)(const char* data, unsigned count, void* context);
+
+// Exports every entry of the volume, flags is FAT_EXPORT_NDJSON or FAT_EXPORT_CSV with optionally
+// FAT_EXPORT_EXTENTS. threads as for fat_walk. records (optional) gets the count of records written.
+uint8_t fat_export(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, unsigned threads, uint8_t flags, exportWrite_t write, void* context, uint32_t* records);
@@ -0,0 +1,413 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE                                                 // splice
+#endif
+
+#include "extract.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#define MOST_PER_CALL 0x40000000                                    // bytes asked from the kernel at once
+#define PIPE_SIZE 0x10000                                           // what a pipe holds by default
+
+#define COPIED 1
+#define FAILED 0
+#define UNSUPPORTED -1                                              // try the next method
+
+typedef struct ExtentList ExtentList;
+struct ExtentList
+{
+    fat_FileExtent* extents;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+typedef struct Copier Copier;
+struct Copier
+{
+    fat_Device* device;
+#ifdef _WIN32
+    HANDLE out;
+#else
+    int out;
+    int pipe[2];                                                    // for splice, -1 until needed
+#endif
+    uint8_t disabled[FAT_EXTRACT_METHODS];
+    char* buffer;                                                   // FAT_EXTRACT_BUFFER, only for buffered copies
+    fat_ExtractStats* stats;
+};
+
+// Appends a piece of the file, merged into the last extent when it continues it in the image too
+static uint8_t addExtent(ExtentList* list, uint64_t offset, uint64_t address, uint64_t length)
+{
+    if (list->count > 0)
+    {
+        fat_FileExtent* last = &list->extents[list->count - 1];
+        if (last->address + last->length == address && last->offset + last->length == offset)
+        {
+            last->length += length;
+            return 1;
+        }
+    }
+
+    if (list->count == list->capacity)
+    {
+        uint32_t capacity = (list->capacity == 0) ? 0x10 : list->capacity * 2;
+        fat_FileExtent* grown = realloc(list->extents, capacity * sizeof(fat_FileExtent));
+        if (grown == NULL)
+            return 0;
+
+        list->extents = grown;
+        list->capacity = capacity;
+    }
+
+    fat_FileExtent* extent = &list->extents[list->count++];
+    extent->offset = offset;
+    extent->address = address;
+    extent->length = length;
+    return 1;
+}
+
+static uint8_t finishExtents(ExtentList* list, uint8_t ok, fat_FileExtent** extents, uint32_t* count)
+{
+    if (!ok)
+    {
+        free(list->extents);
+        return 0;
+    }
+
+    *extents = list->extents;
+    *count = list->count;
+    return 1;
+}
+
+uint8_t fat_tableFileExtents(const fat_BootSector* boot, unsigned partitionOffset, const uint8_t* table, const fat_DirectoryEntry* entry, fat_FileExtent** extents, uint32_t* count)
+{
+    assert(boot != NULL);
+    assert(table != NULL);
+    assert(entry != NULL);
+    assert(extents != NULL);
+    assert(count != NULL);
+
+    *extents = NULL;
+    *count = 0;
+
+    FatType type = fat_getType(boot);
+    uint32_t clusterSize = fat_clusterSize(boot);
+    uint32_t lastCluster = fat_countOfClusters(boot) + 1;
+    uint32_t cluster = entry->clusterHigh << 16 | entry->clusterLow;
+
+    ExtentList list = { NULL, 0, 0 };
+    uint8_t ok = 1;
+    for (uint64_t offset = 0; ok && offset < entry->fileSize;)
+    {
+        if (cluster < 2 || cluster > lastCluster)                   // the chain ends before the file does
+        {
+            ok = 0;
+            break;
+        }
+
+        uint64_t length = (entry->fileSize - offset < clusterSize) ? entry->fileSize - offset : clusterSize;
+        ok = addExtent(&list, offset, fat_clusterToAddress(boot, partitionOffset, cluster), length);
+        offset += length;
+        cluster = fat_fatEntry(type, table, cluster);
+    }
+
+    return finishExtents(&list, ok, extents, count);
+}
+
+uint8_t fat_fileExtents(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, const fat_DirectoryEntry* entry, fat_FileExtent** extents, uint32_t* count)
+{
+    assert(boot != NULL);
+    assert(fetch != NULL);
+    assert(entry != NULL);
+    assert(extents != NULL);
+    assert(count != NULL);
+
+    *extents = NULL;
+    *count = 0;
+    if (entry->fileSize == 0)
+        return 1;
+
+    uint8_t* table = fat_loadFat(boot, partitionOffset, fetch);    // one read instead of one per cluster
+    if (table == NULL)
+        return 0;
+
+    uint8_t ok = fat_tableFileExtents(boot, partitionOffset, table, entry, extents, count);
+    free(table);
+    return ok;
+}
+
+uint8_t fat_exfatFileExtents(const exfat_Volume* volume, const exfat_File* file, fat_FileExtent** extents, uint32_t* count)
+{
+    assert(volume != NULL);
+    assert(file != NULL);
+    assert(extents != NULL);
+    assert(count != NULL);
+
+    *extents = NULL;
+    *count = 0;
+
+    uint64_t valid = (file->validDataLength < file->dataLength) ? file->validDataLength : file->dataLength;
+    if (valid == 0)
+        return 1;
+    if (file->firstCluster < 2)
+        return 0;
+
+    ExtentList list = { NULL, 0, 0 };
+    if (file->flags & EXFAT_FLAG_NO_FAT_CHAIN)                      // one run, the FAT isn't read
+    {
+        uint64_t end = (uint64_t)(file->firstCluster - 2) * volume->clusterSize + valid;
+        uint8_t ok = end <= (uint64_t)volume->boot.clusterCount * volume->clusterSize
+            && addExtent(&list, 0, exfat_clusterToAddress(volume, file->firstCluster), valid);
+        return finishExtents(&list, ok, extents, count);
+    }
+
+    uint32_t cluster = file->firstCluster;
+    uint8_t ok = valid <= (uint64_t)volume->boot.clusterCount * volume->clusterSize;   // else the chain would loop
+    for (uint64_t offset = 0; ok && offset < valid;)
+    {
+        uint64_t length = (valid - offset < volume->clusterSize) ? valid - offset : volume->clusterSize;
+        ok = addExtent(&list, offset, exfat_clusterToAddress(volume, cluster), length);
+        offset += length;
+        if (ok && offset < valid)
+            ok = (cluster = exfat_nextCluster(volume, cluster)) != 0;
+    }
+
+    return finishExtents(&list, ok, extents, count);
+}
+
+static void copied(Copier* c, uint8_t method, uint64_t bytes, uint64_t* address, uint64_t* offset, uint64_t* length)
+{
+    c->stats->methodBytes[method] += bytes;
+    *address += bytes;
+    *offset += bytes;
+    *length -= bytes;
+}
+
+#ifdef __linux__
+// Errors which mean the method can't be used for this pair of files, anything else is a real failure
+static uint8_t unsupported(int error)
+{
+    return error == EINVAL || error == ENOSYS || error == EXDEV || error == EOPNOTSUPP || error == EBADF || error == ESPIPE;
+}
+
+static int copyRange(Copier* c, uint64_t* address, uint64_t* offset, uint64_t* length)
+{
+#ifdef SYS_copy_file_range
+    while (*length > 0)
+    {
+        loff_t in = (loff_t)*address, out = (loff_t)*offset;
+        size_t count = (*length < MOST_PER_CALL) ? (size_t)*length : MOST_PER_CALL;
+        long done = syscall(SYS_copy_file_range, c->device->fd, &in, c->out, &out, count, 0);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done < 0)
+            return unsupported(errno) ? UNSUPPORTED : FAILED;
+        if (done == 0)                                              // the image ends early
+            return FAILED;
+
+        copied(c, FAT_EXTRACT_COPY_RANGE, (uint64_t)done, address, offset, length);
+    }
+    return COPIED;
+#else
+    (void)c; (void)address; (void)offset; (void)length;
+    return UNSUPPORTED;
+#endif
+}
+
+static int sendFile(Copier* c, uint64_t* address, uint64_t* offset, uint64_t* length)
+{
+    while (*length > 0)
+    {
+        if (lseek(c->out, (off_t)*offset, SEEK_SET) < 0)            // sendfile writes at the file position
+            return FAILED;
+
+        off_t in = (off_t)*address;
+        size_t count = (*length < MOST_PER_CALL) ? (size_t)*length : MOST_PER_CALL;
+        ssize_t done = sendfile(c->out, c->device->fd, &in, count);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done < 0)
+            return unsupported(errno) ? UNSUPPORTED : FAILED;
+        if (done == 0)
+            return FAILED;
+
+        copied(c, FAT_EXTRACT_SENDFILE, (uint64_t)done, address, offset, length);
+    }
+    return COPIED;
+}
+
+static int spliceFile(Copier* c, uint64_t* address, uint64_t* offset, uint64_t* length)
+{
+    if (c->pipe[0] < 0 && pipe(c->pipe) != 0)
+        return UNSUPPORTED;
+
+    while (*length > 0)
+    {
+        loff_t in = (loff_t)*address;
+        size_t count = (*length < PIPE_SIZE) ? (size_t)*length : PIPE_SIZE;
+        ssize_t filled = splice(c->device->fd, &in, c->pipe[1], NULL, count, SPLICE_F_MOVE);
+        if (filled < 0 && errno == EINTR)
+            continue;
+        if (filled < 0)
+            return unsupported(errno) ? UNSUPPORTED : FAILED;
+        if (filled == 0)
+            return FAILED;
+
+        for (ssize_t drained = 0; drained < filled;)                // the pipe has to be emptied, no way back
+        {
+            loff_t out = (loff_t)(*offset + drained);
+            ssize_t done = splice(c->pipe[0], NULL, c->out, &out, (size_t)(filled - drained), SPLICE_F_MOVE);
+            if (done < 0 && errno == EINTR)
+                continue;
+            if (done <= 0)
+                return FAILED;
+            drained += done;
+        }
+
+        copied(c, FAT_EXTRACT_SPLICE, (uint64_t)filled, address, offset, length);
+    }
+    return COPIED;
+}
+#endif
+
+static uint8_t writeAt(Copier* c, uint64_t offset, const char* data, uint32_t count)
+{
+    while (count > 0)
+    {
+#ifdef _WIN32
+        OVERLAPPED overlapped;
+        DWORD written = 0;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset = (DWORD)offset;
+        overlapped.OffsetHigh = (DWORD)(offset >> 32);
+        if (!WriteFile(c->out, data, count, &written, &overlapped) || written == 0)
+            return 0;
+#else
+        ssize_t written = pwrite(c->out, data, count, (off_t)offset);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return 0;
+#endif
+        data += written;
+        offset += (uint64_t)written;
+        count -= (uint32_t)written;
+    }
+    return 1;
+}
+
+static int copyBuffered(Copier* c, uint64_t* address, uint64_t* offset, uint64_t* length)
+{
+    if (c->buffer == NULL && (c->buffer = malloc(FAT_EXTRACT_BUFFER)) == NULL)
+        return FAILED;
+
+    while (*length > 0)
+    {
+        uint32_t count = (*length < FAT_EXTRACT_BUFFER) ? (uint32_t)*length : FAT_EXTRACT_BUFFER;
+        if (!fat_deviceRead(c->device, *address, count, c->buffer) || !writeAt(c, *offset, c->buffer, count))
+            return FAILED;
+
+        copied(c, FAT_EXTRACT_BUFFERED, count, address, offset, length);
+    }
+    return COPIED;
+}
+
+typedef int(*copyMethod_t)(Copier* c, uint64_t* address, uint64_t* offset, uint64_t* length);
+
+static uint8_t copyExtent(Copier* c, const fat_FileExtent* extent)
+{
+    uint64_t address = extent->address, offset = extent->offset, length = extent->length;
+    if (address + length > c->device->size)
+        return 0;
+
+#ifdef __linux__
+    static const copyMethod_t methods[] = { copyRange, sendFile, spliceFile };
+    uint8_t zeroCopy = !c->device->packed;                          // a container has to be decompressed
+#else
+    static const copyMethod_t methods[] = { NULL };
+    uint8_t zeroCopy = 0;
+#endif
+
+    uint64_t start = fat_traceClock();
+    int result = UNSUPPORTED;
+    for (uint8_t method = 0; zeroCopy && result == UNSUPPORTED && method < FAT_EXTRACT_BUFFERED; ++method)
+    {
+        if (c->disabled[method])
+            continue;
+
+        result = methods[method](c, &address, &offset, &length);
+        if (result == UNSUPPORTED)
+            c->disabled[method] = 1;
+    }
+
+    if (result == UNSUPPORTED)
+        result = copyBuffered(c, &address, &offset, &length);
+
+    if (c->device->trace != NULL && !c->device->packed)             // buffered reads went through fat_deviceRead already
+        fat_traceRecord(c->device->trace, extent->address, (extent->length > 0xFFFFFFFF) ? 0xFFFFFFFF : (unsigned)extent->length, start, result == COPIED);
+    return result == COPIED;
+}
+
+uint8_t fat_extract(fat_Device* device, const fat_FileExtent* extents, uint32_t count, uint64_t size, const char* path, fat_ExtractStats* stats)
+{
+    assert(device != NULL);
+    assert(extents != NULL || count == 0);
+    assert(path != NULL);
+
+    fat_ExtractStats ignored;
+    Copier c;
+    memset(&c, 0, sizeof(Copier));
+    c.device = device;
+    c.stats = (stats != NULL) ? stats : &ignored;
+    memset(c.stats, 0, sizeof(fat_ExtractStats));
+
+    // sized first, whatever isn't copied stays a hole of zeros
+#ifdef _WIN32
+    c.out = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (c.out == INVALID_HANDLE_VALUE)
+        return 0;
+
+    LARGE_INTEGER end;
+    end.QuadPart = (LONGLONG)size;
+    uint8_t ok = SetFilePointerEx(c.out, end, NULL, FILE_BEGIN) && SetEndOfFile(c.out);
+#else
+    c.out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    c.pipe[0] = c.pipe[1] = -1;
+    if (c.out < 0)
+        return 0;
+
+    uint8_t ok = ftruncate(c.out, (off_t)size) == 0;
+#endif
+
+    for (uint32_t i = 0; ok && i < count; ++i)
+    {
+        ok = extents[i].offset + extents[i].length <= size && copyExtent(&c, &extents[i]);
+        if (ok)
+            c.stats->bytes += extents[i].length;
+    }
+    c.stats->extents = count;
+
+    free(c.buffer);
+#ifdef _WIN32
+    ok &= CloseHandle(c.out) != 0;
+#else
+    if (c.pipe[0] >= 0)
+    {
+        close(c.pipe[0]);
+        close(c.pipe[1]);
+    }
+    ok &= close(c.out) == 0;
+#endif
+    return ok;
+}
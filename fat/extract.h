@@ -0,0 +1,55 @@
+#pragma once
+
+#include "fat.h"
+#include "device.h"
+#include "exfat.h"
+
+#ifdef FAT_NO_HEAP
+#error "the extents of a file are collected on the heap, leave extract.c out of FAT_NO_HEAP builds"
+#endif
+
+// Copies a file out of an image without passing its data through user space. The chain is resolved to
+// extents first: byte ranges of the image which are contiguous in the file, the last one trimmed to the
+// file size. Every extent is then copied from the image to the output with copy_file_range, which lets
+// the kernel copy (or on reflink capable file systems share) the blocks. When it isn't available for the
+// pair of files sendfile is tried, then splice through a pipe, and only then a buffered copy with
+// fat_deviceRead (always used for containers, and on other systems than Linux). A method that fails once
+// isn't tried again for the rest of the copy.
+
+#define FAT_EXTRACT_COPY_RANGE 0x00
+#define FAT_EXTRACT_SENDFILE 0x01
+#define FAT_EXTRACT_SPLICE 0x02
+#define FAT_EXTRACT_BUFFERED 0x03
+#define FAT_EXTRACT_METHODS 0x04
+
+#define FAT_EXTRACT_BUFFER 0x100000                                 // bytes per buffered read
+
+// Bytes of a file which are contiguous in the image
+typedef struct fat_FileExtent fat_FileExtent;
+struct fat_FileExtent
+{
+	uint64_t offset;                                                // in the file
+	uint64_t address;                                               // in the image
+	uint64_t length;
+};
+
+typedef struct fat_ExtractStats fat_ExtractStats;
+struct fat_ExtractStats
+{
+	uint32_t extents;
+	uint64_t bytes;                                                 // copied, holes excluded
+	uint64_t methodBytes[FAT_EXTRACT_METHODS];                      // bytes copied by each FAT_EXTRACT_* method
+};
+
+// Resolves the chain of entry to extents, fails when the chain is shorter than the file. Free extents when done.
+uint8_t fat_fileExtents(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, const fat_DirectoryEntry* entry, fat_FileExtent** extents, uint32_t* count);
+
+// Same as fat_fileExtents with the FAT already loaded by fat_loadFat, for resolving many files
+uint8_t fat_tableFileExtents(const fat_BootSector* boot, unsigned partitionOffset, const uint8_t* table, const fat_DirectoryEntry* entry, fat_FileExtent** extents, uint32_t* count);
+
+// Resolves an exFAT file to extents up to its valid data length, the rest of the file is a hole. Free extents when done.
+uint8_t fat_exfatFileExtents(const exfat_Volume* volume, const exfat_File* file, fat_FileExtent** extents, uint32_t* count);
+
+// Creates the file at path of size bytes and copies count extents of device into it, the bytes no extent
+// covers read as zeros. stats is optional.
+uint8_t fat_extract(fat_Device* device, const fat_FileExtent* extents, uint32_t count, uint64_t size, const char* path, fat_ExtractStats* stats);
@@ -6,24 +6,21 @@
 // Microsoft Extensible Firmware Initiative FAT32 File System Specification 
 // http://download.microsoft.com/download/1/6/1/161ba512-40e2-4cc9-843a-923143f3456c/fatgen103.doc
 
-typedef struct EntryState EntryState;
-struct EntryState
+#ifdef FAT_NO_HEAP                                                  // a heap call sneaking in becomes a compile error
+#define malloc(size) FAT_NO_HEAP_forbids_malloc
+#define calloc(count, size) FAT_NO_HEAP_forbids_calloc
+#define realloc(memory, size) FAT_NO_HEAP_forbids_realloc
+#define free(memory) FAT_NO_HEAP_forbids_free
+#endif
+
+enum
 {
-    unsigned entryIndex;
-    unsigned currentCluster;
-    unsigned startCluster;
-    unsigned currentSector;
-    FatType fatType;
-
-    enum 
-    {
-        EndOfTable = 1 << 0,
-        LfnDirectoryEntry = 1 << 1,
-        EndOfChain = 1 << 2
-    } Status;
-    enum Status flags;    
+    EndOfTable = 1 << 0,
+    EndOfChain = 1 << 2
 };
-static EntryState _state;
+
+static FAT_THREAD_LOCAL fat_DirectoryIterator _iterator;            // state of fat_nextDirectoryEntry
+static FAT_THREAD_LOCAL uint8_t _iteratorReset = 1;
 
 void fat_getDate(uint16_t date, uint8_t* day, uint8_t* month, uint16_t* year)
 {
@@ -60,7 +57,9 @@ void fat_getFileName(char* fileName, const fat_DirectoryEntry* entry)
             : tolower(entry->fileName[i]);                  // just return everything as lower case
     }
 
-    ++x;                                                    // skip the dot
+    if (entry->extension[0] != ' ')                         // means there is an extension
+        fileName[x++] = '.';
+
     for (i = 0; i < 3; ++i)
     {
         if (entry->extension[i] == ' ')
@@ -69,8 +68,7 @@ void fat_getFileName(char* fileName, const fat_DirectoryEntry* entry)
         fileName[x++] = tolower(entry->extension[i]);       // sets extension
     }
 
-    if (i > 0)                                              // means there was an extension
-        fileName[7] = '.';
+    fileName[x] = 0;
 }
 
 static void UCS2ToUTF8(char* filename, const fat_LongFileName* lfn)
@@ -89,6 +87,62 @@ static void UCS2ToUTF8(char* filename, const fat_LongFileName* lfn)
         *p++ = *((char*)lfn->ucs2_3 + i * 2);
 }
 
+// Gets UTF-16 unit i (0 to 12) of a long file name entry
+static uint16_t longNameUnit(const fat_LongFileName* lfn, uint8_t i)
+{
+    return (i < 5) ? lfn->ucs2_1[i] : (i < 11) ? lfn->ucs2_2[i - 5] : lfn->ucs2_3[i - 11];
+}
+
+// Decodes the UTF-16 name of the long file name entries (first part first) into fileName, see fat_utf16ToUtf8
+static unsigned longNameToUtf8(const fat_LongFileName* lfn, uint8_t count, char* fileName, unsigned nameLen)
+{
+    uint16_t units[FAT_LFN_MAX_SLOTS * 13];
+    for (unsigned i = 0; i < count * 13u; ++i)
+        units[i] = longNameUnit(&lfn[i / 13], (uint8_t)(i % 13));
+
+    return fat_utf16ToUtf8(units, count * 13u, fileName, nameLen);
+}
+
+unsigned fat_utf16ToUtf8(const uint16_t* units, unsigned count, char* out, unsigned outLen)
+{
+    assert(units != NULL);
+    assert(out != NULL && outLen > 0);
+
+    unsigned length = 0;
+    for (unsigned i = 0; i < count; ++i)
+    {
+        uint32_t c = units[i];
+        if (c == 0x0000)                                            // the name has its own termination
+            break;
+
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < count && units[i + 1] >= 0xDC00 && units[i + 1] < 0xE000)
+            c = 0x10000 + ((c - 0xD800) << 10) + (units[++i] - 0xDC00); // surrogate pair
+        else if (c >= 0xD800 && c < 0xE000)                         // a lone half
+            c = 0xFFFD;
+
+        unsigned bytes = (c < 0x80) ? 1 : (c < 0x800) ? 2 : (c < 0x10000) ? 3 : 4;
+        if (length + bytes + 1 > outLen)
+            break;
+
+        if (bytes == 1)
+            out[length++] = (char)c;
+        else
+        {
+            out[length++] = (char)((bytes == 2 ? 0xC0 : bytes == 3 ? 0xE0 : 0xF0) | (c >> (6 * (bytes - 1))));
+            for (unsigned shift = 6 * (bytes - 1); shift > 0; shift -= 6)
+                out[length++] = (char)(0x80 | ((c >> (shift - 6)) & 0x3F));
+        }
+    }
+
+    out[length] = 0;
+    return length;
+}
+
+void fat_getLongFileNamePart(char* fileName, const fat_LongFileName* lfn)
+{
+    UCS2ToUTF8(fileName, lfn);
+}
+
 uint32_t fat_sectorsPerFat(const fat_BootSector * boot)
 {
     assert(boot != NULL);
@@ -128,7 +182,7 @@ uint32_t fat_numberOfRootDirSectors(const fat_BootSector * boot)
     return (boot->rootEntries * 32 + boot->bytesPerSector - 1) / boot->bytesPerSector;
 }
 
-uint32_t fat_firstDataSector(const fat_BootSector * boot)
+uint32_t fat_rootDirectorySector(const fat_BootSector * boot)
 {
     assert(boot != NULL);
 
@@ -137,6 +191,13 @@ uint32_t fat_firstDataSector(const fat_BootSector * boot)
     return boot->reservedSectors + (boot->numberOfFATs * sectorsPerFat);
 }
 
+uint32_t fat_firstDataSector(const fat_BootSector * boot)
+{
+    assert(boot != NULL);
+
+    return fat_rootDirectorySector(boot) + fat_numberOfRootDirSectors(boot);  // FAT12/FAT16 keep the root directory in front of the data
+}
+
 uint32_t fat_firstSectorOfCluster(const fat_BootSector * boot, unsigned cluster)
 {
     assert(boot != NULL);
@@ -174,7 +235,7 @@ uint32_t fat_clusterSize(const fat_BootSector * boot)
     return boot->bytesPerSector * boot->sectorsPerCluster;
 }
 
-uint8_t fat_entriesPerCluster(const fat_BootSector * boot)
+uint32_t fat_entriesPerCluster(const fat_BootSector * boot)
 {
     assert(boot != NULL);
 
@@ -187,6 +248,9 @@ FatType fat_getType(const fat_BootSector * boot)
 {
     assert(boot != NULL);
 
+    if (memcmp(boot->OEM, "EXFAT   ", sizeof(boot->OEM)) == 0)    // none of the FAT fields are set, see exfat.h
+        return EXFAT;
+
     uint32_t countOfClusters = fat_countOfClusters(boot);
 
     return (countOfClusters < 4085)
@@ -201,11 +265,7 @@ uint32_t fat_nextPartitionSector(fetchData_t fetchData, fat_BootSector* boot, ui
     assert(fetchData != NULL);
     assert(boot != NULL);
 
-    fat_MBR mbr;
-    if (!fetchData(0, sizeof(mbr), (char*)&mbr))
-        return -1;
-
-    static unsigned i = 0;                                                  // partition indexer (note static)
+    static FAT_THREAD_LOCAL unsigned i = 0;                                 // partition indexer (note static)
     uint32_t partitionOffset = 0;
     for (; i < 4; ++i)														// max 4 boot partitions
     {
@@ -236,175 +296,349 @@ uint32_t fat_nextPartitionSector(fetchData_t fetchData, fat_BootSector* boot, ui
     return partitionOffset;													// return the start of partition
 }
 
-uint32_t fat_nextClusterEntry(const fat_BootSector* boot, unsigned partitionOffset, unsigned cluster, fetchData_t fetch, uint8_t* eoc)
+static unsigned fatOffsetOf(FatType type, unsigned cluster)
 {
-    assert(boot != NULL);
-    assert(fetch != NULL);
-
-    uint32_t sectorsPerFat = fat_sectorsPerFat(boot);
-    FatType type = fat_getType(boot);
-
-    assert( (type == FAT12 && cluster < 0x0FF8) ||
-            (type == FAT16 && cluster < 0xFFF8) ||
-            (type == FAT32 && cluster < 0x0FFFFFF8));
-
-    unsigned fatOffset = (type == FAT12)
+    return (type == FAT12)
         ? cluster + (cluster / 2)
         : (type == FAT16)
             ? cluster * 2
             : cluster * 4;
+}
 
-    uint32_t thisFatSector = boot->reservedSectors + (fatOffset / boot->bytesPerSector);
-    uint32_t thisFatEntry = fatOffset % boot->bytesPerSector;
-
-    char* secBuf = malloc(boot->bytesPerSector);
-    // TODO: General error
-    assert(secBuf != NULL);
-
-    uint32_t address = fat_sectorToAddress(boot, partitionOffset, thisFatSector);
-    if (!fetch(address, boot->bytesPerSector, secBuf))
-        return -1;
-
+static uint32_t decodeFatEntry(FatType type, const uint8_t* p, unsigned cluster)
+{
     uint32_t clusterEntry = 0;
     if (type == FAT12)
     {
-        clusterEntry = *((uint16_t*)&secBuf[thisFatEntry]);
+        clusterEntry = p[0] | (p[1] << 8);
         clusterEntry = (cluster & 0x0001)
             ? clusterEntry >> 4										// odd cluster number
             : clusterEntry & 0x0FFF;								// even cluster number
-
-        if (eoc)
-            *eoc = clusterEntry >= 0x0FF8;
     }
     else if (type == FAT16)
-    {
-        clusterEntry = *((uint16_t*)&secBuf[thisFatEntry]);
-
-        if (eoc)
-            *eoc = clusterEntry >= 0xFFF8;
-    }
+        clusterEntry = p[0] | (p[1] << 8);
     else if (type == FAT32)
-    {
-        clusterEntry = *(((uint32_t*)&secBuf[thisFatEntry])) & 0x0FFFFFFF;
-
-        if (eoc)
-            *eoc = clusterEntry >= 0x0FFFFFF8;
-    }
+        clusterEntry = (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24)) & 0x0FFFFFFF;
     else
         assert("Invalid type");
 
-    free(secBuf);
     return clusterEntry;
 }
 
-uint8_t fat_firstDirectoryEntry(const fat_BootSector * boot, unsigned partitionOffset, unsigned startCluster, fetchData_t fetch, fat_DirectoryEntry* entry, char* fileName, unsigned nameLen)
+uint32_t fat_rootCluster(const fat_BootSector* boot)
+{
+    assert(boot != NULL);
+
+    return fat_getType(boot) == FAT32
+        ? ((fat32_BootSector*)boot->rest)->rootCluster                      // FAT32 root directory is a regular chain
+        : FAT_DIRECTORY_ROOT;                                               // FAT12/FAT16 have a fixed region
+}
+
+uint32_t fat_fatSize(const fat_BootSector* boot)
 {
-    _state.startCluster = -1;                                       // resets nextDirectoryEntry
-    return fat_nextDirectoryEntry(boot, startCluster, partitionOffset, fetch, entry, fileName, nameLen);
+    assert(boot != NULL);
+
+    return fat_sectorsPerFat(boot) * boot->bytesPerSector;
 }
 
-uint8_t fat_nextDirectoryEntry(const fat_BootSector * boot, unsigned partitionOffset, unsigned startCluster, fetchData_t fetch, fat_DirectoryEntry* entry, char* fileName, unsigned nameLen)
+uint8_t fat_readFat(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, uint8_t* table)
 {
     assert(boot != NULL);
     assert(fetch != NULL);
-    assert(entry != NULL);
+    assert(table != NULL);
+
+    FatType type = fat_getType(boot);
+    uint64_t lastCluster = fat_countOfClusters(boot) + 1ull;
+    uint64_t entryBytes = (type == FAT32) ? 4 : 2;                  // a FAT12 entry is read as two bytes too
+    uint64_t fatEnd = (type == FAT12)
+        ? lastCluster + lastCluster / 2 + entryBytes
+        : lastCluster * entryBytes + entryBytes;
+    if (fatEnd > fat_fatSize(boot))
+        return 0;                                                   // the FAT is too small for the clusters, the entries would be read past it
+
+    uint32_t address = fat_sectorToAddress(boot, partitionOffset, boot->reservedSectors);  // first FAT is the one that counts
+    return fetch(address, fat_fatSize(boot), (char*)table);
+}
+
+#ifndef FAT_NO_HEAP
+uint8_t* fat_loadFat(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch)
+{
+    assert(boot != NULL);
+    assert(fetch != NULL);
+
+    uint8_t* table = malloc(fat_fatSize(boot));
+    if (table == NULL)
+        return NULL;
 
-    if (_state.startCluster != startCluster || _state.startCluster == -1)       // different start cluster -> restart
+    if (!fat_readFat(boot, partitionOffset, fetch, table))
     {
-        memset(&_state, 0, sizeof(EntryState));
-        _state.startCluster = startCluster;
-        _state.currentCluster = startCluster;
-        _state.fatType = fat_getType(boot);
+        free(table);
+        return NULL;
     }
-    else                                                            // check if we have valid state
+
+    return table;
+}
+#endif
+
+uint32_t fat_fatEntry(FatType type, const uint8_t* table, unsigned cluster)
+{
+    assert(table != NULL);
+
+    return decodeFatEntry(type, table + fatOffsetOf(type, cluster), cluster);
+}
+
+void fat_setFatEntry(FatType type, uint8_t* table, unsigned cluster, uint32_t value)
+{
+    assert(table != NULL);
+
+    uint8_t* p = table + fatOffsetOf(type, cluster);
+    if (type == FAT12)
     {
-        if (_state.flags & EndOfTable)                              // end has been reached
-            return 0;
+        uint16_t packed = p[0] | (p[1] << 8);
+        packed = (cluster & 0x0001)
+            ? (packed & 0x000F) | (uint16_t)(value << 4)            // odd cluster number
+            : (packed & 0xF000) | (uint16_t)(value & 0x0FFF);       // even cluster number
+        p[0] = (uint8_t)packed;
+        p[1] = (uint8_t)(packed >> 8);
+    }
+    else if (type == FAT16)
+    {
+        p[0] = (uint8_t)value;
+        p[1] = (uint8_t)(value >> 8);
     }
+    else
+    {
+        value = (value & 0x0FFFFFFF) | ((uint32_t)p[3] << 24 & 0xF0000000);    // the top four bits are reserved
+        p[0] = (uint8_t)value;
+        p[1] = (uint8_t)(value >> 8);
+        p[2] = (uint8_t)(value >> 16);
+        p[3] = (uint8_t)(value >> 24);
+    }
+}
 
-    // TODO: Can't we use entry??
-    char entryBuf[sizeof(fat_DirectoryEntry)];  
-    char nameBuf[0xFF] = { 0 };                                     // buffer for the long file name
+uint8_t fat_isEndOfChain(FatType type, uint32_t entry)
+{
+    return (type == FAT12)
+        ? entry >= 0x0FF8
+        : (type == FAT16)
+            ? entry >= 0xFFF8
+            : entry >= 0x0FFFFFF8;
+}
 
-    fat_LongFileName* lfn = (fat_LongFileName*)&entryBuf;
-    fat_DirectoryEntry* dir = (fat_DirectoryEntry*)&entryBuf;
-    
-    for (;  (_state.fatType != FAT32 && _state.entryIndex < boot->rootEntries) ||   // for FAT12/FAT16 the root entries is a given
-            (_state.fatType == FAT32)                                               // FAT32 doesn't restrict this (could be as large as needed)
-        ; ++_state.entryIndex)                                                      // just follow the chain like any file :)
-    {   
-        unsigned clusterEntryIndex = _state.entryIndex;
-        if (_state.fatType == FAT32)
+uint32_t fat_nextClusterEntry(const fat_BootSector* boot, unsigned partitionOffset, unsigned cluster, fetchData_t fetch, uint8_t* eoc)
+{
+    assert(boot != NULL);
+    assert(fetch != NULL);
+
+    FatType type = fat_getType(boot);
+
+    assert( (type == FAT12 && cluster < 0x0FF8) ||
+            (type == FAT16 && cluster < 0xFFF8) ||
+            (type == FAT32 && cluster < 0x0FFFFFF8));
+
+    uint8_t raw[4];                                                 // just the entry, no sector buffer needed
+    uint32_t address = fat_sectorToAddress(boot, partitionOffset, boot->reservedSectors) + fatOffsetOf(type, cluster);
+    if (!fetch(address, (type == FAT32) ? 4 : 2, (char*)raw))
+        return -1;
+
+    uint32_t clusterEntry = decodeFatEntry(type, raw, cluster);
+    if (eoc)
+        *eoc = fat_isEndOfChain(type, clusterEntry);
+
+    return clusterEntry;
+}
+
+void fat_openDirectory(const fat_BootSector* boot, unsigned cluster, fat_DirectoryIterator* it)
+{
+    assert(boot != NULL);
+    assert(it != NULL);
+
+    if (cluster == FAT_DIRECTORY_ROOT)                              // ".." entries point to 0 as well
+        cluster = fat_rootCluster(boot);
+
+    memset(it, 0, sizeof(fat_DirectoryIterator));
+    it->startCluster = cluster;
+    it->currentCluster = cluster;
+}
+
+uint8_t fat_readDirectory(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, fat_DirectoryIterator* it, fat_DirectoryEntry* entry, char* fileName, unsigned nameLen)
+{
+    assert(boot != NULL);
+    assert(fetch != NULL);
+    assert(it != NULL);
+    assert(entry != NULL);
+
+    if (it->flags & EndOfTable)                                     // end has been reached
+        return 0;
+
+    FatType type = fat_getType(boot);
+    uint32_t entriesPerCluster = fat_entriesPerCluster(boot);
+    uint32_t lastCluster = fat_countOfClusters(boot) + 1;
+
+    fat_DirectoryEntry dir;
+    fat_LongFileName* lfn = (fat_LongFileName*)&dir;
+
+    it->longNameCount = 0;                                          // forget the name of the previous entry
+
+    for (;; ++it->entryIndex)
+    {
+        uint32_t address;
+        if (it->startCluster == FAT_DIRECTORY_ROOT)                 // for FAT12/FAT16 the root entries is a given
         {
-            clusterEntryIndex %= fat_entriesPerCluster(boot);
-            if (_state.entryIndex > 0 && clusterEntryIndex == 0)       // next cluster
+            if (it->entryIndex >= boot->rootEntries)
+                break;
+
+            address = fat_sectorToAddress(boot, partitionOffset, fat_rootDirectorySector(boot)) + 
+                sizeof(fat_DirectoryEntry) * it->entryIndex;
+        }
+        else                                                        // every other directory just follows the chain like any file :)
+        {
+            unsigned clusterEntryIndex = it->entryIndex % entriesPerCluster;
+            if (it->entryIndex > 0 && clusterEntryIndex == 0)       // next cluster
             {
-                if (_state.flags & EndOfChain)
+                uint8_t eoc = 0;
+                uint32_t next = 0;
+                if (it->chain != NULL)                              // clusters known up front
                 {
-                    _state.flags |= EndOfTable;
-                    return 0;
+                    if (it->entryIndex / entriesPerCluster < it->chainLength)
+                        next = it->chain[it->entryIndex / entriesPerCluster];
+                    else
+                        eoc = 1;
+                }
+                else if (it->table != NULL)                         // FAT in memory
+                {
+                    next = fat_fatEntry(type, it->table, it->currentCluster);
+                    eoc = fat_isEndOfChain(type, next);
+                }
+                else
+                    next = fat_nextClusterEntry(boot, partitionOffset, it->currentCluster, fetch, &eoc);
+
+                if (eoc || next < 2 || next > lastCluster)          // end of chain (or a broken one)
+                {
+                    it->flags |= EndOfChain;
+                    break;
                 }
 
-                uint8_t eoc;
-                _state.currentCluster = fat_nextClusterEntry(boot, partitionOffset, _state.currentCluster, fetch, &eoc);
-                if (eoc)
-                    _state.flags |= EndOfChain;
+                it->currentCluster = next;
             }
+            else if (it->currentCluster < 2 || it->currentCluster > lastCluster)
+                break;
+
+            address =                                               // calculates the address of where the entry is located
+                fat_clusterToAddress(boot, partitionOffset, it->currentCluster) +               // cluster offset
+                sizeof(fat_DirectoryEntry) * clusterEntryIndex;                                 // entry offset
         }
 
-        uint32_t address =                                          // calculates the address of where the entry is located
-            partitionOffset +                                                                   // base offset
-            fat_firstSectorOfCluster(boot, _state.currentCluster) * boot->bytesPerSector +      // cluster offset
-            sizeof(fat_DirectoryEntry) * clusterEntryIndex;                                     // entry offset
-        
-        if (!fetch(address, sizeof(fat_DirectoryEntry), entryBuf))   // reads the data
-            return 0;
+        if (it->buffer != NULL)                                     // reads a whole cluster (the root region in cluster sized parts)
+        {
+            uint32_t blockIndex = it->entryIndex % entriesPerCluster;
+            uint32_t blockAddress = address - blockIndex * sizeof(fat_DirectoryEntry);
+            if (it->bufferAddress != blockAddress)
+            {
+                uint32_t blockEntries = entriesPerCluster;
+                if (it->startCluster == FAT_DIRECTORY_ROOT && it->entryIndex - blockIndex + blockEntries > boot->rootEntries)
+                    blockEntries = boot->rootEntries - (it->entryIndex - blockIndex);
 
-        if (_state.flags & LfnDirectoryEntry)                       // after the long file name
-        {   
-            ++_state.entryIndex;
-            memcpy(entry, entryBuf, sizeof(fat_DirectoryEntry));
-            if (fileName != NULL)
-                strncpy(fileName, nameBuf, nameLen);
+                it->bufferAddress = 0;
+                if (!fetch(blockAddress, blockEntries * sizeof(fat_DirectoryEntry), (char*)it->buffer))
+                    return 0;
+                it->bufferAddress = blockAddress;
+            }
 
-            _state.flags &= ~LfnDirectoryEntry;
-            return 1;
+            memcpy(&dir, it->buffer + blockIndex * sizeof(fat_DirectoryEntry), sizeof(fat_DirectoryEntry));
         }
+        else if (!fetch(address, sizeof(fat_DirectoryEntry), (char*)&dir))  // reads the data
+            return 0;
 
-        if (dir->fileName[0] == 0)                                  // last entry
+        if (dir.fileName[0] == 0)                                   // last entry
+            break;
+        else if (dir.fileName[0] == 0xE5)                           // deleted entry
         {
-            _state.flags |= EndOfTable;
-            return 0;
-        }
-        else if (dir->fileName[0] == 0xE5)                          // deleted entry
+            it->longNameCount = 0;
             continue;                                               // goto the next
+        }
 
-        if (dir->fileAttributes != FAT_FILE_ATTR_LONG_NAME)         // just a short file name (8.3 notation)
+        if ((dir.fileAttributes & FAT_FILE_ATTR_LONG_NAME_MASK) == FAT_FILE_ATTR_LONG_NAME)
         {
-            ++_state.entryIndex;
-            memcpy(entry, entryBuf, sizeof(fat_DirectoryEntry));
+            uint8_t blockIndex = (lfn->ordinal & 0x1F) - 1;         // calculates which blocks 
+                                                                    // (every lfn is 13 bytes of the file name -> the block)
+            if (blockIndex >= FAT_LFN_MAX_SLOTS)                    // corrupt ordinal
+            {
+                it->longNameCount = 0;
+                continue;
+            }
 
-            fat_getFileName(nameBuf, dir);
-            if (fileName != NULL)
-                strncpy(fileName, nameBuf, nameLen);
+            if (lfn->ordinal & 0x40)                                // last block, comes first on disk
+                it->longNameCount = blockIndex + 1;
+            else if (blockIndex >= it->longNameCount || lfn->checksum != it->longName[it->longNameCount - 1].checksum)
+                it->longNameCount = 0;                              // belongs to another (orphaned) name
 
-            return 1;
+            if (it->longNameCount > 0)                              // kept raw, decoded only when the name is asked for
+                memcpy(&it->longName[blockIndex], lfn, sizeof(fat_LongFileName));
+            continue;
         }
 
-        uint8_t blockIndex = (lfn->ordinal & 0x0F) - 1;             // calculates which blocks 
-                                                                    // (every lfn is 13 bytes of the file name -> the block)
-        if (lfn->ordinal & 0x40)                                    // last block
-            nameBuf[(blockIndex + 1) * 13] = 0;                     // string termination
+        ++it->entryIndex;                                           // the short entry contains location and file date etc.
+        memcpy(entry, &dir, sizeof(fat_DirectoryEntry));
+
+        if (fileName != NULL && nameLen > 0)
+            fat_directoryFileName(it, entry, fileName, nameLen);
 
-        UCS2ToUTF8(nameBuf + blockIndex * 13, lfn);                 // extracts the filename block and convert it to UTF8 (char)
-        if (blockIndex == 0)                                        // after the first block is the usual DirectoryEntry which contains location and file date etc.
-            _state.flags |= LfnDirectoryEntry;
+        return 1;
     }
 
-    _state.flags |= EndOfTable;
+    it->flags |= EndOfTable;
     return 0;
 }
 
+void fat_directoryFileName(const fat_DirectoryIterator* it, const fat_DirectoryEntry* entry, char* fileName, unsigned nameLen)
+{
+    assert(it != NULL);
+    assert(entry != NULL);
+    assert(fileName != NULL && nameLen > 0);
+
+    uint8_t count = it->longNameCount;
+    if (count == 0 || it->longName[count - 1].checksum != fat_checksum(entry->fileName))
+    {
+        char shortName[13];                                         // just a short file name (8.3 notation)
+        fat_getFileName(shortName, entry);
+        strncpy(fileName, shortName, nameLen);
+        fileName[nameLen - 1] = 0;
+        return;
+    }
+
+    longNameToUtf8(it->longName, count, fileName, nameLen);
+}
+
+uint8_t fat_endOfDirectory(const fat_DirectoryIterator* it)
+{
+    assert(it != NULL);
+
+    return (it->flags & EndOfTable) != 0;
+}
+
+uint8_t fat_firstDirectoryEntry(const fat_BootSector * boot, unsigned partitionOffset, unsigned startCluster, fetchData_t fetch, fat_DirectoryEntry* entry, char* fileName, unsigned nameLen)
+{
+    _iteratorReset = 1;                                             // resets nextDirectoryEntry
+    return fat_nextDirectoryEntry(boot, partitionOffset, startCluster, fetch, entry, fileName, nameLen);
+}
+
+uint8_t fat_nextDirectoryEntry(const fat_BootSector * boot, unsigned partitionOffset, unsigned startCluster, fetchData_t fetch, fat_DirectoryEntry* entry, char* fileName, unsigned nameLen)
+{
+    assert(boot != NULL);
+
+    if (startCluster == FAT_DIRECTORY_ROOT)
+        startCluster = fat_rootCluster(boot);
+
+    if (_iteratorReset || _iterator.startCluster != startCluster)  // different start cluster -> restart
+    {
+        fat_openDirectory(boot, startCluster, &_iterator);
+        _iteratorReset = 0;
+    }
+
+    return fat_readDirectory(boot, partitionOffset, fetch, &_iterator, entry, fileName, nameLen);
+}
+
 uint8_t fat_compareFilename(const fat_DirectoryEntry* entry, const char* input)
 {
     assert(entry != NULL);
@@ -437,7 +671,7 @@ uint8_t fat_compareFilename(const fat_DirectoryEntry* entry, const char* input)
     return 1;														// completed the checks :)
 }
 
-uint8_t fat_checksum(uint8_t* name)
+uint8_t fat_checksum(const uint8_t* name)
 {
     uint8_t sum = 0;
 
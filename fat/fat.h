@@ -1,18 +1,33 @@
 #pragma once
 
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
 
+// Define FAT_NO_HEAP for targets without a heap: the driver (fat.c) then never calls malloc or free, the
+// bigger buffers come from the caller, i.e. out of a fat_Arena (arena.h). The tools built on top of the
+// driver (index, container, recover, walk, query, hash, diff, defrag, build, export, exfat, paged, trace, batch, extract, shared, bulk, cursor, dedup) need the heap and are left out of such builds.
+
 #ifdef _MSC_VER
 #define PACK( __declaration__ ) __pragma( pack(push, 1) ) __declaration__ __pragma( pack(pop) )
 #else
 #define PACK( __declaration__ ) __declaration__ __attribute__((__packed__))
 #endif
 
+// State the driver keeps between calls is per thread, so volumes can be read from several threads at
+// once. Builds without threads (FAT_NO_THREADS) or without a heap keep it in plain statics.
+#if defined(FAT_NO_THREADS) || defined(FAT_NO_HEAP)
+#define FAT_THREAD_LOCAL
+#elif defined(_MSC_VER)
+#define FAT_THREAD_LOCAL __declspec(thread)
+#else
+#define FAT_THREAD_LOCAL __thread
+#endif
+
 #define FAT_TYPE_NOTHING 0x00
 #define FAT_TYPE_12BIT 0x01
 #define FAT_TYPE_16BIT 0x04
@@ -157,26 +172,61 @@ struct fat_LongFileName
 	uint16_t ucs2_3[0x02];
 });
 
-typedef enum FatType FatType;
+#define FAT_DIRECTORY_ROOT 0x00
+#define FAT_LFN_MAX_LENGTH 0xFF
+#define FAT_LFN_MAX_SLOTS 0x14
+
 enum FatType
 {
 	FAT12,
 	FAT16,
-	FAT32
+	FAT32,
+	EXFAT                                                           // only recognized, the volume is read with exfat.h
 };
+typedef enum FatType FatType;
 
 // Fetches data from the device (i.e. file or hardware driver)
 typedef uint8_t(*fetchData_t)(unsigned address, unsigned count, char* out);
 
+// Stores data on the device, for the tools writing an image
+typedef uint8_t(*storeData_t)(unsigned address, unsigned count, const char* data);
+
+// State of a directory listing, one per open directory so they can be nested. After opening, table and
+// buffer can be set to avoid the small reads: the chain is then followed in a FAT read with fat_readFat
+// and the entries are read a whole cluster at once into buffer (fat_clusterSize bytes). When the clusters
+// of the directory are known (chain, in order) the FAT isn't read at all.
+typedef struct fat_DirectoryIterator fat_DirectoryIterator;
+struct fat_DirectoryIterator
+{
+	uint32_t startCluster;
+	uint32_t currentCluster;
+	uint32_t entryIndex;
+	uint8_t flags;
+	const uint8_t* table;                                           // optional
+	const uint32_t* chain;                                          // optional, chainLength clusters
+	uint32_t chainLength;
+	uint8_t* buffer;                                                // optional
+	uint32_t bufferAddress;                                         // address of the data in buffer, 0 when empty
+	fat_LongFileName longName[FAT_LFN_MAX_SLOTS];                   // raw long name of the last entry read
+	uint8_t longNameCount;                                          // slots in longName, 0 without a long name
+};
+
 // Gets date from fat date format
 void fat_getDate(uint16_t date, uint8_t* day, uint8_t* month, uint16_t* year);
 
 // Gets time from fat time format
 void fat_getTime(uint16_t time, uint8_t* seconds, uint8_t* minute, uint8_t* hour);
 
-// Gets filename out of a short directory entry, fileName length must be >= 12 
+// Gets filename out of a short directory entry, fileName length must be >= 13
 void fat_getFileName(char* fileName, const fat_DirectoryEntry* entry);
 
+// Converts count UTF-16 units (up to a 0x0000) to UTF-8, a character which doesn't fit in outLen with the
+// termination ends the string. Returns the bytes written without the termination.
+unsigned fat_utf16ToUtf8(const uint16_t* units, unsigned count, char* out, unsigned outLen);
+
+// Gets the 13 characters of a long file name entry, fileName length must be >= 13
+void fat_getLongFileNamePart(char* fileName, const fat_LongFileName* lfn);
+
 // Calculate sectors per fat
 uint32_t fat_sectorsPerFat(const fat_BootSector* boot);
 
@@ -192,6 +242,9 @@ uint32_t fat_clusterToAddress(const fat_BootSector* boot, unsigned partitionOffs
 // Gets the amount of sectors used by root directory
 uint32_t fat_numberOfRootDirSectors(const fat_BootSector* boot);
 
+// Finds the first sector of the fixed root directory (FAT12/FAT16)
+uint32_t fat_rootDirectorySector(const fat_BootSector* boot);
+
 // Finds the first data sector
 uint32_t fat_firstDataSector(const fat_BootSector* boot);
 
@@ -206,11 +259,34 @@ uint32_t fat_countOfClusters(const fat_BootSector* boot);
 
 uint32_t fat_clusterSize(const fat_BootSector* boot);
 
-uint8_t fat_entriesPerCluster(const fat_BootSector* boot);
+uint32_t fat_entriesPerCluster(const fat_BootSector* boot);
 
-// Checks what FAT type bootSector is (FAT12, FAT16, FAT32)
+// Checks what FAT type bootSector is (FAT12, FAT16, FAT32 or EXFAT)
 FatType fat_getType(const fat_BootSector* boot);
 
+// Gets the cluster of the root directory
+uint32_t fat_rootCluster(const fat_BootSector* boot);
+
+// Gets the size of one FAT in bytes
+uint32_t fat_fatSize(const fat_BootSector* boot);
+
+// Reads the first FAT into table, which holds fat_fatSize bytes. Fails when the FAT can't hold an entry for every cluster
+uint8_t fat_readFat(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, uint8_t* table);
+
+#ifndef FAT_NO_HEAP
+// Reads the first FAT into memory (fat_fatSize bytes), free the result when done
+uint8_t* fat_loadFat(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch);
+#endif
+
+// Decodes the entry of cluster out of an in memory copy of the FAT
+uint32_t fat_fatEntry(FatType type, const uint8_t* table, unsigned cluster);
+
+// Encodes value as the entry of cluster into an in memory copy of the FAT
+void fat_setFatEntry(FatType type, uint8_t* table, unsigned cluster, uint32_t value);
+
+// Checks if a FAT entry marks the end of a chain
+uint8_t fat_isEndOfChain(FatType type, uint32_t entry);
+
 // Follows the cluster chain, check eoc if End Of Cluster has been reached
 uint32_t fat_nextClusterEntry(const fat_BootSector* boot, unsigned partitionOffset, unsigned cluster, fetchData_t fetch, uint8_t* eoc);
 
@@ -220,6 +296,19 @@ uint8_t fat_firstDirectoryEntry(const fat_BootSector * boot, unsigned partitionO
 // Returns the next directory entry (cluster chaining is built in)
 uint8_t fat_nextDirectoryEntry(const fat_BootSector * boot, unsigned partitionOffset, unsigned cluster, fetchData_t fetch, fat_DirectoryEntry* entry, char* fileName, unsigned nameLen);
 
+// Opens the directory at cluster for reading, use FAT_DIRECTORY_ROOT for the root directory
+void fat_openDirectory(const fat_BootSector* boot, unsigned cluster, fat_DirectoryIterator* it);
+
+// Reads the next entry of an opened directory, returns 0 when the end has been reached
+uint8_t fat_readDirectory(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, fat_DirectoryIterator* it, fat_DirectoryEntry* entry, char* fileName, unsigned nameLen);
+
+// Gets the name of the entry fat_readDirectory just returned, the long name is only decoded here so
+// reading with fileName NULL and asking the name afterwards skips the work for entries not needed
+void fat_directoryFileName(const fat_DirectoryIterator* it, const fat_DirectoryEntry* entry, char* fileName, unsigned nameLen);
+
+// Checks if fat_readDirectory stopped because the end was reached, 0 means it failed to fetch
+uint8_t fat_endOfDirectory(const fat_DirectoryIterator* it);
+
 // Fetches the next partition, returns the partition offset, use eop to check if end of partitions is reached
 uint32_t fat_nextPartitionSector(fetchData_t fetchData, fat_BootSector* boot, uint8_t* eop);
 
@@ -227,4 +316,4 @@ uint32_t fat_nextPartitionSector(fetchData_t fetchData, fat_BootSector* boot, ui
 uint8_t fat_compareFilename(const fat_DirectoryEntry* entry, const char* input);
 
 // Calculates checksum of long file name
-uint8_t fat_checksum(uint8_t* name);
\ No newline at end of file
+uint8_t fat_checksum(const uint8_t* name);
\ No newline at end of file
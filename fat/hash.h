@@ -0,0 +1,68 @@
+#pragma once
+
+#include "fat.h"
+#include "walk.h"
+
+#ifdef FAT_NO_HEAP
+#error "hashing reads into a pool of heap blocks, leave hash.c out of FAT_NO_HEAP builds"
+#endif
+
+// SHA-256 and CRC32 of every file on the volume. Reading and hashing are separate stages: the walk
+// threads follow the chains and read each file in blocks of up to FAT_HASH_BLOCK_SIZE (contiguous
+// clusters in one fetch), the hash threads take those blocks from a bounded queue. While a block is
+// being hashed the next ones are already being read, and different files go to different hash threads.
+// The blocks of one file always go to the same hash thread so they are hashed in order.
+
+#define FAT_SHA256_SIZE 0x20
+#define FAT_HASH_BLOCK_SIZE 0x80000                                 // most bytes read by one fetch
+#define FAT_HASH_BLOCKS_PER_THREAD 0x04                             // size of the queue, and the memory used
+
+typedef struct fat_Sha256 fat_Sha256;
+struct fat_Sha256
+{
+	uint32_t state[8];
+	uint64_t length;                                                // bytes hashed so far
+	uint8_t buffer[64];                                             // partial block
+};
+
+// XXH64: four lanes of 8 byte words which don't depend on each other, so the processor runs them side by
+// side. Not cryptographic, but many GB/s per core, for finding equal data (see dedup.h).
+typedef struct fat_Xxh64 fat_Xxh64;
+struct fat_Xxh64
+{
+	uint64_t lanes[4];
+	uint64_t seed;
+	uint64_t length;                                                // bytes hashed so far
+	uint8_t buffer[32];                                             // partial stripe
+	uint32_t buffered;
+};
+
+typedef struct fat_FileHash fat_FileHash;
+struct fat_FileHash
+{
+	const char* path;                                               // from the root, separated by slashes
+	fat_DirectoryEntry entry;
+	uint8_t sha256[FAT_SHA256_SIZE];
+	uint32_t crc32;
+	uint8_t complete;                                               // 0 when the chain is shorter than the file or a read failed
+};
+
+// Called for every file hashed, never from two threads at once. Return 0 to stop.
+typedef uint8_t(*fileHashed_t)(const fat_FileHash* hash, void* context);
+
+void fat_sha256Init(fat_Sha256* sha);
+void fat_sha256Update(fat_Sha256* sha, const void* data, size_t length);
+void fat_sha256Final(fat_Sha256* sha, uint8_t* digest);
+
+// Continues crc (0 to start) over data, the usual CRC32 of zip and PNG
+uint32_t fat_crc32(uint32_t crc, const void* data, size_t length);
+
+void fat_xxh64Init(fat_Xxh64* xxh, uint64_t seed);
+void fat_xxh64Update(fat_Xxh64* xxh, const void* data, size_t length);
+uint64_t fat_xxh64Final(const fat_Xxh64* xxh);
+
+// XXH64 of length bytes at once
+uint64_t fat_xxh64(const void* data, size_t length, uint64_t seed);
+
+// Hashes every file of the volume with threads readers and as many hashers (0 is one each per processor)
+uint8_t fat_hashFiles(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, unsigned threads, fileHashed_t hashed, void* context);
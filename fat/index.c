@@ -0,0 +1,536 @@
+#include "index.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// The index is built breadth first: every directory appends all of its children before the next
+// directory is visited, this keeps siblings together so a listing is a single slice of nodes.
+
+typedef struct IndexBuilder IndexBuilder;
+struct IndexBuilder
+{
+    FatType type;
+    uint32_t countOfClusters;
+    const uint8_t* fat;
+
+    fat_IndexNode* nodes;
+    uint32_t nodeCount, nodeCapacity;
+    fat_Extent* extents;
+    uint32_t extentCount, extentCapacity;
+    char* names;
+    uint32_t nameSize, nameCapacity;
+    uint8_t* bitmap;
+    uint32_t bitmapSize;
+    uint8_t* visited;                                               // directory clusters already listed (loops)
+};
+
+static uint64_t fnv1a(uint64_t hash, const uint8_t* data, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= data[i];
+        hash *= 0x00000100000001B3ULL;
+    }
+
+    return hash;
+}
+
+static uint64_t fingerprintOf(const fat_BootSector* boot, const uint8_t* fat)
+{
+    uint64_t hash = fnv1a(0xCBF29CE484222325ULL, (const uint8_t*)boot, sizeof(fat_BootSector));
+    return fnv1a(hash, fat, fat_sectorsPerFat(boot) * boot->bytesPerSector);
+}
+
+static uint8_t grow(void** buffer, uint32_t* capacity, uint32_t needed, size_t elementSize)
+{
+    if (needed <= *capacity)
+        return 1;
+
+    uint32_t newCapacity = *capacity ? *capacity : 64;
+    while (newCapacity < needed)
+        newCapacity *= 2;
+
+    void* p = realloc(*buffer, newCapacity * elementSize);
+    if (p == NULL)
+        return 0;
+
+    *buffer = p;
+    *capacity = newCapacity;
+    return 1;
+}
+
+static uint8_t appendName(IndexBuilder* b, const char* name, uint32_t* offset)
+{
+    uint32_t length = (uint32_t)strlen(name) + 1;
+    if (!grow((void**)&b->names, &b->nameCapacity, b->nameSize + length, 1))
+        return 0;
+
+    memcpy(b->names + b->nameSize, name, length);
+    *offset = b->nameSize;
+    b->nameSize += length;
+    return 1;
+}
+
+static uint8_t appendExtents(IndexBuilder* b, uint32_t cluster, uint32_t* firstExtent, uint32_t* extentCount)
+{
+    uint32_t lastCluster = b->countOfClusters + 1, steps = 0;
+
+    *firstExtent = b->extentCount;
+    *extentCount = 0;
+    while (cluster >= 2 && cluster <= lastCluster && steps++ < b->countOfClusters)   // steps guards against loops
+    {
+        fat_Extent* last = (*extentCount > 0) ? &b->extents[b->extentCount - 1] : NULL;
+        if (last != NULL && last->cluster + last->count == cluster)
+            ++last->count;                                          // continues the current run
+        else
+        {
+            if (!grow((void**)&b->extents, &b->extentCapacity, b->extentCount + 1, sizeof(fat_Extent)))
+                return 0;
+
+            b->extents[b->extentCount].cluster = cluster;
+            b->extents[b->extentCount].count = 1;
+            ++b->extentCount;
+            ++*extentCount;
+        }
+
+        uint32_t next = fat_fatEntry(b->type, b->fat, cluster);
+        if (fat_isEndOfChain(b->type, next))
+            break;
+
+        cluster = next;
+    }
+
+    return 1;
+}
+
+static uint8_t appendNode(IndexBuilder* b, uint32_t parent, const fat_DirectoryEntry* entry, const char* name)
+{
+    if (!grow((void**)&b->nodes, &b->nodeCapacity, b->nodeCount + 1, sizeof(fat_IndexNode)))
+        return 0;
+
+    fat_IndexNode* node = b->nodes + b->nodeCount;
+    memset(node, 0, sizeof(fat_IndexNode));
+    memcpy(&node->entry, entry, sizeof(fat_DirectoryEntry));
+    node->parent = parent;
+    node->firstChild = FAT_INDEX_NONE;
+
+    uint32_t nameOffset, firstExtent, extentCount;                  // the node is packed, no pointers into it
+    if (!appendName(b, name, &nameOffset))
+        return 0;
+
+    uint32_t cluster = entry->clusterHigh << 16 | entry->clusterLow;
+    if (!appendExtents(b, cluster, &firstExtent, &extentCount))
+        return 0;
+
+    node->name = nameOffset;
+    node->firstExtent = firstExtent;
+    node->extentCount = extentCount;
+    ++b->nodeCount;
+    return 1;
+}
+
+static uint8_t listDirectory(IndexBuilder* b, const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, uint32_t nodeIndex)
+{
+    const fat_DirectoryEntry* dir = &b->nodes[nodeIndex].entry;
+    uint32_t cluster = dir->clusterHigh << 16 | dir->clusterLow;
+
+    if (nodeIndex > 0)                                              // root can't be a loop
+    {
+        if (cluster < 2 || cluster > b->countOfClusters + 1 || (b->visited[cluster / 8] & (1 << (cluster % 8))))
+            return 1;
+
+        b->visited[cluster / 8] |= 1 << (cluster % 8);
+    }
+
+    fat_DirectoryIterator it;
+    fat_DirectoryEntry entry;
+    char name[FAT_LFN_MAX_LENGTH + 1];
+
+    fat_openDirectory(boot, nodeIndex > 0 ? cluster : FAT_DIRECTORY_ROOT, &it);
+
+    uint32_t firstChild = b->nodeCount;
+    while (fat_readDirectory(boot, partitionOffset, fetch, &it, &entry, name, sizeof(name)))
+    {
+        if (entry.fileName[0] == '.')                               // skip . and ..
+            continue;
+
+        if (!appendNode(b, nodeIndex, &entry, name))
+            return 0;
+    }
+
+    b->nodes[nodeIndex].firstChild = (b->nodeCount > firstChild) ? firstChild : FAT_INDEX_NONE;
+    b->nodes[nodeIndex].childCount = b->nodeCount - firstChild;
+    return 1;
+}
+
+static uint8_t scanVolume(IndexBuilder* b, const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch)
+{
+    fat_DirectoryEntry root;                                        // the root has no entry of its own
+    memset(&root, 0, sizeof(root));
+    memset(root.fileName, ' ', sizeof(root.fileName) + sizeof(root.extension));
+    root.fileAttributes = FAT_FILE_ATTR_DIRECTORY;
+
+    uint32_t rootCluster = fat_rootCluster(boot);
+    root.clusterHigh = rootCluster >> 16;
+    root.clusterLow = rootCluster & 0xFFFF;
+
+    if (!appendNode(b, FAT_INDEX_NONE, &root, ""))
+        return 0;
+
+    for (uint32_t i = 0; i < b->nodeCount; ++i)                     // nodes grow while walking -> breadth first
+    {
+        const fat_DirectoryEntry* entry = &b->nodes[i].entry;
+        if (!(entry->fileAttributes & FAT_FILE_ATTR_DIRECTORY) || (entry->fileAttributes & FAT_FILE_ATTR_VOLUME))
+            continue;
+
+        if (!listDirectory(b, boot, partitionOffset, fetch, i))
+            return 0;
+    }
+
+    return 1;
+}
+
+static uint32_t buildBitmap(IndexBuilder* b)
+{
+    uint32_t freeClusters = 0;
+    for (uint32_t cluster = 2; cluster <= b->countOfClusters + 1; ++cluster)
+    {
+        if (fat_fatEntry(b->type, b->fat, cluster) != 0)
+            b->bitmap[cluster / 8] |= 1 << (cluster % 8);
+        else
+            ++freeClusters;
+    }
+
+    return freeClusters;
+}
+
+static uint32_t align8(uint32_t value)
+{
+    return (value + 7) & ~7u;
+}
+
+// Lays the sections out behind the header, each one 8 byte aligned
+static void layoutIndex(const IndexBuilder* b, uint64_t fingerprint, unsigned partitionOffset, uint32_t freeClusters, fat_IndexHeader* header)
+{
+    memset(header, 0, sizeof(fat_IndexHeader));
+    header->magic = FAT_INDEX_MAGIC;
+    header->version = FAT_INDEX_VERSION;
+    header->fingerprint = fingerprint;
+    header->partitionOffset = partitionOffset;
+    header->countOfClusters = b->countOfClusters;
+    header->freeClusters = freeClusters;
+
+    header->nodeCount = b->nodeCount;
+    header->nodeOffset = align8(sizeof(fat_IndexHeader));
+    header->extentCount = b->extentCount;
+    header->extentOffset = align8(header->nodeOffset + b->nodeCount * sizeof(fat_IndexNode));
+    header->nameSize = b->nameSize;
+    header->nameOffset = align8(header->extentOffset + b->extentCount * sizeof(fat_Extent));
+    header->bitmapSize = b->bitmapSize;
+    header->bitmapOffset = align8(header->nameOffset + b->nameSize);
+    header->fileSize = header->bitmapOffset + b->bitmapSize;
+}
+
+static void copySection(uint8_t* out, uint32_t offset, const void* section, size_t size)
+{
+    if (size > 0)
+        memcpy(out + offset, section, size);
+}
+
+uint64_t fat_indexFingerprintFat(const fat_BootSector* boot, const uint8_t* fat)
+{
+    assert(boot != NULL);
+    assert(fat != NULL);
+
+    return fingerprintOf(boot, fat);
+}
+
+uint8_t fat_indexFingerprint(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, uint64_t* fingerprint)
+{
+    assert(boot != NULL);
+    assert(fetch != NULL);
+    assert(fingerprint != NULL);
+
+    uint8_t* fat = fat_loadFat(boot, partitionOffset, fetch);
+    if (fat == NULL)
+        return 0;
+
+    *fingerprint = fingerprintOf(boot, fat);
+    free(fat);
+    return 1;
+}
+
+uint8_t fat_indexBuildImage(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, const uint8_t* fat, void** data, uint32_t* size)
+{
+    assert(boot != NULL);
+    assert(fetch != NULL);
+    assert(fat != NULL);
+    assert(data != NULL);
+    assert(size != NULL);
+
+    IndexBuilder b;
+    memset(&b, 0, sizeof(b));
+    b.type = fat_getType(boot);
+    b.countOfClusters = fat_countOfClusters(boot);
+    b.bitmapSize = (b.countOfClusters + 2 + 7) / 8;
+    b.fat = fat;
+
+    *data = NULL;
+    b.bitmap = calloc(b.bitmapSize, 1);
+    b.visited = calloc(b.bitmapSize, 1);
+
+    if (b.bitmap != NULL && b.visited != NULL && scanVolume(&b, boot, partitionOffset, fetch))
+    {
+        fat_IndexHeader header;
+        layoutIndex(&b, fingerprintOf(boot, fat), partitionOffset, buildBitmap(&b), &header);
+
+        uint8_t* out = calloc(header.fileSize, 1);                  // the padding stays zero
+        if (out != NULL)
+        {
+            memcpy(out, &header, sizeof(header));
+            copySection(out, header.nodeOffset, b.nodes, b.nodeCount * sizeof(fat_IndexNode));
+            copySection(out, header.extentOffset, b.extents, b.extentCount * sizeof(fat_Extent));
+            copySection(out, header.nameOffset, b.names, b.nameSize);
+            copySection(out, header.bitmapOffset, b.bitmap, b.bitmapSize);
+            *data = out;
+            *size = header.fileSize;
+        }
+    }
+
+    free(b.nodes);
+    free(b.extents);
+    free(b.names);
+    free(b.bitmap);
+    free(b.visited);
+    return *data != NULL;
+}
+
+static uint8_t writeIndex(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, const uint8_t* fat, const char* path)
+{
+    void* data;
+    uint32_t size;
+    if (!fat_indexBuildImage(boot, partitionOffset, fetch, fat, &data, &size))
+        return 0;
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        free(data);
+        return 0;
+    }
+
+    uint8_t ok = fwrite(data, size, 1, file) == 1;
+    ok &= fclose(file) == 0;
+    free(data);
+    return ok;
+}
+
+uint8_t fat_indexBuild(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, const char* path)
+{
+    assert(boot != NULL);
+    assert(fetch != NULL);
+    assert(path != NULL);
+
+    uint8_t* fat = fat_loadFat(boot, partitionOffset, fetch);
+    if (fat == NULL)
+        return 0;
+
+    uint8_t ok = writeIndex(boot, partitionOffset, fetch, fat, path);
+    free(fat);
+    return ok;
+}
+
+static void* mapFile(const char* path, size_t* size, void** mapping)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    LARGE_INTEGER fileSize;
+    HANDLE map = NULL;
+    void* data = NULL;
+    if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+        map = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (map != NULL)
+        data = MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+
+    CloseHandle(file);                                              // the mapping keeps the file open
+    if (data == NULL)
+    {
+        if (map != NULL)
+            CloseHandle(map);
+        return NULL;
+    }
+
+    *size = (size_t)fileSize.QuadPart;
+    *mapping = map;
+    return data;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    close(fd);                                                      // the mapping keeps the file open
+    if (data == MAP_FAILED)
+        return NULL;
+
+    *size = (size_t)st.st_size;
+    *mapping = NULL;
+    return data;
+#endif
+}
+
+static void unmapFile(void* data, size_t size, void* mapping)
+{
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(data);
+    CloseHandle((HANDLE)mapping);
+#else
+    (void)mapping;
+    munmap(data, size);
+#endif
+}
+
+static uint8_t validSection(size_t size, uint32_t offset, uint64_t length)
+{
+    return offset <= size && length <= size - offset && offset >= sizeof(fat_IndexHeader);
+}
+
+// Every reference of every node stays inside its section, so walking the tree can't leave the index
+static uint8_t validNodes(const fat_IndexHeader* header, const fat_IndexNode* nodes)
+{
+    for (uint32_t i = 0; i < header->nodeCount; ++i)
+    {
+        const fat_IndexNode* node = &nodes[i];
+        uint8_t valid = (node->firstChild == FAT_INDEX_NONE)
+            ? node->childCount == 0
+            : node->firstChild < header->nodeCount && node->childCount <= header->nodeCount - node->firstChild;
+
+        valid = valid && (node->parent == FAT_INDEX_NONE || node->parent < header->nodeCount) &&
+            node->firstExtent <= header->extentCount && node->extentCount <= header->extentCount - node->firstExtent &&
+            node->name < header->nameSize;
+        if (!valid)
+            return 0;
+    }
+
+    return 1;
+}
+
+uint8_t fat_indexAttach(const void* data, size_t size, uint64_t fingerprint, fat_Index* index)
+{
+    assert(data != NULL);
+    assert(index != NULL);
+
+    memset(index, 0, sizeof(fat_Index));
+
+    const fat_IndexHeader* header = data;
+    uint8_t valid = size >= sizeof(fat_IndexHeader) &&
+        header->magic == FAT_INDEX_MAGIC &&
+        header->version == FAT_INDEX_VERSION &&
+        header->fingerprint == fingerprint &&
+        header->fileSize == size &&
+        validSection(size, header->nodeOffset, (uint64_t)header->nodeCount * sizeof(fat_IndexNode)) &&
+        validSection(size, header->extentOffset, (uint64_t)header->extentCount * sizeof(fat_Extent)) &&
+        validSection(size, header->nameOffset, header->nameSize) &&
+        validSection(size, header->bitmapOffset, header->bitmapSize) &&
+        header->nodeCount > 0 && header->nameSize > 0 &&
+        header->bitmapSize >= (header->countOfClusters + 2 + 7) / 8;
+
+    const uint8_t* base = data;
+    valid = valid && base[header->nameOffset + header->nameSize - 1] == '\0' &&   // the last name ends inside the section
+        validNodes(header, (const fat_IndexNode*)(base + header->nodeOffset));
+
+    if (!valid)                                                     // stale or damaged -> caller rebuilds
+        return 0;
+
+    index->header = header;
+    index->nodes = (const fat_IndexNode*)(base + header->nodeOffset);
+    index->extents = (const fat_Extent*)(base + header->extentOffset);
+    index->names = (const char*)(base + header->nameOffset);
+    index->bitmap = base + header->bitmapOffset;
+    return 1;
+}
+
+uint8_t fat_indexOpen(const char* path, uint64_t fingerprint, fat_Index* index)
+{
+    assert(path != NULL);
+    assert(index != NULL);
+
+    size_t size;
+    void* mapping;
+    void* data = mapFile(path, &size, &mapping);
+    if (data == NULL)
+    {
+        memset(index, 0, sizeof(fat_Index));
+        return 0;
+    }
+
+    if (!fat_indexAttach(data, size, fingerprint, index))
+    {
+        unmapFile(data, size, mapping);
+        return 0;
+    }
+
+    index->data = data;                                             // unmapped by fat_indexClose
+    index->size = size;
+    index->mapping = mapping;
+    return 1;
+}
+
+uint8_t fat_indexLoad(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, const char* path, fat_Index* index)
+{
+    uint8_t* fat = fat_loadFat(boot, partitionOffset, fetch);       // for the fingerprint and a rebuild alike
+    if (fat == NULL)
+        return 0;
+
+    uint64_t fingerprint = fingerprintOf(boot, fat);
+    uint8_t ok = fat_indexOpen(path, fingerprint, index) ||
+        (writeIndex(boot, partitionOffset, fetch, fat, path) &&     // falls back to the full scan
+        fat_indexOpen(path, fingerprint, index));
+
+    free(fat);
+    return ok;
+}
+
+void fat_indexClose(fat_Index* index)
+{
+    assert(index != NULL);
+
+    if (index->data != NULL)
+        unmapFile(index->data, index->size, index->mapping);
+
+    memset(index, 0, sizeof(fat_Index));
+}
+
+const char* fat_indexName(const fat_Index* index, const fat_IndexNode* node)
+{
+    assert(index != NULL);
+    assert(node != NULL);
+
+    return (node->name < index->header->nameSize)
+        ? index->names + node->name
+        : "";
+}
+
+uint8_t fat_indexIsAllocated(const fat_Index* index, uint32_t cluster)
+{
+    assert(index != NULL);
+
+    if (cluster / 8 >= index->header->bitmapSize)
+        return 0;
+
+    return (index->bitmap[cluster / 8] >> (cluster % 8)) & 1;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "fat.h"
+
+#ifdef FAT_NO_HEAP
+#error "the index is built on the heap, leave index.c out of FAT_NO_HEAP builds"
+#endif
+
+// Sidecar index of a mounted volume: the directory tree, the extents of every chain and the
+// allocation bitmap. The file is flat (offsets only, no pointers) so it can be mapped as is.
+
+#define FAT_INDEX_MAGIC 0x58444946                                  // "FIDX"
+#define FAT_INDEX_VERSION 0x01
+#define FAT_INDEX_NONE 0xFFFFFFFF
+
+typedef struct fat_IndexHeader fat_IndexHeader;
+PACK(
+struct fat_IndexHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t fingerprint;
+	uint32_t partitionOffset;
+	uint32_t countOfClusters;
+	uint32_t nodeCount;
+	uint32_t nodeOffset;
+	uint32_t extentCount;
+	uint32_t extentOffset;
+	uint32_t nameSize;
+	uint32_t nameOffset;
+	uint32_t bitmapSize;
+	uint32_t bitmapOffset;
+	uint32_t freeClusters;
+	uint32_t fileSize;
+});
+
+// One node per directory entry, children of a directory are stored next to each other
+typedef struct fat_IndexNode fat_IndexNode;
+PACK(
+struct fat_IndexNode
+{
+	fat_DirectoryEntry entry;
+	uint32_t parent;
+	uint32_t firstChild;
+	uint32_t childCount;
+	uint32_t name;
+	uint32_t firstExtent;
+	uint32_t extentCount;
+});
+
+// Run of consecutive clusters
+typedef struct fat_Extent fat_Extent;
+PACK(
+struct fat_Extent
+{
+	uint32_t cluster;
+	uint32_t count;
+});
+
+typedef struct fat_Index fat_Index;
+struct fat_Index
+{
+	const fat_IndexHeader* header;
+	const fat_IndexNode* nodes;
+	const fat_Extent* extents;
+	const char* names;
+	const uint8_t* bitmap;
+
+	void* data;
+	size_t size;
+	void* mapping;
+};
+
+// Calculates the fingerprint of the volume out of the boot sector and the FAT
+uint8_t fat_indexFingerprint(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, uint64_t* fingerprint);
+
+// Calculates the fingerprint out of the boot sector and a FAT loaded with fat_loadFat
+uint64_t fat_indexFingerprintFat(const fat_BootSector* boot, const uint8_t* fat);
+
+// Scans the whole volume and builds the index in memory, fat is loaded with fat_loadFat. Free *data when done.
+uint8_t fat_indexBuildImage(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, const uint8_t* fat, void** data, uint32_t* size);
+
+// Scans the whole volume and writes the index to path
+uint8_t fat_indexBuild(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, const char* path);
+
+// Maps the index at path, fails if it is missing, damaged or doesn't match fingerprint
+uint8_t fat_indexOpen(const char* path, uint64_t fingerprint, fat_Index* index);
+
+// Sets index up over size bytes at data which the caller keeps mapped, fails if they aren't an index of fingerprint.
+// fat_indexClose leaves data alone.
+uint8_t fat_indexAttach(const void* data, size_t size, uint64_t fingerprint, fat_Index* index);
+
+// Maps the index at path, (re)builds it first when the volume has been changed
+uint8_t fat_indexLoad(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, const char* path, fat_Index* index);
+
+// Unmaps the index
+void fat_indexClose(fat_Index* index);
+
+// Gets the name of a node
+const char* fat_indexName(const fat_Index* index, const fat_IndexNode* node);
+
+// Checks if cluster is allocated according to the bitmap
+uint8_t fat_indexIsAllocated(const fat_Index* index, uint32_t cluster);
@@ -0,0 +1,384 @@
+#include "paged.h"
+
+#define LINEAR_RUNS 0x08                                            // fewer runs are searched one by one
+
+// Bytes of count FAT entries, the first one of a page is always an even cluster
+static uint32_t entryBytes(FatType type, uint32_t count)
+{
+    return (type == FAT12)
+        ? (count * 3 + 1) / 2
+        : (type == FAT16)
+            ? count * 2
+            : count * 4;
+}
+
+static uint32_t pageEntries(const fat_PagedFat* paged, uint32_t page)
+{
+    uint32_t first = page * FAT_PAGE_ENTRIES;
+    return (paged->entryCount - first < FAT_PAGE_ENTRIES) ? paged->entryCount - first : FAT_PAGE_ENTRIES;
+}
+
+// Fetches the entries of page and decodes them in place, entries holds FAT_PAGE_ENTRIES. The decoding runs
+// backwards so an entry is only written over bytes of entries already decoded.
+static uint8_t readPage(const fat_PagedFat* paged, uint32_t page, uint32_t* entries)
+{
+    uint32_t count = pageEntries(paged, page);
+    uint32_t first = page * FAT_PAGE_ENTRIES;
+    uint32_t address = fat_sectorToAddress(paged->boot, paged->partitionOffset, paged->boot->reservedSectors) + entryBytes(paged->type, first);
+    if (!paged->fetch(address, entryBytes(paged->type, count), (char*)entries))
+        return 0;
+
+    for (uint32_t i = count; i-- > 0;)
+        entries[i] = fat_fatEntry(paged->type, (const uint8_t*)entries, i);
+    return 1;
+}
+
+// Cuts count decoded entries in runs, returns the count of runs or FAT_PAGE_IRREGULAR when there are too many
+static uint16_t buildRuns(const uint32_t* entries, uint32_t count, fat_FatRun* runs)
+{
+    uint32_t runCount = 0;
+    for (uint32_t i = 0; i < count;)
+    {
+        if (runCount == FAT_PAGE_MAX_RUNS)
+            return FAT_PAGE_IRREGULAR;
+
+        uint32_t start = i++;
+        uint32_t value = entries[start];
+        if (i < count && entries[i] == value + 1)
+        {
+            while (i < count && entries[i] == entries[i - 1] + 1)
+                ++i;
+            value |= FAT_RUN_SEQUENTIAL;
+        }
+        else
+        {
+            while (i < count && entries[i] == value)
+                ++i;
+        }
+
+        runs[runCount].start = (uint16_t)start;
+        runs[runCount].count = (uint16_t)(i - start);
+        runs[runCount].value = value;
+        ++runCount;
+    }
+
+    return (uint16_t)runCount;
+}
+
+static const fat_FatRun* findRun(const fat_FatPage* page, uint32_t index)
+{
+    const fat_FatRun* runs = page->runs;
+    if (page->runCount <= LINEAR_RUNS)
+    {
+        while (index >= (uint32_t)runs->start + runs->count)
+            ++runs;
+        return runs;
+    }
+
+    uint32_t low = 0, high = page->runCount - 1u;
+    while (low < high)
+    {
+        uint32_t middle = (low + high + 1) / 2;
+        if (runs[middle].start <= index)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    return &runs[low];
+}
+
+static uint32_t runEntry(const fat_FatRun* run, uint32_t index)
+{
+    return (run->value & FAT_RUN_SEQUENTIAL)
+        ? (run->value & ~FAT_RUN_SEQUENTIAL) + (index - run->start)
+        : run->value;
+}
+
+uint8_t fat_pageCacheInit(fat_PageCache* cache, uint64_t budget)
+{
+    assert(cache != NULL);
+
+    memset(cache, 0, sizeof(fat_PageCache));
+    uint64_t slotCount = budget / (FAT_PAGE_ENTRIES * sizeof(uint32_t));
+    cache->slotCount = (slotCount == 0) ? 1 : (slotCount > 0xFFFFFFFE) ? 0xFFFFFFFE : (uint32_t)slotCount;
+    cache->slots = calloc(cache->slotCount, sizeof(fat_PageCacheSlot));
+    if (cache->slots == NULL)
+        return 0;
+
+#ifndef FAT_NO_THREADS
+    fat_mutexInit(&cache->lock);
+#endif
+    return 1;
+}
+
+void fat_pageCacheDestroy(fat_PageCache* cache)
+{
+    assert(cache != NULL);
+
+    if (cache->slots == NULL)
+        return;
+
+    for (uint32_t i = 0; i < cache->slotCount; ++i)
+        free(cache->slots[i].entries);
+    free(cache->slots);
+#ifndef FAT_NO_THREADS
+    fat_mutexDestroy(&cache->lock);
+#endif
+    memset(cache, 0, sizeof(fat_PageCache));
+}
+
+uint8_t fat_pagedOpen(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, fat_PageCache* cache, fat_PagedFat* paged)
+{
+    assert(boot != NULL);
+    assert(fetch != NULL);
+    assert(cache != NULL);
+    assert(paged != NULL);
+
+    memset(paged, 0, sizeof(fat_PagedFat));
+    paged->boot = boot;
+    paged->partitionOffset = partitionOffset;
+    paged->fetch = fetch;
+    paged->type = fat_getType(boot);
+    paged->cache = cache;
+    if (paged->type == EXFAT)
+        return 0;
+
+    paged->entryCount = fat_countOfClusters(boot) + 2;
+    uint32_t fatEntries = (paged->type == FAT12)                    // a FAT which is too small ends the table
+        ? fat_fatSize(boot) * 2 / 3
+        : fat_fatSize(boot) / ((paged->type == FAT16) ? 2 : 4);
+    if (paged->entryCount > fatEntries)
+        paged->entryCount = fatEntries;
+
+    paged->pageCount = (paged->entryCount + FAT_PAGE_ENTRIES - 1) / FAT_PAGE_ENTRIES;
+    paged->pages = calloc(paged->pageCount, sizeof(fat_FatPage));
+    uint32_t* entries = malloc(FAT_PAGE_ENTRIES * sizeof(uint32_t));
+    fat_FatRun* runs = malloc(FAT_PAGE_MAX_RUNS * sizeof(fat_FatRun));
+    uint8_t ok = paged->pages != NULL && entries != NULL && runs != NULL;
+
+    for (uint32_t page = 0; ok && page < paged->pageCount; ++page)
+    {
+        ok = readPage(paged, page, entries);
+        if (!ok)
+            break;
+
+        fat_FatPage* p = &paged->pages[page];
+        p->runCount = buildRuns(entries, pageEntries(paged, page), runs);
+        if (p->runCount == FAT_PAGE_IRREGULAR)
+            continue;
+
+        p->runs = malloc(p->runCount * sizeof(fat_FatRun));
+        ok = p->runs != NULL;
+        if (ok)
+            memcpy(p->runs, runs, p->runCount * sizeof(fat_FatRun));
+    }
+
+    free(entries);
+    free(runs);
+    if (!ok)
+        fat_pagedClose(paged);
+    return ok;
+}
+
+void fat_pagedClose(fat_PagedFat* paged)
+{
+    assert(paged != NULL);
+
+    if (paged->pages == NULL)
+        return;
+
+#ifndef FAT_NO_THREADS
+    fat_mutexLock(&paged->cache->lock);
+#endif
+    for (uint32_t page = 0; page < paged->pageCount; ++page)
+    {
+        if (paged->pages[page].slot != 0)
+            paged->cache->slots[paged->pages[page].slot - 1].owner = NULL;
+        free(paged->pages[page].runs);
+    }
+#ifndef FAT_NO_THREADS
+    fat_mutexUnlock(&paged->cache->lock);
+#endif
+
+    free(paged->pages);
+    paged->pages = NULL;
+}
+
+// Gets the decoded entries of an irregular page, from the cache or fetched into the least recently used
+// slot. The cache is locked.
+static const uint32_t* decodedPage(fat_PagedFat* paged, uint32_t page)
+{
+    fat_PageCache* cache = paged->cache;
+    fat_FatPage* p = &paged->pages[page];
+    if (p->slot != 0)
+    {
+        fat_PageCacheSlot* slot = &cache->slots[p->slot - 1];
+        slot->lastUse = ++cache->clock;
+        ++cache->hits;
+        return slot->entries;
+    }
+
+    ++cache->misses;
+    uint32_t victim = 0;
+    for (uint32_t i = 0; i < cache->slotCount; ++i)
+    {
+        if (cache->slots[i].owner == NULL)
+        {
+            victim = i;
+            break;
+        }
+
+        if (cache->slots[i].lastUse < cache->slots[victim].lastUse)
+            victim = i;
+    }
+
+    fat_PageCacheSlot* slot = &cache->slots[victim];
+    if (slot->owner != NULL)
+    {
+        slot->owner->pages[slot->page].slot = 0;
+        slot->owner = NULL;
+        ++cache->evictions;
+    }
+
+    if (slot->entries == NULL && (slot->entries = malloc(FAT_PAGE_ENTRIES * sizeof(uint32_t))) == NULL)
+        return NULL;
+
+    if (!readPage(paged, page, slot->entries))
+        return NULL;
+
+    slot->owner = paged;
+    slot->page = page;
+    slot->lastUse = ++cache->clock;
+    p->slot = victim + 1;
+    return slot->entries;
+}
+
+uint8_t fat_pagedEntry(fat_PagedFat* paged, uint32_t cluster, uint32_t* entry)
+{
+    assert(paged != NULL);
+    assert(entry != NULL);
+
+    if (cluster >= paged->entryCount)
+        return 0;
+
+    const fat_FatPage* page = &paged->pages[cluster / FAT_PAGE_ENTRIES];
+    uint32_t index = cluster % FAT_PAGE_ENTRIES;
+    if (page->runs != NULL)                                         // the runs never change, no lock needed
+    {
+        *entry = runEntry(findRun(page, index), index);
+        return 1;
+    }
+
+#ifndef FAT_NO_THREADS
+    fat_mutexLock(&paged->cache->lock);
+#endif
+    const uint32_t* entries = decodedPage(paged, cluster / FAT_PAGE_ENTRIES);
+    if (entries != NULL)
+        *entry = entries[index];
+#ifndef FAT_NO_THREADS
+    fat_mutexUnlock(&paged->cache->lock);
+#endif
+
+    return entries != NULL;
+}
+
+uint8_t fat_pagedExtent(fat_PagedFat* paged, uint32_t cluster, uint32_t* length, uint32_t* next)
+{
+    assert(paged != NULL);
+    assert(length != NULL);
+    assert(next != NULL);
+
+    uint32_t count = 0;
+    for (;;)
+    {
+        if (cluster >= paged->entryCount)
+            return 0;
+
+        // in a sequential run linking to the next cluster every entry up to its end links forward
+        const fat_FatPage* page = &paged->pages[cluster / FAT_PAGE_ENTRIES];
+        uint32_t index = cluster % FAT_PAGE_ENTRIES;
+        uint32_t entry, span = 1;
+        if (page->runs != NULL)
+        {
+            const fat_FatRun* run = findRun(page, index);
+            entry = runEntry(run, index);
+            if (run->value & FAT_RUN_SEQUENTIAL)
+                span = (uint32_t)run->start + run->count - index;
+        }
+        else if (!fat_pagedEntry(paged, cluster, &entry))
+            return 0;
+
+        if (entry != cluster + 1)
+        {
+            *length = count + 1;
+            *next = entry;
+            return 1;
+        }
+
+        count += span;
+        cluster += span;
+    }
+}
+
+uint8_t fat_pagedFreeClusters(fat_PagedFat* paged, uint32_t* count)
+{
+    assert(paged != NULL);
+    assert(count != NULL);
+
+    *count = 0;
+    for (uint32_t page = 0; page < paged->pageCount; ++page)
+    {
+        const fat_FatPage* p = &paged->pages[page];
+        uint32_t first = page * FAT_PAGE_ENTRIES;
+        if (p->runs == NULL)
+        {
+            for (uint32_t cluster = (first < 2) ? 2 : first; cluster < first + pageEntries(paged, page); ++cluster)
+            {
+                uint32_t entry;
+                if (!fat_pagedEntry(paged, cluster, &entry))
+                    return 0;
+                *count += entry == 0;
+            }
+            continue;
+        }
+
+        for (uint16_t i = 0; i < p->runCount; ++i)                  // a free run is a range of equal entries of 0
+        {
+            const fat_FatRun* run = &p->runs[i];
+            if (run->value != 0)
+                continue;
+
+            uint32_t start = first + run->start;
+            uint32_t end = start + run->count;
+            if (start < 2)
+                start = 2;
+            if (end > start)
+                *count += end - start;
+        }
+    }
+
+    return 1;
+}
+
+void fat_pagedStats(const fat_PagedFat* paged, fat_PagedStats* stats)
+{
+    assert(paged != NULL);
+    assert(stats != NULL);
+
+    memset(stats, 0, sizeof(fat_PagedStats));
+    stats->pages = paged->pageCount;
+    stats->indexBytes = (uint64_t)paged->pageCount * sizeof(fat_FatPage);
+    stats->flatBytes = (uint64_t)paged->entryCount * sizeof(uint32_t);
+    for (uint32_t page = 0; page < paged->pageCount; ++page)
+    {
+        const fat_FatPage* p = &paged->pages[page];
+        if (p->runs == NULL)
+        {
+            ++stats->irregularPages;
+            continue;
+        }
+
+        stats->runs += p->runCount;
+        stats->indexBytes += p->runCount * sizeof(fat_FatRun);
+    }
+}
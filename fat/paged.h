@@ -0,0 +1,116 @@
+#pragma once
+
+#include "fat.h"
+#include "thread.h"
+
+#ifdef FAT_NO_HEAP
+#error "the paged FAT keeps its runs and decoded pages on the heap, leave paged.c out of FAT_NO_HEAP builds"
+#endif
+
+// FAT access without holding the whole FAT in memory. The FAT is cut in pages of FAT_PAGE_ENTRIES
+// entries and every page is stored as runs: a run of consecutive links (a contiguous piece of a chain)
+// or of equal entries (free clusters, end of chain marks) is one fat_FatRun. A page that would need more
+// than FAT_PAGE_MAX_RUNS runs is irregular, nothing of it is kept and it is read again from the FAT
+// when needed. So the memory which stays allocated follows the fragmentation of the volume, not its size.
+//
+// Lookups in a page of runs search the runs, which never change after opening so no lock is taken. An
+// irregular page is fetched and decoded into a flat array of a fat_PageCache when used, which holds as
+// many decoded pages as its budget allows and evicts the least recently used page. One cache can be
+// shared by any number of volumes (and threads), so a single budget bounds the memory of every mounted
+// volume together.
+
+#define FAT_PAGE_ENTRIES 0x1000                                     // decoded a page takes 16 KB
+#define FAT_PAGE_MAX_RUNS 0x0400                                    // half of a decoded page
+#define FAT_PAGE_IRREGULAR 0xFFFF                                   // runCount of a page which isn't kept
+
+#define FAT_RUN_SEQUENTIAL 0x80000000                               // flag in fat_FatRun value
+
+// Entries start up to start + count - 1 of a page. Each is value, or with FAT_RUN_SEQUENTIAL the first
+// is value and every next one is one more (a link to the next cluster when value is the cluster after start).
+typedef struct fat_FatRun fat_FatRun;
+struct fat_FatRun
+{
+	uint16_t start;
+	uint16_t count;
+	uint32_t value;
+};
+
+typedef struct fat_FatPage fat_FatPage;
+struct fat_FatPage
+{
+	fat_FatRun* runs;                                               // NULL when irregular
+	uint16_t runCount;
+	uint32_t slot;                                                  // in the cache + 1, 0 when not decoded
+};
+
+typedef struct fat_PagedFat fat_PagedFat;
+
+typedef struct fat_PageCacheSlot fat_PageCacheSlot;
+struct fat_PageCacheSlot
+{
+	fat_PagedFat* owner;                                            // NULL when free
+	uint32_t page;
+	uint32_t lastUse;
+	uint32_t* entries;                                              // FAT_PAGE_ENTRIES, allocated on first use
+};
+
+typedef struct fat_PageCache fat_PageCache;
+struct fat_PageCache
+{
+	fat_PageCacheSlot* slots;
+	uint32_t slotCount;
+	uint32_t clock;
+	uint32_t hits;
+	uint32_t misses;
+	uint32_t evictions;
+#ifndef FAT_NO_THREADS
+	fat_Mutex lock;
+#endif
+};
+
+struct fat_PagedFat
+{
+	const fat_BootSector* boot;
+	unsigned partitionOffset;
+	fetchData_t fetch;
+	FatType type;
+	uint32_t entryCount;                                            // clusters + 2
+	uint32_t pageCount;
+	fat_FatPage* pages;
+	fat_PageCache* cache;
+};
+
+// Memory use of a paged FAT
+typedef struct fat_PagedStats fat_PagedStats;
+struct fat_PagedStats
+{
+	uint32_t pages;
+	uint32_t irregularPages;
+	uint32_t runs;
+	uint64_t indexBytes;                                            // runs and page table, what stays allocated
+	uint64_t flatBytes;                                             // the FAT as one array of 32 bit entries
+};
+
+// Sets up a cache which keeps up to budget bytes of decoded pages (at least one page)
+uint8_t fat_pageCacheInit(fat_PageCache* cache, uint64_t budget);
+
+// Frees the cache, close every paged FAT using it first
+void fat_pageCacheDestroy(fat_PageCache* cache);
+
+// Reads the FAT page by page into runs, decoded irregular pages go into cache. boot must outlive the paged FAT.
+uint8_t fat_pagedOpen(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, fat_PageCache* cache, fat_PagedFat* paged);
+
+// Frees the runs and gives the cached pages back
+void fat_pagedClose(fat_PagedFat* paged);
+
+// Gets the FAT entry of cluster, 0 when it is out of range or an irregular page can't be fetched again
+uint8_t fat_pagedEntry(fat_PagedFat* paged, uint32_t cluster, uint32_t* entry);
+
+// Gets the contiguous piece of the chain starting at cluster: length clusters, next is the entry of the
+// last one (the next piece of the chain or an end of chain mark). Runs are skipped in one step.
+uint8_t fat_pagedExtent(fat_PagedFat* paged, uint32_t cluster, uint32_t* length, uint32_t* next);
+
+// Counts the free clusters, irregular pages are fetched again through the cache
+uint8_t fat_pagedFreeClusters(fat_PagedFat* paged, uint32_t* count);
+
+void fat_pagedStats(const fat_PagedFat* paged, fat_PagedStats* stats);
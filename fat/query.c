@@ -0,0 +1,185 @@
+#include "query.h"
+#include "thread.h"
+
+#define MAX_PATH_COMPONENTS 0x40
+
+typedef struct Find Find;
+struct Find
+{
+    const fat_Query* query;
+    queryFound_t found;
+    void* context;
+
+    char* components[MAX_PATH_COMPONENTS];                          // pattern split at the slashes
+    uint32_t componentCount;
+    const char* namePattern;                                        // last component
+#ifndef FAT_NO_THREADS
+    fat_Mutex lock;
+#endif
+};
+
+void fat_queryInit(fat_Query* query)
+{
+    assert(query != NULL);
+
+    memset(query, 0, sizeof(fat_Query));
+    query->maxSize = FAT_QUERY_ANY_SIZE;
+    query->modifiedTo = FAT_QUERY_ANY_TIME;
+    query->createdTo = FAT_QUERY_ANY_TIME;
+    query->accessedTo = FAT_QUERY_ANY_TIME;
+    query->maxDepth = FAT_QUERY_ANY_DEPTH;
+}
+
+uint32_t fat_packDateTime(uint16_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t minute, uint8_t second)
+{
+    uint16_t date = (uint16_t)(((year - 1980) & 0x7F) << 9 | (month & 0x0F) << 5 | (day & 0x1F));
+    uint16_t time = (uint16_t)((hour & 0x1F) << 11 | (minute & 0x3F) << 5 | ((second / 2) & 0x1F));
+    return (uint32_t)date << 16 | time;
+}
+
+uint8_t fat_queryMatchEntry(const fat_Query* query, const fat_DirectoryEntry* entry)
+{
+    assert(query != NULL);
+    assert(entry != NULL);
+
+    if ((entry->fileAttributes & query->attributesSet) != query->attributesSet || (entry->fileAttributes & query->attributesClear))
+        return 0;
+
+    if (entry->fileSize < query->minSize || entry->fileSize > query->maxSize)
+        return 0;
+
+    uint32_t modified = (uint32_t)entry->word << 16 | entry->time;
+    if (modified < query->modifiedFrom || modified > query->modifiedTo)
+        return 0;
+
+    uint32_t created = (uint32_t)entry->dateCreated << 16 | entry->timeCreatedHourMinute;
+    if (created < query->createdFrom || created > query->createdTo)
+        return 0;
+
+    uint32_t accessed = (uint32_t)entry->dateAccessed << 16;        // whole days
+    return accessed >= (query->accessedFrom & 0xFFFF0000) && accessed <= (query->accessedTo | 0x0000FFFF);
+}
+
+uint8_t fat_globMatch(const char* pattern, const char* name)
+{
+    assert(pattern != NULL);
+    assert(name != NULL);
+
+    const char* star = NULL;                                        // last * seen, and where it started matching
+    const char* retry = NULL;
+
+    while (*name)
+    {
+        if (*pattern == '*')
+        {
+            star = pattern++;
+            retry = name;
+        }
+        else if (*pattern == '?' || (*pattern && tolower((uint8_t)*pattern) == tolower((uint8_t)*name)))
+        {
+            ++pattern;
+            ++name;
+        }
+        else if (star != NULL)                                      // let the * take one more character
+        {
+            pattern = star + 1;
+            name = ++retry;
+        }
+        else
+            return 0;
+    }
+
+    while (*pattern == '*')
+        ++pattern;
+    return *pattern == 0;
+}
+
+static uint8_t findVisit(const fat_WalkEntry* entry, void* context)
+{
+    Find* f = context;
+    const fat_Query* query = f->query;
+    uint8_t isDirectory = (entry->entry.fileAttributes & FAT_FILE_ATTR_DIRECTORY) != 0;
+
+    uint8_t result = (isDirectory && entry->depth >= query->maxDepth)
+        ? FAT_WALK_SKIP
+        : FAT_WALK_CONTINUE;
+
+    if (f->componentCount > 1)                                      // path pattern
+    {
+        uint32_t last = f->componentCount - 1;
+        if (entry->depth < last)                                    // only the directories on the way count
+        {
+            if (!isDirectory || !fat_globMatch(f->components[entry->depth], entry->fileName))
+                return FAT_WALK_SKIP;
+            return result;
+        }
+
+        if (entry->depth > last)
+            return FAT_WALK_SKIP;
+        result = FAT_WALK_SKIP;                                     // nothing below can match anymore
+    }
+
+    if (!fat_queryMatchEntry(query, &entry->entry))                 // raw fields first, no names decoded
+        return result;
+
+    char fileName[FAT_LFN_MAX_LENGTH + 1];
+    fat_walkFileName(entry, fileName, sizeof(fileName));
+    if (f->namePattern != NULL && !fat_globMatch(f->namePattern, fileName))
+        return result;
+
+#ifndef FAT_NO_THREADS
+    fat_mutexLock(&f->lock);
+#endif
+    uint8_t more = f->found(entry, fileName, f->context);
+#ifndef FAT_NO_THREADS
+    fat_mutexUnlock(&f->lock);
+#endif
+
+    return more ? result : FAT_WALK_STOP;
+}
+
+uint8_t fat_find(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, unsigned threads, const fat_Query* query, queryFound_t found, void* context)
+{
+    assert(query != NULL);
+    assert(found != NULL);
+
+    Find f;
+    memset(&f, 0, sizeof(Find));
+    f.query = query;
+    f.found = found;
+    f.context = context;
+
+    char* pattern = NULL;
+    if (query->pattern != NULL)
+    {
+        const char* p = query->pattern;
+        while (*p == '/')                                           // always from the root
+            ++p;
+
+        pattern = malloc(strlen(p) + 1);
+        if (pattern == NULL)
+            return 0;
+        strcpy(pattern, p);
+
+        for (char* component = pattern; component != NULL && f.componentCount < MAX_PATH_COMPONENTS;)
+        {
+            f.components[f.componentCount++] = component;
+            component = strchr(component, '/');
+            if (component != NULL)
+                *component++ = 0;
+        }
+
+        f.namePattern = f.components[f.componentCount - 1];
+    }
+
+#ifndef FAT_NO_THREADS
+    fat_mutexInit(&f.lock);
+#endif
+    uint8_t ok = fat_walk(boot, partitionOffset, fetch, threads, FAT_WALK_PRE | FAT_WALK_LAZY_NAMES, findVisit, &f);
+#ifndef FAT_NO_THREADS
+    fat_mutexDestroy(&f.lock);
+#endif
+
+    free(pattern);
+    return ok;
+}
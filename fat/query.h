@@ -0,0 +1,44 @@
+#pragma once
+
+#include "fat.h"
+#include "walk.h"
+
+// Searches the volume for entries matching a query. Size, attributes and dates are compared on the raw
+// directory entry: a packed FAT date and time (date << 16 | time) sorts like the moment it stands for,
+// so nothing is decoded. Only the entries passing those get their long name decoded for the pattern.
+
+#define FAT_QUERY_ANY_SIZE 0xFFFFFFFF
+#define FAT_QUERY_ANY_TIME 0xFFFFFFFF
+#define FAT_QUERY_ANY_DEPTH 0xFFFFFFFF
+
+typedef struct fat_Query fat_Query;
+struct fat_Query
+{
+	const char* pattern;                                            // name glob (* and ?, case insensitive), NULL for any
+	uint8_t attributesSet;                                          // FAT_FILE_ATTR_* which must be set
+	uint8_t attributesClear;                                        // FAT_FILE_ATTR_* which must be clear
+	uint32_t minSize, maxSize;                                      // inclusive
+	uint32_t modifiedFrom, modifiedTo;                              // packed with fat_packDateTime, inclusive
+	uint32_t createdFrom, createdTo;
+	uint32_t accessedFrom, accessedTo;                              // the time part is ignored, FAT only keeps the date
+	uint32_t maxDepth;                                              // 0 searches the root directory only
+};
+
+// Called for every match, never from two threads at once. Return 0 to stop.
+typedef uint8_t(*queryFound_t)(const fat_WalkEntry* entry, const char* fileName, void* context);
+
+// Sets up a query which matches everything
+void fat_queryInit(fat_Query* query);
+
+// Packs a moment the way it is stored in a directory entry (date << 16 | time)
+uint32_t fat_packDateTime(uint16_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t minute, uint8_t second);
+
+// Checks the raw fields of the entry: attributes, size and dates
+uint8_t fat_queryMatchEntry(const fat_Query* query, const fat_DirectoryEntry* entry);
+
+// Matches name against a glob pattern, case insensitive
+uint8_t fat_globMatch(const char* pattern, const char* name);
+
+// Walks the volume on threads (0 is one per processor) and reports the matches. When the pattern contains
+// slashes it is matched against the path from the root and directories that can't lead to a match are skipped.
+uint8_t fat_find(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, unsigned threads, const fat_Query* query, queryFound_t found, void* context);
@@ -0,0 +1,531 @@
+#include "recover.h"
+#include "thread.h"
+
+typedef struct Recovery Recovery;
+struct Recovery
+{
+    const fat_BootSector* boot;
+    unsigned partitionOffset;
+    fetchData_t fetch;
+    deletedFound_t found;
+    void* context;
+
+    FatType type;
+    uint32_t lastCluster;
+    uint32_t clusterSize;
+    uint8_t* fat;
+};
+
+// Long file name state while going through the entries of one directory. Deleted slots lost their
+// ordinal (first byte), they are kept in disk order: the slot right before the short entry is block 1.
+typedef struct EntryParser EntryParser;
+struct EntryParser
+{
+    fat_LongFileName slots[FAT_LFN_MAX_SLOTS];
+    uint8_t slotCount;
+    uint8_t slotsDeleted;
+};
+
+typedef struct DirectoryQueue DirectoryQueue;
+struct DirectoryQueue
+{
+    uint32_t* clusters;
+    uint8_t* deleted;
+    uint32_t count, capacity;
+};
+
+static uint8_t isFree(const Recovery* r, uint32_t cluster)
+{
+    return fat_fatEntry(r->type, r->fat, cluster) == 0;
+}
+
+static uint8_t validNameChar(uint8_t c)
+{
+    return c >= 0x20 && !(c >= 'a' && c <= 'z') && strchr("\"*+,/:;<=>?[\\]|", c) == NULL;
+}
+
+// Checks if the 32 bytes could be a directory entry, used to recognize directory clusters
+static uint8_t validEntry(const Recovery* r, const fat_DirectoryEntry* entry)
+{
+    if ((entry->fileAttributes & FAT_FILE_ATTR_LONG_NAME_MASK) == FAT_FILE_ATTR_LONG_NAME)
+    {
+        const fat_LongFileName* lfn = (const fat_LongFileName*)entry;
+        return lfn->type == 0 && lfn->cluster == 0;
+    }
+
+    if (entry->fileAttributes & 0xC0)
+        return 0;
+
+    const uint8_t* shortName = (const uint8_t*)entry;               // name and extension
+    if (shortName[0] != 0xE5 && shortName[0] != 0x05 && (shortName[0] == ' ' || !validNameChar(shortName[0])))
+        return 0;
+
+    for (uint8_t i = 1; i < 11; ++i)
+    {
+        if (!validNameChar(shortName[i]))
+            return 0;
+    }
+
+    uint32_t cluster = entry->clusterHigh << 16 | entry->clusterLow;
+    if (cluster > r->lastCluster || (r->type != FAT32 && entry->clusterHigh != 0))
+        return 0;
+
+    uint8_t day, month;
+    uint16_t year;
+    fat_getDate(entry->word, &day, &month, &year);                  // last write date
+    return entry->word == 0 || (month >= 1 && month <= 12 && day >= 1);
+}
+
+// Checks if a whole cluster looks like directory entries: valid entries followed by zeros only
+static uint8_t looksLikeDirectory(const Recovery* r, const uint8_t* data, uint32_t count, uint8_t requireDots)
+{
+    const fat_DirectoryEntry* entries = (const fat_DirectoryEntry*)data;
+    uint32_t shortEntries = 0, i;
+
+    if (requireDots && (memcmp(&entries[0], ".          ", 11) != 0 || memcmp(&entries[1], "..         ", 11) != 0 ||
+        !(entries[0].fileAttributes & FAT_FILE_ATTR_DIRECTORY) || !(entries[1].fileAttributes & FAT_FILE_ATTR_DIRECTORY)))
+        return 0;
+
+    for (i = 0; i < count && entries[i].fileName[0] != 0; ++i)
+    {
+        if (entries[i].fileName[0] != '.' && !validEntry(r, &entries[i]))
+            return 0;
+
+        if ((entries[i].fileAttributes & FAT_FILE_ATTR_LONG_NAME_MASK) != FAT_FILE_ATTR_LONG_NAME)
+            ++shortEntries;
+    }
+
+    uint32_t rest = (count - i) * sizeof(fat_DirectoryEntry);       // end of directory, the rest is unused
+    const uint8_t* tail = data + i * sizeof(fat_DirectoryEntry);
+    if (rest > 0 && (tail[0] != 0 || memcmp(tail, tail + 1, rest - 1) != 0))
+        return 0;
+
+    return shortEntries >= (requireDots ? 2u : 1u);
+}
+
+static void estimate(const Recovery* r, fat_DeletedEntry* d)
+{
+    const fat_DirectoryEntry* entry = &d->entry;
+
+    d->firstCluster = entry->clusterHigh << 16 | entry->clusterLow;
+    d->clusterCount = (entry->fileSize + r->clusterSize - 1) / r->clusterSize;
+    if ((entry->fileAttributes & FAT_FILE_ATTR_DIRECTORY) && d->firstCluster != 0)
+        d->clusterCount = 1;                                        // directories have no size, at least their first cluster
+
+    d->freeClusters = 0;
+    if (d->firstCluster >= 2)
+    {
+        for (uint32_t c = d->firstCluster; c < d->firstCluster + d->clusterCount && c <= r->lastCluster && isFree(r, c); ++c)
+            ++d->freeClusters;                                      // contiguous until something else took a cluster
+    }
+
+    uint64_t recoverable = (uint64_t)d->freeClusters * r->clusterSize;
+    d->recoverableSize = (recoverable < entry->fileSize) ? (uint32_t)recoverable : entry->fileSize;
+    if (entry->fileAttributes & FAT_FILE_ATTR_DIRECTORY)
+        d->recoverableSize = 0;
+
+    d->state = (d->clusterCount == 0 || d->freeClusters == d->clusterCount)
+        ? FAT_RECOVER_FULL
+        : (d->freeClusters > 0)
+            ? FAT_RECOVER_PARTIAL
+            : FAT_RECOVER_OVERWRITTEN;
+}
+
+// Builds the long name out of the collected slots, returns 0 if they don't belong to entry
+static uint8_t assembleName(EntryParser* p, const fat_DirectoryEntry* entry, fat_DeletedEntry* d)
+{
+    if (p->slotCount == 0)
+        return 0;
+
+    uint8_t checksum = p->slots[0].checksum;
+    uint16_t units[FAT_LFN_MAX_SLOTS * 13];                         // the slots were collected last part first
+    for (unsigned i = 0; i < p->slotCount * 13u; ++i)
+    {
+        const fat_LongFileName* lfn = &p->slots[p->slotCount - 1 - i / 13];
+        unsigned j = i % 13;
+        units[i] = (j < 5) ? lfn->ucs2_1[j] : (j < 11) ? lfn->ucs2_2[j - 5] : lfn->ucs2_3[j - 11];
+    }
+    fat_utf16ToUtf8(units, p->slotCount * 13u, d->fileName, sizeof(d->fileName));
+
+    if (!p->slotsDeleted)                                           // live name, checksum must match as is
+        return fat_checksum(entry->fileName) == checksum;
+
+    uint8_t shortName[11];                                          // guess the lost first byte out of the long name
+    memcpy(shortName, entry->fileName, 11);
+    shortName[0] = (units[0] < 0x80) ? (uint8_t)toupper(units[0]) : '_';   // a short name has no characters beyond ASCII
+    if (fat_checksum(shortName) != checksum)
+        return 0;
+
+    d->entry.fileName[0] = shortName[0];
+    d->restored = 1;
+    return 1;
+}
+
+static uint8_t queueDirectory(DirectoryQueue* queue, uint32_t cluster, uint8_t deleted)
+{
+    if (queue->count == queue->capacity)
+    {
+        uint32_t capacity = queue->capacity ? queue->capacity * 2 : 64;
+        uint32_t* clusters = realloc(queue->clusters, capacity * sizeof(uint32_t));
+        if (clusters == NULL)
+            return 0;
+        queue->clusters = clusters;
+
+        uint8_t* deletedFlags = realloc(queue->deleted, capacity);
+        if (deletedFlags == NULL)
+            return 0;
+        queue->deleted = deletedFlags;
+        queue->capacity = capacity;
+    }
+
+    queue->clusters[queue->count] = cluster;
+    queue->deleted[queue->count] = deleted;
+    ++queue->count;
+    return 1;
+}
+
+// Handles one entry, returns 0 at the end of the directory. Entries of deleted or orphaned directories
+// are reported even when they are not deleted themselves.
+static uint8_t parseEntry(Recovery* r, EntryParser* p, const fat_DirectoryEntry* entry, uint32_t directoryCluster, uint32_t address, uint8_t deletedParent, uint8_t orphan, DirectoryQueue* queue, uint8_t* stop)
+{
+    if (entry->fileName[0] == 0)                                    // last entry
+        return 0;
+
+    uint8_t deleted = entry->fileName[0] == 0xE5;
+    if ((entry->fileAttributes & FAT_FILE_ATTR_LONG_NAME_MASK) == FAT_FILE_ATTR_LONG_NAME)
+    {
+        const fat_LongFileName* lfn = (const fat_LongFileName*)entry;
+        if (p->slotCount == FAT_LFN_MAX_SLOTS || (p->slotCount > 0 && (p->slots[0].checksum != lfn->checksum || p->slotsDeleted != deleted)))
+            p->slotCount = 0;                                       // doesn't belong to the previous slots
+
+        if (!deleted && (lfn->ordinal & 0x40))                      // first slot of a live name
+            p->slotCount = 0;
+
+        memcpy(&p->slots[p->slotCount++], lfn, sizeof(fat_LongFileName));
+        p->slotsDeleted = deleted;
+        return 1;
+    }
+
+    uint8_t isDot = entry->fileName[0] == '.';
+    uint8_t isDirectory = (entry->fileAttributes & FAT_FILE_ATTR_DIRECTORY) && !(entry->fileAttributes & FAT_FILE_ATTR_VOLUME);
+    uint32_t cluster = entry->clusterHigh << 16 | entry->clusterLow;
+
+    if (!deleted && !deletedParent && !orphan)                      // live entry of a live directory
+    {
+        if (isDirectory && !isDot && queue != NULL && !queueDirectory(queue, cluster, 0))
+            *stop = 1;
+
+        p->slotCount = 0;
+        return 1;
+    }
+
+    if (isDot || (entry->fileAttributes & FAT_FILE_ATTR_VOLUME))
+    {
+        p->slotCount = 0;
+        return 1;
+    }
+
+    fat_DeletedEntry d;
+    memset(&d, 0, sizeof(d));
+    memcpy(&d.entry, entry, sizeof(fat_DirectoryEntry));
+    d.directoryCluster = directoryCluster;
+    d.address = address;
+    d.deleted = deleted;
+    d.orphan = orphan;
+
+    if (!assembleName(p, entry, &d))
+    {
+        fat_DirectoryEntry shortEntry = *entry;                     // the lost first byte shows as '_'
+        if (deleted)
+            shortEntry.fileName[0] = '_';
+        fat_getFileName(d.fileName, &shortEntry);
+    }
+    p->slotCount = 0;
+
+    estimate(r, &d);
+    if (!r->found(&d, r->context))
+        *stop = 1;
+
+    if (isDirectory && (deleted || deletedParent) && queue != NULL && d.state != FAT_RECOVER_OVERWRITTEN && !queueDirectory(queue, cluster, 1))
+        *stop = 1;
+
+    return 1;
+}
+
+// Reads the directory at cluster and handles its entries, deleted directories have no chain anymore
+static uint8_t scanDirectory(Recovery* r, uint32_t cluster, uint8_t deleted, uint8_t* buffer, DirectoryQueue* queue, uint8_t* visited, uint8_t* stop)
+{
+    EntryParser parser;
+    parser.slotCount = 0;
+
+    if (cluster == FAT_DIRECTORY_ROOT)                              // FAT12/FAT16 root region
+    {
+        uint32_t size = r->boot->rootEntries * sizeof(fat_DirectoryEntry);
+        uint32_t address = fat_sectorToAddress(r->boot, r->partitionOffset, fat_rootDirectorySector(r->boot));
+        uint8_t* root = malloc(size);
+        if (root == NULL || !r->fetch(address, size, (char*)root))
+        {
+            free(root);
+            return 0;
+        }
+
+        for (uint32_t i = 0; i < r->boot->rootEntries && !*stop; ++i)
+        {
+            if (!parseEntry(r, &parser, (fat_DirectoryEntry*)root + i, FAT_DIRECTORY_ROOT, address + i * sizeof(fat_DirectoryEntry), 0, 0, queue, stop))
+                break;
+        }
+
+        free(root);
+        return 1;
+    }
+
+    uint32_t entriesPerCluster = fat_entriesPerCluster(r->boot);
+    for (uint32_t steps = 0; steps <= r->lastCluster && !*stop; ++steps)
+    {
+        if (cluster < 2 || cluster > r->lastCluster || (visited[cluster / 8] & (1 << (cluster % 8))))
+            break;
+        visited[cluster / 8] |= 1 << (cluster % 8);
+
+        uint32_t address = fat_clusterToAddress(r->boot, r->partitionOffset, cluster);
+        if (!r->fetch(address, r->clusterSize, (char*)buffer))
+            return 0;
+
+        if (deleted && !looksLikeDirectory(r, buffer, entriesPerCluster, steps == 0))
+            break;                                                  // overwritten, or the directory ended
+
+        for (uint32_t i = 0; i < entriesPerCluster; ++i)
+        {
+            if (!parseEntry(r, &parser, (fat_DirectoryEntry*)buffer + i, cluster, address + i * sizeof(fat_DirectoryEntry), deleted, 0, queue, stop))
+                return 1;
+            if (*stop)
+                return 1;
+        }
+
+        if (deleted)                                                // guess it continues in the next free cluster
+        {
+            ++cluster;
+            if (cluster > r->lastCluster || !isFree(r, cluster))
+                break;
+        }
+        else
+        {
+            uint32_t next = fat_fatEntry(r->type, r->fat, cluster);
+            if (fat_isEndOfChain(r->type, next))
+                break;
+            cluster = next;
+        }
+    }
+
+    return 1;
+}
+
+static uint8_t initRecovery(Recovery* r, const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, deletedFound_t found, void* context)
+{
+    assert(boot != NULL);
+    assert(fetch != NULL);
+    assert(found != NULL);
+
+    memset(r, 0, sizeof(Recovery));
+    r->boot = boot;
+    r->partitionOffset = partitionOffset;
+    r->fetch = fetch;
+    r->found = found;
+    r->context = context;
+    r->type = fat_getType(boot);
+    r->lastCluster = fat_countOfClusters(boot) + 1;
+    r->clusterSize = fat_clusterSize(boot);
+    r->fat = fat_loadFat(boot, partitionOffset, fetch);
+    return r->fat != NULL;
+}
+
+uint8_t fat_recoverDeleted(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, deletedFound_t found, void* context)
+{
+    Recovery r;
+    if (!initRecovery(&r, boot, partitionOffset, fetch, found, context))
+        return 0;
+
+    DirectoryQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    uint8_t* buffer = malloc(r.clusterSize);
+    uint8_t* visited = calloc(r.lastCluster / 8 + 1, 1);
+    uint8_t ok = buffer != NULL && visited != NULL && queueDirectory(&queue, fat_rootCluster(boot), 0);
+    uint8_t stop = 0;
+
+    for (uint32_t i = 0; ok && !stop && i < queue.count; ++i)       // queue grows while scanning -> whole tree
+        ok = scanDirectory(&r, queue.clusters[i], queue.deleted[i], buffer, &queue, visited, &stop);
+
+    free(queue.clusters);
+    free(queue.deleted);
+    free(buffer);
+    free(visited);
+    free(r.fat);
+    return ok;
+}
+
+typedef struct Sweep Sweep;
+struct Sweep
+{
+    Recovery* r;
+    uint32_t nextCluster;
+    uint32_t clustersPerBlock;
+    uint8_t stop;
+    uint8_t failed;                                                 // set under the lock like stop
+#ifndef FAT_NO_THREADS
+    fat_Mutex lock;
+#endif
+};
+
+static void sweepLock(Sweep* s)
+{
+#ifndef FAT_NO_THREADS
+    fat_mutexLock(&s->lock);
+#endif
+}
+
+static void sweepUnlock(Sweep* s)
+{
+#ifndef FAT_NO_THREADS
+    fat_mutexUnlock(&s->lock);
+#endif
+}
+
+static void sweepFailed(Sweep* s)
+{
+    sweepLock(s);
+    s->failed = 1;
+    sweepUnlock(s);
+}
+
+static uint8_t sweepFound(const fat_DeletedEntry* deleted, void* context)
+{
+    Sweep* s = context;                                             // reports are serialized
+    sweepLock(s);
+    uint8_t more = !s->stop && s->r->found(deleted, s->r->context);
+    if (!more)
+        s->stop = 1;
+    sweepUnlock(s);
+    return more;
+}
+
+static void sweepCluster(Recovery* local, const uint8_t* data, uint32_t cluster)
+{
+    uint32_t entriesPerCluster = fat_entriesPerCluster(local->boot);
+    if (!looksLikeDirectory(local, data, entriesPerCluster, 0))
+        return;
+
+    EntryParser parser;
+    parser.slotCount = 0;
+
+    uint8_t stop = 0;
+    uint32_t address = fat_clusterToAddress(local->boot, local->partitionOffset, cluster);
+    for (uint32_t i = 0; i < entriesPerCluster && !stop; ++i)
+    {
+        if (!parseEntry(local, &parser, (const fat_DirectoryEntry*)data + i, cluster, address + i * sizeof(fat_DirectoryEntry), 0, 1, NULL, &stop))
+            break;
+    }
+}
+
+// Takes blocks of clusters in address order, so all threads together still read the disk front to back
+static void sweepWorker(void* argument)
+{
+    Sweep* s = argument;
+    Recovery local = *s->r;                                         // reports go through the lock
+    local.found = sweepFound;
+    local.context = s;
+
+    uint8_t* buffer = malloc((size_t)s->clustersPerBlock * local.clusterSize);
+    if (buffer == NULL)
+    {
+        sweepFailed(s);
+        return;
+    }
+
+    for (;;)
+    {
+        sweepLock(s);
+        uint32_t first = s->nextCluster;
+        s->nextCluster += s->clustersPerBlock;
+        uint8_t stop = s->stop || first > local.lastCluster;
+        sweepUnlock(s);
+        if (stop)
+            break;
+
+        uint32_t end = first + s->clustersPerBlock;
+        if (end > local.lastCluster + 1)
+            end = local.lastCluster + 1;
+
+        for (uint32_t cluster = first; cluster < end;)              // one read per run of free clusters
+        {
+            if (!isFree(&local, cluster))
+            {
+                ++cluster;
+                continue;
+            }
+
+            uint32_t run = cluster;
+            while (run < end && isFree(&local, run))
+                ++run;
+
+            uint32_t address = fat_clusterToAddress(local.boot, local.partitionOffset, cluster);
+            if (!local.fetch(address, (run - cluster) * local.clusterSize, (char*)buffer))
+            {
+                sweepFailed(s);
+                break;
+            }
+
+            for (uint32_t c = cluster; c < run; ++c)
+                sweepCluster(&local, buffer + (size_t)(c - cluster) * local.clusterSize, c);
+
+            cluster = run;
+        }
+    }
+
+    free(buffer);
+}
+
+uint8_t fat_recoverSweep(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, unsigned threads, deletedFound_t found, void* context)
+{
+    Recovery r;
+    if (!initRecovery(&r, boot, partitionOffset, fetch, found, context))
+        return 0;
+
+    Sweep s;
+    memset(&s, 0, sizeof(s));
+    s.r = &r;
+    s.nextCluster = 2;
+    s.clustersPerBlock = FAT_RECOVER_SWEEP_BLOCK / r.clusterSize;
+    if (s.clustersPerBlock == 0)
+        s.clustersPerBlock = 1;
+
+#ifndef FAT_NO_THREADS
+    if (threads == 0)
+        threads = fat_processorCount();
+
+    fat_mutexInit(&s.lock);
+    fat_Thread* workers = malloc(threads * sizeof(fat_Thread));
+    unsigned started = 0;
+    if (workers != NULL)
+    {
+        for (; started < threads; ++started)
+        {
+            if (!fat_threadStart(&workers[started], sweepWorker, &s))
+                break;
+        }
+    }
+
+    if (started == 0)                                               // no threads available, do it ourselves
+        sweepWorker(&s);
+
+    for (unsigned i = 0; i < started; ++i)
+        fat_threadJoin(workers[i]);
+
+    free(workers);
+    fat_mutexDestroy(&s.lock);
+#else
+    (void)threads;
+    sweepWorker(&s);
+#endif
+
+    free(r.fat);
+    return !s.failed;
+}
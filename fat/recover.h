@@ -0,0 +1,45 @@
+#pragma once
+
+#include "fat.h"
+
+#ifdef FAT_NO_HEAP
+#error "recovery queues directories on the heap, leave recover.c out of FAT_NO_HEAP builds"
+#endif
+
+// Recovery of deleted files. The directory scan walks every (also deleted) directory and reports the
+// deleted entries, the sweep reads all free clusters of the data region looking for directory
+// clusters nobody references anymore. For each file the recoverable part is estimated from the FAT
+// with the usual undelete assumption: the file was allocated contiguously from its first cluster.
+
+#define FAT_RECOVER_OVERWRITTEN 0x00
+#define FAT_RECOVER_PARTIAL 0x01
+#define FAT_RECOVER_FULL 0x02
+
+#define FAT_RECOVER_SWEEP_BLOCK 0x400000                            // bytes per read of the sweep
+
+typedef struct fat_DeletedEntry fat_DeletedEntry;
+struct fat_DeletedEntry
+{
+	fat_DirectoryEntry entry;                                       // first byte of the name restored when possible
+	char fileName[FAT_LFN_MAX_LENGTH + 1];
+	uint32_t directoryCluster;                                      // cluster holding the entry, 0 for the FAT12/FAT16 root
+	uint32_t address;                                               // byte address of the short entry
+	uint8_t deleted;                                                // 0 for live entries inside a deleted or orphaned directory
+	uint8_t restored;                                               // first byte of the name taken from the long file name
+	uint8_t orphan;                                                 // found by the sweep
+	uint8_t state;                                                  // FAT_RECOVER_*
+	uint32_t firstCluster;
+	uint32_t clusterCount;                                          // clusters needed to hold fileSize
+	uint32_t freeClusters;                                          // free clusters from firstCluster on
+	uint32_t recoverableSize;
+};
+
+// Called for every entry found, return 0 to stop
+typedef uint8_t(*deletedFound_t)(const fat_DeletedEntry* deleted, void* context);
+
+// Walks the directory tree and reports the deleted entries
+uint8_t fat_recoverDeleted(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, deletedFound_t found, void* context);
+
+// Sweeps the free clusters for orphaned directory clusters and reports their entries. The region is
+// split over threads (0 is one per processor), so fetch must be safe to call from several threads.
+uint8_t fat_recoverSweep(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, unsigned threads, deletedFound_t found, void* context);
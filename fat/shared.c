@@ -0,0 +1,332 @@
+#include "shared.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define OBJECT_MISSING 0x00
+#define OBJECT_PENDING 0x01                                         // created but not filled yet
+#define OBJECT_MAPPED 0x02
+
+static uint32_t align8(uint32_t value)
+{
+    return (value + 7) & ~7u;
+}
+
+// Orders the writes of the cache before its ready flag, and the read of the flag before the reads of the cache
+static void barrier(void)
+{
+#ifdef _WIN32
+    MemoryBarrier();
+#else
+    __sync_synchronize();
+#endif
+}
+
+static void sleepMillisecond(void)
+{
+#ifdef _WIN32
+    Sleep(1);
+#else
+    struct timespec delay = { 0, 1000000 };
+    nanosleep(&delay, NULL);
+#endif
+}
+
+void fat_sharedName(uint64_t fingerprint, char name[FAT_SHARED_NAME])
+{
+    assert(name != NULL);
+
+#ifdef _WIN32
+    sprintf(name, "Local\\fat-%016llx", (unsigned long long)fingerprint);
+#else
+    sprintf(name, "/fat-%016llx", (unsigned long long)fingerprint);
+#endif
+}
+
+static uint8_t mapObject(const char* name, fat_Shared* shared)
+{
+#ifdef _WIN32
+    HANDLE map = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+    if (map == NULL)
+        return OBJECT_MISSING;
+
+    MEMORY_BASIC_INFORMATION info;
+    void* data = MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+    if (data == NULL || VirtualQuery(data, &info, sizeof(info)) == 0)
+    {
+        if (data != NULL)
+            UnmapViewOfFile(data);
+        CloseHandle(map);
+        return OBJECT_PENDING;
+    }
+
+    shared->data = data;
+    shared->size = info.RegionSize;                                 // whole pages, the header holds the exact size
+    shared->mapping = map;
+    return OBJECT_MAPPED;
+#else
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return OBJECT_MISSING;
+
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (uint64_t)st.st_size >= sizeof(fat_SharedHeader))   // 0 until the publisher sized it
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    close(fd);                                                      // the mapping keeps the object open
+    if (data == MAP_FAILED)
+        return OBJECT_PENDING;
+
+    shared->data = data;
+    shared->size = (size_t)st.st_size;
+    shared->mapping = NULL;
+    return OBJECT_MAPPED;
+#endif
+}
+
+// Sets shared up over the mapped object, a foreign or damaged object fails like any other input
+static uint8_t attachData(fat_Shared* shared, uint64_t fingerprint)
+{
+    const fat_SharedHeader* header = shared->data;
+    if (header->magic != FAT_SHARED_MAGIC || header->version != FAT_SHARED_VERSION ||
+        header->fingerprint != fingerprint || header->size > shared->size)
+        return 0;
+
+    const uint8_t* base = shared->data;
+    uint8_t valid = header->fatOffset >= sizeof(fat_SharedHeader) && header->fatOffset % 8 == 0 &&
+        header->fatOffset <= header->size && (uint64_t)header->entryCount * sizeof(uint32_t) <= header->size - header->fatOffset &&
+        header->indexOffset % 8 == 0 && header->indexOffset <= header->size && header->indexSize <= header->size - header->indexOffset &&
+        fat_indexAttach(base + header->indexOffset, header->indexSize, fingerprint, &shared->index) &&
+        shared->index.header->countOfClusters + 2 == header->entryCount;
+
+    if (!valid)
+        return 0;
+
+    shared->header = header;
+    shared->fat = (const uint32_t*)(base + header->fatOffset);
+    return 1;
+}
+
+// Maps the cache of fingerprint once it is ready, OBJECT_PENDING when it never got ready or isn't a valid cache
+static uint8_t attachObject(uint64_t fingerprint, fat_Shared* shared)
+{
+    memset(shared, 0, sizeof(fat_Shared));
+
+    char name[FAT_SHARED_NAME];
+    fat_sharedName(fingerprint, name);
+
+    for (unsigned waited = 0; ; ++waited)
+    {
+        uint8_t state = mapObject(name, shared);
+        if (state == OBJECT_MISSING)
+            return OBJECT_MISSING;
+
+        if (state == OBJECT_MAPPED)
+        {
+            const volatile fat_SharedHeader* header = shared->data;
+            if (header->ready)
+            {
+                barrier();
+                if (attachData(shared, fingerprint))
+                    return OBJECT_MAPPED;
+
+                fat_sharedClose(shared);
+                return OBJECT_PENDING;
+            }
+
+            fat_sharedClose(shared);                                // still being filled
+        }
+
+        if (waited == FAT_SHARED_WAIT)                              // the publisher is gone, see fat_sharedRemove
+            return OBJECT_PENDING;
+        sleepMillisecond();
+    }
+}
+
+uint8_t fat_sharedOpen(uint64_t fingerprint, fat_Shared* shared)
+{
+    assert(shared != NULL);
+
+    return attachObject(fingerprint, shared) == OBJECT_MAPPED;
+}
+
+// Lays the decoded FAT and the index out behind the header, the ready flag stays 0
+static uint8_t buildImage(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, const uint8_t* fat, uint64_t fingerprint, uint8_t** image, size_t* size)
+{
+    void* index;
+    uint32_t indexSize;
+    if (!fat_indexBuildImage(boot, partitionOffset, fetch, fat, &index, &indexSize))
+        return 0;
+
+    fat_SharedHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = FAT_SHARED_MAGIC;
+    header.version = FAT_SHARED_VERSION;
+    header.fingerprint = fingerprint;
+    header.type = fat_getType(boot);
+    header.entryCount = fat_countOfClusters(boot) + 2;
+    header.fatOffset = align8(sizeof(fat_SharedHeader));
+    header.indexOffset = align8(header.fatOffset + header.entryCount * sizeof(uint32_t));
+    header.indexSize = indexSize;
+    header.size = (uint64_t)header.indexOffset + indexSize;
+
+    *image = (header.size <= SIZE_MAX) ? calloc((size_t)header.size, 1) : NULL;
+    if (*image == NULL)
+    {
+        free(index);
+        return 0;
+    }
+
+    uint32_t* entries = (uint32_t*)(*image + header.fatOffset);
+    for (uint32_t cluster = 0; cluster < header.entryCount; ++cluster)
+        entries[cluster] = fat_fatEntry(header.type, fat, cluster);
+
+    memcpy(*image, &header, sizeof(header));
+    memcpy(*image + header.indexOffset, index, indexSize);
+    *size = (size_t)header.size;
+    free(index);
+    return 1;
+}
+
+// Creates the object and fills it, fails when another process created it first. On Windows the object
+// lives as long as a handle is open, owner keeps it until the publisher has attached.
+static uint8_t publish(const char* name, const uint8_t* image, size_t size, void** owner)
+{
+    *owner = NULL;
+
+#ifdef _WIN32
+    HANDLE map = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, name);
+    if (map == NULL)
+        return 0;
+    if (GetLastError() == ERROR_ALREADY_EXISTS)
+    {
+        CloseHandle(map);
+        return 0;
+    }
+
+    uint8_t* data = MapViewOfFile(map, FILE_MAP_WRITE, 0, 0, size);
+    if (data == NULL)
+    {
+        CloseHandle(map);
+        return 0;
+    }
+
+    memcpy(data, image, size);
+    barrier();
+    ((fat_SharedHeader*)data)->ready = 1;
+    UnmapViewOfFile(data);
+
+    *owner = map;
+    return 1;
+#else
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return 0;
+
+    void* data = MAP_FAILED;
+    if (ftruncate(fd, (off_t)size) == 0)
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return 0;
+    }
+
+    memcpy(data, image, size);
+    barrier();
+    ((fat_SharedHeader*)data)->ready = 1;
+    munmap(data, size);
+    return 1;
+#endif
+}
+
+uint8_t fat_sharedLoad(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, fat_Shared* shared)
+{
+    assert(boot != NULL);
+    assert(fetch != NULL);
+    assert(shared != NULL);
+
+    memset(shared, 0, sizeof(fat_Shared));
+
+    uint8_t* fat = fat_loadFat(boot, partitionOffset, fetch);
+    if (fat == NULL)
+        return 0;
+
+    uint64_t fingerprint = fat_indexFingerprintFat(boot, fat);
+    uint8_t state = attachObject(fingerprint, shared);
+    if (state != OBJECT_MISSING)                                    // a cache which never got ready isn't replaced here
+    {
+        free(fat);
+        return state == OBJECT_MAPPED;
+    }
+
+    uint8_t* image;
+    size_t size;
+    uint8_t built = buildImage(boot, partitionOffset, fetch, fat, fingerprint, &image, &size);
+    free(fat);
+    if (!built)
+        return 0;
+
+    char name[FAT_SHARED_NAME];
+    fat_sharedName(fingerprint, name);
+
+    void* owner;
+    uint8_t created = publish(name, image, size, &owner);
+    free(image);
+
+    uint8_t ok = fat_sharedOpen(fingerprint, shared);               // the loser of a race attaches to the copy of the winner
+#ifdef _WIN32
+    if (owner != NULL)
+        CloseHandle((HANDLE)owner);
+#endif
+    shared->created = ok && created;
+    return ok;
+}
+
+void fat_sharedClose(fat_Shared* shared)
+{
+    assert(shared != NULL);
+
+    if (shared->data != NULL)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(shared->data);
+        CloseHandle((HANDLE)shared->mapping);
+#else
+        munmap(shared->data, shared->size);
+#endif
+    }
+
+    memset(shared, 0, sizeof(fat_Shared));
+}
+
+uint8_t fat_sharedRemove(uint64_t fingerprint)
+{
+    char name[FAT_SHARED_NAME];
+    fat_sharedName(fingerprint, name);
+
+#ifdef _WIN32
+    return 0;                                                       // named mappings go with their last handle
+#else
+    return shm_unlink(name) == 0;
+#endif
+}
+
+uint32_t fat_sharedEntry(const fat_Shared* shared, uint32_t cluster)
+{
+    assert(shared != NULL);
+
+    return (cluster < shared->header->entryCount)
+        ? shared->fat[cluster]
+        : 0;
+}
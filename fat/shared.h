@@ -0,0 +1,71 @@
+#pragma once
+
+#include "fat.h"
+#include "index.h"
+
+#ifdef FAT_NO_HEAP
+#error "the shared cache is built on the heap before it is published, leave shared.c out of FAT_NO_HEAP builds"
+#endif
+
+// Cache of a volume in named shared memory, for processes which analyse the same image at the same time.
+// It holds the decoded FAT (one uint32_t per cluster) followed by the index of index.h. Both are offsets
+// only, so every process maps the cache at its own address, and the object is named after the fingerprint
+// of the volume. The first process decodes the FAT, scans the tree and publishes the result. The next ones
+// map it read-only without reading the image again, the pages are shared instead of copied.
+//
+// A cache is built in private memory and copied into the object once it is complete, the ready flag of
+// the header is set last. Two processes which start together both build it, the one creating the object
+// publishes and the other one drops its copy and attaches. On POSIX systems the object outlives the
+// processes until fat_sharedRemove (or a reboot), on Windows it is gone when the last process closes it.
+
+#define FAT_SHARED_MAGIC 0x4D485346                                 // "FSHM"
+#define FAT_SHARED_VERSION 0x01
+#define FAT_SHARED_NAME 0x20                                        // bytes of a name with its terminator
+#define FAT_SHARED_WAIT 0x03E8                                      // milliseconds to wait for a publishing process
+
+typedef struct fat_SharedHeader fat_SharedHeader;
+PACK(
+struct fat_SharedHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t fingerprint;
+	uint32_t ready;                                                 // set once everything else is in place
+	uint32_t type;                                                  // FatType of the volume
+	uint32_t entryCount;                                            // countOfClusters + 2
+	uint32_t fatOffset;
+	uint32_t indexOffset;
+	uint32_t indexSize;
+	uint64_t size;
+});
+
+typedef struct fat_Shared fat_Shared;
+struct fat_Shared
+{
+	const fat_SharedHeader* header;
+	const uint32_t* fat;                                            // decoded entries, indexed by cluster
+	fat_Index index;                                                // attached to the cache, not mapped by itself
+	uint8_t created;                                                // this process published the cache
+
+	void* data;
+	size_t size;
+	void* mapping;
+};
+
+// Gets the name of the shared memory object of fingerprint
+void fat_sharedName(uint64_t fingerprint, char name[FAT_SHARED_NAME]);
+
+// Attaches to the cache of fingerprint, fails when there is no complete cache of it. Reads nothing of the image.
+uint8_t fat_sharedOpen(uint64_t fingerprint, fat_Shared* shared);
+
+// Attaches to the cache of the volume, builds and publishes it first when there is none
+uint8_t fat_sharedLoad(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, fat_Shared* shared);
+
+// Unmaps the cache, it stays published for other processes
+void fat_sharedClose(fat_Shared* shared);
+
+// Removes the cache of fingerprint (also one left incomplete by a crashed process), attached processes keep their mapping
+uint8_t fat_sharedRemove(uint64_t fingerprint);
+
+// Gets the decoded FAT entry of cluster, 0 (free) outside of the volume
+uint32_t fat_sharedEntry(const fat_Shared* shared, uint32_t cluster);
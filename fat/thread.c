@@ -0,0 +1,207 @@
+#include "thread.h"
+
+static FAT_THREAD_LOCAL void* binding = NULL;
+
+void fat_threadBind(void* pointer)
+{
+    binding = pointer;
+}
+
+void* fat_threadBinding(void)
+{
+    return binding;
+}
+
+#ifndef FAT_NO_THREADS
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+typedef struct ThreadStart ThreadStart;
+struct ThreadStart
+{
+    threadFunction_t function;
+    void* argument;
+    void* binding;                                                  // of the starting thread
+};
+
+#ifdef _WIN32
+static DWORD WINAPI threadMain(LPVOID p)
+#else
+static void* threadMain(void* p)
+#endif
+{
+    ThreadStart start = *(ThreadStart*)p;                           // copy, the trampoline is ours to free
+    free(p);
+
+    binding = start.binding;
+    start.function(start.argument);
+    return 0;
+}
+
+uint8_t fat_threadStart(fat_Thread* thread, threadFunction_t function, void* argument)
+{
+    assert(thread != NULL);
+    assert(function != NULL);
+
+    ThreadStart* start = malloc(sizeof(ThreadStart));
+    if (start == NULL)
+        return 0;
+
+    start->function = function;
+    start->argument = argument;
+    start->binding = binding;
+
+#ifdef _WIN32
+    *thread = CreateThread(NULL, 0, threadMain, start, 0, NULL);
+    if (*thread != NULL)
+        return 1;
+#else
+    if (pthread_create(thread, NULL, threadMain, start) == 0)
+        return 1;
+#endif
+
+    free(start);
+    return 0;
+}
+
+void fat_threadJoin(fat_Thread thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+void fat_mutexInit(fat_Mutex* mutex)
+{
+#ifdef _WIN32
+    InitializeCriticalSection(mutex);
+#else
+    pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void fat_mutexDestroy(fat_Mutex* mutex)
+{
+#ifdef _WIN32
+    DeleteCriticalSection(mutex);
+#else
+    pthread_mutex_destroy(mutex);
+#endif
+}
+
+void fat_mutexLock(fat_Mutex* mutex)
+{
+#ifdef _WIN32
+    EnterCriticalSection(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+void fat_mutexUnlock(fat_Mutex* mutex)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+void fat_conditionInit(fat_Condition* condition)
+{
+#ifdef _WIN32
+    InitializeConditionVariable(condition);
+#else
+    pthread_cond_init(condition, NULL);
+#endif
+}
+
+void fat_conditionDestroy(fat_Condition* condition)
+{
+#ifdef _WIN32
+    (void)condition;                                                // nothing to free
+#else
+    pthread_cond_destroy(condition);
+#endif
+}
+
+void fat_conditionWait(fat_Condition* condition, fat_Mutex* mutex)
+{
+#ifdef _WIN32
+    SleepConditionVariableCS(condition, mutex, INFINITE);
+#else
+    pthread_cond_wait(condition, mutex);
+#endif
+}
+
+void fat_conditionSignal(fat_Condition* condition)
+{
+#ifdef _WIN32
+    WakeConditionVariable(condition);
+#else
+    pthread_cond_signal(condition);
+#endif
+}
+
+void fat_conditionBroadcast(fat_Condition* condition)
+{
+#ifdef _WIN32
+    WakeAllConditionVariable(condition);
+#else
+    pthread_cond_broadcast(condition);
+#endif
+}
+
+long fat_atomicIncrement(volatile long* value)
+{
+#ifdef _WIN32
+    return InterlockedIncrement(value);
+#else
+    return __sync_add_and_fetch(value, 1);
+#endif
+}
+
+long fat_atomicDecrement(volatile long* value)
+{
+#ifdef _WIN32
+    return InterlockedDecrement(value);
+#else
+    return __sync_sub_and_fetch(value, 1);
+#endif
+}
+
+unsigned fat_processorCount(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (unsigned)count : 1;
+#endif
+}
+
+#else
+
+long fat_atomicIncrement(volatile long* value)
+{
+    return ++*value;
+}
+
+long fat_atomicDecrement(volatile long* value)
+{
+    return --*value;
+}
+
+unsigned fat_processorCount(void)
+{
+    return 1;
+}
+
+#endif
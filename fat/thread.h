@@ -0,0 +1,64 @@
+#pragma once
+
+#include "fat.h"
+
+#ifdef FAT_NO_HEAP
+#error "threads are started with a heap allocated trampoline, leave thread.c out of FAT_NO_HEAP builds"
+#endif
+
+// Minimal threading layer for the parallel parts of the driver. Define FAT_NO_THREADS for embedded
+// builds: everything keeps working, it just runs on the calling thread.
+
+#ifndef FAT_NO_THREADS
+
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE fat_Thread;
+typedef CRITICAL_SECTION fat_Mutex;
+typedef CONDITION_VARIABLE fat_Condition;
+#else
+#include <pthread.h>
+typedef pthread_t fat_Thread;
+typedef pthread_mutex_t fat_Mutex;
+typedef pthread_cond_t fat_Condition;
+#endif
+
+typedef void(*threadFunction_t)(void* argument);
+
+// Starts function on a new thread
+uint8_t fat_threadStart(fat_Thread* thread, threadFunction_t function, void* argument);
+
+// Waits for the thread to finish
+void fat_threadJoin(fat_Thread thread);
+
+void fat_mutexInit(fat_Mutex* mutex);
+void fat_mutexDestroy(fat_Mutex* mutex);
+void fat_mutexLock(fat_Mutex* mutex);
+void fat_mutexUnlock(fat_Mutex* mutex);
+
+void fat_conditionInit(fat_Condition* condition);
+void fat_conditionDestroy(fat_Condition* condition);
+
+// Releases mutex while waiting, it is locked again on return
+void fat_conditionWait(fat_Condition* condition, fat_Mutex* mutex);
+void fat_conditionSignal(fat_Condition* condition);
+void fat_conditionBroadcast(fat_Condition* condition);
+
+#endif
+
+// Binds a pointer to the calling thread, threads started with fat_threadStart inherit the binding of the
+// thread that started them. A fetch has no context of its own, through the binding one fetch function can
+// serve a different volume on every thread (see batch.h).
+void fat_threadBind(void* binding);
+
+// Gets the pointer bound to the calling thread, NULL when nothing was bound
+void* fat_threadBinding(void);
+
+// Adds one to value and returns the result, atomic when threads are enabled
+long fat_atomicIncrement(volatile long* value);
+
+// Subtracts one from value and returns the result, atomic when threads are enabled
+long fat_atomicDecrement(volatile long* value);
+
+// Gets the amount of processors, 1 without threads
+unsigned fat_processorCount(void);
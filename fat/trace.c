@@ -0,0 +1,269 @@
+#include "trace.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+static FAT_THREAD_LOCAL uint8_t currentOp = FAT_TRACE_OP_NONE;
+
+uint64_t fat_traceClock(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000 + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000 / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+#endif
+}
+
+static void flushRecords(fat_Trace* trace)
+{
+    if (trace->length > 0 && !trace->failed)
+        trace->failed = fwrite(trace->records, sizeof(fat_TraceRecord), trace->length, trace->file) != trace->length;
+    trace->length = 0;
+}
+
+uint8_t fat_traceOpen(const char* path, fat_Trace* trace)
+{
+    assert(path != NULL);
+    assert(trace != NULL);
+
+    memset(trace, 0, sizeof(fat_Trace));
+    trace->header.magic = FAT_TRACE_MAGIC;
+    trace->header.version = FAT_TRACE_VERSION;
+    trace->header.recordSize = sizeof(fat_TraceRecord);
+
+    trace->records = malloc(FAT_TRACE_BUFFER * sizeof(fat_TraceRecord));
+    trace->file = fopen(path, "wb");
+    if (trace->records == NULL || trace->file == NULL ||
+        fwrite(&trace->header, sizeof(fat_TraceHeader), 1, trace->file) != 1)   // rewritten when closed
+    {
+        if (trace->file != NULL)
+            fclose(trace->file);
+        free(trace->records);
+        return 0;
+    }
+
+#ifndef FAT_NO_THREADS
+    fat_mutexInit(&trace->lock);
+#endif
+    trace->opened = fat_traceClock();
+    return 1;
+}
+
+uint8_t fat_traceClose(fat_Trace* trace)
+{
+    assert(trace != NULL);
+
+    if (trace->file == NULL)
+        return 0;
+
+    flushRecords(trace);
+    uint8_t ok = !trace->failed &&
+        fseek(trace->file, 0, SEEK_SET) == 0 &&
+        fwrite(&trace->header, sizeof(fat_TraceHeader), 1, trace->file) == 1;
+    ok &= fclose(trace->file) == 0;
+
+    free(trace->records);
+#ifndef FAT_NO_THREADS
+    fat_mutexDestroy(&trace->lock);
+#endif
+    memset(trace, 0, sizeof(fat_Trace));
+    return ok;
+}
+
+void fat_traceSetVolume(fat_Trace* trace, const fat_BootSector* boot, unsigned partitionOffset)
+{
+    assert(trace != NULL);
+    assert(boot != NULL);
+
+    uint64_t regions[FAT_TRACE_REGIONS];                            // the header is packed, filled in one copy
+    regions[FAT_TRACE_REGION_RESERVED] = partitionOffset;
+    regions[FAT_TRACE_REGION_FAT] = fat_sectorToAddress(boot, partitionOffset, boot->reservedSectors);
+    regions[FAT_TRACE_REGION_ROOT] = regions[FAT_TRACE_REGION_FAT] + (uint64_t)boot->numberOfFATs * fat_fatSize(boot);
+    regions[FAT_TRACE_REGION_DATA] = fat_clusterToAddress(boot, partitionOffset, 2);   // FAT32 has an empty root region
+    memcpy(trace->header.regions, regions, sizeof(regions));
+    trace->header.clusterSize = fat_clusterSize(boot);
+}
+
+uint8_t fat_traceSetOp(uint8_t op)
+{
+    uint8_t previous = currentOp;
+    currentOp = op;
+    return previous;
+}
+
+void fat_traceRecord(fat_Trace* trace, uint64_t address, unsigned count, uint64_t start, uint8_t ok)
+{
+    assert(trace != NULL);
+
+    uint64_t end = fat_traceClock();
+    fat_TraceRecord record;
+    record.address = address;
+    record.start = start - trace->opened;
+    record.duration = (end - start > 0xFFFFFFFF) ? 0xFFFFFFFF : (uint32_t)(end - start);
+    record.count = count;
+    record.op = currentOp;
+    record.ok = ok;
+    record.reserved = 0;
+
+#ifndef FAT_NO_THREADS
+    fat_mutexLock(&trace->lock);
+#endif
+    trace->records[trace->length++] = record;
+    ++trace->header.recordCount;
+    if (trace->length == FAT_TRACE_BUFFER)
+        flushRecords(trace);
+#ifndef FAT_NO_THREADS
+    fat_mutexUnlock(&trace->lock);
+#endif
+}
+
+uint8_t fat_traceLoad(const char* path, fat_TraceHeader* header, fat_TraceRecord** records, uint64_t* count)
+{
+    assert(path != NULL);
+    assert(header != NULL);
+    assert(records != NULL);
+    assert(count != NULL);
+
+    *records = NULL;
+    *count = 0;
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return 0;
+
+    if (fread(header, sizeof(fat_TraceHeader), 1, file) != 1 || header->magic != FAT_TRACE_MAGIC ||
+        header->version != FAT_TRACE_VERSION || header->recordSize != sizeof(fat_TraceRecord))
+    {
+        fclose(file);
+        return 0;
+    }
+
+    // the records are read until the end, a trace which wasn't closed has a count of 0 in its header
+    uint64_t capacity = 0;
+    uint8_t ok = 1;
+    for (;;)
+    {
+        if (*count == capacity)
+        {
+            capacity = (capacity == 0) ? FAT_TRACE_BUFFER : capacity * 2;
+            fat_TraceRecord* grown = realloc(*records, (size_t)capacity * sizeof(fat_TraceRecord));
+            if (grown == NULL)
+            {
+                ok = 0;
+                break;
+            }
+            *records = grown;
+        }
+
+        size_t read = fread(*records + *count, sizeof(fat_TraceRecord), (size_t)(capacity - *count), file);
+        *count += read;
+        if (*count < capacity)
+            break;
+    }
+
+    ok &= !ferror(file);
+    fclose(file);
+    if (!ok)
+    {
+        free(*records);
+        *records = NULL;
+        *count = 0;
+    }
+    return ok;
+}
+
+uint8_t fat_traceRegion(const fat_TraceHeader* header, uint64_t address)
+{
+    assert(header != NULL);
+
+    uint8_t region = FAT_TRACE_REGION_DATA;
+    while (region > FAT_TRACE_REGION_RESERVED && address < header->regions[region])
+        --region;
+    return region;
+}
+
+uint64_t fat_traceModelDelay(const fat_TraceModel* model, const fat_TraceRecord* record, uint64_t previousEnd)
+{
+    assert(model != NULL);
+    assert(record != NULL);
+
+    uint64_t delay = model->latency;
+    if (record->address != previousEnd)
+        delay += model->seek;
+    if (model->bandwidth != 0)
+        delay += (uint64_t)record->count * 1000000000 / model->bandwidth;
+    return delay;
+}
+
+// Orders byte ranges (start and end) by start
+static int compareRanges(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void countRequest(fat_TraceRegion* region, const fat_TraceRecord* record, uint8_t sequential)
+{
+    ++region->requests;
+    region->bytes += record->count;
+    region->sequential += sequential;
+}
+
+uint8_t fat_traceLocality(const fat_TraceHeader* header, const fat_TraceRecord* records, uint64_t count, fat_TraceLocality* locality)
+{
+    assert(header != NULL);
+    assert(records != NULL || count == 0);
+    assert(locality != NULL);
+
+    memset(locality, 0, sizeof(fat_TraceLocality));
+
+    uint64_t* ranges = malloc((size_t)(count + 1) * 2 * sizeof(uint64_t));
+    if (ranges == NULL)
+        return 0;
+
+    uint64_t previousEnd = UINT64_MAX;
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        const fat_TraceRecord* record = &records[i];
+        uint8_t sequential = record->address == previousEnd;
+        if (sequential)
+            ++locality->sequential;
+        else if (record->address > previousEnd && record->address - previousEnd <= FAT_TRACE_NEAR)
+            ++locality->near;
+        else
+            ++locality->random;
+
+        ++locality->requests;
+        locality->bytes += record->count;
+        countRequest(&locality->regions[fat_traceRegion(header, record->address)], record, sequential);
+        countRequest(&locality->ops[(record->op < FAT_TRACE_OPS) ? record->op : FAT_TRACE_OP_NONE], record, sequential);
+
+        previousEnd = record->address + record->count;
+        ranges[i * 2] = record->address;
+        ranges[i * 2 + 1] = previousEnd;
+    }
+
+    // bytes read more than once count once: merge the ranges in address order
+    qsort(ranges, (size_t)count, 2 * sizeof(uint64_t), compareRanges);
+    uint64_t covered = 0;
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        uint64_t start = (ranges[i * 2] > covered) ? ranges[i * 2] : covered;
+        if (ranges[i * 2 + 1] > start)
+        {
+            locality->uniqueBytes += ranges[i * 2 + 1] - start;
+            covered = ranges[i * 2 + 1];
+        }
+    }
+
+    free(ranges);
+    return 1;
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "fat.h"
+#include "thread.h"
+
+#ifdef FAT_NO_HEAP
+#error "the trace buffers its records on the heap, leave trace.c out of FAT_NO_HEAP builds"
+#endif
+
+// Fetch traces: every read of a device (see fat_deviceTrace) or of any fetch that calls fat_traceRecord
+// is stored as one fixed size record of address, length, start, duration and the operation of the
+// calling thread. Operations are set per thread with fat_traceSetOp, the walk labels its FAT and
+// directory reads and the hashing its data reads, so the trace tells which part of the driver asked.
+// Records are collected in a buffer of FAT_TRACE_BUFFER records and appended to the file when it fills up.
+//
+// The trace header holds the regions of the volume (set with fat_traceSetVolume), so a trace can be
+// analyzed without the image: fat_traceLocality counts sequential and random requests per region.
+
+#define FAT_TRACE_MAGIC 0x43525446                                  // "FTRC"
+#define FAT_TRACE_VERSION 0x01
+#define FAT_TRACE_BUFFER 0x1000                                     // records
+#define FAT_TRACE_NEAR 0x10000                                      // a forward skip up to this is near, further is random
+
+#define FAT_TRACE_OP_NONE 0x00                                      // not labelled
+#define FAT_TRACE_OP_MOUNT 0x01                                     // MBR and boot sector
+#define FAT_TRACE_OP_FAT 0x02
+#define FAT_TRACE_OP_DIRECTORY 0x03
+#define FAT_TRACE_OP_DATA 0x04
+#define FAT_TRACE_OPS 0x05                                          // tools may use higher values of their own
+
+#define FAT_TRACE_REGION_RESERVED 0x00                              // boot sector and reserved sectors
+#define FAT_TRACE_REGION_FAT 0x01                                   // every copy of the FAT
+#define FAT_TRACE_REGION_ROOT 0x02                                  // fixed root directory of FAT12/FAT16
+#define FAT_TRACE_REGION_DATA 0x03
+#define FAT_TRACE_REGIONS 0x04
+
+typedef struct fat_TraceHeader fat_TraceHeader;
+PACK(
+struct fat_TraceHeader
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t recordSize;
+	uint64_t recordCount;                                           // written when the trace is closed
+	uint64_t regions[FAT_TRACE_REGIONS];                            // start address of each region, all 0 when unknown
+	uint32_t clusterSize;
+	uint32_t reserved;
+});
+
+typedef struct fat_TraceRecord fat_TraceRecord;
+PACK(
+struct fat_TraceRecord
+{
+	uint64_t address;
+	uint64_t start;                                                 // nanoseconds since the trace was opened
+	uint32_t duration;                                              // nanoseconds, saturates at 0xFFFFFFFF
+	uint32_t count;
+	uint8_t op;                                                     // FAT_TRACE_OP_*
+	uint8_t ok;                                                     // what the fetch returned
+	uint16_t reserved;
+});
+
+typedef struct fat_Trace fat_Trace;
+struct fat_Trace
+{
+	FILE* file;
+	fat_TraceHeader header;
+	uint64_t opened;                                                // fat_traceClock at open
+	fat_TraceRecord* records;                                       // FAT_TRACE_BUFFER
+	uint32_t length;
+	uint8_t failed;
+#ifndef FAT_NO_THREADS
+	fat_Mutex lock;
+#endif
+};
+
+// Delay a slow medium adds to a request: latency for every request, seek when it doesn't continue
+// where the previous request ended and the transfer at bandwidth bytes per second (0 is unlimited)
+typedef struct fat_TraceModel fat_TraceModel;
+struct fat_TraceModel
+{
+	uint32_t latency;                                               // nanoseconds
+	uint32_t seek;                                                  // nanoseconds
+	uint64_t bandwidth;
+};
+
+typedef struct fat_TraceRegion fat_TraceRegion;
+struct fat_TraceRegion
+{
+	uint64_t requests;
+	uint64_t bytes;
+	uint64_t sequential;                                            // requests which continue the previous one
+};
+
+typedef struct fat_TraceLocality fat_TraceLocality;
+struct fat_TraceLocality
+{
+	uint64_t requests;
+	uint64_t bytes;
+	uint64_t sequential;                                            // starts where the previous request ended
+	uint64_t near;                                                  // skips forward up to FAT_TRACE_NEAR bytes
+	uint64_t random;                                                // anything else, backwards included
+	uint64_t uniqueBytes;                                           // bytes read at least once
+	fat_TraceRegion regions[FAT_TRACE_REGIONS];
+	fat_TraceRegion ops[FAT_TRACE_OPS];                             // higher operations are counted as FAT_TRACE_OP_NONE
+};
+
+// Monotonic clock in nanoseconds
+uint64_t fat_traceClock(void);
+
+// Creates the trace file at path
+uint8_t fat_traceOpen(const char* path, fat_Trace* trace);
+
+// Writes the remaining records and the final header, returns 0 when any write failed
+uint8_t fat_traceClose(fat_Trace* trace);
+
+// Stores the regions of the volume in the header
+void fat_traceSetVolume(fat_Trace* trace, const fat_BootSector* boot, unsigned partitionOffset);
+
+// Sets the operation of the calling thread for the following records, returns the previous one
+uint8_t fat_traceSetOp(uint8_t op);
+
+// Records a fetch which started at start (fat_traceClock) and just returned ok, safe to call from several threads
+void fat_traceRecord(fat_Trace* trace, uint64_t address, unsigned count, uint64_t start, uint8_t ok);
+
+// Reads a trace file, free records when done
+uint8_t fat_traceLoad(const char* path, fat_TraceHeader* header, fat_TraceRecord** records, uint64_t* count);
+
+// Gets the region of address, FAT_TRACE_REGION_DATA when the header has no regions
+uint8_t fat_traceRegion(const fat_TraceHeader* header, uint64_t address);
+
+// Nanoseconds model adds to record, previousEnd is where the request before it ended
+uint64_t fat_traceModelDelay(const fat_TraceModel* model, const fat_TraceRecord* record, uint64_t previousEnd);
+
+// Counts the access pattern of count records in the order they were recorded
+uint8_t fat_traceLocality(const fat_TraceHeader* header, const fat_TraceRecord* records, uint64_t count, fat_TraceLocality* locality);
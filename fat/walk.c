@@ -0,0 +1,425 @@
+#include "walk.h"
+#include "thread.h"
+#include "trace.h"
+
+typedef struct WalkDirectory WalkDirectory;
+struct WalkDirectory
+{
+    WalkDirectory* parent;                                          // NULL for the root
+    fat_WalkEntry self;                                             // entry in the parent, for the post-order visit
+    uint32_t cluster;
+    uint32_t depth;
+    volatile long pending;                                          // own scan plus the unfinished subdirectories
+};
+
+// Directories of one worker, the owner works at the tail and thieves take from the head
+typedef struct Deque Deque;
+struct Deque
+{
+    WalkDirectory** items;
+    uint32_t head, tail, capacity;
+#ifndef FAT_NO_THREADS
+    fat_Mutex lock;
+#endif
+};
+
+typedef struct Walker Walker;
+struct Walker
+{
+    const fat_BootSector* boot;
+    unsigned partitionOffset;
+    fetchData_t fetch;
+    walkVisit_t visit;
+    void* context;
+    uint8_t order;
+
+    uint8_t* fat;
+    uint32_t rootCluster;
+    uint32_t lastCluster;
+
+    Deque* deques;
+    volatile long queued;                                           // directories waiting in the deques
+    volatile long outstanding;                                      // directories not scanned yet
+    volatile uint8_t stop;
+    volatile uint8_t failed;
+#ifndef FAT_NO_THREADS
+    fat_Mutex idleLock;
+    fat_Condition idle;
+    unsigned sleeping;
+#endif
+};
+
+typedef struct Worker Worker;
+struct Worker
+{
+    Walker* walker;
+    unsigned index;
+    unsigned count;
+    uint8_t* buffer;                                                // one cluster
+};
+
+static void dequeLock(Deque* deque)
+{
+#ifndef FAT_NO_THREADS
+    fat_mutexLock(&deque->lock);
+#else
+    (void)deque;
+#endif
+}
+
+static void dequeUnlock(Deque* deque)
+{
+#ifndef FAT_NO_THREADS
+    fat_mutexUnlock(&deque->lock);
+#else
+    (void)deque;
+#endif
+}
+
+static uint8_t push(Walker* w, unsigned index, WalkDirectory* directory)
+{
+    Deque* deque = &w->deques[index];
+    dequeLock(deque);
+
+    if (deque->head == deque->tail)                                 // empty, start over at the front
+        deque->head = deque->tail = 0;
+
+    if (deque->tail == deque->capacity)
+    {
+        if (deque->head > 0)                                        // room left at the front
+        {
+            memmove(deque->items, deque->items + deque->head, (deque->tail - deque->head) * sizeof(WalkDirectory*));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        }
+        else
+        {
+            uint32_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+            WalkDirectory** items = realloc(deque->items, capacity * sizeof(WalkDirectory*));
+            if (items == NULL)
+            {
+                dequeUnlock(deque);
+                return 0;
+            }
+
+            deque->items = items;
+            deque->capacity = capacity;
+        }
+    }
+
+    deque->items[deque->tail++] = directory;
+    dequeUnlock(deque);
+
+    fat_atomicIncrement(&w->queued);
+#ifndef FAT_NO_THREADS
+    fat_mutexLock(&w->idleLock);                                    // after queued, so a worker going to sleep can't miss it
+    if (w->sleeping > 0)
+        fat_conditionSignal(&w->idle);
+    fat_mutexUnlock(&w->idleLock);
+#endif
+    return 1;
+}
+
+static WalkDirectory* take(Walker* w, unsigned index, uint8_t steal)
+{
+    Deque* deque = &w->deques[index];
+    WalkDirectory* directory = NULL;
+
+    dequeLock(deque);
+    if (deque->head != deque->tail)
+        directory = steal ? deque->items[deque->head++] : deque->items[--deque->tail];
+    dequeUnlock(deque);
+
+    if (directory != NULL)
+        fat_atomicDecrement(&w->queued);
+    return directory;
+}
+
+static WalkDirectory* next(Worker* worker)
+{
+    WalkDirectory* directory = take(worker->walker, worker->index, 0);  // newest of our own first
+    for (unsigned i = 1; directory == NULL && i < worker->count; ++i)
+        directory = take(worker->walker, (worker->index + i) % worker->count, 1);   // oldest of another
+
+    return directory;
+}
+
+static uint8_t report(Walker* w, const fat_WalkEntry* entry)
+{
+    uint8_t result = w->visit(entry, w->context);
+    if (result == FAT_WALK_STOP)
+        w->stop = 1;
+
+    return result;
+}
+
+// Drops the part directory had in its own pending count and finishes every directory that completes by it
+static void finish(Walker* w, WalkDirectory* directory)
+{
+    while (directory != NULL && fat_atomicDecrement(&directory->pending) == 0)
+    {
+        WalkDirectory* parent = directory->parent;
+        if (parent != NULL && (w->order & FAT_WALK_POST) && !w->stop)
+            report(w, &directory->self);
+
+        free(directory);
+        directory = parent;
+    }
+}
+
+static void complete(Walker* w, WalkDirectory* directory)
+{
+    finish(w, directory);
+    if (fat_atomicDecrement(&w->outstanding) == 0)
+    {
+#ifndef FAT_NO_THREADS
+        fat_mutexLock(&w->idleLock);                                // the whole tree has been walked
+        fat_conditionBroadcast(&w->idle);
+        fat_mutexUnlock(&w->idleLock);
+#endif
+    }
+}
+
+// Checks if cluster can be descended into, a directory pointing to one of its parents would never end
+static uint8_t validDirectory(const Walker* w, const WalkDirectory* directory, uint32_t cluster)
+{
+    if (cluster < 2 || cluster > w->lastCluster)
+        return 0;
+
+    for (; directory != NULL; directory = directory->parent)
+    {
+        if ((directory->parent == NULL ? w->rootCluster : directory->cluster) == cluster)
+            return 0;
+    }
+
+    return 1;
+}
+
+static void scan(Worker* worker, WalkDirectory* directory)
+{
+    Walker* w = worker->walker;
+
+    fat_DirectoryIterator it;
+    fat_openDirectory(w->boot, directory->cluster, &it);
+    it.table = w->fat;
+    it.buffer = worker->buffer;
+
+    fat_WalkEntry entry;
+    entry.parent = (directory->parent != NULL) ? &directory->self : NULL;
+    entry.directoryCluster = directory->cluster;
+    entry.depth = directory->depth;
+    entry.iterator = &it;
+
+    uint8_t lazy = (w->order & FAT_WALK_LAZY_NAMES) != 0;
+    uint8_t op = fat_traceSetOp(FAT_TRACE_OP_DIRECTORY);           // the visits may read data, they label their own
+    while (!w->stop && fat_readDirectory(w->boot, w->partitionOffset, w->fetch, &it, &entry.entry, lazy ? NULL : entry.fileName, sizeof(entry.fileName)))
+    {
+        if ((entry.entry.fileAttributes & FAT_FILE_ATTR_VOLUME) || entry.entry.fileName[0] == '.')
+            continue;                                               // volume label, "." and ".."
+
+        uint8_t result = FAT_WALK_CONTINUE;
+        if (!(entry.entry.fileAttributes & FAT_FILE_ATTR_DIRECTORY))
+        {
+            if (lazy)
+                entry.fileName[0] = 0;
+
+            entry.order = (w->order & FAT_WALK_PRE) ? FAT_WALK_PRE : FAT_WALK_POST;
+            report(w, &entry);
+            continue;
+        }
+
+        if (lazy)                                                   // directories always have their name, it's in the parent chain
+            fat_directoryFileName(&it, &entry.entry, entry.fileName, sizeof(entry.fileName));
+
+        if (w->order & FAT_WALK_PRE)
+        {
+            entry.order = FAT_WALK_PRE;
+            result = report(w, &entry);
+            if (result == FAT_WALK_STOP)
+                break;
+        }
+
+        uint32_t cluster = entry.entry.clusterHigh << 16 | entry.entry.clusterLow;
+        if (result == FAT_WALK_SKIP || !validDirectory(w, directory, cluster))
+        {
+            if (w->order & FAT_WALK_POST)                           // nothing to wait for
+            {
+                entry.order = FAT_WALK_POST;
+                report(w, &entry);
+            }
+            continue;
+        }
+
+        WalkDirectory* child = malloc(sizeof(WalkDirectory));
+        if (child == NULL)
+        {
+            w->failed = w->stop = 1;
+            break;
+        }
+
+        child->parent = directory;
+        child->self = entry;
+        child->self.order = FAT_WALK_POST;
+        child->self.iterator = NULL;
+        child->cluster = cluster;
+        child->depth = directory->depth + 1;
+        child->pending = 1;
+
+        fat_atomicIncrement(&directory->pending);
+        fat_atomicIncrement(&w->outstanding);
+        if (!push(w, worker->index, child))
+        {
+            w->failed = w->stop = 1;
+            complete(w, child);
+            break;
+        }
+    }
+
+    if (!w->stop && !fat_endOfDirectory(&it))                       // fetch failed
+        w->failed = w->stop = 1;
+    fat_traceSetOp(op);
+}
+
+void fat_walkFileName(const fat_WalkEntry* entry, char* fileName, unsigned nameLen)
+{
+    assert(entry != NULL);
+    assert(fileName != NULL && nameLen > 0);
+
+    if (entry->fileName[0] != 0 || entry->iterator == NULL)         // already decoded
+    {
+        strncpy(fileName, entry->fileName, nameLen);
+        fileName[nameLen - 1] = 0;
+    }
+    else
+        fat_directoryFileName(entry->iterator, &entry->entry, fileName, nameLen);
+}
+
+static void walkWorker(void* argument)
+{
+    Worker* worker = argument;
+    Walker* w = worker->walker;
+
+    for (;;)
+    {
+        WalkDirectory* directory = next(worker);
+        if (directory != NULL)
+        {
+            if (!w->stop)                                           // after a stop the rest is only cleaned up
+                scan(worker, directory);
+            complete(w, directory);
+            continue;
+        }
+
+#ifndef FAT_NO_THREADS
+        fat_mutexLock(&w->idleLock);                                // nothing to steal, wait for new directories
+        while (w->queued == 0 && w->outstanding > 0)
+        {
+            ++w->sleeping;
+            fat_conditionWait(&w->idle, &w->idleLock);
+            --w->sleeping;
+        }
+
+        uint8_t done = w->outstanding == 0;
+        fat_mutexUnlock(&w->idleLock);
+        if (done)
+            break;
+#else
+        break;                                                      // alone, an empty deque means done
+#endif
+    }
+}
+
+uint8_t fat_walk(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, unsigned threads, uint8_t order, walkVisit_t visit, void* context)
+{
+    assert(boot != NULL);
+    assert(fetch != NULL);
+    assert(visit != NULL);
+
+    Walker w;
+    memset(&w, 0, sizeof(Walker));
+    w.boot = boot;
+    w.partitionOffset = partitionOffset;
+    w.fetch = fetch;
+    w.visit = visit;
+    w.context = context;
+    w.order = order;
+    w.rootCluster = fat_rootCluster(boot);
+    w.lastCluster = fat_countOfClusters(boot) + 1;
+
+#ifdef FAT_NO_THREADS
+    threads = 1;
+#else
+    if (threads == 0)
+        threads = fat_processorCount();
+#endif
+
+    uint8_t op = fat_traceSetOp(FAT_TRACE_OP_FAT);
+    w.fat = fat_loadFat(boot, partitionOffset, fetch);
+    fat_traceSetOp(op);
+    w.deques = calloc(threads, sizeof(Deque));
+    Worker* workers = calloc(threads, sizeof(Worker));
+    WalkDirectory* root = calloc(1, sizeof(WalkDirectory));
+    uint8_t ok = w.fat != NULL && w.deques != NULL && workers != NULL && root != NULL;
+
+    for (unsigned i = 0; ok && i < threads; ++i)
+    {
+        workers[i].walker = &w;
+        workers[i].index = i;
+        workers[i].count = threads;
+        workers[i].buffer = malloc(fat_clusterSize(boot));
+        ok = workers[i].buffer != NULL;
+    }
+
+    if (ok)
+    {
+#ifndef FAT_NO_THREADS
+        fat_mutexInit(&w.idleLock);
+        fat_conditionInit(&w.idle);
+        for (unsigned i = 0; i < threads; ++i)
+            fat_mutexInit(&w.deques[i].lock);
+#endif
+
+        root->cluster = FAT_DIRECTORY_ROOT;
+        root->pending = 1;
+        w.outstanding = 1;
+        ok = push(&w, 0, root);
+        if (ok)
+            root = NULL;                                            // freed by the walk
+
+#ifndef FAT_NO_THREADS
+        fat_Thread* handles = malloc(threads * sizeof(fat_Thread));
+        unsigned started = 0;
+        for (unsigned i = 1; ok && handles != NULL && i < threads; ++i, ++started)
+        {
+            if (!fat_threadStart(&handles[started], walkWorker, &workers[i]))
+                break;                                              // the deques of the others stay empty
+        }
+
+        if (ok)
+            walkWorker(&workers[0]);                                // the caller is worker 0
+
+        for (unsigned i = 0; i < started; ++i)
+            fat_threadJoin(handles[i]);
+        free(handles);
+
+        for (unsigned i = 0; i < threads; ++i)
+            fat_mutexDestroy(&w.deques[i].lock);
+        fat_conditionDestroy(&w.idle);
+        fat_mutexDestroy(&w.idleLock);
+#else
+        if (ok)
+            walkWorker(&workers[0]);
+#endif
+    }
+
+    for (unsigned i = 0; workers != NULL && i < threads; ++i)
+        free(workers[i].buffer);
+    for (unsigned i = 0; w.deques != NULL && i < threads; ++i)
+        free(w.deques[i].items);
+
+    free(root);
+    free(workers);
+    free(w.deques);
+    free(w.fat);
+    return ok && !w.failed;
+}
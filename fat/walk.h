@@ -0,0 +1,43 @@
+#pragma once
+
+#include "fat.h"
+
+#ifdef FAT_NO_HEAP
+#error "the walk allocates its directory tasks, leave walk.c out of FAT_NO_HEAP builds"
+#endif
+
+// Visits every entry of the volume. Directories are tasks of a work-stealing pool: every worker takes
+// the directories it found itself first (depth first, close on disk) and steals the oldest directory
+// of another worker when it runs out, so wide and deep trees keep all workers busy. With one thread
+// (or FAT_NO_THREADS) everything runs on the calling thread.
+
+#define FAT_WALK_PRE 0x01                                           // visit directories before their content
+#define FAT_WALK_POST 0x02                                          // visit directories after their content
+#define FAT_WALK_LAZY_NAMES 0x04                                    // leave the name of files empty, see fat_walkFileName
+
+#define FAT_WALK_CONTINUE 0x00
+#define FAT_WALK_SKIP 0x01                                          // don't descend into this directory
+#define FAT_WALK_STOP 0x02                                          // stop the whole walk
+
+typedef struct fat_WalkEntry fat_WalkEntry;
+struct fat_WalkEntry
+{
+	fat_DirectoryEntry entry;
+	char fileName[FAT_LFN_MAX_LENGTH + 1];
+	const fat_WalkEntry* parent;                                    // directory holding the entry, NULL in the root
+	uint32_t directoryCluster;                                      // start cluster of that directory, 0 for the root
+	uint32_t depth;                                                 // 0 in the root
+	uint8_t order;                                                  // FAT_WALK_PRE or FAT_WALK_POST
+	const fat_DirectoryIterator* iterator;                          // directory being read, only during the visit
+};
+
+// Called for every entry, returns FAT_WALK_*. Files are visited once, directories once per order asked
+// for; a skipped directory still gets its post-order visit. The parent chain stays valid during the call.
+typedef uint8_t(*walkVisit_t)(const fat_WalkEntry* entry, void* context);
+
+// Walks the tree below the root, order is a combination of FAT_WALK_PRE, FAT_WALK_POST and FAT_WALK_LAZY_NAMES. With more than
+// one thread (0 is one per processor) visit and fetch are called from several threads at once.
+uint8_t fat_walk(const fat_BootSector* boot, unsigned partitionOffset, fetchData_t fetch, unsigned threads, uint8_t order, walkVisit_t visit, void* context);
+
+// Gets the name of the visited entry, with FAT_WALK_LAZY_NAMES the long name of a file is decoded here
+void fat_walkFileName(const fat_WalkEntry* entry, char* fileName, unsigned nameLen);
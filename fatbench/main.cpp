@@ -0,0 +1,290 @@
+#include "stdafx.h"
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define HAS_RDTSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAS_RDTSC
+#endif
+#include <chrono>
+#include <functional>
+
+using namespace std;
+
+fat_Device device;
+fat_BootSector boot;
+
+uint32_t offset = 0;
+uint64_t fetchCycles = 0;                                           // spent inside fetch, to tell the driver's own part
+
+uint64_t cycles()
+{
+#ifdef HAS_RDTSC
+    return __rdtsc();
+#else
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+uint8_t fetch(unsigned address, unsigned count, char* out)
+{
+    uint64_t start = cycles();
+    uint8_t ok = fat_deviceRead(&device, address, count, out);
+    fetchCycles += cycles() - start;
+    return ok;
+}
+
+struct Measurement
+{
+    const char* name;
+    uint64_t count = 0, total = 0, worst = 0, best = UINT64_MAX;
+    uint64_t ownWorst = 0;                                          // without the time spent in fetch
+
+    uint64_t start, fetchStart;
+
+    explicit Measurement(const char* name) : name(name) { }
+
+    void begin()
+    {
+        fetchStart = fetchCycles;
+        start = cycles();
+    }
+
+    void end()
+    {
+        uint64_t spent = cycles() - start;
+        uint64_t own = spent - (fetchCycles - fetchStart);
+
+        ++count;
+        total += spent;
+        worst = max(worst, spent);
+        best = min(best, spent);
+        ownWorst = max(ownWorst, own);
+    }
+
+    void print() const
+    {
+        if (count == 0)
+        {
+            cout << "  " << name << ": nothing measured" << endl;
+            return;
+        }
+
+        cout << "  " << name << ": 0x" << count << " ops" << endl;
+        cout << "    min/avg/max: 0x" << best << " / 0x" << total / count << " / 0x" << worst << endl;
+        cout << "    max without fetch: 0x" << ownWorst << endl;
+    }
+};
+
+void benchChain(unsigned count, const uint8_t* table)
+{
+    Measurement sector("fat_nextClusterEntry"), memory("fat_fatEntry");
+    FatType type = fat_getType(&boot);
+    uint32_t lastCluster = fat_countOfClusters(&boot) + 1;
+
+    for (uint32_t cluster = 2; cluster <= lastCluster && cluster < count + 2; ++cluster)
+    {
+        uint8_t eoc;
+        sector.begin();
+        fat_nextClusterEntry(&boot, offset, cluster, fetch, &eoc);
+        sector.end();
+
+        memory.begin();
+        fat_fatEntry(type, table, cluster);
+        memory.end();
+    }
+
+    sector.print();
+    memory.print();
+}
+
+void benchDirectory(unsigned count, fat_Arena* arena, const uint8_t* table)
+{
+    Measurement plain("fat_readDirectory"), buffered("fat_readDirectory (cluster buffer)"), name("fat_directoryFileName");
+
+    fat_DirectoryEntry entry;
+    char fileName[FAT_LFN_MAX_LENGTH + 1];
+
+    while (plain.count < count)                                     // the root over and over
+    {
+        fat_DirectoryIterator it;
+        fat_openDirectory(&boot, FAT_DIRECTORY_ROOT, &it);
+
+        uint64_t before = plain.count;
+        for (;;)
+        {
+            plain.begin();
+            uint8_t more = fat_readDirectory(&boot, offset, fetch, &it, &entry, nullptr, 0);
+            if (!more)
+                break;
+            plain.end();
+        }
+
+        if (plain.count == before)                                  // empty root
+            break;
+    }
+
+    uint32_t mark = fat_arenaMark(arena);
+    fat_DirectoryIterator* it = (fat_DirectoryIterator*)fat_arenaAlloc(arena, sizeof(fat_DirectoryIterator));
+    while (it != nullptr && buffered.count < count)
+    {
+        uint32_t iteratorMark = fat_arenaMark(arena);
+        if (!fat_openDirectoryArena(&boot, FAT_DIRECTORY_ROOT, arena, it))
+            break;
+        it->table = table;
+
+        uint64_t before = buffered.count;
+        for (;;)
+        {
+            buffered.begin();
+            uint8_t more = fat_readDirectory(&boot, offset, fetch, it, &entry, nullptr, 0);
+            if (!more)
+                break;
+            buffered.end();
+
+            name.begin();
+            fat_directoryFileName(it, &entry, fileName, sizeof(fileName));
+            name.end();
+        }
+
+        fat_arenaRelease(arena, iteratorMark);
+        if (buffered.count == before)
+            break;
+    }
+    fat_arenaRelease(arena, mark);
+
+    plain.print();
+    buffered.print();
+    name.print();
+}
+
+typedef function<bool(uint64_t address, unsigned count, char* out)> read_t;
+
+// Reads length bytes from start in requests of request bytes, returns the microseconds it took
+uint64_t timeReads(const read_t& read, uint64_t start, uint64_t length, unsigned request, vector<char>& buffer)
+{
+    auto begin = chrono::steady_clock::now();
+    for (uint64_t done = 0; done + request <= length; done += request)
+    {
+        if (!read(start + done, request, buffer.data()))
+            return 0;
+    }
+
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - begin).count();
+}
+
+// Compares the buffered fstream the dumpers use with positional and direct (past the page cache) reads
+void benchThroughput(const char* path, unsigned count)
+{
+    uint32_t clusterSize = fat_clusterSize(&boot);
+    uint64_t start = fat_clusterToAddress(&boot, offset, 2);
+    uint64_t length = min<uint64_t>((uint64_t)count * clusterSize, (uint64_t)fat_countOfClusters(&boot) * clusterSize);
+    length = min<uint64_t>(length, 0x4000000);
+    uint64_t smallLength = min<uint64_t>(length, 0x400000);         // 32 byte reads take long through fstream
+
+    fstream file(path, ios_base::in | ios_base::binary);
+    fat_Device plain, direct;
+    if (device.packed || !file.is_open() || !fat_deviceOpen(path, &plain))
+    {
+        cout << "  only raw images are compared" << endl;
+        return;
+    }
+
+    if (!fat_deviceOpenDirect(path, &direct))
+    {
+        cout << "  direct reads aren't supported here" << endl;
+        fat_deviceClose(&plain);
+        return;
+    }
+    fat_deviceSetSectorSize(&direct, boot.bytesPerSector);
+
+    read_t readers[] = {
+        [&](uint64_t address, unsigned size, char* out) { return fat_deviceRead(&direct, address, size, out) != 0; },
+        [&](uint64_t address, unsigned size, char* out) { return fat_deviceRead(&plain, address, size, out) != 0; },
+        [&](uint64_t address, unsigned size, char* out) { file.seekg(address); file.read(out, size); return file.good(); },
+    };
+    const char* names[] = { "direct", "pread", "fstream" };         // direct first, the others fill the page cache
+
+    vector<char> buffer(clusterSize);
+    for (int i = 0; i < 3; ++i)
+    {
+        uint64_t clusters = timeReads(readers[i], start, length, clusterSize, buffer);
+        uint64_t entries = timeReads(readers[i], start, smallLength, sizeof(fat_DirectoryEntry), buffer);
+
+        cout << "  " << names[i] << ": 0x" << (clusters ? length * 1000000 / clusters / 1024 : 0) << " KB/s in clusters, 0x"
+            << (entries ? smallLength * 1000000 / entries / 1024 : 0) << " KB/s in directory entries" << endl;
+    }
+
+    fat_deviceClose(&direct);
+    fat_deviceClose(&plain);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        cout << "Usage: " << "fatbench [image] [mbr] [count] [direct]" << endl;
+        cout << endl;
+        cout << "image: the file to be measured" << endl;
+        cout << "mbr: enter true if there is a mbr present otherwise enter false" << endl;
+        cout << "count: (optional) operations per measurement, defaults to 10000" << endl;
+        cout << "direct: (optional) enter true to measure the driver on direct reads (past the page cache)" << endl;
+        return -1;
+    }
+
+    bool direct = false;
+    if (argc > 4)
+        istringstream(argv[4]) >> boolalpha >> direct;
+
+    if (!(direct ? fat_deviceOpenDirect(argv[1], &device) : fat_deviceOpen(argv[1], &device)))
+    {
+        cout << "Couldn't open file? Check the path." << endl;
+        return -1;
+    }
+
+    bool mbr;
+    istringstream(argv[2]) >> boolalpha >> mbr;
+
+    if (mbr)
+        offset = fat_nextPartitionSector(fetch, &boot, nullptr);
+    else
+        fetch(0, sizeof(fat_BootSector), (char*)&boot);
+
+    fat_deviceSetSectorSize(&device, boot.bytesPerSector);
+
+    unsigned count = 0x10000;
+    if (argc > 3)
+        istringstream(argv[3]) >> hex >> count;
+
+    vector<uint8_t> memory(fat_fatSize(&boot) + sizeof(fat_DirectoryIterator) + fat_clusterSize(&boot) + 3 * FAT_ARENA_ALIGNMENT);
+    fat_Arena arena;                                                // everything the driver works with comes from here
+    fat_arenaInit(&arena, memory.data(), (uint32_t)memory.size());
+
+    const uint8_t* table = fat_readFatArena(&boot, offset, fetch, &arena);
+    if (table == nullptr)
+    {
+        cout << "Couldn't read the FAT." << endl;
+        fat_deviceClose(&device);
+        return -1;
+    }
+
+    cout << hex << setfill('0');
+#ifdef HAS_RDTSC
+    cout << "Cycles per operation (time stamp counter):" << endl;
+#else
+    cout << "Nanoseconds per operation:" << endl;
+#endif
+
+    benchChain(count, table);
+    benchDirectory(count, &arena, table);
+
+    cout << endl;
+    cout << "Arena: 0x" << arena.peak << " of 0x" << arena.size << " bytes used at most" << endl;
+
+    cout << endl << "Throughput:" << endl;
+    benchThroughput(argv[1], count);
+
+    fat_deviceClose(&device);
+    return 0;
+}
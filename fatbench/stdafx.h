@@ -0,0 +1,25 @@
+// stdafx.h : include file for standard system include files,
+// or project specific include files that are used frequently, but
+// are changed infrequently
+//
+
+#pragma once
+
+#include "targetver.h"
+
+#include <stdio.h>
+#include <cinttypes>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+extern "C" {
+#include "fat.h"
+#include "arena.h"
+#include "device.h"
+#include "container.h"
+}
+
+// TODO: reference additional headers your program requires here
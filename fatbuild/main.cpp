@@ -0,0 +1,611 @@
+#include "stdafx.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+#ifdef _WIN32
+typedef wstring HostPath;                                           // wide, so every name survives until it is converted to UTF-8
+#else
+typedef string HostPath;
+#endif
+
+const uint32_t batchSize = 0x400000;                                // bytes per write
+
+struct Node
+{
+    string name;                                                    // UTF-8
+    HostPath path;
+    uint64_t size;
+    bool directory;
+    tm modified;
+    uint32_t parent;
+    uint32_t cluster;
+    vector<uint32_t> children;
+    vector<fat_DirectoryEntry> entries;                             // directories: the content, long name slots included
+    vector<uint32_t> shortEntries;                                  // per child, its short entry in entries
+};
+
+vector<Node> nodes;
+fat_BootSector boot;
+fat_Builder builder;
+
+// The image, written at 64 bit addresses and sparse where the host file system supports it
+struct Output
+{
+#ifdef _WIN32
+    HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+    int fd = -1;
+#endif
+
+    bool open(const char* path, uint64_t size)
+    {
+#ifdef _WIN32
+        handle = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (handle == INVALID_HANDLE_VALUE)
+            return false;
+
+        DWORD returned;                                             // fails on file systems without sparse files, which is fine
+        DeviceIoControl(handle, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL);
+        LARGE_INTEGER end;
+        end.QuadPart = size;
+        return SetFilePointerEx(handle, end, NULL, FILE_BEGIN) && SetEndOfFile(handle);
+#else
+        fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        return fd >= 0 && ftruncate(fd, size) == 0;
+#endif
+    }
+
+    bool write(uint64_t address, const char* data, uint32_t count)
+    {
+        while (count > 0)
+        {
+#ifdef _WIN32
+            OVERLAPPED overlapped = {};
+            overlapped.Offset = (DWORD)address;
+            overlapped.OffsetHigh = (DWORD)(address >> 32);
+            DWORD written;
+            if (!WriteFile(handle, data, count, &written, &overlapped) || written == 0)
+                return false;
+#else
+            ssize_t written = pwrite(fd, data, count, address);
+            if (written <= 0)
+                return false;
+#endif
+            address += written;
+            data += written;
+            count -= (uint32_t)written;
+        }
+
+        return true;
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        CloseHandle(handle);
+        handle = INVALID_HANDLE_VALUE;
+#else
+        ::close(fd);
+        fd = -1;
+#endif
+    }
+};
+
+Output output;
+
+// Collects the data, which is laid out in address order, into large writes. The slack between two chains
+// (the rest of a cluster) is zeroed in the batch rather than starting a new write.
+struct Writer
+{
+    vector<char> batch = vector<char>(batchSize);
+    uint64_t address = 0;
+    uint32_t length = 0;
+    uint64_t written = 0;
+    uint32_t writes = 0;
+
+    // Returns room for count bytes (up to batchSize) at address
+    char* append(uint64_t at, uint32_t count)
+    {
+        uint64_t end = address + length;
+        if (length == 0 || at < end || at - end + count > batch.size() - length)
+        {
+            if (!flush())
+                return nullptr;
+            address = at;
+        }
+        else
+        {
+            memset(&batch[length], 0, (size_t)(at - end));
+            length += (uint32_t)(at - end);
+        }
+
+        char* room = &batch[length];
+        length += count;
+        return room;
+    }
+
+    bool flush()
+    {
+        if (length == 0)
+            return true;
+
+        bool ok = output.write(address, batch.data(), length);
+        written += length;
+        ++writes;
+        length = 0;
+        return ok;
+    }
+};
+
+Writer writer;
+
+uint8_t store(unsigned address, unsigned count, const char* data)
+{
+    return output.write(address, data, count);
+}
+
+#ifdef _WIN32
+string toUtf8(const wstring& text)
+{
+    int length = WideCharToMultiByte(CP_UTF8, 0, text.c_str(), (int)text.size(), NULL, 0, NULL, NULL);
+    string result(length, 0);
+    WideCharToMultiByte(CP_UTF8, 0, text.c_str(), (int)text.size(), &result[0], length, NULL, NULL);
+    return result;
+}
+#endif
+
+// Entry of a host directory
+struct Found
+{
+    string name;
+    HostPath path;
+    bool directory;
+    uint64_t size;
+    tm modified;
+};
+
+// Adds the entry found while listing parent, unless it can't be stored
+void addNode(uint32_t parent, const string& name, const HostPath& path, bool directory, uint64_t size, const tm& modified)
+{
+    fat_LongFileName slots[FAT_LFN_MAX_SLOTS];
+    uint8_t shortName[11];
+    if (!fat_shortName(name.c_str(), 0, shortName) && fat_longNameEntries(name.c_str(), shortName, slots) == 0)
+    {
+        cout << "Skipped, the name is too long: " << name << endl;
+        return;
+    }
+    if (!directory && size > 0xFFFFFFFF)
+    {
+        cout << "Skipped, larger than 4 GB: " << name << endl;
+        return;
+    }
+
+    Node node = {};
+    node.name = name;
+    node.path = path;
+    node.size = directory ? 0 : size;
+    node.directory = directory;
+    node.modified = modified;
+    node.parent = parent;
+    nodes.push_back(node);
+    nodes[parent].children.push_back((uint32_t)nodes.size() - 1);
+}
+
+// Lists the host directory of nodes[index], appending its files and subdirectories
+bool list(uint32_t index)
+{
+    HostPath path = nodes[index].path;                              // nodes grows while listing
+    vector<Found> found;
+
+#ifdef _WIN32
+    WIN32_FIND_DATAW data;
+    HANDLE find = FindFirstFileW((path + L"\\*").c_str(), &data);
+    if (find == INVALID_HANDLE_VALUE)
+    {
+        cout << "Couldn't list: " << toUtf8(path) << endl;
+        return false;
+    }
+
+    do
+    {
+        wstring name = data.cFileName;
+        if (name == L"." || name == L"..")
+            continue;
+
+        FILETIME local;
+        SYSTEMTIME system;
+        FileTimeToLocalFileTime(&data.ftLastWriteTime, &local);
+        FileTimeToSystemTime(&local, &system);
+
+        tm modified = {};
+        modified.tm_year = system.wYear - 1900;
+        modified.tm_mon = system.wMonth - 1;
+        modified.tm_mday = system.wDay;
+        modified.tm_hour = system.wHour;
+        modified.tm_min = system.wMinute;
+        modified.tm_sec = system.wSecond;
+
+        found.push_back({ toUtf8(name), path + L"\\" + name, (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0,
+            (uint64_t)data.nFileSizeHigh << 32 | data.nFileSizeLow, modified });
+    } while (FindNextFileW(find, &data));
+    FindClose(find);
+#else
+    DIR* directory = opendir(path.c_str());
+    if (directory == nullptr)
+    {
+        cout << "Couldn't list: " << path << endl;
+        return false;
+    }
+
+    while (dirent* next = readdir(directory))
+    {
+        string name = next->d_name;
+        if (name == "." || name == "..")
+            continue;
+
+        struct stat status;
+        string child = path + "/" + name;
+        if (stat(child.c_str(), &status) != 0 || !(S_ISDIR(status.st_mode) || S_ISREG(status.st_mode)))
+        {
+            cout << "Skipped, not a file or directory: " << child << endl;
+            continue;
+        }
+
+        tm modified;
+        localtime_r(&status.st_mtime, &modified);
+        found.push_back({ name, child, S_ISDIR(status.st_mode), (uint64_t)status.st_size, modified });
+    }
+    closedir(directory);
+#endif
+
+    sort(found.begin(), found.end(), [](const Found& a, const Found& b) { return a.name < b.name; });    // same image for the same tree
+
+    unordered_set<string> names;                                    // FAT names ignore case, the first one wins
+    for (const Found& entry : found)
+    {
+        char folded[FAT_LFN_MAX_LENGTH * 3 + 1];
+        fat_foldName(entry.name.c_str(), folded, sizeof(folded));
+        if (!names.insert(folded).second)
+        {
+            cout << "Skipped, the name only differs in case: " << entry.name << endl;
+            continue;
+        }
+
+        addNode(index, entry.name, entry.path, entry.directory, entry.size, entry.modified);
+    }
+
+    return true;
+}
+
+fat_DirectoryEntry makeEntry(const uint8_t* shortName, const Node& node)
+{
+    fat_DirectoryEntry entry = {};
+    memcpy(entry.fileName, shortName, sizeof(entry.fileName));
+    memcpy(entry.extension, shortName + 8, sizeof(entry.extension));
+    entry.fileAttributes = node.directory ? FAT_FILE_ATTR_DIRECTORY : FAT_FILE_ATTR_ARCHIVE;
+    entry.time = fat_makeTime(node.modified.tm_sec, node.modified.tm_min, node.modified.tm_hour);
+    entry.word = fat_makeDate(node.modified.tm_mday, node.modified.tm_mon + 1, node.modified.tm_year + 1900);
+    entry.timeCreatedHourMinute = entry.time;
+    entry.dateCreated = entry.word;
+    entry.dateAccessed = entry.word;
+    entry.fileSize = (uint32_t)node.size;
+    return entry;
+}
+
+// Makes the content of a directory, without the clusters which are only known after allocating
+bool makeEntries(uint32_t index)
+{
+    Node& directory = nodes[index];
+    if (index != 0)
+    {
+        directory.entries.push_back(makeEntry((const uint8_t*)".          ", directory));
+        directory.entries.push_back(makeEntry((const uint8_t*)"..         ", directory));
+    }
+
+    // Names which are valid short names keep them, the others get the first free numeric tail
+    vector<array<uint8_t, 11>> shortNames(directory.children.size());
+    vector<bool> exact(directory.children.size());
+    unordered_set<string> used;
+    for (size_t i = 0; i < directory.children.size(); ++i)
+    {
+        exact[i] = fat_shortName(nodes[directory.children[i]].name.c_str(), 0, shortNames[i].data()) != 0;
+        if (exact[i])
+            used.insert(string((const char*)shortNames[i].data(), 11));
+    }
+
+    unordered_map<string, uint32_t> tails;                          // next tail to try per name without tail
+    for (size_t i = 0; i < directory.children.size(); ++i)
+    {
+        if (exact[i])
+            continue;
+
+        const char* name = nodes[directory.children[i]].name.c_str();
+        uint32_t& tail = tails[string((const char*)shortNames[i].data(), 11)];
+        do
+        {
+            if (tail > 999999)
+                return false;
+            fat_shortName(name, tail++, shortNames[i].data());
+        } while (!used.insert(string((const char*)shortNames[i].data(), 11)).second);
+    }
+
+    for (size_t i = 0; i < directory.children.size(); ++i)
+    {
+        const Node& child = nodes[directory.children[i]];
+        if (!exact[i])
+        {
+            fat_LongFileName slots[FAT_LFN_MAX_SLOTS];
+            uint8_t count = fat_longNameEntries(child.name.c_str(), shortNames[i].data(), slots);
+            for (uint8_t j = 0; j < count; ++j)
+                directory.entries.push_back(*(fat_DirectoryEntry*)&slots[j]);
+        }
+
+        directory.shortEntries.push_back((uint32_t)directory.entries.size());
+        directory.entries.push_back(makeEntry(shortNames[i].data(), child));
+    }
+
+    return directory.entries.size() <= FAT_BUILD_MAX_ENTRIES;
+}
+
+void setCluster(fat_DirectoryEntry& entry, uint32_t cluster)
+{
+    entry.clusterHigh = (uint16_t)(cluster >> 16);
+    entry.clusterLow = (uint16_t)cluster;
+}
+
+// Allocates every chain in one pass: a directory, its files, then each subdirectory the same way.
+// Returns the nodes in the order of their clusters, empty when the image is too small.
+vector<uint32_t> allocate(FatType type)
+{
+    vector<uint32_t> order;
+    vector<uint32_t> pending(1, 0);
+    while (!pending.empty())
+    {
+        uint32_t index = pending.back();
+        pending.pop_back();
+
+        Node& directory = nodes[index];
+        if (index != 0 || type == FAT32)                            // the FAT12/FAT16 root has its own region
+        {
+            directory.cluster = fat_builderAllocate(&builder, (uint32_t)directory.entries.size() * sizeof(fat_DirectoryEntry));
+            if (directory.cluster == 0)
+                return vector<uint32_t>();
+        }
+        order.push_back(index);
+
+        size_t firstPending = pending.size();
+        for (uint32_t child : directory.children)
+        {
+            Node& node = nodes[child];
+            if (node.directory)
+            {
+                pending.push_back(child);
+                continue;
+            }
+            if (node.size == 0)                                     // empty files have no chain
+                continue;
+
+            node.cluster = fat_builderAllocate(&builder, (uint32_t)node.size);
+            if (node.cluster == 0)
+                return vector<uint32_t>();
+            order.push_back(child);
+        }
+        reverse(pending.begin() + firstPending, pending.end());     // first subdirectory on top
+    }
+
+    for (Node& directory : nodes)
+    {
+        if (!directory.directory)
+            continue;
+
+        for (size_t i = 0; i < directory.children.size(); ++i)
+            setCluster(directory.entries[directory.shortEntries[i]], nodes[directory.children[i]].cluster);
+        if (&directory != &nodes[0])                                // ".." of a directory in the root is 0
+        {
+            setCluster(directory.entries[0], directory.cluster);
+            setCluster(directory.entries[1], directory.parent == 0 ? 0 : nodes[directory.parent].cluster);
+        }
+    }
+
+    return order;
+}
+
+FILE* openHost(const HostPath& path)
+{
+#ifdef _WIN32
+    return _wfopen(path.c_str(), L"rb");
+#else
+    return fopen(path.c_str(), "rb");
+#endif
+}
+
+// Copies the file into the image, a file which shrunk since it was listed is padded with zeros
+bool copyFile(const Node& node)
+{
+    FILE* file = openHost(node.path);
+    if (file == nullptr)
+        cout << "Couldn't read, left zeroed: " << node.name << endl;
+
+    uint64_t address = fat_builderAddress(&builder, node.cluster);
+    uint64_t remaining = node.size;
+    while (remaining > 0)
+    {
+        uint32_t count = (uint32_t)min<uint64_t>(remaining, batchSize);
+        char* room = writer.append(address, count);
+        if (room == nullptr)
+        {
+            if (file != nullptr)
+                fclose(file);
+            return false;
+        }
+
+        size_t read = file != nullptr ? fread(room, 1, count, file) : 0;
+        memset(room + read, 0, count - read);
+        address += count;
+        remaining -= count;
+    }
+
+    if (file != nullptr)
+        fclose(file);
+    return true;
+}
+
+bool write(const vector<uint32_t>& order, FatType type)
+{
+    for (uint32_t index : order)
+    {
+        const Node& node = nodes[index];
+        if (!node.directory)
+        {
+            if (!copyFile(node))
+                return false;
+            continue;
+        }
+
+        uint32_t length = (uint32_t)node.entries.size() * sizeof(fat_DirectoryEntry);
+        uint64_t address = (index == 0 && type != FAT32)
+            ? fat_sectorToAddress(&boot, 0, fat_rootDirectorySector(&boot))
+            : fat_builderAddress(&builder, node.cluster);
+        char* room = writer.append(address, length);
+        if (room == nullptr)
+            return false;
+        if (length > 0)
+            memcpy(room, node.entries.data(), length);
+    }
+
+    return writer.flush();
+}
+
+uint64_t milliseconds(chrono::steady_clock::time_point since)
+{
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - since).count();
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 4)
+    {
+        cout << "Usage: " << "fatbuild [directory] [output] [size] [type] [cluster]" << endl;
+        cout << endl;
+        cout << "directory: the directory whose content is copied into the image" << endl;
+        cout << "output: the image to create, sparse where the file system allows it" << endl;
+        cout << "size: the size of the image in bytes" << endl;
+        cout << "type: (optional) fat12, fat16 or fat32, picked from the size by default" << endl;
+        cout << "cluster: (optional) bytes per cluster, picked for the type by default" << endl;
+        return -1;
+    }
+
+    fat_BuildOptions options = {};
+    options.type = FAT_BUILD_TYPE_AUTO;
+    options.volumeId = (uint32_t)time(nullptr);
+    istringstream(argv[3]) >> hex >> options.size;
+    if (argc > 4)
+    {
+        string type = argv[4];
+        options.type = type == "fat12" ? FAT12 : type == "fat16" ? FAT16 : type == "fat32" ? FAT32 : FAT_BUILD_TYPE_AUTO;
+    }
+    if (argc > 5)
+        istringstream(argv[5]) >> hex >> options.clusterSize;
+
+    auto start = chrono::steady_clock::now();
+    Node root = {};
+    root.directory = true;
+#ifdef _WIN32
+    int length = MultiByteToWideChar(CP_ACP, 0, argv[1], -1, NULL, 0);
+    root.path.resize(length);
+    MultiByteToWideChar(CP_ACP, 0, argv[1], -1, &root.path[0], length);
+    root.path.resize(length - 1);
+#else
+    root.path = argv[1];
+#endif
+    time_t now = time(nullptr);
+    root.modified = *localtime(&now);
+    nodes.push_back(root);
+
+    uint64_t files = 0, bytes = 0;
+    for (uint32_t i = 0; i < nodes.size(); ++i)                     // nodes grows while the directories are listed
+    {
+        if (nodes[i].directory)
+        {
+            if (!list(i) && i == 0)                                 // a subdirectory which can't be listed stays empty
+                return -1;
+            continue;
+        }
+        ++files;
+        bytes += nodes[i].size;
+    }
+
+    for (uint32_t i = 0; i < nodes.size(); ++i)
+    {
+        if (nodes[i].directory && !makeEntries(i))
+        {
+            cout << "Too many entries in: " << nodes[i].name << endl;
+            return -1;
+        }
+    }
+
+    cout << hex;
+    cout << "Listed 0x" << files << " files and 0x" << nodes.size() - files << " directories (0x" << bytes << " bytes) in 0x" << milliseconds(start) << " ms" << endl;
+
+    options.rootEntries = (uint16_t)max<size_t>(FAT_BUILD_ROOT_ENTRIES, min<size_t>(0xFFFF, nodes[0].entries.size()));
+    if (!fat_buildBootSector(&options, &boot))
+    {
+        cout << "No valid layout for this size, type and cluster size." << endl;
+        return -1;
+    }
+
+    FatType type = fat_getType(&boot);
+    if (type != FAT32 && nodes[0].entries.size() > boot.rootEntries)
+    {
+        cout << "Too many entries in the root directory." << endl;
+        return -1;
+    }
+
+    if (!output.open(argv[2], options.size))
+    {
+        cout << "Couldn't create the output." << endl;
+        return -1;
+    }
+
+    start = chrono::steady_clock::now();
+    vector<uint32_t> order;
+    bool ok = fat_builderInit(&builder, &boot, 0, store) != 0;
+    if (ok)
+    {
+        order = allocate(type);
+        if (order.empty())
+            cout << "The image is too small." << endl;
+    }
+
+    ok = ok && !order.empty() && write(order, type);
+    uint32_t used = builder.nextCluster - 2, clusters = builder.lastCluster - 1;
+    ok = ok && fat_builderFinish(&builder);
+    fat_builderFree(&builder);
+    output.close();
+
+    if (!ok)
+    {
+        cout << "Error writing the image." << endl;
+        return -1;
+    }
+
+    uint64_t elapsed = milliseconds(start);
+    cout << "Type: FAT" << dec << (type == FAT12 ? 12 : type == FAT16 ? 16 : 32) << hex << ", cluster size: 0x" << fat_clusterSize(&boot) << endl;
+    cout << "Clusters used: 0x" << used << " of 0x" << clusters << endl;
+    cout << "Written 0x" << writer.written << " bytes in 0x" << writer.writes << " writes and 0x" << elapsed << " ms";
+    if (elapsed > 0)
+        cout << " (0x" << writer.written / elapsed * 1000 / 1024 << " KB/s)";
+    cout << endl;
+
+    return 0;
+}
@@ -0,0 +1,246 @@
+#include "stdafx.h"
+
+using namespace std;
+
+fat_Device device;
+
+uint8_t fetch(unsigned address, unsigned count, char* out)
+{
+    return fat_deviceRead(&device, address, count, out);
+}
+
+// A FAT volume whose geometry can be used, exFAT isn't indexed
+bool validBootSector(const fat_BootSector& boot)
+{
+    uint16_t bytesPerSector = boot.bytesPerSector;
+    uint8_t sectorsPerCluster = boot.sectorsPerCluster;
+    return memcmp(boot.OEM, "EXFAT   ", sizeof(boot.OEM)) != 0
+        && bytesPerSector >= 0x200 && bytesPerSector <= 0x1000 && (bytesPerSector & (bytesPerSector - 1)) == 0
+        && sectorsPerCluster != 0 && (sectorsPerCluster & (sectorsPerCluster - 1)) == 0
+        && boot.numberOfFATs != 0 && boot.reservedSectors != 0 && fat_sectorsPerFat(&boot) != 0;
+}
+
+void printRatio(const char* kind, const fat_DedupRecord* records, uint64_t count)
+{
+    fat_DedupRatio ratio;
+    fat_dedupRatio(records, count, &ratio);
+
+    cout << hex;
+    cout << kind << ": 0x" << ratio.records << " records, 0x" << ratio.contents << " distinct, 0x" << ratio.shared
+        << " in more than one image, 0x" << ratio.bytes << " bytes for 0x" << ratio.uniqueBytes << " unique";
+    if (ratio.uniqueBytes > 0)
+        cout << " (dedup ratio " << dec << fixed << setprecision(2) << (double)ratio.bytes / ratio.uniqueBytes << hex << ")";
+    cout << endl;
+}
+
+int build(int argc, char* argv[])
+{
+    ifstream manifest(argv[3]);
+    if (!manifest.is_open())
+    {
+        cout << "Couldn't open the manifest." << endl;
+        return -1;
+    }
+
+    uint8_t what = FAT_DEDUP_CLUSTERS | FAT_DEDUP_FILES;
+    if (argc > 4 && string(argv[4]) == "clusters")
+        what = FAT_DEDUP_CLUSTERS;
+    else if (argc > 4 && string(argv[4]) == "files")
+        what = FAT_DEDUP_FILES;
+
+    unsigned threads = 0;
+    if (argc > 5)
+        istringstream(argv[5]) >> hex >> threads;
+
+    fat_DedupBuilder builder;
+    fat_dedupInit(&builder);
+
+    cout << hex;
+    auto start = chrono::steady_clock::now();
+    unsigned failed = 0;
+    string line;
+    while (getline(manifest, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.empty())
+            continue;
+
+        bool mbr = false;
+        size_t tab = line.find('\t');
+        if (tab != string::npos)
+        {
+            istringstream(line.substr(tab + 1)) >> boolalpha >> mbr;
+            line.erase(tab);
+        }
+
+        if (!fat_deviceOpen(line.c_str(), &device))
+        {
+            cout << line << ": couldn't open" << endl;
+            ++failed;
+            continue;
+        }
+
+        fat_BootSector boot;
+        uint32_t offset = 0;
+        bool mounted;
+        if (mbr)
+        {
+            offset = fat_nextPartitionSector(fetch, &boot, nullptr);
+            mounted = offset != (uint32_t)-1 && offset != 0;
+        }
+        else
+            mounted = fetch(0, sizeof(fat_BootSector), (char*)&boot) != 0;
+
+        uint64_t bytesRead = builder.bytesRead;
+        auto imageStart = chrono::steady_clock::now();
+        bool ok = mounted && validBootSector(boot) &&
+            fat_dedupAddImage(&builder, line.c_str(), &device, &boot, offset, what, threads);
+        uint64_t elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - imageStart).count();
+        fat_deviceClose(&device);
+
+        if (!ok)
+        {
+            cout << line << ": couldn't hash" << endl;
+            ++failed;
+            continue;
+        }
+
+        const fat_DedupImage& image = builder.images[builder.imageCount - 1];
+        cout << line << ": 0x" << image.clusters << " clusters, 0x" << image.files << " files, 0x"
+            << builder.bytesRead - bytesRead << " bytes in 0x" << elapsed << " ms";
+        if (image.skipped > 0)
+            cout << ", 0x" << image.skipped << " skipped (chain too short)";
+        cout << endl;
+    }
+
+    if (!fat_dedupWrite(&builder, argv[2]))
+    {
+        cout << "Couldn't write the index." << endl;
+        fat_dedupFree(&builder);
+        return -1;
+    }
+
+    uint64_t elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    cout << "Indexed: 0x" << builder.imageCount << " images, 0x" << builder.bytesRead << " bytes in 0x" << elapsed << " ms";
+    if (elapsed > 0)
+        cout << " (0x" << builder.bytesRead * 1000 / elapsed / 1024 << " KB/s)";
+    cout << endl;
+    if (failed > 0)
+        cout << "Failed: 0x" << failed << " images" << endl;
+
+    printRatio("Clusters", builder.clusters, builder.clusterCount);
+    printRatio("Files", builder.files, builder.fileCount);
+    fat_dedupFree(&builder);
+    return 0;
+}
+
+void printRecord(const fat_DedupIndex& index, const fat_DedupRecord& record)
+{
+    cout << "  " << fat_dedupName(&index, index.images[record.image].name) << "\tcluster 0x" << record.cluster;
+    if (record.path != FAT_DEDUP_NONE)
+        cout << "\t" << fat_dedupName(&index, record.path);
+    cout << endl;
+}
+
+int stats(fat_DedupIndex& index, int argc, char* argv[])
+{
+    const fat_DedupHeader* header = index.header;
+
+    cout << hex;
+    for (uint32_t i = 0; i < header->imageCount; ++i)
+    {
+        const fat_DedupImage& image = index.images[i];
+        cout << fat_dedupName(&index, image.name) << ": cluster size 0x" << image.clusterSize << ", 0x" << image.clusters
+            << " clusters, 0x" << image.files << " files";
+        if (image.skipped > 0)
+            cout << ", 0x" << image.skipped << " skipped";
+        cout << endl;
+    }
+
+    printRatio("Clusters", index.clusters, header->clusterCount);
+    printRatio("Files", index.files, header->fileCount);
+
+    unsigned top = 0x0A;
+    if (argc > 3)
+        istringstream(argv[3]) >> hex >> top;
+
+    // the file contents with the most copies, the records of one content are next to each other
+    vector<pair<uint64_t, uint64_t>> groups;                        // copies, first record
+    for (uint64_t first = 0; first < header->fileCount;)
+    {
+        uint64_t end = first + 1;
+        while (end < header->fileCount && index.files[end].hash == index.files[first].hash && index.files[end].size == index.files[first].size)
+            ++end;
+        if (end - first > 1)
+            groups.push_back({ end - first, first });
+        first = end;
+    }
+
+    sort(groups.begin(), groups.end(), [](const pair<uint64_t, uint64_t>& a, const pair<uint64_t, uint64_t>& b)
+        { return a.first != b.first ? a.first > b.first : a.second < b.second; });
+    if (groups.size() > top)
+        groups.resize(top);
+
+    for (const pair<uint64_t, uint64_t>& group : groups)
+    {
+        const fat_DedupRecord& record = index.files[group.second];
+        cout << setfill('0') << setw(16) << record.hash << setfill(' ') << ": 0x" << record.size << " bytes, 0x" << group.first << " copies" << endl;
+        for (uint64_t i = 0; i < group.first; ++i)
+            printRecord(index, index.files[group.second + i]);
+    }
+    return 0;
+}
+
+int find(fat_DedupIndex& index, char* argv[])
+{
+    uint64_t hash = 0;
+    istringstream(argv[3]) >> hex >> hash;
+
+    uint64_t clusters, files;
+    const fat_DedupRecord* clusterRecords = fat_dedupFind(index.clusters, index.header->clusterCount, hash, &clusters);
+    const fat_DedupRecord* fileRecords = fat_dedupFind(index.files, index.header->fileCount, hash, &files);
+
+    cout << hex;
+    cout << "Clusters: 0x" << clusters << endl;
+    for (uint64_t i = 0; i < clusters; ++i)
+        printRecord(index, clusterRecords[i]);
+    cout << "Files: 0x" << files << endl;
+    for (uint64_t i = 0; i < files; ++i)
+        printRecord(index, fileRecords[i]);
+    return (clusters + files > 0) ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+    string mode = (argc > 1) ? argv[1] : "";
+    if (argc < 3 || (mode != "--build" && mode != "--stats" && mode != "--find") ||
+        (mode == "--build" && argc < 4) || (mode == "--find" && argc < 4))
+    {
+        cout << "Usage: " << "fatdedup --build [index] [manifest] [what] [threads]" << endl;
+        cout << "       " << "fatdedup --stats [index] [top]" << endl;
+        cout << "       " << "fatdedup --find [index] [hash]" << endl;
+        cout << endl;
+        cout << "index: the dedup index file, written by --build" << endl;
+        cout << "manifest: the images to index, one path per line, followed by a tab and true when it has a mbr" << endl;
+        cout << "what: (optional) clusters, files or both, defaults to both" << endl;
+        cout << "threads: (optional) workers hashing the clusters of an image, defaults to one per processor" << endl;
+        cout << "top: (optional) file contents with the most copies to list, defaults to 0xA" << endl;
+        cout << "hash: XXH64 of a cluster or a file, as listed by --stats" << endl;
+        return -1;
+    }
+
+    if (mode == "--build")
+        return build(argc, argv);
+
+    fat_DedupIndex index;
+    if (!fat_dedupOpen(argv[2], &index))
+    {
+        cout << "Couldn't open the index, missing or damaged?" << endl;
+        return -1;
+    }
+
+    int result = (mode == "--stats") ? stats(index, argc, argv) : find(index, argv);
+    fat_dedupClose(&index);
+    return result;
+}
@@ -0,0 +1,219 @@
+#include "stdafx.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+fat_Device device;
+fat_BootSector boot;
+fstream output;
+
+uint32_t offset = 0;
+
+uint8_t fetch(unsigned address, unsigned count, char* out)
+{
+    return fat_deviceRead(&device, address, count, out);
+}
+
+uint8_t store(unsigned address, unsigned count, const char* data)
+{
+    output.seekp(address);
+    output.write(data, count);
+    return output.good();
+}
+
+// Whether output names the image itself (also through another path or a link), opening it would truncate the image
+bool sameFile(const char* image, const char* output)
+{
+    if (strcmp(image, output) == 0)
+        return true;
+
+#ifdef _WIN32
+    BY_HANDLE_FILE_INFORMATION info[2];
+    const char* paths[2] = { image, output };
+    for (int i = 0; i < 2; ++i)
+    {
+        HANDLE handle = CreateFileA(paths[i], 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (handle == INVALID_HANDLE_VALUE)
+            return false;                                           // the output doesn't exist yet
+
+        BOOL ok = GetFileInformationByHandle(handle, &info[i]);
+        CloseHandle(handle);
+        if (!ok)
+            return false;
+    }
+
+    return info[0].dwVolumeSerialNumber == info[1].dwVolumeSerialNumber &&
+        info[0].nFileIndexHigh == info[1].nFileIndexHigh && info[0].nFileIndexLow == info[1].nFileIndexLow;
+#else
+    struct stat a, b;
+    return stat(image, &a) == 0 && stat(output, &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+#endif
+}
+
+struct Benchmark
+{
+    vector<char> buffer;
+    uint64_t bytes = 0;
+    uint32_t fetches = 0;
+    uint32_t clusterSize = 0;
+    bool ok = true;
+};
+
+// Reads the file a run of contiguous clusters at once, like the read paths following a chain do
+uint8_t readFile(const fat_WalkEntry* entry, void* context)
+{
+    Benchmark* benchmark = (Benchmark*)context;
+    if ((entry->entry.fileAttributes & FAT_FILE_ATTR_DIRECTORY) || entry->entry.fileSize == 0)
+        return FAT_WALK_CONTINUE;
+
+    FatType type = fat_getType(&boot);
+    uint32_t lastCluster = fat_countOfClusters(&boot) + 1;
+    uint32_t cluster = entry->entry.clusterHigh << 16 | entry->entry.clusterLow;
+    uint32_t remaining = entry->entry.fileSize;
+    uint32_t perFetch = (uint32_t)benchmark->buffer.size() / benchmark->clusterSize;
+
+    while (remaining > 0 && cluster >= 2 && cluster <= lastCluster)
+    {
+        uint32_t start = cluster, count = 1;
+        uint32_t next = fat_fatEntry(type, entry->iterator->table, cluster);
+        while (next == cluster + 1 && count < perFetch && (uint64_t)count * benchmark->clusterSize < remaining)
+        {
+            cluster = next;
+            next = fat_fatEntry(type, entry->iterator->table, cluster);
+            ++count;
+        }
+
+        uint32_t bytes = min(count * benchmark->clusterSize, remaining);
+        if (!fetch(fat_clusterToAddress(&boot, offset, start), bytes, benchmark->buffer.data()))
+        {
+            benchmark->ok = false;
+            return FAT_WALK_STOP;
+        }
+
+        ++benchmark->fetches;
+        benchmark->bytes += bytes;
+        remaining -= bytes;
+        cluster = fat_isEndOfChain(type, next) ? 0 : next;
+    }
+
+    return FAT_WALK_CONTINUE;
+}
+
+bool report(const char* title)
+{
+    fat_Fragmentation fragmentation;
+    if (!fat_fragmentation(&boot, offset, fetch, &fragmentation))
+        return false;
+
+    Benchmark benchmark;
+    benchmark.clusterSize = fat_clusterSize(&boot);
+    benchmark.buffer.resize(max(0x100000u, benchmark.clusterSize));
+
+    auto start = chrono::steady_clock::now();
+    fat_walk(&boot, offset, fetch, 1, FAT_WALK_PRE | FAT_WALK_LAZY_NAMES, readFile, &benchmark);
+    uint64_t elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+
+    cout << title << endl;
+    cout << "  Files: 0x" << fragmentation.files << ", directories: 0x" << fragmentation.directories << endl;
+    cout << "  Fragmented: 0x" << fragmentation.fragmented << ", runs: 0x" << fragmentation.runs << " over 0x" << fragmentation.clusters << " clusters" << endl;
+    cout << "  Reading every file: 0x" << benchmark.fetches << " fetches, 0x" << benchmark.bytes << " bytes in 0x" << elapsed << " us";
+    if (elapsed > 0)
+        cout << " (0x" << benchmark.bytes * 1000000 / elapsed / 1024 << " KB/s)";
+    cout << endl;
+
+    return benchmark.ok;
+}
+
+bool openImage(const char* path, bool mbr)
+{
+    if (!fat_deviceOpen(path, &device))
+        return false;
+
+    if (mbr)
+        offset = fat_nextPartitionSector(fetch, &boot, nullptr);
+    else
+        fetch(0, sizeof(fat_BootSector), (char*)&boot);
+
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 4)
+    {
+        cout << "Usage: " << "fatdefrag [image] [mbr] [output]" << endl;
+        cout << endl;
+        cout << "image: the file to be defragmented" << endl;
+        cout << "mbr: enter true if there is a mbr present otherwise enter false" << endl;
+        cout << "output: the defragmented image to create, the same size as image" << endl;
+        return -1;
+    }
+
+    if (sameFile(argv[1], argv[3]))
+    {
+        cout << "The output can't be the image itself, defragmenting writes a new image." << endl;
+        return -1;
+    }
+
+    bool mbr;
+    istringstream(argv[2]) >> boolalpha >> mbr;
+
+    if (!openImage(argv[1], mbr))
+    {
+        cout << "Couldn't open file? Check the path." << endl;
+        return -1;
+    }
+
+    cout << hex;
+    if (!report("Before:"))
+    {
+        cout << "Error reading data from fetch." << endl;
+        fat_deviceClose(&device);
+        return -1;
+    }
+
+    output.open(argv[3], ios_base::in | ios_base::out | ios_base::binary | ios_base::trunc);
+    if (!output.is_open())
+    {
+        cout << "Couldn't create the output." << endl;
+        fat_deviceClose(&device);
+        return -1;
+    }
+
+    vector<char> head(offset);                                      // the MBR and whatever precedes the partition
+    bool ok = (offset == 0 || (fetch(0, offset, head.data()) && store(0, offset, head.data())));
+    if (ok && device.size > 0)                                      // the free clusters aren't written, size it up front
+    {
+        output.seekp(device.size - 1);
+        output.put(0);
+        ok = output.good();
+    }
+
+    fat_DefragStats stats;
+    ok = ok && fat_defrag(&boot, offset, fetch, store, &stats);
+    output.close();
+    fat_deviceClose(&device);
+
+    if (!ok)
+    {
+        cout << "Error writing the defragmented image." << endl;
+        return -1;
+    }
+
+    cout << endl << "Defragmented: 0x" << stats.chains << " chains, 0x" << stats.clusters << " clusters of which 0x" << stats.moved << " moved" << endl;
+    cout << "  0x" << stats.reads << " reads, 0x" << stats.writes << " writes" << endl << endl;
+
+    if (!openImage(argv[3], mbr) || !report("After:"))
+    {
+        cout << "Error reading the defragmented image." << endl;
+        return -1;
+    }
+
+    fat_deviceClose(&device);
+    return 0;
+}
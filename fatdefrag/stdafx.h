@@ -0,0 +1,27 @@
+// stdafx.h : include file for standard system include files,
+// or project specific include files that are used frequently, but
+// are changed infrequently
+//
+
+#pragma once
+
+#include "targetver.h"
+
+#include <stdio.h>
+#include <cinttypes>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <chrono>
+
+extern "C" {
+#include "fat.h"
+#include "device.h"
+#include "walk.h"
+#include "defrag.h"
+#include "container.h"
+}
+
+// TODO: reference additional headers your program requires here
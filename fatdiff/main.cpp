@@ -0,0 +1,126 @@
+#include "stdafx.h"
+
+using namespace std;
+
+fat_Device devices[2];
+fat_BootSector boots[2];
+
+uint32_t offsets[2] = { 0, 0 };
+unsigned counts[5] = { 0 };                                         // per FAT_DIFF_*
+
+uint8_t fetchFirst(unsigned address, unsigned count, char* out)
+{
+    return fat_deviceRead(&devices[0], address, count, out);
+}
+
+uint8_t fetchSecond(unsigned address, unsigned count, char* out)
+{
+    return fat_deviceRead(&devices[1], address, count, out);
+}
+
+string describeFields(uint8_t fields)
+{
+    string text;
+    const char* names[] = { "size", "chain", "attributes", "modified", "created" };
+    for (int i = 0; i < 5; ++i)
+    {
+        if (fields & (1 << i))
+            text += text.empty() ? names[i] : string(", ") + names[i];
+    }
+
+    return text;
+}
+
+uint8_t printChange(const fat_DiffEntry* change, void*)
+{
+    const fat_DirectoryEntry& entry = (change->change == FAT_DIFF_REMOVED) ? change->oldEntry : change->newEntry;
+    const char* type = (entry.fileAttributes & FAT_FILE_ATTR_DIRECTORY) ? "DIR" : "FIL";
+
+    switch (change->change)
+    {
+    case FAT_DIFF_ADDED:
+        printf("  + [%s] (%.8x:%.8x) %s\n", type, entry.clusterHigh << 16 | entry.clusterLow, entry.fileSize, change->path);
+        break;
+    case FAT_DIFF_REMOVED:
+        printf("  - [%s] (%.8x:%.8x) %s\n", type, entry.clusterHigh << 16 | entry.clusterLow, entry.fileSize, change->path);
+        break;
+    case FAT_DIFF_MODIFIED:
+        printf("  M [%s] (%.8x:%.8x) %s: %s\n", type, entry.clusterHigh << 16 | entry.clusterLow, entry.fileSize, change->path, describeFields(change->fields).c_str());
+        break;
+    case FAT_DIFF_MOVED:
+        printf("  > [%s] (%.8x:%.8x) %s -> %s", type, entry.clusterHigh << 16 | entry.clusterLow, entry.fileSize, change->oldPath, change->path);
+        if (change->fields != 0)
+            printf(": %s", describeFields(change->fields).c_str());
+        printf("\n");
+        break;
+    }
+
+    ++counts[change->change];
+    return 1;
+}
+
+bool open(int index, const char* path, const char* mbrText, fetchData_t fetch)
+{
+    if (!fat_deviceOpen(path, &devices[index]))
+    {
+        cout << "Couldn't open " << path << "? Check the path." << endl;
+        return false;
+    }
+
+    bool mbr;
+    istringstream(mbrText) >> boolalpha >> mbr;
+
+    if (mbr)
+        offsets[index] = fat_nextPartitionSector(fetch, &boots[index], nullptr);
+    else
+        fetch(0, sizeof(fat_BootSector), (char*)&boots[index]);
+
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 5)
+    {
+        cout << "Usage: " << "fatdiff [image] [mbr] [other] [mbr]" << endl;
+        cout << endl;
+        cout << "image: the older snapshot" << endl;
+        cout << "other: the newer snapshot" << endl;
+        cout << "mbr: enter true if there is a mbr present otherwise enter false" << endl;
+        return -1;
+    }
+
+    if (!open(0, argv[1], argv[2], fetchFirst))
+        return -1;
+    if (!open(1, argv[3], argv[4], fetchSecond))
+    {
+        fat_deviceClose(&devices[0]);
+        return -1;
+    }
+
+    fat_DiffVolume first = { &boots[0], offsets[0], fetchFirst };
+    fat_DiffVolume second = { &boots[1], offsets[1], fetchSecond };
+    fat_DiffSummary summary;
+
+    cout << "Changes:" << endl;
+    uint8_t ok = fat_diff(&first, &second, &summary, printChange, nullptr);
+    if (!ok)
+        cout << "Error reading data from fetch." << endl;
+
+    cout << endl << hex;
+    cout << "Boot sector: " << (summary.bootChanged ? "changed" : "same") << endl;
+    if (fat_getType(&boots[0]) == FAT32)
+        cout << "FSInfo sector: " << (summary.fsInfoChanged ? "changed" : "same") << endl;
+    if (summary.geometryChanged)
+        cout << "Geometry: changed, every chain is taken as changed" << endl;
+    else
+        cout << "FAT entries changed: 0x" << summary.changedFatEntries << endl;
+
+    cout << "Added: 0x" << counts[FAT_DIFF_ADDED] << ", removed: 0x" << counts[FAT_DIFF_REMOVED]
+        << ", modified: 0x" << counts[FAT_DIFF_MODIFIED] << ", moved: 0x" << counts[FAT_DIFF_MOVED] << endl;
+    cout << "Directories compared: 0x" << summary.directoriesCompared << ", unchanged files (not read): 0x" << summary.filesUnchanged << endl;
+
+    fat_deviceClose(&devices[1]);
+    fat_deviceClose(&devices[0]);
+    return ok ? 0 : -1;
+}
@@ -8,18 +8,41 @@ fat_MBR mbr;
 
 uint32_t offset = 0;
 
+fat_Container container;
+bool packed = false;
+
 uint8_t fetch(unsigned address, unsigned count, char* out)
 {
+    if (packed)
+        return fat_containerRead(&container, address, count, out);
+
+    file.seekg(address);
+    file.read(out, count);
+
+    return file.good();
+}
+
+uint8_t fetch64(uint64_t address, unsigned count, char* out)
+{
+    if (packed)
+        return address + count <= UINT32_MAX && fat_containerRead(&container, (unsigned)address, count, out);
+
     file.seekg(address);
     file.read(out, count);
 
     return file.good();
 }
 
+uint32_t rootDirectoryAddress()
+{
+    return (fat_getType(&boot) == FAT32)
+        ? fat_clusterToAddress(&boot, offset, fat_rootCluster(&boot))
+        : fat_sectorToAddress(&boot, offset, fat_rootDirectorySector(&boot));
+}
+
 void dumpRandomInfo()
 {
     auto fatType = fat_getType(&boot);
-    auto rootDirectoryAddress = fat_clusterToAddress(&boot, offset, 2);
 
     if (offset == 0)
         cout << "MBR Signature not found, assuming bootsector @ offset: 0" << endl;
@@ -32,40 +55,399 @@ void dumpRandomInfo()
     cout << "  Cluster Size: 0x" << setw(4) << fat_clusterSize(&boot) << endl;
     cout << "  Sectors Per Cluster: 0x" << setw(2) << static_cast<int>(boot.sectorsPerCluster) << endl;
     cout << "  Bytes Per Sector: 0x" << setw(4) << boot.bytesPerSector << endl;
-    cout << "  Root Directory: 0x" << setw(8) << rootDirectoryAddress << endl;
+    cout << "  Root Directory: 0x" << setw(8) << rootDirectoryAddress() << endl;
+}
+
+void printEntry(const fat_DirectoryEntry& entry, const char* name)
+{
+    uint32_t cluster = entry.clusterHigh << 16 | entry.clusterLow;
+
+    if (entry.fileAttributes & FAT_FILE_ATTR_DIRECTORY)
+        printf("  [DIR] [%.8s    ] (%.8x:%.8x) %s\n", entry.fileName, cluster, entry.fileSize, name);
+    else
+        printf("  [FIL] [%.8s.%.3s] (%.8x:%.8x) %s\n", entry.fileName, entry.extension, cluster, entry.fileSize, name);
 }
 
 void dumpRootDir()
 {
-    cout << "Dumping root directory at: 0x" << setw(8) << fat_clusterToAddress(&boot, offset, 2) << endl;
+    cout << "Dumping root directory at: 0x" << setw(8) << rootDirectoryAddress() << endl;
 
-    fat_DirectoryEntry entry = { 0 };
+    fat_DirectoryEntry entry = {};
     char buf[255];
 
-    while (fat_nextDirectoryEntry(&boot, offset, 2, fetch, &entry, buf, 255))
+    while (fat_nextDirectoryEntry(&boot, offset, FAT_DIRECTORY_ROOT, fetch, &entry, buf, 255))
+        printEntry(entry, buf);
+}
+
+void dumpIndex(const char* path)
+{
+    fat_Index index;
+    if (!fat_indexLoad(&boot, offset, fetch, path, &index))
+    {
+        cout << "Couldn't load or build the index: " << path << endl;
+        return;
+    }
+
+    const fat_IndexHeader* header = index.header;
+    cout << "Dumping index: " << path << endl;
+    cout << "  Fingerprint: 0x" << setw(16) << header->fingerprint << endl;
+    cout << "  Entries: 0x" << setw(8) << header->nodeCount - 1 << endl;
+    cout << "  Extents: 0x" << setw(8) << header->extentCount << endl;
+    cout << "  Free Clusters: 0x" << setw(8) << header->freeClusters << endl;
+    cout << endl;
+
+    cout << "Dumping root directory from index" << endl;
+
+    const fat_IndexNode* root = &index.nodes[0];
+    for (uint32_t i = 0; i < root->childCount; ++i)
+    {
+        const fat_IndexNode* node = &index.nodes[root->firstChild + i];
+        printEntry(node->entry, fat_indexName(&index, node));
+    }
+
+    fat_indexClose(&index);
+}
+
+uint64_t microseconds(chrono::steady_clock::time_point since)
+{
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - since).count();
+}
+
+// The cache in shared memory is keyed by the same fingerprint as the index, only the first process scans the volume
+void dumpShared()
+{
+    auto begin = chrono::steady_clock::now();
+    uint64_t fingerprint;
+    if (!fat_indexFingerprint(&boot, offset, fetch, &fingerprint))
+    {
+        cout << "Couldn't read the FAT." << endl;
+        return;
+    }
+    uint64_t fingerprinted = microseconds(begin);
+
+    begin = chrono::steady_clock::now();
+    fat_Shared shared;
+    if (!fat_sharedOpen(fingerprint, &shared) && !fat_sharedLoad(&boot, offset, fetch, &shared))
+    {
+        cout << "Couldn't attach to or publish the shared cache, an incomplete one is removed with --unshare." << endl;
+        return;
+    }
+    uint64_t attached = microseconds(begin);
+
+    const fat_IndexHeader* header = shared.index.header;
+    uint32_t allocated = 0;
+    for (uint32_t cluster = 2; cluster < shared.header->entryCount; ++cluster)
+        allocated += fat_sharedEntry(&shared, cluster) != 0;
+
+    char name[FAT_SHARED_NAME];
+    fat_sharedName(fingerprint, name);
+    cout << "Dumping shared cache: " << name << endl;
+    cout << "  Fingerprint: 0x" << setw(16) << fingerprint << " in 0x" << fingerprinted << " us" << endl;
+    cout << "  " << (shared.created ? "Published" : "Attached") << " in: 0x" << attached << " us" << endl;
+    cout << "  Size: 0x" << setw(8) << shared.header->size << endl;
+    cout << "  Entries: 0x" << setw(8) << header->nodeCount - 1 << endl;
+    cout << "  Extents: 0x" << setw(8) << header->extentCount << endl;
+    cout << "  Allocated Clusters: 0x" << setw(8) << allocated << endl;
+    cout << "  Free Clusters: 0x" << setw(8) << header->freeClusters << endl;
+    cout << endl;
+
+    cout << "Dumping root directory from shared cache" << endl;
+
+    const fat_IndexNode* root = &shared.index.nodes[0];
+    for (uint32_t i = 0; i < root->childCount; ++i)
+    {
+        const fat_IndexNode* node = &shared.index.nodes[root->firstChild + i];
+        printEntry(node->entry, fat_indexName(&shared.index, node));
+    }
+
+    fat_sharedClose(&shared);
+}
+
+int unshare()
+{
+    uint64_t fingerprint;
+    if (!fat_indexFingerprint(&boot, offset, fetch, &fingerprint))
+    {
+        cout << "Couldn't read the FAT." << endl;
+        return -1;
+    }
+
+    char name[FAT_SHARED_NAME];
+    fat_sharedName(fingerprint, name);
+    if (!fat_sharedRemove(fingerprint))
+    {
+        cout << "No shared cache to remove: " << name << endl;
+        return -1;
+    }
+
+    cout << "Removed shared cache: " << name << endl;
+    return 0;
+}
+
+unsigned pageFetches = 0;
+
+uint8_t countingFetch(unsigned address, unsigned count, char* out)
+{
+    ++pageFetches;
+    return fetch(address, count, out);
+}
+
+// Lists count entries of a directory starting at an entry number (through the directory index) or at a token
+int dumpPage(unsigned cluster, const string& from, uint32_t count)
+{
+    vector<uint8_t> buffer(fat_clusterSize(&boot));
+    fat_DirectoryIndex index = {};
+    fat_DirectoryCursor cursor;
+    fat_DirectoryToken token;
+    bool resume = fat_tokenFromText(from.c_str(), &token) != 0;
+
+    auto begin = chrono::steady_clock::now();
+    if (resume)
+    {
+        fat_cursorOpen(&boot, cluster, nullptr, buffer.data(), &cursor);
+        if (!fat_cursorResume(&boot, &cursor, &token))
+        {
+            cout << "The token belongs to another directory." << endl;
+            return -1;
+        }
+        cout << "Resumed at entry 0x" << cursor.ordinal << " in 0x" << microseconds(begin) << " us" << endl;
+    }
+    else if (from.size() == FAT_TOKEN_TEXT - 1 || from.size() > 8)  // longer than any ordinal, a token cut short or mistyped
+    {
+        cout << "The token is damaged, use the token printed after the previous page." << endl;
+        return -1;
+    }
+    else
+    {
+        uint32_t ordinal = 0;
+        istringstream(from) >> hex >> ordinal;
+        if (!fat_directoryIndexBuild(&boot, offset, countingFetch, cluster, &index))
+        {
+            cout << "Couldn't read the directory." << endl;
+            return -1;
+        }
+        cout << "Indexed: 0x" << index.entryCount << " entries in 0x" << index.blockCount << " blocks with 0x" << pageFetches
+            << " reads in 0x" << microseconds(begin) << " us" << endl;
+
+        pageFetches = 0;
+        begin = chrono::steady_clock::now();
+        fat_cursorOpen(&boot, cluster, &index, buffer.data(), &cursor);
+        if (!fat_cursorSeek(&boot, offset, countingFetch, &cursor, ordinal))
+        {
+            cout << "The directory has only 0x" << index.entryCount << " entries." << endl;
+            fat_directoryIndexFree(&index);
+            return -1;
+        }
+        cout << "Seeked to entry 0x" << ordinal << " with 0x" << pageFetches << " reads in 0x" << microseconds(begin) << " us" << endl;
+    }
+
+    pageFetches = 0;
+    fat_DirectoryEntry entry;
+    char name[FAT_LFN_MAX_LENGTH + 1];
+    for (uint32_t i = 0; i < count && fat_cursorNext(&boot, offset, countingFetch, &cursor, &entry, name, sizeof(name)); ++i)
+        printEntry(entry, name);
+
+    char text[FAT_TOKEN_TEXT];
+    fat_cursorToken(&cursor, &token);
+    fat_tokenToText(&token, text);
+    cout << "Listed with 0x" << pageFetches << " reads, next page: " << text << endl;
+
+    fat_directoryIndexFree(&index);
+    return 0;
+}
+
+// exFAT has its own boot region and directory entry sets, the FAT is only read for fragmented files
+int dumpExfat()
+{
+    exfat_Volume volume;
+    if (!exfat_mount(fetch64, offset, &volume))
+    {
+        cout << "Couldn't mount the exFAT volume, the boot region, bitmap or up-case table is damaged." << endl;
+        return -1;
+    }
+
+    char label[0x0B * 3 + 1];
+    fat_utf16ToUtf8(volume.label, volume.labelLength, label, sizeof(label));
+
+    cout << "Dumping boot region data:" << endl;
+    cout << "  BootSector at: 0x" << setw(8) << offset << endl;
+    cout << "  FatType: exFAT" << endl;
+    cout << "  Label: " << label << endl;
+    cout << "  Total Clusters: 0x" << setw(8) << volume.boot.clusterCount << endl;
+    cout << "  Free Clusters: 0x" << setw(8) << volume.freeClusters << endl;
+    cout << "  Cluster Size: 0x" << setw(8) << volume.clusterSize << endl;
+    cout << "  Bytes Per Sector: 0x" << setw(4) << volume.bytesPerSector << endl;
+    cout << "  FAT: 0x" << setw(16) << offset + (uint64_t)volume.boot.fatOffset * volume.bytesPerSector << endl;
+    cout << "  Cluster Heap: 0x" << setw(16) << exfat_clusterToAddress(&volume, 2) << endl;
+    cout << "  Root Directory: 0x" << setw(16) << exfat_clusterToAddress(&volume, volume.boot.firstClusterOfRootDirectory) << endl;
+    cout << endl;
+
+    cout << "Dumping root directory" << endl;
+
+    exfat_DirectoryIterator it;
+    exfat_File entry;
+    char name[EXFAT_NAME_MAX_LENGTH * 3 + 1];
+    exfat_openDirectory(&volume, NULL, &it);
+    while (exfat_readDirectory(&volume, &it, &entry))
     {
-        uint32_t cluster = entry.clusterHigh << 16 | entry.clusterLow;
+        exfat_fileName(&entry, name, sizeof(name));
+        printf("  [%s] [%s] (%.8x:%.16" PRIx64 ") %s\n", (entry.attributes & FAT_FILE_ATTR_DIRECTORY) ? "DIR" : "FIL",
+            (entry.flags & EXFAT_FLAG_NO_FAT_CHAIN) ? "NoFatChain" : "FatChain  ", entry.firstCluster, entry.dataLength, name);
+    }
+
+    int result = exfat_endOfDirectory(&it) ? 0 : -1;
+    if (result != 0)
+        cout << "Error reading data from fetch." << endl;
+
+    exfat_unmount(&volume);
+    cout << endl;
+    return result;
+}
+
+uint8_t writeExport(const char* data, unsigned count, void*)
+{
+    return fwrite(data, 1, count, stdout) == count;
+}
+
+// Streams a record for every entry of the volume to stdout, nothing else is printed
+int exportTree(const string& format, bool extents)
+{
+    uint8_t flags = (format == "csv") ? FAT_EXPORT_CSV : FAT_EXPORT_NDJSON;
+    if (extents)
+        flags |= FAT_EXPORT_EXTENTS;
 
-        if (entry.fileAttributes & FAT_FILE_ATTR_DIRECTORY)
-            printf("  [DIR] [%.8s    ] (%.2d:%.2d) %s\n", entry.fileName, cluster, entry.fileSize, buf);
-        else
-            printf("  [FIL] [%.8s.%.3s] (%.2d:%.2d) %s\n", entry.fileName, entry.extension, cluster, entry.fileSize, buf);
+    if (!fat_export(&boot, offset, fetch, 1, flags, writeExport, nullptr, nullptr))    // fetch reads through one stream
+    {
+        cerr << "Error reading data from fetch." << endl;
+        return -1;
     }
+
+    fflush(stdout);
+    return 0;
+}
+
+const char* typeName(FatType type)
+{
+    return (type == FAT12) ? "FAT12" : (type == FAT16) ? "FAT16" : (type == FAT32) ? "FAT32" : "exFAT";
+}
+
+void printBatchResult(const fat_BatchResult* result, void*)
+{
+    static const char* errors[] = { "", "couldn't open", "no FAT or exFAT volume", "read error" };
+
+    cout << result->image->path << ": ";
+    if (result->status != FAT_BATCH_OK)
+    {
+        cout << errors[result->status] << endl;
+        return;
+    }
+
+    cout << typeName(result->type) << ", 0x" << result->files << " files, 0x" << result->directories << " directories, 0x"
+        << result->bytes << " bytes, 0x" << result->fragments << " fragments, 0x" << result->freeClusters << " of 0x"
+        << result->clusters << " clusters free";
+    if (result->brokenChains > 0)
+        cout << ", 0x" << result->brokenChains << " broken chains";
+    cout << ", read 0x" << result->bytesRead << " bytes in 0x" << result->elapsed / 1000000 << " ms" << endl;
+}
+
+// Processes every image of the manifest (one per line, a tab and true after the path for a MBR) on a shared pool
+int runBatch(int argc, char* argv[])
+{
+    ifstream manifest(argv[2]);
+    if (!manifest.is_open())
+    {
+        cout << "Couldn't open the manifest." << endl;
+        return -1;
+    }
+
+    vector<string> paths;
+    vector<fat_BatchImage> images;
+    string line;
+    while (getline(manifest, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.empty())
+            continue;
+
+        bool mbr = false;
+        size_t tab = line.find('\t');
+        if (tab != string::npos)
+        {
+            istringstream(line.substr(tab + 1)) >> boolalpha >> mbr;
+            line.erase(tab);
+        }
+
+        paths.push_back(line);
+        images.push_back({ nullptr, mbr });
+    }
+
+    for (size_t i = 0; i < images.size(); ++i)
+        images[i].path = paths[i].c_str();
+
+    fat_BatchOptions options = { 0, 0, 0 };
+    if (argc > 3)
+        istringstream(argv[3]) >> hex >> options.threads;
+    if (argc > 4)
+        istringstream(argv[4]) >> hex >> options.maxOpen;
+    if (argc > 5)
+        istringstream(argv[5]) >> hex >> options.cacheBytes;
+
+    cout << hex;
+    fat_BatchTotals totals;
+    if (!fat_batchRun(images.data(), (uint32_t)images.size(), &options, printBatchResult, nullptr, &totals))
+    {
+        cout << "Couldn't allocate the page cache." << endl;
+        return -1;
+    }
+
+    uint64_t elapsed = totals.elapsed / 1000000;
+    cout << endl;
+    cout << "Batch: 0x" << totals.images << " images";
+    if (totals.failed > 0)
+        cout << " (0x" << totals.failed << " failed)";
+    cout << ", 0x" << totals.files << " files, 0x" << totals.directories << " directories in 0x" << elapsed << " ms" << endl;
+    if (elapsed > 0)
+        cout << "Throughput: 0x" << (uint64_t)totals.images * 1000 / elapsed << " images/s, 0x" << totals.files * 1000 / elapsed
+            << " files/s, 0x" << totals.bytesRead * 1000 / elapsed / 1024 << " KB/s read" << endl;
+
+    return totals.failed == 0 ? 0 : -1;
 }
 
 int main(int argc, char* argv[])
 {
+    if (argc > 2 && string(argv[1]) == "--batch")
+        return runBatch(argc, argv);
+
     if (argc < 3)
     {
-        cout << "Usage: " << "fatdumper [image] [mbr]" << endl;
+        cout << "Usage: " << "fatdumper [image] [mbr] [index]" << endl;
+        cout << "       " << "fatdumper [image] [mbr] [export] [extents]" << endl;
+        cout << "       " << "fatdumper [image] [mbr] --page [directory] [from] [count]" << endl;
+        cout << "       " << "fatdumper --batch [manifest] [threads] [open] [cache]" << endl;
         cout << endl;
         cout << "image: the file to be dumped" << endl;
         cout << "mbr: enter true if there is a mbr present otherwise enter false" << endl;
+        cout << "index: (optional) sidecar index file, created or refreshed when the image changed" << endl;
+        cout << "       --shared attaches to the cache of the volume in shared memory, publishing it first if needed" << endl;
+        cout << "       --unshare removes that cache" << endl;
+        cout << "export: ndjson or csv, writes a record for every entry of the volume instead" << endl;
+        cout << "extents: (optional) enter true to add the runs of clusters of every entry to the export" << endl;
+        cout << "directory: first cluster of the directory to page through, 0 for the root" << endl;
+        cout << "from: (optional) number of the first entry to list, or the token printed after the previous page" << endl;
+        cout << "count: (optional) entries per page, defaults to 0x20" << endl;
+        cout << "manifest: the images to summarize, one path per line, followed by a tab and true when it has a mbr" << endl;
+        cout << "threads: (optional) workers shared by all images, defaults to one per processor" << endl;
+        cout << "open: (optional) most images open at once, defaults to one per worker" << endl;
+        cout << "cache: (optional) bytes of decoded FAT pages shared by all images, defaults to 64 MB" << endl;
         return -1;
     }
 
-    file.open(argv[1], ios_base::in | ios_base::binary);
-    if (!file.is_open())
+    packed = fat_containerOpen(argv[1], &container) != 0;          // compressed containers are read as is
+    if (!packed)
+        file.open(argv[1], ios_base::in | ios_base::binary);
+
+    if (!packed && !file.is_open())
     {
         cout << "Couldn't open file? Check the path." << endl;
         return -1;
@@ -83,11 +465,44 @@ int main(int argc, char* argv[])
     {
         fetch(0, sizeof(fat_BootSector), (char*)&boot);
     }
+
+    if (fat_getType(&boot) == EXFAT)
+    {
+        cout << hex << setfill('0');
+        return dumpExfat();
+    }
     
+    string mode = (argc > 3) ? argv[3] : "";
+    if (mode == "ndjson" || mode == "csv")
+    {
+        bool extents = false;
+        if (argc > 4)
+            istringstream(argv[4]) >> boolalpha >> extents;
+        return exportTree(mode, extents);
+    }
+
     cout << hex << setfill('0');
+    if (mode == "--unshare")
+        return unshare();
+    if (mode == "--page")
+    {
+        unsigned cluster = FAT_DIRECTORY_ROOT;
+        uint32_t count = 0x20;
+        if (argc > 4)
+            istringstream(argv[4]) >> hex >> cluster;
+        if (argc > 6)
+            istringstream(argv[6]) >> hex >> count;
+        return dumpPage(cluster, (argc > 5) ? argv[5] : "0", count);
+    }
+
     dumpRandomInfo();
     cout << endl;
-    dumpRootDir();
+    if (mode == "--shared")
+        dumpShared();
+    else if (argc > 3)
+        dumpIndex(argv[3]);
+    else
+        dumpRootDir();
     cout << endl;
 
     return 0;
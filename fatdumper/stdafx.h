@@ -9,13 +9,23 @@
 
 #include <stdio.h>
 #include <cinttypes>
+#include <chrono>
 #include <iostream>
 #include <iomanip>
 #include <fstream>
 #include <sstream>
+#include <string>
+#include <vector>
 
 extern "C" {
 #include "fat.h"
+#include "container.h"
+#include "exfat.h"
+#include "index.h"
+#include "shared.h"
+#include "cursor.h"
+#include "export.h"
+#include "batch.h"
 }
 
 // TODO: reference additional headers your program requires here
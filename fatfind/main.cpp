@@ -0,0 +1,177 @@
+#include "stdafx.h"
+
+using namespace std;
+
+fat_Device device;
+fat_BootSector boot;
+
+uint32_t offset = 0;
+unsigned found = 0;
+
+uint8_t fetch(unsigned address, unsigned count, char* out)
+{
+    return fat_deviceRead(&device, address, count, out);            // called from the walk threads
+}
+
+// Parses YYYY-MM-DD with an optional ,HH:MM:SS, a date alone means the start or the end of that day
+bool parseDateTime(const string& text, bool endOfDay, uint32_t* packed)
+{
+    unsigned year, month, day, hour = endOfDay ? 23 : 0, minute = endOfDay ? 59 : 0, second = endOfDay ? 58 : 0;
+    char dash1, dash2;
+
+    istringstream stream(text);
+    if (!(stream >> dec >> year >> dash1 >> month >> dash2 >> day) || dash1 != '-' || dash2 != '-')
+        return false;
+
+    char comma, colon1, colon2;
+    if (stream >> comma && (comma != ',' || !(stream >> hour >> colon1 >> minute >> colon2 >> second)))
+        return false;
+
+    *packed = fat_packDateTime(year, month, day, hour, minute, second);
+    return true;
+}
+
+uint8_t parseAttributes(const string& text)
+{
+    uint8_t attributes = 0;
+    for (char c : text)
+    {
+        switch (tolower(c))
+        {
+        case 'r': attributes |= FAT_FILE_ATTR_READONLY; break;
+        case 'h': attributes |= FAT_FILE_ATTR_HIDDEN; break;
+        case 's': attributes |= FAT_FILE_ATTR_SYSTEM; break;
+        case 'd': attributes |= FAT_FILE_ATTR_DIRECTORY; break;
+        case 'a': attributes |= FAT_FILE_ATTR_ARCHIVE; break;
+        }
+    }
+
+    return attributes;
+}
+
+bool parseFilter(const string& filter, fat_Query* query, unsigned* threads)
+{
+    size_t split = filter.find('=');
+    if (split == string::npos)
+        return false;
+
+    string key = filter.substr(0, split), value = filter.substr(split + 1);
+    if (key == "minsize")
+        return !!(istringstream(value) >> hex >> query->minSize);
+    if (key == "maxsize")
+        return !!(istringstream(value) >> hex >> query->maxSize);
+    if (key == "after")
+        return parseDateTime(value, false, &query->modifiedFrom);
+    if (key == "before")
+        return parseDateTime(value, true, &query->modifiedTo);
+    if (key == "created-after")
+        return parseDateTime(value, false, &query->createdFrom);
+    if (key == "created-before")
+        return parseDateTime(value, true, &query->createdTo);
+    if (key == "accessed-after")
+        return parseDateTime(value, false, &query->accessedFrom);
+    if (key == "accessed-before")
+        return parseDateTime(value, true, &query->accessedTo);
+    if (key == "attr")
+        return (query->attributesSet = parseAttributes(value)) != 0;
+    if (key == "noattr")
+        return (query->attributesClear = parseAttributes(value)) != 0;
+    if (key == "depth")
+        return !!(istringstream(value) >> hex >> query->maxDepth);
+    if (key == "threads")
+        return !!(istringstream(value) >> hex >> *threads);
+
+    return false;
+}
+
+void printPath(const fat_WalkEntry* entry)
+{
+    if (entry->parent != NULL)
+    {
+        printPath(entry->parent);
+        printf("/");
+    }
+
+    printf("%s", entry->fileName);
+}
+
+uint8_t printMatch(const fat_WalkEntry* match, const char* fileName, void*)
+{
+    const fat_DirectoryEntry& entry = match->entry;
+
+    uint8_t day, month, seconds, minute, hour;
+    uint16_t year;
+    fat_getDate(entry.word, &day, &month, &year);
+    fat_getTime(entry.time, &seconds, &minute, &hour);
+
+    printf("  [%s] (%.8x:%.8x) %.4d-%.2d-%.2d %.2d:%.2d:%.2d ",
+        (entry.fileAttributes & FAT_FILE_ATTR_DIRECTORY) ? "DIR" : "FIL",
+        entry.clusterHigh << 16 | entry.clusterLow, entry.fileSize,
+        year, month, day, hour, minute, seconds);
+
+    if (match->parent != NULL)
+    {
+        printPath(match->parent);
+        printf("/");
+    }
+    printf("%s\n", fileName);
+
+    ++found;
+    return 1;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 4)
+    {
+        cout << "Usage: " << "fatfind [image] [mbr] [pattern] [filters...]" << endl;
+        cout << endl;
+        cout << "image: the file to be searched" << endl;
+        cout << "mbr: enter true if there is a mbr present otherwise enter false" << endl;
+        cout << "pattern: name to search for, * and ? are wildcards, slashes match the path (i.e. DCIM/*/*.jpg)" << endl;
+        cout << "filters: (optional) any of" << endl;
+        cout << "  minsize=size maxsize=size" << endl;
+        cout << "  after=date before=date (last modified, date is YYYY-MM-DD or YYYY-MM-DD,HH:MM:SS)" << endl;
+        cout << "  created-after=date created-before=date accessed-after=date accessed-before=date" << endl;
+        cout << "  attr=rhsda noattr=rhsda (attributes which must be set or clear)" << endl;
+        cout << "  depth=levels threads=count" << endl;
+        return -1;
+    }
+
+    if (!fat_deviceOpen(argv[1], &device))
+    {
+        cout << "Couldn't open file? Check the path." << endl;
+        return -1;
+    }
+
+    bool mbr;
+    istringstream(argv[2]) >> boolalpha >> mbr;
+
+    if (mbr)
+        offset = fat_nextPartitionSector(fetch, &boot, nullptr);
+    else
+        fetch(0, sizeof(fat_BootSector), (char*)&boot);
+
+    fat_Query query;
+    fat_queryInit(&query);
+    query.pattern = argv[3];
+
+    unsigned threads = 0;
+    for (int i = 4; i < argc; ++i)
+    {
+        if (!parseFilter(argv[i], &query, &threads))
+        {
+            cout << "Unknown filter: " << argv[i] << endl;
+            fat_deviceClose(&device);
+            return -1;
+        }
+    }
+
+    cout << "Searching for: " << query.pattern << endl;
+    if (!fat_find(&boot, offset, fetch, threads, &query, printMatch, nullptr))
+        cout << "Error reading data from fetch." << endl;
+
+    cout << endl << hex << "Found: 0x" << found << endl;
+    fat_deviceClose(&device);
+    return 0;
+}
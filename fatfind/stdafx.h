@@ -0,0 +1,24 @@
+// stdafx.h : include file for standard system include files,
+// or project specific include files that are used frequently, but
+// are changed infrequently
+//
+
+#pragma once
+
+#include "targetver.h"
+
+#include <stdio.h>
+#include <cinttypes>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+
+extern "C" {
+#include "fat.h"
+#include "device.h"
+#include "query.h"
+#include "container.h"
+}
+
+// TODO: reference additional headers your program requires here
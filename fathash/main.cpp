@@ -0,0 +1,263 @@
+#include "stdafx.h"
+
+using namespace std;
+
+fat_Device device;
+fat_BootSector boot;
+fat_Trace trace;
+
+uint32_t offset = 0;
+
+struct Line
+{
+    string path;
+    string text;
+};
+
+vector<Line> lines;
+uint64_t bytes = 0;
+unsigned incomplete = 0;
+
+uint8_t fetch(unsigned address, unsigned count, char* out)
+{
+    return fat_deviceRead(&device, address, count, out);            // called from the walk threads
+}
+
+uint8_t addHash(const fat_FileHash* hash, void*)
+{
+    char text[FAT_SHA256_SIZE * 2 + 0x40];
+    int length = sprintf(text, "\t%.8x\t%.8x\t%.8x\t",
+        hash->entry.fileSize, hash->entry.clusterHigh << 16 | hash->entry.clusterLow, hash->crc32);
+    for (int i = 0; i < FAT_SHA256_SIZE; ++i)
+        length += sprintf(text + length, "%.2x", hash->sha256[i]);
+    if (!hash->complete)
+        strcpy(text + length, "\tincomplete");
+
+    lines.push_back({ hash->path, text });                          // fat_hashFiles never calls from two threads at once
+    bytes += hash->entry.fileSize;
+    if (!hash->complete)
+        ++incomplete;
+    return 1;
+}
+
+struct BulkEntry
+{
+    string path;
+    fat_DirectoryEntry entry;
+};
+
+vector<BulkEntry> bulkEntries;
+vector<uint32_t> bulkEntryOf;                                       // entry of every file handed to fat_bulkRead
+vector<uint64_t> bulkSize;                                          // bytes handed to fat_bulkRead, less when the chain is short
+
+uint8_t collectFile(const fat_WalkEntry* entry, void*)
+{
+    if (entry->entry.fileAttributes & FAT_FILE_ATTR_DIRECTORY)
+        return FAT_WALK_CONTINUE;
+
+    string path = entry->fileName;
+    for (const fat_WalkEntry* parent = entry->parent; parent != nullptr; parent = parent->parent)
+        path = string(parent->fileName) + "/" + path;
+
+    bulkEntries.push_back({ path, entry->entry });
+    return FAT_WALK_CONTINUE;
+}
+
+fat_Sha256 bulkSha;                                                 // of the file coming in parts
+uint32_t bulkCrc;
+
+uint8_t hashBulkFile(uint32_t index, uint64_t offset, const uint8_t* data, uint64_t length, void*)
+{
+    const BulkEntry& file = bulkEntries[bulkEntryOf[index]];
+    if (offset == 0)
+    {
+        fat_sha256Init(&bulkSha);
+        bulkCrc = 0;
+    }
+
+    if (data != nullptr)
+    {
+        fat_sha256Update(&bulkSha, data, (size_t)length);
+        bulkCrc = fat_crc32(bulkCrc, data, (size_t)length);
+        if (offset + length < bulkSize[index])
+            return 1;                                               // more parts follow
+    }
+
+    fat_FileHash hash;
+    hash.path = file.path.c_str();
+    hash.entry = file.entry;
+    hash.complete = data != nullptr && bulkSize[index] == file.entry.fileSize;
+    hash.crc32 = bulkCrc;
+    fat_sha256Final(&bulkSha, hash.sha256);
+
+    return addHash(&hash, nullptr);
+}
+
+// Bytes of the file its chain reaches, as far as the threaded mode reads it
+uint32_t readablePrefix(const uint8_t* table, const fat_DirectoryEntry& entry)
+{
+    FatType type = fat_getType(&boot);
+    uint32_t clusterSize = fat_clusterSize(&boot);
+    uint32_t lastCluster = fat_countOfClusters(&boot) + 1;
+    uint32_t cluster = entry.clusterHigh << 16 | entry.clusterLow;
+
+    uint32_t bytes = 0;
+    while (bytes < entry.fileSize && cluster >= 2 && cluster <= lastCluster)
+    {
+        bytes += (entry.fileSize - bytes < clusterSize) ? entry.fileSize - bytes : clusterSize;
+        cluster = fat_fatEntry(type, table, cluster);
+    }
+
+    return bytes;
+}
+
+// Lists every file first, then reads them all in the order of their data on the device
+bool hashBulk(uint64_t gap)
+{
+    if (!fat_walk(&boot, offset, fetch, 1, FAT_WALK_PRE, collectFile, nullptr))
+        return false;
+
+    uint8_t op = fat_traceSetOp(FAT_TRACE_OP_FAT);
+    uint8_t* table = fat_loadFat(&boot, offset, fetch);
+    fat_traceSetOp(op);
+    if (table == nullptr)
+        return false;
+
+    vector<fat_BulkFile> files;
+    for (uint32_t i = 0; i < bulkEntries.size(); ++i)
+    {
+        fat_DirectoryEntry entry = bulkEntries[i].entry;
+        fat_FileExtent* extents;
+        uint32_t count;
+        if (!fat_tableFileExtents(&boot, offset, table, &entry, &extents, &count))
+        {
+            entry.fileSize = readablePrefix(table, entry);          // the chain ends before the file does, hash what there is
+            if (!fat_tableFileExtents(&boot, offset, table, &entry, &extents, &count))
+            {
+                free(table);
+                return false;
+            }
+        }
+
+        files.push_back({ extents, count, entry.fileSize });
+        bulkEntryOf.push_back(i);
+        bulkSize.push_back(entry.fileSize);
+    }
+    free(table);
+
+    fat_BulkOptions options = { gap, 0, 0 };
+    fat_BulkStats stats;
+    bool ok = fat_bulkRead(&device, files.data(), (uint32_t)files.size(), &options, hashBulkFile, nullptr, &stats) != 0;
+    for (const fat_BulkFile& file : files)
+        free((void*)file.extents);
+
+    cout << hex;
+    cout << "Bulk: 0x" << stats.sweeps << " sweeps, 0x" << stats.reads << " reads for 0x" << stats.pieces << " pieces, 0x"
+        << stats.bytesRead << " bytes read for 0x" << stats.bytes << endl;
+    return ok;
+}
+
+int main(int argc, char* argv[])
+{
+    bool bulk = argc > 1 && string(argv[1]) == "--bulk";
+    if (bulk)
+    {
+        ++argv;                                                     // the other arguments keep their place
+        --argc;
+    }
+
+    if (argc < 4)
+    {
+        cout << "Usage: " << "fathash [image] [mbr] [manifest] [threads] [trace]" << endl;
+        cout << "       " << "fathash --bulk [image] [mbr] [manifest] [gap] [trace]" << endl;
+        cout << endl;
+        cout << "image: the file to be hashed" << endl;
+        cout << "mbr: enter true if there is a mbr present otherwise enter false" << endl;
+        cout << "manifest: the file to write the hashes to, one line per file: path, size, cluster, crc32, sha256" << endl;
+        cout << "threads: (optional) readers and hashers each, defaults to one per processor" << endl;
+        cout << "--bulk: reads all files in one pass in the order of their data on the device" << endl;
+        cout << "gap: (optional) bytes between two extents which are read through rather than seeked over, defaults to 64 KB" << endl;
+        cout << "trace: (optional) file to record every read in, replay it with fatreplay" << endl;
+        return -1;
+    }
+
+    if (!fat_deviceOpen(argv[1], &device))
+    {
+        cout << "Couldn't open file? Check the path." << endl;
+        return -1;
+    }
+
+    bool tracing = argc > 5;
+    if (tracing)
+    {
+        if (!fat_traceOpen(argv[5], &trace))
+        {
+            cout << "Couldn't create the trace." << endl;
+            fat_deviceClose(&device);
+            return -1;
+        }
+        fat_deviceTrace(&device, &trace);
+    }
+
+    bool mbr;
+    istringstream(argv[2]) >> boolalpha >> mbr;
+
+    uint8_t op = fat_traceSetOp(FAT_TRACE_OP_MOUNT);
+    if (mbr)
+        offset = fat_nextPartitionSector(fetch, &boot, nullptr);
+    else
+        fetch(0, sizeof(fat_BootSector), (char*)&boot);
+    fat_traceSetOp(op);
+
+    if (tracing)
+        fat_traceSetVolume(&trace, &boot, offset);
+
+    unsigned threads = 0;
+    uint64_t gap = FAT_BULK_GAP;
+    if (argc > 4 && bulk)
+        istringstream(argv[4]) >> hex >> gap;
+    else if (argc > 4)
+        istringstream(argv[4]) >> hex >> threads;
+
+    ofstream manifest(argv[3], ios_base::out | ios_base::trunc);
+    if (!manifest.is_open())
+    {
+        cout << "Couldn't create the manifest." << endl;
+        if (tracing)
+            fat_traceClose(&trace);
+        fat_deviceClose(&device);
+        return -1;
+    }
+
+    auto start = chrono::steady_clock::now();
+    uint8_t ok = bulk ? hashBulk(gap) : fat_hashFiles(&boot, offset, fetch, threads, addHash, nullptr);
+    uint64_t elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+
+    if (!ok)
+        cout << "Error reading data from fetch." << endl;
+
+    sort(lines.begin(), lines.end(), [](const Line& a, const Line& b) { return a.path < b.path; });
+    for (const Line& line : lines)
+        manifest << line.path << line.text << '\n';
+
+    cout << hex;
+    cout << "Hashed: 0x" << lines.size() << " files, 0x" << bytes << " bytes in 0x" << elapsed << " ms";
+    if (elapsed > 0)
+        cout << " (0x" << bytes * 1000 / elapsed / 1024 << " KB/s)";
+    cout << endl;
+    if (incomplete > 0)
+        cout << "Incomplete: 0x" << incomplete << " (chain too short or unreadable)" << endl;
+
+    if (tracing)
+    {
+        uint64_t records = trace.header.recordCount;
+        fat_deviceTrace(&device, nullptr);
+        if (fat_traceClose(&trace))
+            cout << "Trace: 0x" << records << " reads recorded" << endl;
+        else
+            cout << "Couldn't write the trace." << endl;
+    }
+
+    fat_deviceClose(&device);
+    return ok ? 0 : -1;
+}
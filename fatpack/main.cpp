@@ -0,0 +1,37 @@
+#include "stdafx.h"
+
+using namespace std;
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        cout << "Usage: " << "fatpack [image] [container] [chunksize]" << endl;
+        cout << endl;
+        cout << "image: the raw image to be packed" << endl;
+        cout << "container: the compressed container to be written" << endl;
+        cout << "chunksize: (optional) size of a chunk, defaults to 10000" << endl;
+        return -1;
+    }
+
+    unsigned chunkSize = 0;
+    if (argc > 3)
+        istringstream(argv[3]) >> hex >> chunkSize;
+
+    fat_ContainerStats stats;
+    if (!fat_containerConvert(argv[1], argv[2], chunkSize, &stats))
+    {
+        cout << "Couldn't pack the image? Check the paths." << endl;
+        return -1;
+    }
+
+    cout << hex << setfill('0');
+    cout << "Packed " << argv[1] << " into " << argv[2] << endl;
+    cout << "  Image Size: 0x" << setw(8) << stats.imageSize << endl;
+    cout << "  Container Size: 0x" << setw(8) << stats.containerSize << endl;
+    cout << "  Holes: 0x" << setw(8) << stats.holes << endl;
+    cout << "  Stored: 0x" << setw(8) << stats.stored << endl;
+    cout << "  Compressed: 0x" << setw(8) << stats.compressed << endl;
+
+    return 0;
+}
@@ -0,0 +1,91 @@
+#include "stdafx.h"
+
+using namespace std;
+
+fat_Device device;
+fat_BootSector boot;
+
+uint32_t offset = 0;
+unsigned found = 0;
+
+uint8_t fetch(unsigned address, unsigned count, char* out)
+{
+    return fat_deviceRead(&device, address, count, out);            // called from the sweep threads as well
+}
+
+const char* stateName(uint8_t state)
+{
+    return (state == FAT_RECOVER_FULL)
+        ? "FULL"
+        : (state == FAT_RECOVER_PARTIAL)
+            ? "PART"
+            : "GONE";
+}
+
+uint8_t printEntry(const fat_DeletedEntry* deleted, void*)
+{
+    const fat_DirectoryEntry& entry = deleted->entry;
+
+    printf("  [%s] [%s] [%.8s.%.3s] (%.8x:%.8x) %.8x/%.8x %s%s\n",
+        (entry.fileAttributes & FAT_FILE_ATTR_DIRECTORY) ? "DIR" : "FIL",
+        stateName(deleted->state),
+        entry.fileName, entry.extension,
+        deleted->firstCluster, entry.fileSize,
+        deleted->recoverableSize, entry.fileSize,
+        deleted->fileName,
+        deleted->orphan ? " (orphaned)" : deleted->deleted ? "" : " (in deleted directory)");
+
+    ++found;
+    return 1;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        cout << "Usage: " << "fatrecover [image] [mbr] [sweep] [threads]" << endl;
+        cout << endl;
+        cout << "image: the file to be scanned" << endl;
+        cout << "mbr: enter true if there is a mbr present otherwise enter false" << endl;
+        cout << "sweep: (optional) enter true to sweep the free clusters for orphaned directories" << endl;
+        cout << "threads: (optional) amount of sweep threads, defaults to one per processor" << endl;
+        return -1;
+    }
+
+    if (!fat_deviceOpen(argv[1], &device))
+    {
+        cout << "Couldn't open file? Check the path." << endl;
+        return -1;
+    }
+
+    bool mbr;
+    istringstream(argv[2]) >> boolalpha >> mbr;
+
+    if (mbr)
+        offset = fat_nextPartitionSector(fetch, &boot, nullptr);
+    else
+        fetch(0, sizeof(fat_BootSector), (char*)&boot);
+
+    bool sweep = false;
+    if (argc > 3)
+        istringstream(argv[3]) >> boolalpha >> sweep;
+
+    unsigned threads = 0;
+    if (argc > 4)
+        istringstream(argv[4]) >> hex >> threads;
+
+    cout << "Deleted entries:" << endl;
+    if (!fat_recoverDeleted(&boot, offset, fetch, printEntry, nullptr))
+        cout << "Error reading data from fetch." << endl;
+
+    if (sweep)
+    {
+        cout << endl << "Orphaned directory clusters:" << endl;
+        if (!fat_recoverSweep(&boot, offset, fetch, threads, printEntry, nullptr))
+            cout << "Error reading data from fetch." << endl;
+    }
+
+    cout << endl << hex << "Found: 0x" << found << endl;
+    fat_deviceClose(&device);
+    return 0;
+}
@@ -0,0 +1,200 @@
+#include "stdafx.h"
+
+using namespace std;
+
+fat_Device device;
+
+const char* opNames[FAT_TRACE_OPS] = { "Other", "Mount", "FAT", "Directory", "Data" };
+const char* regionNames[FAT_TRACE_REGIONS] = { "Reserved", "FAT", "Root", "Data" };
+
+struct Preset
+{
+    const char* name;
+    fat_TraceModel model;
+};
+
+// Rough figures of the media, latency and seek in nanoseconds, bandwidth in bytes per second
+const Preset presets[] =
+{
+    { "sd", { 100000, 600000, 20000000 } },                         // SD card: slow random reads
+    { "hdd", { 50000, 8000000, 150000000 } },                       // spinning disk: every seek costs milliseconds
+    { "nfs", { 500000, 0, 100000000 } },                            // network storage: a round trip per request
+};
+
+// Parses a preset or latency:seek:bandwidth (microseconds, microseconds, KB/s)
+bool parseModel(const string& text, fat_TraceModel* model)
+{
+    for (const Preset& preset : presets)
+    {
+        if (text == preset.name)
+        {
+            *model = preset.model;
+            return true;
+        }
+    }
+
+    istringstream stream(text);
+    uint32_t latency, seek;
+    uint64_t bandwidth;
+    char colon1, colon2;
+    if (!(stream >> hex >> latency >> colon1 >> seek >> colon2 >> bandwidth) || colon1 != ':' || colon2 != ':')
+        return false;
+
+    model->latency = latency * 1000;
+    model->seek = seek * 1000;
+    model->bandwidth = bandwidth * 1024;
+    return true;
+}
+
+void printPercentiles(const char* title, vector<uint64_t>& latencies)
+{
+    if (latencies.empty())
+        return;
+
+    sort(latencies.begin(), latencies.end());
+    auto at = [&](unsigned permille) { return latencies[(latencies.size() - 1) * permille / 1000]; };
+
+    cout << title << " (ns):" << endl;
+    cout << "  p50: 0x" << at(500) << ", p90: 0x" << at(900) << ", p99: 0x" << at(990)
+        << ", p99.9: 0x" << at(999) << ", max: 0x" << latencies.back() << endl;
+}
+
+void printRegion(const char* name, const fat_TraceRegion& region)
+{
+    if (region.requests == 0)
+        return;
+
+    cout << "  " << name << ": 0x" << region.requests << " requests, 0x" << region.bytes << " bytes, "
+        << dec << region.sequential * 100 / region.requests << hex << "% sequential" << endl;
+}
+
+void printLocality(const fat_TraceHeader& header, const fat_TraceRecord* records, uint64_t count)
+{
+    fat_TraceLocality locality;
+    if (!fat_traceLocality(&header, records, count, &locality) || locality.requests == 0)
+        return;
+
+    cout << "Locality (in recorded order):" << endl;
+    cout << "  Sequential: 0x" << locality.sequential << " (" << dec << locality.sequential * 100 / locality.requests << hex << "%)" << endl;
+    cout << "  Near: 0x" << locality.near << " (" << dec << locality.near * 100 / locality.requests << hex << "%)" << endl;
+    cout << "  Random: 0x" << locality.random << " (" << dec << locality.random * 100 / locality.requests << hex << "%)" << endl;
+    cout << "  Unique Bytes: 0x" << locality.uniqueBytes << " of 0x" << locality.bytes << " read" << endl;
+    cout << endl;
+
+    if (header.regions[FAT_TRACE_REGION_DATA] != 0)
+    {
+        cout << "Regions:" << endl;
+        for (unsigned i = 0; i < FAT_TRACE_REGIONS; ++i)
+            printRegion(regionNames[i], locality.regions[i]);
+        cout << endl;
+    }
+
+    cout << "Operations:" << endl;
+    for (unsigned i = 0; i < FAT_TRACE_OPS; ++i)
+        printRegion(opNames[i], locality.ops[i]);
+    cout << endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        cout << "Usage: " << "fatreplay [trace] [image] [model] [direct]" << endl;
+        cout << endl;
+        cout << "trace: the recorded reads (see fathash)" << endl;
+        cout << "image: the image to read them from again" << endl;
+        cout << "model: (optional) sd, hdd or nfs, or latency:seek:bandwidth in us, us and KB/s, adds the delays of a slow medium" << endl;
+        cout << "direct: (optional) enter true to read past the page cache" << endl;
+        return -1;
+    }
+
+    fat_TraceHeader header;
+    fat_TraceRecord* records;
+    uint64_t count;
+    if (!fat_traceLoad(argv[1], &header, &records, &count))
+    {
+        cout << "Couldn't read the trace." << endl;
+        return -1;
+    }
+
+    fat_TraceModel model = { 0, 0, 0 };
+    bool modeled = argc > 3 && string(argv[3]) != "none";
+    if (modeled && !parseModel(argv[3], &model))
+    {
+        cout << "Unknown model, use sd, hdd, nfs or latency:seek:bandwidth." << endl;
+        free(records);
+        return -1;
+    }
+
+    bool direct = false;
+    if (argc > 4)
+        istringstream(argv[4]) >> boolalpha >> direct;
+
+    if (!(direct ? fat_deviceOpenDirect(argv[2], &device) : fat_deviceOpen(argv[2], &device)))
+    {
+        cout << "Couldn't open file? Check the path." << endl;
+        free(records);
+        return -1;
+    }
+
+    uint64_t bytes = 0, span = 0, failed = 0;
+    unsigned largest = 0;
+    vector<uint64_t> recorded;
+    recorded.reserve(count);
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        bytes += records[i].count;
+        span = max<uint64_t>(span, records[i].start + records[i].duration);
+        largest = max(largest, records[i].count);
+        failed += !records[i].ok;
+        recorded.push_back(records[i].duration);
+    }
+
+    cout << hex;
+    cout << "Trace: 0x" << count << " requests, 0x" << bytes << " bytes in 0x" << span / 1000000 << " ms";
+    if (failed > 0)
+        cout << ", 0x" << failed << " failed";
+    cout << endl;
+    printPercentiles("Recorded latency", recorded);
+    cout << endl;
+
+    // one request at a time in the recorded order, the model adds its delay to what the backend took
+    vector<char> buffer(max(largest, 1u));
+    vector<uint64_t> latencies;
+    latencies.reserve(count);
+    uint64_t previousEnd = UINT64_MAX, delays = 0, errors = 0;
+    uint64_t start = fat_traceClock();
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        const fat_TraceRecord& record = records[i];
+        uint64_t issued = fat_traceClock();
+        errors += !fat_deviceRead(&device, record.address, record.count, buffer.data());
+        uint64_t latency = fat_traceClock() - issued;
+
+        if (modeled)
+        {
+            uint64_t delay = fat_traceModelDelay(&model, &record, previousEnd);
+            latency += delay;
+            delays += delay;
+        }
+
+        latencies.push_back(latency);
+        previousEnd = record.address + record.count;
+    }
+    uint64_t elapsed = fat_traceClock() - start + delays;
+
+    cout << "Replay" << (modeled ? " (modeled)" : "") << ": 0x" << elapsed / 1000000 << " ms";
+    if (elapsed > 0)
+        cout << ", 0x" << bytes * 1000000000 / elapsed / 1024 << " KB/s, 0x" << count * 1000000000 / elapsed << " requests/s";
+    if (errors > 0)
+        cout << ", 0x" << errors << " failed";
+    cout << endl;
+    printPercentiles("Replay latency", latencies);
+    cout << endl;
+
+    printLocality(header, records, count);
+
+    fat_deviceClose(&device);
+    free(records);
+    return errors == 0 ? 0 : -1;
+}
@@ -8,8 +8,25 @@ fat_MBR mbr;
 
 uint32_t offset = 0;
 
+fat_Container container;
+bool packed = false;
+
 uint8_t fetch(unsigned address, unsigned count, char* out)
 {
+    if (packed)
+        return fat_containerRead(&container, address, count, out);
+
+    file.seekg(address);
+    file.read(out, count);
+
+    return file.good();
+}
+
+uint8_t fetch64(uint64_t address, unsigned count, char* out)
+{
+    if (packed)
+        return address + count <= UINT32_MAX && fat_containerRead(&container, (unsigned)address, count, out);
+
     file.seekg(address);
     file.read(out, count);
 
@@ -30,7 +47,7 @@ bool compareCaseInsensitive(const string& a, const string& b)
 uint8_t findFile(const string& file, fat_DirectoryEntry* entry)
 {
     char buf[255];
-    while (fat_nextDirectoryEntry(&boot, offset, 2, fetch, entry, buf, 255))
+    while (fat_nextDirectoryEntry(&boot, offset, FAT_DIRECTORY_ROOT, fetch, entry, buf, 255))
     {
         if (compareCaseInsensitive(buf, file))
             return 1;
@@ -94,8 +111,7 @@ void dumpFile(const fat_DirectoryEntry* entry)
 
     do
     {
-        uint32_t sector = fat_firstSectorOfCluster(&boot, currentCluster) + fat_firstDataSector(&boot);
-        uint32_t address = fat_sectorToAddress(&boot, offset, sector);
+        uint32_t address = fat_clusterToAddress(&boot, offset, currentCluster);
         if (!addressPrinted)
         {
             cout << "Address: 0x" << setw(8) << address << endl << endl;
@@ -124,20 +140,187 @@ void dumpFile(const fat_DirectoryEntry* entry)
     cout << endl << endl;
 }
 
+// Same dump for a file in the root directory of an exFAT volume, read through exfat_readFile so a
+// NoFatChain file never touches the FAT
+int dumpExfatFile(const string& filename)
+{
+    exfat_Volume volume;
+    if (!exfat_mount(fetch64, offset, &volume))
+    {
+        cout << "Couldn't mount the exFAT volume, the boot region, bitmap or up-case table is damaged." << endl;
+        return -1;
+    }
+
+    exfat_File entry;
+    if (!exfat_findFile(&volume, NULL, filename.c_str(), &entry))
+    {
+        cout << "File not found in root directory (don't forget the extension.) Check with fatdumper what is in it." << endl;
+        exfat_unmount(&volume);
+        return -1;
+    }
+
+    cout << "Dumping contents of cluster: 0x" << hex << setfill('0') << setw(8) << entry.firstCluster << endl;
+    cout << "FileSize: 0x" << setw(16) << entry.dataLength << endl;
+    cout << "Contiguous: " << ((entry.flags & EXFAT_FLAG_NO_FAT_CHAIN) ? "yes" : "no") << endl;
+    cout << "Created: " << getDate(entry.created >> 16) << endl;
+    cout << "Modified: " << getDate(entry.modified >> 16) << " " << getTime(entry.modified & 0xFFFF) << endl;
+
+    if (entry.dataLength > 0)
+        cout << "Address: 0x" << setw(16) << exfat_clusterToAddress(&volume, entry.firstCluster) << endl << endl;
+
+    uint32_t clusterSize = volume.clusterSize;
+    char* buf = new char[clusterSize];
+    int result = 0;
+    for (uint64_t position = 0; position < entry.dataLength; position += clusterSize)
+    {
+        unsigned count = (entry.dataLength - position < clusterSize) ? (unsigned)(entry.dataLength - position) : clusterSize;
+        if (!exfat_readFile(&volume, &entry, position, count, buf))
+        {
+            cout << "Error reading data from fetch." << endl;
+            result = -1;
+            break;
+        }
+
+        for (unsigned i = 0; i < count; ++i)
+        {
+            asHex(cout, buf[i]);
+            cout << " ";
+        }
+    }
+
+    delete[] buf;
+    exfat_unmount(&volume);
+
+    cout << endl << endl;
+    return result;
+}
+
+fat_Device device;
+
+uint8_t fetchDevice(unsigned address, unsigned count, char* out)
+{
+    return fat_deviceRead(&device, address, count, out);
+}
+
+uint8_t fetchDevice64(uint64_t address, unsigned count, char* out)
+{
+    return fat_deviceRead(&device, address, count, out);
+}
+
+// Resolves the file in the root directory to extents of the image and copies them to output, the data
+// goes from the image to the output inside the kernel when the system allows it
+int extractFile(const char* image, bool mbr, const string& filename, const char* output)
+{
+    if (!fat_deviceOpen(image, &device))
+    {
+        cout << "Couldn't open file? Check the path." << endl;
+        return -1;
+    }
+
+    if (mbr)
+        offset = fat_nextPartitionSector(fetchDevice, &boot, nullptr);
+    else
+        fetchDevice(0, sizeof(fat_BootSector), (char*)&boot);
+
+    fat_FileExtent* extents = nullptr;
+    uint32_t count = 0;
+    uint64_t size = 0;
+    bool found = false, resolved = false;
+    if (fat_getType(&boot) == EXFAT)
+    {
+        exfat_Volume* volume = new exfat_Volume;
+        exfat_File entry;
+        if (exfat_mount(fetchDevice64, offset, volume))
+        {
+            found = exfat_findFile(volume, NULL, filename.c_str(), &entry) != 0;
+            resolved = found && fat_exfatFileExtents(volume, &entry, &extents, &count);
+            size = entry.dataLength;
+            exfat_unmount(volume);
+        }
+        delete volume;
+    }
+    else
+    {
+        fat_DirectoryIterator it;
+        fat_DirectoryEntry entry;
+        char name[FAT_LFN_MAX_LENGTH + 1];
+        fat_openDirectory(&boot, FAT_DIRECTORY_ROOT, &it);
+        while (!found && fat_readDirectory(&boot, offset, fetchDevice, &it, &entry, name, sizeof(name)))
+            found = !(entry.fileAttributes & (FAT_FILE_ATTR_DIRECTORY | FAT_FILE_ATTR_VOLUME)) && compareCaseInsensitive(name, filename);
+
+        resolved = found && fat_fileExtents(&boot, offset, fetchDevice, &entry, &extents, &count);
+        size = entry.fileSize;
+    }
+
+    if (!found)
+    {
+        cout << "File not found in root directory (don't forget the extension.) Check with fatdumper what is in it." << endl;
+        fat_deviceClose(&device);
+        return -1;
+    }
+
+    if (!resolved)
+    {
+        cout << "Couldn't resolve the clusters of the file, its chain is damaged." << endl;
+        fat_deviceClose(&device);
+        return -1;
+    }
+
+    fat_ExtractStats stats;
+    auto start = chrono::steady_clock::now();
+    uint8_t ok = fat_extract(&device, extents, count, size, output, &stats);
+    uint64_t elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    free(extents);
+    fat_deviceClose(&device);
+
+    if (!ok)
+    {
+        cout << "Couldn't write the output or read the image." << endl;
+        return -1;
+    }
+
+    static const char* methods[FAT_EXTRACT_METHODS] = { "copy_file_range", "sendfile", "splice", "buffered" };
+    cout << hex;
+    cout << "Extracted: 0x" << size << " bytes in 0x" << stats.extents << " extents, 0x" << elapsed << " ms";
+    if (elapsed > 0)
+        cout << " (0x" << stats.bytes * 1000 / elapsed / 1024 << " KB/s)";
+    cout << endl;
+    for (unsigned i = 0; i < FAT_EXTRACT_METHODS; ++i)
+    {
+        if (stats.methodBytes[i] > 0)
+            cout << "  " << methods[i] << ": 0x" << stats.methodBytes[i] << " bytes" << endl;
+    }
+    if (size > stats.bytes)
+        cout << "  hole: 0x" << size - stats.bytes << " bytes past the valid data length" << endl;
+    return 0;
+}
+
 int main(int argc, char* argv[])
 {
+    if (argc > 5 && string(argv[1]) == "--extract")
+    {
+        bool extractMbr;
+        istringstream(argv[3]) >> boolalpha >> extractMbr;
+        return extractFile(argv[2], extractMbr, argv[4], argv[5]);
+    }
+
     if (argc < 4)
     {
         cout << "Usage: " << "filedumper [image] [mbr] [filename]" << endl;
+        cout << "       " << "filedumper --extract [image] [mbr] [filename] [output]" << endl;
         cout << endl;
         cout << "image: the file to be dumped" << endl;
         cout << "mbr: enter true if there is a mbr present otherwise enter false" << endl;
         cout << "filename: filename of a file in the root directory to be dumped" << endl;
+        cout << "output: the file to copy it to instead, the data is copied by the kernel where possible" << endl;
         return -1;
     }
 
-    file.open(argv[1], ios_base::in | ios_base::binary);
-    if (!file.is_open())
+    packed = fat_containerOpen(argv[1], &container) != 0;          // compressed containers are read as is
+    if (!packed)
+        file.open(argv[1], ios_base::in | ios_base::binary);
+
+    if (!packed && !file.is_open())
     {
         cout << "Couldn't open file? Check the path." << endl;
         return -1;
@@ -157,6 +340,9 @@ int main(int argc, char* argv[])
     }
 
     string filename(argv[3]);
+    if (fat_getType(&boot) == EXFAT)
+        return dumpExfatFile(filename);
+
     fat_DirectoryEntry entry;
     if (!findFile(filename, &entry))
     {
@@ -13,9 +13,14 @@
 #include <iomanip>
 #include <fstream>
 #include <sstream>
+#include <chrono>
+#include <string>
 
 extern "C" {
 #include "fat.h"
+#include "container.h"
+#include "exfat.h"
+#include "extract.h"
 }
 
 // TODO: reference additional headers your program requires here